@@ -0,0 +1,312 @@
+/**
+ * @author Michal Witanowski
+ * @brief  VFS benchmarks. Results are printed as JSON (default) or CSV, so they can be compared
+ *         between versions.
+ */
+
+#include "vfs.hpp"
+
+#include <string.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <random>
+
+#define BENCH_IMAGE_SIZE (512ull * 1024 * 1024)
+
+// size of the file used by the throughput benchmarks
+#define BENCH_FILE_SIZE (128u * 1024 * 1024)
+
+// number of requests issued by the random access benchmarks
+#define BENCH_RANDOM_OPS 4096
+
+#define BENCH_FILES_NUM 10000
+
+// number of nested directories in the deep directory benchmarks
+#define BENCH_DIR_DEPTH 16
+
+#define BENCH_LIST_REPEATS 20
+
+/**
+ * Result of a single benchmark
+ */
+struct BenchResult
+{
+    std::string name;
+    uint32 size;    //< request size in bytes (zero if not applicable)
+    uint64 ops;     //< number of operations performed
+    uint64 bytes;   //< number of bytes transferred
+    double seconds;
+};
+
+class Timer
+{
+    std::chrono::steady_clock::time_point mStart;
+
+public:
+    Timer() : mStart(std::chrono::steady_clock::now()) {}
+
+    double GetSeconds() const
+    {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - mStart;
+        return elapsed.count();
+    }
+};
+
+static std::vector<BenchResult> gResults;
+
+static void AddResult(const std::string& name, uint32 size, uint64 ops, uint64 bytes,
+                      double seconds)
+{
+    BenchResult result;
+    result.name = name;
+    result.size = size;
+    result.ops = ops;
+    result.bytes = bytes;
+    result.seconds = seconds;
+    gResults.push_back(result);
+
+    std::cerr << name << (size ? " (" + std::to_string(size) + " B)" : "") << ": " <<
+                 seconds << " s" << std::endl;
+}
+
+static double PerSecond(double value, double seconds)
+{
+    return seconds > 0.0 ? value / seconds : 0.0;
+}
+
+void PrintJson(const Vfs& vfs)
+{
+    std::cout << "{" << std::endl <<
+                 "  \"version\": " << VFS_VERSION_CURRENT << "," << std::endl <<
+                 "  \"blockSize\": " << vfs.GetBlockSize() << "," << std::endl <<
+                 "  \"results\": [" << std::endl;
+
+    for (size_t i = 0; i < gResults.size(); ++i)
+    {
+        const BenchResult& result = gResults[i];
+        std::cout << "    { \"name\": \"" << result.name << "\", \"size\": " << result.size <<
+                     ", \"ops\": " << result.ops << ", \"bytes\": " << result.bytes <<
+                     ", \"seconds\": " << result.seconds <<
+                     ", \"opsPerSec\": " << PerSecond(result.ops, result.seconds) <<
+                     ", \"mbPerSec\": " << PerSecond(result.bytes / 1e6, result.seconds) <<
+                     " }" << (i + 1 < gResults.size() ? "," : "") << std::endl;
+    }
+
+    std::cout << "  ]" << std::endl << "}" << std::endl;
+}
+
+void PrintCsv()
+{
+    std::cout << "name,size,ops,bytes,seconds,ops_per_sec,mb_per_sec" << std::endl;
+    for (const BenchResult& result : gResults)
+    {
+        std::cout << result.name << "," << result.size << "," << result.ops << "," <<
+                     result.bytes << "," << result.seconds << "," <<
+                     PerSecond(result.ops, result.seconds) << "," <<
+                     PerSecond(result.bytes / 1e6, result.seconds) << std::endl;
+    }
+}
+
+void SequentialBench(Vfs& vfs, uint32 requestSize)
+{
+    std::vector<uint8> buffer(requestSize, 0x5A);
+    const uint32 requests = BENCH_FILE_SIZE / requestSize;
+
+    PathInfo info;
+    if (vfs.GetInfo("seq", info))
+        VFS_ASSERT(vfs.Remove("seq"));
+
+    Timer writeTimer;
+    VfsFile* file = vfs.OpenFile("seq", true);
+    VFS_ASSERT(file != nullptr);
+    for (uint32 i = 0; i < requests; ++i)
+        VFS_ASSERT(file->Write(requestSize, buffer.data()) == requestSize);
+    VFS_ASSERT(vfs.Close(file));
+    VFS_ASSERT(vfs.Sync());
+    AddResult("seq_write", requestSize, requests, BENCH_FILE_SIZE, writeTimer.GetSeconds());
+
+    Timer readTimer;
+    file = vfs.OpenFile("seq", false);
+    VFS_ASSERT(file != nullptr);
+    for (uint32 i = 0; i < requests; ++i)
+        VFS_ASSERT(file->Read(requestSize, buffer.data()) == requestSize);
+    VFS_ASSERT(vfs.Close(file));
+    AddResult("seq_read", requestSize, requests, BENCH_FILE_SIZE, readTimer.GetSeconds());
+}
+
+void RandomBench(Vfs& vfs, uint32 requestSize)
+{
+    std::vector<uint8> buffer(requestSize, 0xA5);
+    std::mt19937 random(requestSize);
+    std::uniform_int_distribution<uint32> distribution(0, BENCH_FILE_SIZE / requestSize - 1);
+
+    // the file written by the sequential benchmark is reused
+    VfsFile* file = vfs.OpenFile("seq", false);
+    VFS_ASSERT(file != nullptr);
+
+    Timer writeTimer;
+    for (uint32 i = 0; i < BENCH_RANDOM_OPS; ++i)
+    {
+        file->Seek(static_cast<uint64>(distribution(random)) * requestSize, VfsSeekMode::Begin);
+        VFS_ASSERT(file->Write(requestSize, buffer.data()) == requestSize);
+    }
+    VFS_ASSERT(vfs.Sync());
+    AddResult("random_write", requestSize, BENCH_RANDOM_OPS,
+              static_cast<uint64>(BENCH_RANDOM_OPS) * requestSize, writeTimer.GetSeconds());
+
+    Timer readTimer;
+    for (uint32 i = 0; i < BENCH_RANDOM_OPS; ++i)
+    {
+        file->Seek(static_cast<uint64>(distribution(random)) * requestSize, VfsSeekMode::Begin);
+        VFS_ASSERT(file->Read(requestSize, buffer.data()) == requestSize);
+    }
+    AddResult("random_read", requestSize, BENCH_RANDOM_OPS,
+              static_cast<uint64>(BENCH_RANDOM_OPS) * requestSize, readTimer.GetSeconds());
+
+    VFS_ASSERT(vfs.Close(file));
+}
+
+// create, open and remove files in the given directory
+void MetadataBench(Vfs& vfs, const std::string& dir, const std::string& suffix)
+{
+    std::vector<std::string> paths;
+    for (uint32 i = 0; i < BENCH_FILES_NUM; ++i)
+        paths.push_back(dir + "/file" + std::to_string(i));
+
+    Timer createTimer;
+    for (const auto& path : paths)
+    {
+        VfsFile* file = vfs.OpenFile(path, true);
+        VFS_ASSERT(file != nullptr);
+        VFS_ASSERT(vfs.Close(file));
+    }
+    VFS_ASSERT(vfs.Sync());
+    AddResult("create_" + suffix, 0, paths.size(), 0, createTimer.GetSeconds());
+
+    Timer openTimer;
+    for (const auto& path : paths)
+    {
+        VfsFile* file = vfs.OpenFile(path, false);
+        VFS_ASSERT(file != nullptr);
+        VFS_ASSERT(vfs.Close(file));
+    }
+    AddResult("open_" + suffix, 0, paths.size(), 0, openTimer.GetSeconds());
+
+    Timer listTimer;
+    std::vector<std::string> nodes;
+    for (uint32 i = 0; i < BENCH_LIST_REPEATS; ++i)
+        VFS_ASSERT(vfs.List(dir, nodes) && nodes.size() == paths.size());
+    AddResult("list_" + suffix, 0, static_cast<uint64>(BENCH_LIST_REPEATS) * paths.size(), 0,
+              listTimer.GetSeconds());
+
+    Timer removeTimer;
+    for (const auto& path : paths)
+        VFS_ASSERT(vfs.Remove(path));
+    VFS_ASSERT(vfs.Sync());
+    AddResult("remove_" + suffix, 0, paths.size(), 0, removeTimer.GetSeconds());
+}
+
+// write a large file into the gaps left by removed small files (like small_test.sh does)
+void FragmentationBench(Vfs& vfs)
+{
+    const uint32 smallSize = 64 * 1024;
+    const uint32 smallFilesNum = 2048;
+    std::vector<uint8> buffer(smallSize, 0x3C);
+
+    VFS_ASSERT(vfs.CreateDir("frag"));
+    for (uint32 i = 0; i < smallFilesNum; ++i)
+    {
+        VfsFile* file = vfs.OpenFile("frag/" + std::to_string(i), true);
+        VFS_ASSERT(file != nullptr);
+        VFS_ASSERT(file->Write(smallSize, buffer.data()) == smallSize);
+        VFS_ASSERT(vfs.Close(file));
+    }
+
+    for (uint32 i = 1; i < smallFilesNum; i += 2)
+        VFS_ASSERT(vfs.Remove("frag/" + std::to_string(i)));
+    VFS_ASSERT(vfs.Sync());
+
+    const uint32 bigSize = smallSize * smallFilesNum / 4;
+    buffer.resize(bigSize);
+    Timer timer;
+    VfsFile* file = vfs.OpenFile("frag/big", true);
+    VFS_ASSERT(file != nullptr);
+    VFS_ASSERT(file->Write(bigSize, buffer.data()) == bigSize);
+    VFS_ASSERT(vfs.Close(file));
+    VFS_ASSERT(vfs.Sync());
+    AddResult("fragmented_write", bigSize, 1, bigSize, timer.GetSeconds());
+
+    Timer readTimer;
+    file = vfs.OpenFile("frag/big", false);
+    VFS_ASSERT(file != nullptr);
+    VFS_ASSERT(file->Read(bigSize, buffer.data()) == bigSize);
+    VFS_ASSERT(vfs.Close(file));
+    AddResult("fragmented_read", bigSize, 1, bigSize, readTimer.GetSeconds());
+}
+
+void PrintUsage()
+{
+    std::cout << "Usage: vfsBench [--json | --csv] [--mmap] [image path (optional)]" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    bool csv = false;
+    VfsStorageMode mode = VfsStorageMode::Stdio;
+    std::string path = "bench.bin";
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--csv") == 0)
+            csv = true;
+        else if (strcmp(argv[i], "--json") == 0)
+            csv = false;
+        else if (strcmp(argv[i], "--mmap") == 0)
+            mode = VfsStorageMode::MemoryMapped;
+        else if (argv[i][0] == '-')
+        {
+            PrintUsage();
+            return 1;
+        }
+        else
+            path = argv[i];
+    }
+
+    Vfs vfs;
+    if (!vfs.Init(path, BENCH_IMAGE_SIZE, mode))
+    {
+        return 1;
+    }
+
+    const uint32 sizes[] = { 4 * 1024, 64 * 1024, 1024 * 1024 };
+    for (uint32 size : sizes)
+        SequentialBench(vfs, size);
+
+    for (uint32 size : sizes)
+        RandomBench(vfs, size);
+    VFS_ASSERT(vfs.Remove("seq"));
+
+    VFS_ASSERT(vfs.CreateDir("flat"));
+    MetadataBench(vfs, "flat", "flat");
+
+    std::string deepDir = "deep";
+    VFS_ASSERT(vfs.CreateDir(deepDir));
+    for (uint32 i = 1; i < BENCH_DIR_DEPTH; ++i)
+    {
+        deepDir += "/" + std::to_string(i);
+        VFS_ASSERT(vfs.CreateDir(deepDir));
+    }
+    MetadataBench(vfs, deepDir, "deep");
+
+    FragmentationBench(vfs);
+
+    if (csv)
+        PrintCsv();
+    else
+        PrintJson(vfs);
+
+    vfs.Release();
+    remove(path.c_str());
+    return 0;
+}
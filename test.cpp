@@ -8,6 +8,14 @@
 #include <string.h>
 #include <iostream>
 #include <string>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <stddef.h>
+
+#ifndef _WIN32
+    #include <sys/stat.h>
+#endif
 
 void DirTest()
 {
@@ -214,12 +222,1550 @@ void FileStressTest()
     }
 }
 
+void CacheTest()
+{
+    const uint32 fsSize = 16 * 1024 * 1024;
+    const uint32 fileSize = 300 * 1024;
+    std::vector<uint8> buffer(fileSize);
+    for (uint32 i = 0; i < fileSize; i++)
+        buffer[i] = static_cast<uint8>(i * 7);
+
+    {
+        Vfs vfs;
+        vfs.SetCacheSize(8 * VFS_DEFAULT_BLOCK_SIZE); // force evictions
+        VFS_ASSERT(vfs.Init("test.bin", fsSize));
+        VFS_ASSERT(vfs.CreateDir("dir"));
+
+        const uint32 chunkSize = 1000;
+        VfsFile* file = vfs.OpenFile("dir/file", true);
+        VFS_ASSERT(file != nullptr);
+        for (uint32 i = 0; i < fileSize; i += chunkSize)
+        {
+            uint32 toWrite = std::min(chunkSize, fileSize - i);
+            VFS_ASSERT(file->Write(toWrite, buffer.data() + i) == toWrite);
+        }
+
+        // small unaligned writes go through the cache (unless they are sequential)
+        for (uint32 end = fileSize; end > 0; )
+        {
+            uint32 start = end > chunkSize ? end - chunkSize : 0;
+            VFS_ASSERT(file->Seek(start, VfsSeekMode::Begin) == start);
+            VFS_ASSERT(file->Write(end - start, buffer.data() + start) == end - start);
+            end = start;
+        }
+        VFS_ASSERT(vfs.Close(file));
+
+        VFS_ASSERT(vfs.GetCacheStats().evictions > 0);
+        VFS_ASSERT(vfs.GetCacheStats().hits > 0);
+    }
+
+    {
+        Vfs vfs;
+        VFS_ASSERT(vfs.Open("test.bin"));
+
+        std::vector<uint8> readBuffer(fileSize);
+        VfsFile* file = vfs.OpenFile("dir/file", false);
+        VFS_ASSERT(file != nullptr);
+        VFS_ASSERT(file->Read(fileSize, readBuffer.data()) == fileSize);
+        VFS_ASSERT(readBuffer == buffer);
+        VFS_ASSERT(vfs.Close(file));
+
+        // whole blocks are read bypassing the cache
+        VFS_ASSERT(vfs.GetCacheStats().direct == fileSize / VFS_DEFAULT_BLOCK_SIZE);
+    }
+}
+
+void MemoryMappedTest()
+{
+    const uint32 fsSize = 16 * 1024 * 1024;
+    const uint32 fileSize = 100 * 1024;
+    std::vector<uint8> buffer(fileSize);
+    for (uint32 i = 0; i < fileSize; i++)
+        buffer[i] = static_cast<uint8>(i * 13);
+
+    {
+        Vfs vfs;
+        VFS_ASSERT(vfs.Init("test.bin", fsSize, VfsStorageMode::MemoryMapped));
+        VFS_ASSERT(vfs.GetStorageMode() == VfsStorageMode::MemoryMapped);
+        VFS_ASSERT(vfs.CreateDir("dir"));
+
+        VfsFile* file = vfs.OpenFile("dir/file", true);
+        VFS_ASSERT(file != nullptr);
+        VFS_ASSERT(file->Write(fileSize, buffer.data()) == fileSize);
+        VFS_ASSERT(vfs.Close(file));
+        VFS_ASSERT(vfs.Sync());
+    }
+
+    // the image must be readable in both modes
+    const VfsStorageMode modes[] = { VfsStorageMode::Stdio, VfsStorageMode::MemoryMapped };
+    for (VfsStorageMode mode : modes)
+    {
+        Vfs vfs;
+        VFS_ASSERT(vfs.Open("test.bin", mode));
+        VFS_ASSERT(vfs.GetStorageMode() == mode);
+
+        std::vector<uint8> readBuffer(fileSize);
+        VfsFile* file = vfs.OpenFile("dir/file", false);
+        VFS_ASSERT(file != nullptr);
+        VFS_ASSERT(file->Read(fileSize, readBuffer.data()) == fileSize);
+        VFS_ASSERT(readBuffer == buffer);
+        VFS_ASSERT(vfs.Close(file));
+    }
+}
+
+void FragmentedFilesTest()
+{
+    const uint32 fsSize = 32 * 1024 * 1024;
+    const uint32 chunks = 1500; // one block per chunk - interleaving makes a lot of extents
+    std::vector<uint8> chunk(VFS_DEFAULT_BLOCK_SIZE);
+
+    {
+        Vfs vfs;
+        VFS_ASSERT(vfs.Init("test.bin", fsSize));
+
+        VfsFile* fileA = vfs.OpenFile("a", true);
+        VfsFile* fileB = vfs.OpenFile("b", true);
+        VFS_ASSERT(fileA != nullptr && fileB != nullptr);
+
+        for (uint32 i = 0; i < chunks; ++i)
+        {
+            memset(chunk.data(), static_cast<int>(i), VFS_DEFAULT_BLOCK_SIZE);
+            VFS_ASSERT(fileA->Write(VFS_DEFAULT_BLOCK_SIZE, chunk.data()) == VFS_DEFAULT_BLOCK_SIZE);
+            memset(chunk.data(), static_cast<int>(~i), VFS_DEFAULT_BLOCK_SIZE);
+            VFS_ASSERT(fileB->Write(VFS_DEFAULT_BLOCK_SIZE, chunk.data()) == VFS_DEFAULT_BLOCK_SIZE);
+        }
+
+        // write past the file end - the gap must be read as zeros
+        uint32 gapEnd = (chunks + 3) * VFS_DEFAULT_BLOCK_SIZE;
+        VFS_ASSERT(fileA->Seek(3 * VFS_DEFAULT_BLOCK_SIZE, VfsSeekMode::End) == gapEnd);
+        VFS_ASSERT(fileA->Write(VFS_DEFAULT_BLOCK_SIZE, chunk.data()) == VFS_DEFAULT_BLOCK_SIZE);
+
+        VFS_ASSERT(vfs.Close(fileA));
+        VFS_ASSERT(vfs.Close(fileB));
+    }
+
+    {
+        Vfs vfs;
+        VFS_ASSERT(vfs.Open("test.bin"));
+
+        VfsFile* fileA = vfs.OpenFile("a", false);
+        VfsFile* fileB = vfs.OpenFile("b", false);
+        VFS_ASSERT(fileA != nullptr && fileB != nullptr);
+
+        for (uint32 i = 0; i < chunks; ++i)
+        {
+            VFS_ASSERT(fileA->Read(VFS_DEFAULT_BLOCK_SIZE, chunk.data()) == VFS_DEFAULT_BLOCK_SIZE);
+            VFS_ASSERT(chunk[0] == static_cast<uint8>(i) && chunk[VFS_DEFAULT_BLOCK_SIZE - 1] == chunk[0]);
+            VFS_ASSERT(fileB->Read(VFS_DEFAULT_BLOCK_SIZE, chunk.data()) == VFS_DEFAULT_BLOCK_SIZE);
+            VFS_ASSERT(chunk[0] == static_cast<uint8>(~i) && chunk[VFS_DEFAULT_BLOCK_SIZE - 1] == chunk[0]);
+        }
+
+        VFS_ASSERT(fileA->Read(VFS_DEFAULT_BLOCK_SIZE, chunk.data()) == VFS_DEFAULT_BLOCK_SIZE);
+        VFS_ASSERT(chunk[0] == 0 && chunk[VFS_DEFAULT_BLOCK_SIZE - 1] == 0);
+
+        VFS_ASSERT(vfs.Close(fileA));
+        VFS_ASSERT(vfs.Close(fileB));
+
+        VFS_ASSERT(vfs.Remove("a"));
+        VFS_ASSERT(vfs.Remove("b"));
+    }
+}
+
+void PreallocateTest()
+{
+    const uint32 fsSize = 4 * 1024 * 1024;
+    const uint32 fileSize = 100000;
+
+    Vfs vfs;
+    VFS_ASSERT(vfs.Init("test.bin", fsSize));
+
+    // make some holes
+    for (int i = 0; i < 20; ++i)
+    {
+        std::string name = "small" + std::to_string(i);
+        VfsFile* file = vfs.OpenFile(name, true);
+        VFS_ASSERT(file != nullptr);
+        VFS_ASSERT(file->Write(sizeof(i), &i) == sizeof(i));
+        VFS_ASSERT(vfs.Close(file));
+    }
+    for (int i = 0; i < 20; i += 2)
+        VFS_ASSERT(vfs.Remove("small" + std::to_string(i)));
+
+    VfsFile* file = vfs.OpenFile("big", true);
+    VFS_ASSERT(file != nullptr);
+    VFS_ASSERT(file->Preallocate(fileSize));
+    VFS_ASSERT(file->Seek(0, VfsSeekMode::End) == 0); // size is not affected
+    VFS_ASSERT(!file->Preallocate(2 * fsSize));       // not enough space
+
+    for (uint32 i = 0; i < fileSize; i += sizeof(i))
+        VFS_ASSERT(file->Write(sizeof(i), &i) == sizeof(i));
+    VFS_ASSERT(vfs.Close(file));
+
+    file = vfs.OpenFile("big", false);
+    VFS_ASSERT(file != nullptr);
+    VFS_ASSERT(file->Seek(0, VfsSeekMode::End) == fileSize);
+    file->Seek(0, VfsSeekMode::Begin);
+    for (uint32 i = 0; i < fileSize; i += sizeof(i))
+    {
+        uint32 data = 0;
+        VFS_ASSERT(file->Read(sizeof(data), &data) == sizeof(data));
+        VFS_ASSERT(data == i);
+    }
+    VFS_ASSERT(vfs.Close(file));
+}
+
+void LargeFileTest(bool fullSize)
+{
+    const uint64 farOffset = 5ull * 1024 * 1024 * 1024;
+
+    Vfs vfs;
+    VFS_ASSERT(vfs.Init("test.bin", 4 * 1024 * 1024));
+
+    // file cursor is 64-bit
+    VfsFile* file = vfs.OpenFile("file", true);
+    VFS_ASSERT(file != nullptr);
+    VFS_ASSERT(file->Seek(farOffset, VfsSeekMode::Begin) == farOffset);
+    VFS_ASSERT(file->Seek(-1, VfsSeekMode::Curr) == farOffset - 1);
+    VFS_ASSERT(!file->Preallocate(farOffset)); // not enough space
+    VFS_ASSERT(vfs.Close(file));
+
+    // the image is created without writing it
+    const uint64 sparseSize = 2ull * 1024 * 1024 * 1024;
+    VFS_ASSERT(vfs.Init("test.bin", sparseSize));
+    VFS_ASSERT(vfs.CreateDir("dir"));
+    VFS_ASSERT(vfs.Sync());
+#ifndef _WIN32
+    struct stat st;
+    VFS_ASSERT(stat("test.bin", &st) == 0);
+    VFS_ASSERT(static_cast<uint64>(st.st_size) == sparseSize);
+    VFS_ASSERT(static_cast<uint64>(st.st_blocks) * 512 < sparseSize / 16);
+#endif
+    vfs.Release();
+    VFS_ASSERT(vfs.Open("test.bin"));
+    std::vector<std::string> nodes;
+    VFS_ASSERT(vfs.List("", nodes) && nodes.size() == 1);
+    VFS_ASSERT(vfs.List("dir", nodes) && nodes.empty());
+
+    // the following part needs a few gigabytes of disk space
+    if (!fullSize)
+        return;
+
+    const uint64 fsSize = farOffset + 256 * 1024 * 1024; // inode table takes 1/64 of the image
+    const uint64 fileSize = farOffset + 3;
+    const char marker[] = "4GiB+";
+    VFS_ASSERT(vfs.Init("test.bin", fsSize));
+
+    file = vfs.OpenFile("file", true);
+    VFS_ASSERT(file != nullptr);
+    VFS_ASSERT(file->Preallocate(fileSize));
+    VFS_ASSERT(file->Seek(farOffset - 3, VfsSeekMode::Begin) == farOffset - 3);
+    VFS_ASSERT(file->Write(sizeof(marker), marker) == sizeof(marker));
+    VFS_ASSERT(vfs.Close(file));
+
+    // the size must survive reopening the image
+    vfs.Release();
+    VFS_ASSERT(vfs.Open("test.bin"));
+    PathInfo info;
+    VFS_ASSERT(vfs.GetInfo("file", info));
+    VFS_ASSERT(info.size == fileSize);
+
+    char data[sizeof(marker)];
+    file = vfs.OpenFile("file", false);
+    VFS_ASSERT(file != nullptr);
+    VFS_ASSERT(file->Seek(-static_cast<int64>(sizeof(marker)), VfsSeekMode::End) == farOffset - 3);
+    VFS_ASSERT(file->Read(sizeof(data), data) == sizeof(data));
+    VFS_ASSERT(memcmp(data, marker, sizeof(marker)) == 0);
+
+    // the gap is filled with zeros
+    uint64 zeroOffset = 4ull * 1024 * 1024 * 1024 - 2;
+    VFS_ASSERT(file->Seek(zeroOffset, VfsSeekMode::Begin) == zeroOffset);
+    VFS_ASSERT(file->Read(4, data) == 4);
+    VFS_ASSERT(data[0] == 0 && data[1] == 0 && data[2] == 0 && data[3] == 0);
+    VFS_ASSERT(vfs.Close(file));
+}
+
+void BlockSizeTest()
+{
+    const uint32 blockSizes[] = { VFS_MIN_BLOCK_SIZE, 64 * 1024, VFS_MAX_BLOCK_SIZE };
+    const uint32 fileSize = 3 * 1024 * 1024 + 123;
+    const int entriesNum = 500;
+    std::vector<uint8> buffer(fileSize);
+    for (uint32 i = 0; i < fileSize; i++)
+        buffer[i] = static_cast<uint8>(i * 11);
+
+    {
+        Vfs vfs;
+        VFS_ASSERT(!vfs.SetBlockSize(3000));
+        VFS_ASSERT(!vfs.SetBlockSize(VFS_MIN_BLOCK_SIZE / 2));
+        VFS_ASSERT(!vfs.SetBlockSize(2 * VFS_MAX_BLOCK_SIZE));
+    }
+
+    for (uint32 blockSize : blockSizes)
+    {
+        {
+            Vfs vfs;
+            VFS_ASSERT(vfs.SetBlockSize(blockSize));
+            VFS_ASSERT(vfs.Init("test.bin", 32 * 1024 * 1024));
+            VFS_ASSERT(vfs.GetBlockSize() == blockSize);
+
+            VFS_ASSERT(vfs.CreateDir("dir"));
+            for (int i = 0; i < entriesNum; ++i)
+                VFS_ASSERT(vfs.CreateDir("dir/" + std::to_string(i)));
+
+            // unaligned writes mixed with whole blocks
+            const uint32 chunkSize = 100000;
+            VfsFile* file = vfs.OpenFile("dir/file", true);
+            VFS_ASSERT(file != nullptr);
+            for (uint32 i = 0; i < fileSize; i += chunkSize)
+            {
+                uint32 toWrite = std::min(chunkSize, fileSize - i);
+                VFS_ASSERT(file->Write(toWrite, buffer.data() + i) == toWrite);
+            }
+            VFS_ASSERT(vfs.Close(file));
+        }
+
+        {
+            Vfs vfs;
+            VFS_ASSERT(vfs.Open("test.bin", VfsStorageMode::MemoryMapped));
+            VFS_ASSERT(vfs.GetBlockSize() == blockSize);
+
+            std::vector<std::string> nodes;
+            VFS_ASSERT(vfs.List("dir", nodes));
+            VFS_ASSERT(nodes.size() == entriesNum + 1);
+            PathInfo info;
+            VFS_ASSERT(vfs.GetInfo("dir/" + std::to_string(entriesNum / 2), info));
+
+            std::vector<uint8> readBuffer(fileSize);
+            VfsFile* file = vfs.OpenFile("dir/file", false);
+            VFS_ASSERT(file != nullptr);
+            VFS_ASSERT(file->Read(fileSize, readBuffer.data()) == fileSize);
+            VFS_ASSERT(readBuffer == buffer);
+            VFS_ASSERT(vfs.Close(file));
+        }
+    }
+}
+
+void InlineDataTest()
+{
+    const uint32 fsSize = 1024 * 1024;
+    const int filesNum = 200;
+    const char data[] = "inline";
+
+    Vfs vfs;
+    VFS_ASSERT(vfs.Init("test.bin", fsSize));
+    VFS_ASSERT(vfs.CreateDir("dir"));
+
+    // small files don't take any data blocks
+    for (int i = 0; i < filesNum; ++i)
+    {
+        VfsFile* file = vfs.OpenFile("dir/" + std::to_string(i), true);
+        VFS_ASSERT(file != nullptr);
+        VFS_ASSERT(file->Write(sizeof(data), data) == sizeof(data));
+        VFS_ASSERT(vfs.Close(file));
+    }
+
+    // ...so there is still space for a file spanning almost all the blocks
+    std::vector<uint8> buffer(fsSize * 3 / 4);
+    VfsFile* file = vfs.OpenFile("big", true);
+    VFS_ASSERT(file != nullptr);
+    VFS_ASSERT(file->Write(static_cast<uint32>(buffer.size()), buffer.data()) == buffer.size());
+    VFS_ASSERT(vfs.Close(file));
+
+    // writing past the file end within the inode
+    file = vfs.OpenFile("dir/0", false);
+    VFS_ASSERT(file != nullptr);
+    VFS_ASSERT(file->Seek(INODE_INLINE_SIZE - sizeof(data), VfsSeekMode::Begin) ==
+               INODE_INLINE_SIZE - sizeof(data));
+    VFS_ASSERT(file->Write(sizeof(data), data) == sizeof(data));
+    VFS_ASSERT(vfs.Close(file));
+
+    // growing beyond the inode moves the data to a block
+    file = vfs.OpenFile("dir/1", false);
+    VFS_ASSERT(file != nullptr);
+    VFS_ASSERT(file->Seek(0, VfsSeekMode::End) == sizeof(data));
+    for (int i = 0; i < 100; ++i)
+        VFS_ASSERT(file->Write(sizeof(data), data) == sizeof(data));
+    VFS_ASSERT(vfs.Close(file));
+
+    vfs.Release();
+    VFS_ASSERT(vfs.Open("test.bin"));
+
+    char readData[INODE_INLINE_SIZE];
+    file = vfs.OpenFile("dir/0", false);
+    VFS_ASSERT(file != nullptr);
+    VFS_ASSERT(file->Read(sizeof(readData), readData) == INODE_INLINE_SIZE);
+    VFS_ASSERT(memcmp(readData, data, sizeof(data)) == 0);
+    VFS_ASSERT(readData[sizeof(data)] == 0 && readData[INODE_INLINE_SIZE - sizeof(data) - 1] == 0);
+    VFS_ASSERT(memcmp(readData + INODE_INLINE_SIZE - sizeof(data), data, sizeof(data)) == 0);
+    VFS_ASSERT(vfs.Close(file));
+
+    file = vfs.OpenFile("dir/1", false);
+    VFS_ASSERT(file != nullptr);
+    VFS_ASSERT(file->Seek(0, VfsSeekMode::End) == 101 * sizeof(data));
+    file->Seek(0, VfsSeekMode::Begin);
+    for (int i = 0; i < 101; ++i)
+    {
+        VFS_ASSERT(file->Read(sizeof(data), readData) == sizeof(data));
+        VFS_ASSERT(memcmp(readData, data, sizeof(data)) == 0);
+    }
+    VFS_ASSERT(vfs.Close(file));
+
+    for (int i = 0; i < filesNum; ++i)
+        VFS_ASSERT(vfs.Remove("dir/" + std::to_string(i)));
+}
+
+void DirIndexTest()
+{
+    const int entriesNum = 3000;
+
+    Vfs vfs;
+    VFS_ASSERT(vfs.Init("test.bin", 64 * 1024 * 1024));
+    VFS_ASSERT(vfs.CreateDir("dir"));
+
+    // large enough to be hash indexed
+    for (int i = 0; i < entriesNum; ++i)
+        VFS_ASSERT(vfs.CreateDir("dir/entry" + std::to_string(i)));
+    VFS_ASSERT(!vfs.CreateDir("dir/entry123"));
+
+    // swap-with-last removal moves the entries around
+    for (int i = 0; i < entriesNum; i += 3)
+        VFS_ASSERT(vfs.Remove("dir/entry" + std::to_string(i)));
+    for (int i = 1; i < entriesNum; i += 3)
+        VFS_ASSERT(vfs.Rename("dir/entry" + std::to_string(i), "dir/renamed" + std::to_string(i)));
+
+    PathInfo info;
+    for (int i = 0; i < entriesNum; ++i)
+    {
+        std::string name = std::to_string(i);
+        VFS_ASSERT(vfs.GetInfo("dir/entry" + name, info) == (i % 3 == 2));
+        VFS_ASSERT(vfs.GetInfo("dir/renamed" + name, info) == (i % 3 == 1));
+    }
+
+    std::vector<std::string> nodes;
+    VFS_ASSERT(vfs.List("dir", nodes));
+    VFS_ASSERT(nodes.size() == entriesNum - entriesNum / 3);
+
+    // removing the directory releases its index
+    for (const auto& node : nodes)
+        VFS_ASSERT(vfs.Remove("dir/" + node));
+    VFS_ASSERT(vfs.Remove("dir"));
+    VFS_ASSERT(vfs.CreateDir("dir"));
+    VFS_ASSERT(vfs.List("dir", nodes));
+    VFS_ASSERT(nodes.empty());
+}
+
+void CompactDirTest()
+{
+    Vfs vfs;
+    VFS_ASSERT(vfs.Init("test.bin", 16 * 1024 * 1024));
+    VFS_ASSERT(vfs.CreateDir("dir"));
+
+    // entries of all the possible lengths
+    for (size_t i = 1; i <= VFS_MAX_NAME_LENGTH; ++i)
+        VFS_ASSERT(vfs.CreateDir("dir/" + std::string(i, 'a' + i % 26)));
+    VFS_ASSERT(!vfs.CreateDir("dir/" + std::string(VFS_MAX_NAME_LENGTH + 1, 'x')));
+
+    // removing most of the entries compacts the directory
+    for (size_t i = 1; i <= VFS_MAX_NAME_LENGTH; ++i)
+        if (i % 4 != 0)
+            VFS_ASSERT(vfs.Remove("dir/" + std::string(i, 'a' + i % 26)));
+
+    std::vector<std::string> nodes;
+    VFS_ASSERT(vfs.List("dir", nodes));
+    VFS_ASSERT(nodes.size() == VFS_MAX_NAME_LENGTH / 4);
+    for (const auto& node : nodes)
+        VFS_ASSERT(node.length() % 4 == 0 && node[0] == static_cast<char>('a' + node.length() % 26));
+
+    // the following entries are appended after the compacted ones
+    for (size_t i = 1; i <= VFS_MAX_NAME_LENGTH; ++i)
+        if (i % 4 != 0)
+            VFS_ASSERT(vfs.CreateDir("dir/" + std::string(i, 'a' + i % 26)));
+
+    PathInfo info;
+    for (size_t i = 1; i <= VFS_MAX_NAME_LENGTH; ++i)
+        VFS_ASSERT(vfs.GetInfo("dir/" + std::string(i, 'a' + i % 26), info));
+    VFS_ASSERT(vfs.List("dir", nodes));
+    VFS_ASSERT(nodes.size() == VFS_MAX_NAME_LENGTH);
+}
+
+void DentryCacheTest()
+{
+    Vfs vfs;
+    VFS_ASSERT(vfs.Init("test.bin", 4 * 1024 * 1024));
+
+    std::string deepPath;
+    for (int i = 0; i < 8; ++i)
+    {
+        deepPath += "/level" + std::to_string(i);
+        VFS_ASSERT(vfs.CreateDir(deepPath));
+    }
+
+    // resolving a cached path doesn't depend on its depth (only the target inode is read)
+    PathInfo info;
+    VFS_ASSERT(vfs.GetInfo("level0", info));
+    VfsCacheStats stats = vfs.GetCacheStats();
+    VFS_ASSERT(vfs.GetInfo("level0", info));
+    uint64 shallowAccesses = vfs.GetCacheStats().hits + vfs.GetCacheStats().misses -
+                             stats.hits - stats.misses;
+    VFS_ASSERT(vfs.GetInfo(deepPath, info));
+    stats = vfs.GetCacheStats();
+    VFS_ASSERT(vfs.GetInfo(deepPath, info));
+    VFS_ASSERT(vfs.GetCacheStats().hits + vfs.GetCacheStats().misses -
+               stats.hits - stats.misses == shallowAccesses);
+
+    // negative entries are replaced when the path is created
+    VFS_ASSERT(!vfs.GetInfo(deepPath + "/file", info));
+    VfsFile* file = vfs.OpenFile(deepPath + "/file", true);
+    VFS_ASSERT(file != nullptr);
+    VFS_ASSERT(vfs.Close(file));
+    VFS_ASSERT(vfs.GetInfo(deepPath + "/file", info));
+
+    // renaming a directory keeps the paths below it valid
+    VFS_ASSERT(vfs.Rename("level0/level1", "moved"));
+    VFS_ASSERT(!vfs.GetInfo(deepPath, info));
+    VFS_ASSERT(!vfs.GetInfo("level0/level1", info));
+    std::string movedPath = "moved" + deepPath.substr(std::string("/level0/level1").length());
+    VFS_ASSERT(vfs.GetInfo(movedPath + "/file", info));
+
+    // removed directory inode may be reused by another directory
+    VFS_ASSERT(vfs.Remove(movedPath + "/file"));
+    VFS_ASSERT(!vfs.GetInfo(movedPath + "/file", info));
+    VFS_ASSERT(!vfs.GetInfo(movedPath + "/other", info));
+    VFS_ASSERT(vfs.Remove(movedPath));
+    VFS_ASSERT(vfs.CreateDir("new"));
+    VFS_ASSERT(vfs.CreateDir("new/other"));
+    VFS_ASSERT(vfs.GetInfo("new/other", info));
+    VFS_ASSERT(!vfs.GetInfo(movedPath, info));
+}
+
+void ConcurrencyTest()
+{
+    const int threadsNum = 8;
+    const uint32 fileSize = 300000;
+
+    Vfs vfs;
+    vfs.SetCacheSize(64 * VFS_DEFAULT_BLOCK_SIZE);
+    VFS_ASSERT(vfs.Init("test.bin", 16 * 1024 * 1024));
+    VFS_ASSERT(vfs.CreateDir("dir"));
+
+    auto pattern = [](int thread, uint32 offset) -> uint8
+    {
+        return static_cast<uint8>(thread * 31 + offset / 7);
+    };
+
+    // create and write different files in parallel (using unaligned chunks, so the cache is used)
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threadsNum; ++t)
+    {
+        threads.emplace_back([&vfs, &pattern, t, fileSize]
+        {
+            std::vector<uint8> buffer(1000);
+            VfsFile* file = vfs.OpenFile("dir/file" + std::to_string(t), true);
+            VFS_ASSERT(file != nullptr);
+            for (uint32 offset = 0; offset < fileSize; offset += 1000)
+            {
+                for (uint32 i = 0; i < 1000; ++i)
+                    buffer[i] = pattern(t, offset + i);
+                VFS_ASSERT(file->Write(1000, buffer.data()) == 1000);
+            }
+            VFS_ASSERT(vfs.Close(file));
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+    threads.clear();
+
+    std::vector<std::string> nodes;
+    VFS_ASSERT(vfs.List("dir", nodes));
+    VFS_ASSERT(nodes.size() == threadsNum);
+
+    // read the same file and different files in parallel
+    VfsFile* shared = vfs.OpenFile("dir/file0", false);
+    VFS_ASSERT(shared != nullptr);
+    VFS_ASSERT(!vfs.Remove("dir/file0")); // the file is opened
+
+    for (int t = 0; t < threadsNum; ++t)
+    {
+        threads.emplace_back([&vfs, &pattern, t, fileSize]
+        {
+            std::vector<uint8> buffer(fileSize);
+            for (int source : { 0, t })
+            {
+                VfsFile* file = vfs.OpenFile("dir/file" + std::to_string(source), false);
+                VFS_ASSERT(file != nullptr);
+                VFS_ASSERT(file->Read(fileSize, buffer.data()) == fileSize);
+                for (uint32 i = 0; i < fileSize; ++i)
+                    VFS_ASSERT(buffer[i] == pattern(source, i));
+                VFS_ASSERT(vfs.Close(file));
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    VFS_ASSERT(vfs.Close(shared));
+    VFS_ASSERT(vfs.Remove("dir/file0"));
+}
+
+void AsyncReadTest(VfsAsyncMode mode)
+{
+    const uint32 fileSize = 4 * 1024 * 1024;
+    const int readsNum = 64;
+
+    Vfs vfs;
+    vfs.SetAsyncMode(mode);
+    VFS_ASSERT(vfs.Init("test.bin", 32 * 1024 * 1024));
+
+    std::vector<uint32> data(fileSize / sizeof(uint32));
+    for (uint32 i = 0; i < data.size(); ++i)
+        data[i] = i;
+
+    // write in unaligned chunks, so some of the blocks stay dirty in the cache
+    VfsFile* file = vfs.OpenFile("file", true);
+    VFS_ASSERT(file != nullptr);
+    const uint8* dataPtr = reinterpret_cast<const uint8*>(data.data());
+    for (uint32 written = 0; written < fileSize; )
+    {
+        uint32 bytes = std::min<uint32>(fileSize - written, 100000);
+        VFS_ASSERT(file->Write(bytes, dataPtr + written) == bytes);
+        written += bytes;
+    }
+
+    // many reads in flight at once
+    std::vector<std::vector<uint8>> buffers(readsNum);
+    std::vector<uint32> offsets(readsNum);
+    std::atomic<int> finished(0);
+    std::atomic<int> failed(0);
+    for (int i = 0; i < readsNum; ++i)
+    {
+        uint32 bytes = 1 + static_cast<uint32>(rand()) % (256 * 1024);
+        offsets[i] = static_cast<uint32>(rand()) % (fileSize - bytes);
+        buffers[i].resize(bytes);
+        VFS_ASSERT(file->ReadAsync(offsets[i], bytes, buffers[i].data(), [&, bytes](uint32 read)
+        {
+            if (read != bytes)
+                failed++;
+            finished++;
+        }));
+    }
+
+    // the write waits for the reads (the callbacks may still be running)
+    VFS_ASSERT(file->Seek(0, VfsSeekMode::Begin) == 0);
+    VFS_ASSERT(file->Write(sizeof(uint32), data.data()) == sizeof(uint32));
+    while (finished < readsNum)
+        std::this_thread::yield();
+    VFS_ASSERT(failed == 0);
+
+    for (int i = 0; i < readsNum; ++i)
+        VFS_ASSERT(memcmp(buffers[i].data(), dataPtr + offsets[i], buffers[i].size()) == 0);
+
+    // reads past the file end are truncated
+    std::vector<uint8> buffer(fileSize);
+    VFS_ASSERT(file->ReadAsync(fileSize - 10, 100, buffer.data()).get() == 10);
+    VFS_ASSERT(file->ReadAsync(fileSize, 100, buffer.data()).get() == 0);
+    VFS_ASSERT(vfs.Close(file));
+
+    // the whole file, with nothing cached
+    vfs.Release();
+    VFS_ASSERT(vfs.Open("test.bin"));
+    file = vfs.OpenFile("file", false);
+    VFS_ASSERT(file != nullptr);
+    VFS_ASSERT(file->ReadAsync(0, fileSize, buffer.data()).get() == fileSize);
+    VFS_ASSERT(memcmp(buffer.data(), dataPtr, fileSize) == 0);
+
+    // a read in flight when the file is closed
+    VFS_ASSERT(file->ReadAsync(0, fileSize, buffer.data(), [](uint32) {}));
+    VFS_ASSERT(vfs.Close(file));
+
+    // small file stored in the inode
+    file = vfs.OpenFile("small", true);
+    VFS_ASSERT(file != nullptr);
+    VFS_ASSERT(file->Write(16, dataPtr) == 16);
+    VFS_ASSERT(file->ReadAsync(4, 100, buffer.data()).get() == 12);
+    VFS_ASSERT(memcmp(buffer.data(), dataPtr + 4, 12) == 0);
+    VFS_ASSERT(vfs.Close(file));
+}
+
+void BatchTest()
+{
+    const int filesNum = 2000;
+
+    Vfs vfs;
+    VFS_ASSERT(vfs.Init("test.bin", 16 * 1024 * 1024));
+    VFS_ASSERT(vfs.CreateDir("existing"));
+
+    // parents listed after their children are still created first
+    std::vector<std::string> dirs = { "a/b/c", "a", "a/b", "x", "existing", "missing/y", "x" };
+    std::vector<bool> results;
+    VFS_ASSERT(vfs.CreateDirs(dirs, &results) == 4);
+    VFS_ASSERT(results == std::vector<bool>({ true, true, true, true, false, false, false }));
+
+    std::vector<std::string> files;
+    for (int i = 0; i < filesNum; ++i)
+        files.push_back("a/b/file" + std::to_string(i));
+    files.push_back("a/b/c");
+    VFS_ASSERT(vfs.CreateFiles(files, &results) == filesNum);
+    VFS_ASSERT(!results.back());
+
+    std::vector<std::string> nodes;
+    VFS_ASSERT(vfs.List("a/b", nodes));
+    VFS_ASSERT(nodes.size() == filesNum + 1);
+
+    PathInfo info;
+    VFS_ASSERT(vfs.GetInfo("a/b/file123", info) && !info.directory && info.size == 0);
+    VFS_ASSERT(vfs.GetInfo("a/b/c", info) && info.directory);
+
+    VfsFile* file = vfs.OpenFile("a/b/file0", false);
+    VFS_ASSERT(file != nullptr);
+    VFS_ASSERT(file->Write(4, "data") == 4);
+
+    // opened files and non-empty directories are not removed
+    files.push_back("a/b");
+    files.push_back("x");
+    VFS_ASSERT(vfs.RemoveMany(files, &results) == filesNum + 1);
+    VFS_ASSERT(!results[0] && results[1] && results[filesNum] && !results[filesNum + 1] &&
+               results[filesNum + 2]);
+    VFS_ASSERT(vfs.Close(file));
+
+    VFS_ASSERT(vfs.List("a/b", nodes));
+    VFS_ASSERT(nodes.size() == 1 && nodes[0] == "file0");
+    VFS_ASSERT(!vfs.GetInfo("a/b/file1", info) && !vfs.GetInfo("a/b/c", info));
+
+    // whole tree at once
+    std::vector<std::string> tree = { "a", "a/b", "a/b/file0", "existing" };
+    VFS_ASSERT(vfs.RemoveMany(tree) == 4);
+    VFS_ASSERT(vfs.List("", nodes));
+    VFS_ASSERT(nodes.empty());
+
+    // the released inodes are reused
+    for (auto& path : files)
+        path = path.substr(path.rfind('/') + 1);
+    VFS_ASSERT(vfs.CreateFiles(files) == filesNum + 3);
+}
+
+// read or write a range of the image file directly
+static bool AccessImage(const char* path, uint64 offset, std::vector<uint8>& data, bool write)
+{
+    FILE* file = fopen(path, "r+b");
+    if (file == nullptr)
+        return false;
+
+    bool result = fseek(file, static_cast<long>(offset), SEEK_SET) == 0;
+    if (write)
+        result = result && fwrite(data.data(), 1, data.size(), file) == data.size();
+    else
+        result = result && fread(data.data(), 1, data.size(), file) == data.size();
+
+    fclose(file);
+    return result;
+}
+
+void JournalTest()
+{
+    const int threadsNum = 4;
+    const int filesNum = 50;
+    const char data[] = "journaled";
+
+    Vfs vfs;
+    VFS_ASSERT(vfs.Init("test.bin", 16 * 1024 * 1024));
+    VFS_ASSERT(vfs.CreateDir("dir"));
+
+    // concurrent operations and syncs (waiting syncs are merged into a single commit)
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threadsNum; ++t)
+    {
+        threads.emplace_back([&vfs, &data, t, filesNum]
+        {
+            for (int i = 0; i < filesNum; ++i)
+            {
+                VfsFile* file = vfs.OpenFile("dir/" + std::to_string(t * filesNum + i), true);
+                VFS_ASSERT(file != nullptr);
+                VFS_ASSERT(file->Write(sizeof(data), data) == sizeof(data));
+                VFS_ASSERT(vfs.Close(file));
+                VFS_ASSERT(vfs.Sync());
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    // metadata area (bitmaps and inodes) after the last commit
+    Superblock superblock;
+    std::vector<uint8> superblockData(sizeof(superblock));
+    VFS_ASSERT(AccessImage("test.bin", 0, superblockData, false));
+    memcpy(&superblock, superblockData.data(), sizeof(superblock));
+    VFS_ASSERT(superblock.version == VFS_VERSION_CURRENT && superblock.journalBlocks > 0);
+    std::vector<uint8> metadata((superblock.firstDataBlock - 1) * superblock.blockSize);
+    VFS_ASSERT(AccessImage("test.bin", superblock.blockSize, metadata, false));
+
+    std::vector<uint8> buffer(100000, 7);
+    VfsFile* file = vfs.OpenFile("big", true);
+    VFS_ASSERT(file != nullptr);
+    VFS_ASSERT(file->Write(static_cast<uint32>(buffer.size()), buffer.data()) == buffer.size());
+    VFS_ASSERT(vfs.Close(file));
+    VFS_ASSERT(vfs.CreateDir("last"));
+    vfs.Release();
+
+    // crash after the last transaction was logged - none of its in-place writes are done
+    VFS_ASSERT(AccessImage("test.bin", superblock.blockSize, metadata, true));
+    VFS_ASSERT(vfs.Open("test.bin"));
+
+    std::vector<std::string> nodes;
+    VFS_ASSERT(vfs.List("dir", nodes));
+    VFS_ASSERT(nodes.size() == threadsNum * filesNum);
+    VFS_ASSERT(vfs.List("last", nodes) && nodes.empty());
+
+    std::vector<uint8> readBuffer(buffer.size());
+    file = vfs.OpenFile("big", false);
+    VFS_ASSERT(file != nullptr);
+    VFS_ASSERT(file->Read(static_cast<uint32>(readBuffer.size()), readBuffer.data()) ==
+               buffer.size());
+    VFS_ASSERT(readBuffer == buffer);
+    VFS_ASSERT(vfs.Close(file));
+
+    VFS_ASSERT(vfs.CreateDir("torn"));
+    vfs.Release();
+
+    // a record with an invalid checksum is not replayed
+    std::vector<uint8> header(sizeof(JournalHeader));
+    const uint64 journalOffset = static_cast<uint64>(superblock.firstDataBlock +
+                                                     superblock.journalStart) *
+                                 superblock.blockSize;
+    VFS_ASSERT(AccessImage("test.bin", journalOffset, header, false));
+    header[offsetof(JournalHeader, checksum)] ^= 1;
+    VFS_ASSERT(AccessImage("test.bin", journalOffset, header, true));
+    VFS_ASSERT(vfs.Open("test.bin"));
+    VFS_ASSERT(vfs.List("torn", nodes));
+    VFS_ASSERT(vfs.List("", nodes) && nodes.size() == 4);
+    vfs.Release();
+
+    // images without a journal
+    vfs.SetJournalSize(0);
+    VFS_ASSERT(vfs.Init("test.bin", 16 * 1024 * 1024));
+    VFS_ASSERT(vfs.CreateDir("dir"));
+    VFS_ASSERT(vfs.Sync());
+    vfs.Release();
+
+    VFS_ASSERT(AccessImage("test.bin", 0, superblockData, false));
+    memcpy(&superblock, superblockData.data(), sizeof(superblock));
+    VFS_ASSERT(superblock.journalBlocks == 0);
+    VFS_ASSERT(vfs.Open("test.bin"));
+    VFS_ASSERT(vfs.List("dir", nodes) && nodes.empty());
+}
+
+static void CheckFile(Vfs& vfs, const std::string& path, const std::vector<uint8>& data)
+{
+    std::vector<uint8> readData(data.size() + 1);
+    VfsFile* file = vfs.OpenFile(path, false);
+    VFS_ASSERT(file != nullptr);
+    VFS_ASSERT(file->Read(static_cast<uint32>(readData.size()), readData.data()) == data.size());
+    readData.pop_back();
+    VFS_ASSERT(readData == data);
+    VFS_ASSERT(vfs.Close(file));
+}
+
+void CloneTest()
+{
+    const uint32 fsSize = 16 * 1024 * 1024;
+    const int clonesNum = 8;
+
+    Vfs vfs;
+    VFS_ASSERT(vfs.Init("test.bin", fsSize));
+
+    std::vector<uint8> buffer(6 * 1024 * 1024);
+    for (size_t i = 0; i < buffer.size(); ++i)
+        buffer[i] = static_cast<uint8>(i * 7 + i / 4096);
+
+    VfsFile* file = vfs.OpenFile("source", true);
+    VFS_ASSERT(file != nullptr);
+    VFS_ASSERT(file->Write(static_cast<uint32>(buffer.size()), buffer.data()) == buffer.size());
+    VFS_ASSERT(vfs.Close(file));
+
+    // clones don't take space for the data
+    for (int i = 0; i < clonesNum; ++i)
+        VFS_ASSERT(vfs.Clone("source", "clone" + std::to_string(i)));
+    VFS_ASSERT(!vfs.Clone("source", "clone0"));
+    VFS_ASSERT(!vfs.Clone("missing", "clone"));
+
+    // modifications of a clone are not visible in the other files
+    std::vector<uint8> modified = buffer;
+    const char data[] = "modified";
+    const uint64 offset = 3 * 4096 + 100;
+    memcpy(modified.data() + offset, data, sizeof(data));
+    file = vfs.OpenFile("clone0", false);
+    VFS_ASSERT(file != nullptr);
+    VFS_ASSERT(file->Seek(offset, VfsSeekMode::Begin) == offset);
+    VFS_ASSERT(file->Write(sizeof(data), data) == sizeof(data));
+    VFS_ASSERT(vfs.Close(file));
+
+    // ...also when whole blocks are overwritten
+    std::vector<uint8> overwritten = buffer;
+    std::vector<uint8> blocks(64 * 1024, 0xAB);
+    memcpy(overwritten.data() + 1024 * 1024, blocks.data(), blocks.size());
+    file = vfs.OpenFile("source", false);
+    VFS_ASSERT(file != nullptr);
+    VFS_ASSERT(file->Seek(1024 * 1024, VfsSeekMode::Begin) == 1024 * 1024);
+    VFS_ASSERT(file->Write(static_cast<uint32>(blocks.size()), blocks.data()) == blocks.size());
+    VFS_ASSERT(vfs.Close(file));
+
+    CheckFile(vfs, "clone0", modified);
+    CheckFile(vfs, "clone1", buffer);
+    CheckFile(vfs, "source", overwritten);
+
+    // the shared blocks are kept by the other files
+    VFS_ASSERT(vfs.Remove("source"));
+    vfs.Release();
+    VFS_ASSERT(vfs.Open("test.bin"));
+    CheckFile(vfs, "clone0", modified);
+    CheckFile(vfs, "clone" + std::to_string(clonesNum - 1), buffer);
+
+    // small files are cloned with their inodes
+    file = vfs.OpenFile("small", true);
+    VFS_ASSERT(file != nullptr);
+    VFS_ASSERT(file->Write(sizeof(data), data) == sizeof(data));
+    VFS_ASSERT(vfs.Close(file));
+    VFS_ASSERT(vfs.Clone("small", "small clone"));
+    CheckFile(vfs, "small clone", std::vector<uint8>(data, data + sizeof(data)));
+
+    // the space is reclaimed when the last file is removed
+    for (int i = 0; i < clonesNum; ++i)
+        VFS_ASSERT(vfs.Remove("clone" + std::to_string(i)));
+    buffer.resize(12 * 1024 * 1024);
+    file = vfs.OpenFile("big", true);
+    VFS_ASSERT(file != nullptr);
+    VFS_ASSERT(file->Write(static_cast<uint32>(buffer.size()), buffer.data()) == buffer.size());
+    VFS_ASSERT(vfs.Close(file));
+}
+
+void StatsTest()
+{
+    const char data[] = "stats";
+
+    Vfs vfs;
+    VFS_ASSERT(vfs.Init("test.bin", 16 * 1024 * 1024));
+
+    // nothing is gathered by default
+    VfsFile* file = vfs.OpenFile("file", true);
+    VFS_ASSERT(file != nullptr);
+    VFS_ASSERT(vfs.Close(file));
+    VfsStats stats = vfs.GetStats();
+    VFS_ASSERT(stats.operations[static_cast<size_t>(VfsOperation::OpenFile)].count == 0);
+    VFS_ASSERT(stats.image.writes == 0 && stats.bitmapScans == 0);
+
+    vfs.SetStatsEnabled(true);
+    std::vector<uint8> buffer(100000, 1);
+    file = vfs.OpenFile("file", false);
+    VFS_ASSERT(file != nullptr);
+    VFS_ASSERT(file->Write(static_cast<uint32>(buffer.size()), buffer.data()) == buffer.size());
+    VFS_ASSERT(file->Seek(0, VfsSeekMode::Begin) == 0);
+    VFS_ASSERT(file->Read(sizeof(data), buffer.data()) == sizeof(data));
+    VFS_ASSERT(vfs.Close(file));
+    VFS_ASSERT(vfs.CreateDir("dir"));
+    VFS_ASSERT(vfs.Rename("file", "dir/file"));
+    std::vector<std::string> nodes;
+    VFS_ASSERT(vfs.List("dir", nodes) && nodes.size() == 1);
+    VFS_ASSERT(vfs.Remove("dir/file"));
+    VFS_ASSERT(vfs.Sync());
+
+    stats = vfs.GetStats();
+    for (size_t i = 0; i < static_cast<size_t>(VfsOperation::Count); ++i)
+    {
+        const VfsOperationStats& operation = stats.operations[i];
+        VFS_ASSERT(operation.count == 1);
+        VFS_ASSERT(operation.maxTime <= operation.totalTime);
+
+        uint64 count = 0;
+        for (uint32 j = 0; j < VFS_LATENCY_BUCKETS; ++j)
+            count += operation.histogram[j];
+        VFS_ASSERT(count == 1);
+    }
+
+    VFS_ASSERT(stats.image.writes > 0 && stats.image.bytesWritten >= buffer.size());
+    VFS_ASSERT(stats.image.syncs > 0);
+    VFS_ASSERT(stats.bitmapScans > 0);
+    VFS_ASSERT(stats.blockLookups[VFS_LOOKUP_DEPTHS - 1] > 0);
+
+    vfs.ResetStats();
+    stats = vfs.GetStats();
+    VFS_ASSERT(stats.operations[static_cast<size_t>(VfsOperation::Write)].count == 0);
+    VFS_ASSERT(stats.image.writes == 0);
+}
+
+// fill a file with a pattern (so the truncated contents can be verified)
+static std::vector<uint8> MakePattern(size_t size)
+{
+    std::vector<uint8> data(size);
+    for (size_t i = 0; i < size; ++i)
+        data[i] = static_cast<uint8>(i * 13 + i / 4096);
+    return data;
+}
+
+static void WriteFile(Vfs& vfs, const std::string& path, const std::vector<uint8>& data)
+{
+    VfsFile* file = vfs.OpenFile(path, true);
+    VFS_ASSERT(file != nullptr);
+    VFS_ASSERT(file->Write(static_cast<uint32>(data.size()), data.data()) == data.size());
+    VFS_ASSERT(vfs.Close(file));
+}
+
+// create an image in the oldest format (files are mapped with block pointers trees there)
+static void MakeLegacyImage(Vfs& vfs, uint32 size)
+{
+    vfs.SetJournalSize(0);
+    VFS_ASSERT(vfs.Init("test.bin", size));
+    const uint32 blockSize = vfs.GetBlockSize();
+    vfs.Release();
+
+    std::vector<uint8> version(sizeof(uint32), 0);
+    VFS_ASSERT(AccessImage("test.bin", offsetof(Superblock, version), version, true));
+
+    // legacy images have no shared blocks table (inode 1 doesn't fit in the old layout)
+    std::vector<uint8> inodeBitmap(1);
+    VFS_ASSERT(AccessImage("test.bin", blockSize, inodeBitmap, false));
+    inodeBitmap[0] &= ~(1 << 1);
+    VFS_ASSERT(AccessImage("test.bin", blockSize, inodeBitmap, true));
+}
+
+static void TruncateFile(Vfs& vfs, const std::string& path, uint64 size)
+{
+    VfsFile* file = vfs.OpenFile(path, false);
+    VFS_ASSERT(file != nullptr);
+    VFS_ASSERT(file->Truncate(size));
+    VFS_ASSERT(vfs.Close(file));
+}
+
+void TruncateTest()
+{
+    const uint32 fsSize = 64 * 1024 * 1024;
+    const std::vector<uint8> data = MakePattern(40 * 1024 * 1024);
+
+    // an image with files mapped by block pointers trees
+    Vfs vfs;
+    MakeLegacyImage(vfs, fsSize);
+    VFS_ASSERT(vfs.Open("test.bin"));
+
+    // the whole tree (with double-indirect blocks) is released, so the space can be reused
+    for (int i = 0; i < 4; ++i)
+    {
+        WriteFile(vfs, "file", data);
+        VFS_ASSERT(vfs.Remove("file"));
+    }
+
+    // shrinking keeps the beginning of the file
+    std::vector<uint8> expected(data.begin(), data.begin() + 100000);
+    WriteFile(vfs, "file", data);
+    TruncateFile(vfs, "file", expected.size());
+    CheckFile(vfs, "file", expected);
+
+    // growing fills the file with zeros
+    TruncateFile(vfs, "file", 3 * 1024 * 1024);
+    expected.resize(3 * 1024 * 1024, 0);
+    CheckFile(vfs, "file", expected);
+
+    // the truncated blocks are free again
+    WriteFile(vfs, "file2", data);
+    VFS_ASSERT(vfs.Remove("file2"));
+    VFS_ASSERT(vfs.Remove("file"));
+    vfs.Release();
+
+    // extent mapped files
+    VFS_ASSERT(vfs.Init("test.bin", fsSize));
+    WriteFile(vfs, "file", data);
+    VFS_ASSERT(vfs.Clone("file", "clone"));
+    TruncateFile(vfs, "file", 12345);
+    TruncateFile(vfs, "file", 20000);
+    expected.assign(data.begin(), data.begin() + 12345);
+    expected.resize(20000, 0);
+    CheckFile(vfs, "file", expected);
+    CheckFile(vfs, "clone", data);
+
+    // the shared blocks are released with the last file using them
+    TruncateFile(vfs, "clone", 0);
+    CheckFile(vfs, "clone", std::vector<uint8>());
+    VFS_ASSERT(vfs.Remove("file"));
+    WriteFile(vfs, "file", data);
+
+    // files stored in inodes
+    const char small[] = "small file";
+    WriteFile(vfs, "small", std::vector<uint8>(small, small + sizeof(small)));
+    TruncateFile(vfs, "small", 5);
+    TruncateFile(vfs, "small", 8);
+    CheckFile(vfs, "small", { 's', 'm', 'a', 'l', 'l', 0, 0, 0 });
+}
+
+void JournalLimitsTest()
+{
+    const uint32 fsSize = 16 * 1024 * 1024;
+    const std::vector<uint8> data = MakePattern(2 * 1024 * 1024);
+
+    Vfs vfs;
+    VFS_ASSERT(vfs.Init("test.bin", fsSize));
+    WriteFile(vfs, "a", data);
+    VFS_ASSERT(vfs.Sync());
+
+    Superblock superblock;
+    std::vector<uint8> superblockData(sizeof(superblock));
+    VFS_ASSERT(AccessImage("test.bin", 0, superblockData, false));
+    memcpy(&superblock, superblockData.data(), sizeof(superblock));
+    std::vector<uint8> metadata((superblock.firstDataBlock - 1) * superblock.blockSize);
+    VFS_ASSERT(AccessImage("test.bin", superblock.blockSize, metadata, false));
+
+    // the blocks of the removed file are not reused before the removal is committed
+    std::vector<uint8> otherData(data.rbegin(), data.rend());
+    VFS_ASSERT(vfs.Remove("a"));
+    WriteFile(vfs, "b", otherData);
+
+    // crash before the next commit - the file data is written in place, the metadata is not
+    std::vector<uint8> image(fsSize);
+    VFS_ASSERT(AccessImage("test.bin", 0, image, false));
+    FILE* crashFile = fopen("crash.bin", "wb");
+    VFS_ASSERT(crashFile != nullptr);
+    VFS_ASSERT(fwrite(image.data(), 1, image.size(), crashFile) == image.size());
+    fclose(crashFile);
+    VFS_ASSERT(AccessImage("crash.bin", superblock.blockSize, metadata, true));
+
+    Vfs crashed;
+    VFS_ASSERT(crashed.Open("crash.bin"));
+    CheckFile(crashed, "a", data);
+    VFS_ASSERT(crashed.OpenFile("b", false) == nullptr);
+    crashed.Release();
+    remove("crash.bin");
+
+    // the released blocks are reclaimed by a commit when the free ones are not enough
+    for (int i = 0; i < 4; ++i)
+    {
+        const std::string name = "big" + std::to_string(i);
+        WriteFile(vfs, name, MakePattern(8 * 1024 * 1024));
+        VFS_ASSERT(vfs.Remove(name));
+    }
+    CheckFile(vfs, "b", otherData);
+    vfs.Release();
+
+    // batches larger than the journal are committed in parts
+    const uint32 filesNum = 2000;
+    std::vector<std::string> paths;
+    for (uint32 i = 0; i < filesNum; ++i)
+        paths.push_back("dir/" + std::to_string(i));
+
+    vfs.SetJournalSize(64 * VFS_DEFAULT_BLOCK_SIZE);
+    VFS_ASSERT(vfs.Init("test.bin", fsSize));
+    VFS_ASSERT(vfs.CreateDir("dir"));
+    VFS_ASSERT(vfs.CreateFiles(paths) == filesNum);
+    VFS_ASSERT(vfs.Sync());
+    vfs.Release();
+
+    std::vector<std::string> nodes;
+    VFS_ASSERT(vfs.Open("test.bin"));
+    VFS_ASSERT(vfs.List("dir", nodes) && nodes.size() == filesNum);
+    VFS_ASSERT(vfs.RemoveMany(paths) == filesNum);
+    VFS_ASSERT(vfs.List("dir", nodes) && nodes.empty());
+    vfs.Release();
+
+    // a gap past the file end is zeroed with whole blocks, not logged (the journal holds only
+    // a small part of it)
+    const uint32 blockSize = 64 * 1024;
+    const uint64 gapSize = 32 * 1024 * 1024;
+    Vfs largeBlocks;
+    VFS_ASSERT(largeBlocks.SetBlockSize(blockSize));
+    VFS_ASSERT(largeBlocks.Init("test.bin", 4 * gapSize));
+    VfsFile* file = largeBlocks.OpenFile("gap", true);
+    VFS_ASSERT(file != nullptr);
+    VFS_ASSERT(file->Write(100, data.data()) == 100);
+    VFS_ASSERT(file->Truncate(gapSize));
+    VFS_ASSERT(largeBlocks.Close(file));
+    VFS_ASSERT(largeBlocks.Sync());
+    largeBlocks.Release();
+
+    std::vector<uint8> expected(gapSize, 0);
+    memcpy(expected.data(), data.data(), 100);
+    VFS_ASSERT(largeBlocks.Open("test.bin"));
+    CheckFile(largeBlocks, "gap", expected);
+}
+
+// append chunks to the files in turns, so their blocks are interleaved
+static void WriteInterleaved(Vfs& vfs, const std::vector<std::string>& paths,
+                             const std::vector<uint8>& data, uint32 chunkSize)
+{
+    for (uint32 offset = 0; offset < data.size(); offset += chunkSize)
+    {
+        for (const auto& path : paths)
+        {
+            VfsFile* file = vfs.OpenFile(path, offset == 0);
+            VFS_ASSERT(file != nullptr);
+            VFS_ASSERT(file->Seek(offset, VfsSeekMode::Begin) == offset);
+            VFS_ASSERT(file->Write(chunkSize, data.data() + offset) == chunkSize);
+            VFS_ASSERT(vfs.Close(file));
+        }
+    }
+}
+
+void DefragTest()
+{
+    const uint32 fsSize = 32 * 1024 * 1024;
+    const std::vector<uint8> data = MakePattern(2 * 1024 * 1024);
+
+    Vfs vfs;
+    VFS_ASSERT(vfs.Init("test.bin", fsSize));
+    WriteInterleaved(vfs, { "a", "b", "c" }, data, 8 * 1024);
+    VFS_ASSERT(vfs.Remove("b"));
+
+    // the work is split into steps, each one moves at least one file
+    VfsDefragStats stats;
+    uint32 filesMoved = 0;
+    uint32 steps = 0;
+    do
+    {
+        stats = vfs.Defragment(1);
+        filesMoved += stats.filesMoved;
+        steps++;
+    } while (!stats.finished);
+    VFS_ASSERT(filesMoved == 2);
+    VFS_ASSERT(steps >= 2);
+    CheckFile(vfs, "a", data);
+    CheckFile(vfs, "c", data);
+
+    // nothing left to do
+    stats = vfs.Defragment(~0ULL);
+    VFS_ASSERT(stats.finished && stats.bytesMoved == 0);
+
+    vfs.Release();
+    VFS_ASSERT(vfs.Open("test.bin"));
+    CheckFile(vfs, "a", data);
+    CheckFile(vfs, "c", data);
+
+    // directory with holes after the removed entries
+    const uint32 entriesNum = 600;
+    VFS_ASSERT(vfs.CreateDir("dir"));
+    for (uint32 i = 0; i < entriesNum; ++i)
+        VFS_ASSERT(vfs.CreateDir("dir/entry" + std::to_string(i)));
+    for (uint32 i = 0; i < entriesNum; i += 3)
+        VFS_ASSERT(vfs.Remove("dir/entry" + std::to_string(i)));
+
+    stats = vfs.Defragment(~0ULL);
+    VFS_ASSERT(stats.finished && stats.dirsCompacted == 1);
+    std::vector<std::string> nodes;
+    VFS_ASSERT(vfs.List("dir", nodes) && nodes.size() == entriesNum - entriesNum / 3);
+    PathInfo info;
+    VFS_ASSERT(vfs.GetInfo("dir/entry1", info) && info.directory);
+    VFS_ASSERT(!vfs.GetInfo("dir/entry3", info));
+    vfs.Release();
+
+    // files mapped by block pointers trees
+    MakeLegacyImage(vfs, fsSize);
+    VFS_ASSERT(vfs.Open("test.bin"));
+
+    WriteInterleaved(vfs, { "a", "b" }, data, 8 * 1024);
+    VFS_ASSERT(vfs.Remove("b"));
+    stats = vfs.Defragment(~0ULL);
+    VFS_ASSERT(stats.finished && stats.filesMoved == 1);
+    vfs.Release();
+    VFS_ASSERT(vfs.Open("test.bin"));
+    CheckFile(vfs, "a", data);
+    VFS_ASSERT(vfs.Remove("a"));
+
+    // a fragmented file with a hole (older versions allowed writing past the file end)
+    const uint32 blockSize = vfs.GetBlockSize();
+    const std::vector<uint8> smallData = MakePattern(4 * blockSize);
+    WriteInterleaved(vfs, { "sparse", "b" }, smallData, blockSize);
+    vfs.Release();
+
+    Superblock superblock;
+    std::vector<uint8> superblockData(sizeof(superblock));
+    VFS_ASSERT(AccessImage("test.bin", 0, superblockData, false));
+    memcpy(&superblock, superblockData.data(), sizeof(superblock));
+    const uint32 sparseINode = 1; // the first one after the root directory
+    const uint64 inodeOffset = static_cast<uint64>(1 + superblock.dataBitmapBlocks +
+                                                   superblock.inodeBitmapBlocks) * blockSize +
+                               sparseINode * INODE_LEGACY_SIZE;
+    std::vector<uint8> inodeData(INODE_LEGACY_SIZE);
+    VFS_ASSERT(AccessImage("test.bin", inodeOffset, inodeData, false));
+    VFS_ASSERT(inodeData[offsetof(INode, ptrDepth)] == 0);
+    memset(&inodeData[offsetof(INode, blockPtr) + 2 * sizeof(uint32)], 0xFF, sizeof(uint32));
+    VFS_ASSERT(AccessImage("test.bin", inodeOffset, inodeData, true));
+
+    // the sparse file is skipped, the blocks after the hole stay where they are
+    VFS_ASSERT(vfs.Open("test.bin"));
+    stats = vfs.Defragment(~0ULL);
+    VFS_ASSERT(stats.finished && stats.filesMoved == 1);
+    CheckFile(vfs, "b", smallData);
+    VfsFile* file = vfs.OpenFile("sparse", false);
+    VFS_ASSERT(file != nullptr);
+    std::vector<uint8> block(blockSize);
+    for (uint32 i = 0; i < 4; ++i)
+    {
+        if (i == 2)
+            continue;
+
+        VFS_ASSERT(file->Seek(static_cast<uint64>(i) * blockSize, VfsSeekMode::Begin) ==
+                   static_cast<uint64>(i) * blockSize);
+        VFS_ASSERT(file->Read(blockSize, block.data()) == blockSize);
+        VFS_ASSERT(memcmp(block.data(), smallData.data() + i * blockSize, blockSize) == 0);
+    }
+    VFS_ASSERT(vfs.Close(file));
+}
+
+void UsageTest()
+{
+    const uint32 fsSize = 32 * 1024 * 1024;
+    const std::vector<uint8> data = MakePattern(1024 * 1024);
+
+    Vfs vfs;
+    VFS_ASSERT(vfs.Init("test.bin", fsSize));
+    VfsUsageReport report;
+    VFS_ASSERT(vfs.GetUsageReport(report));
+    const uint32 initialFree = report.freeBlocks;
+    VFS_ASSERT(report.journalBlocks > 0);
+    VFS_ASSERT(report.totalBlocks - report.freeBlocks == report.journalBlocks);
+    VFS_ASSERT(report.directories == 1 && report.files == 0);
+
+    WriteInterleaved(vfs, { "a", "b" }, data, 16 * 1024);
+    WriteFile(vfs, "small", { 1, 2, 3 });
+    VFS_ASSERT(vfs.CreateDir("dir"));
+    VFS_ASSERT(vfs.Clone("a", "dir/clone"));
+
+    // the hash index of a large directory is not counted as a file
+    const uint32 indexedFiles = 2000;
+    std::vector<std::string> paths;
+    for (uint32 i = 0; i < indexedFiles; ++i)
+        paths.push_back("indexed/" + std::to_string(i));
+    VFS_ASSERT(vfs.CreateDir("indexed"));
+    VFS_ASSERT(vfs.CreateFiles(paths) == indexedFiles);
+
+    // the shared blocks table is written on sync
+    VFS_ASSERT(vfs.Sync());
+    VFS_ASSERT(vfs.GetUsageReport(report));
+    const uint32 fileBlocks = static_cast<uint32>(data.size() / report.blockSize);
+    VFS_ASSERT(report.files == 4 + indexedFiles && report.directories == 3);
+    VFS_ASSERT(report.inlineFiles == 1 + indexedFiles);
+    VFS_ASSERT(report.fragmentedFiles == 3);
+    VFS_ASSERT(report.sharedBlocks == fileBlocks);
+    VFS_ASSERT(report.refsTableBlocks > 0 && report.dirIndexBlocks > 0);
+    VFS_ASSERT(report.inodes.size() == report.files + report.directories);
+
+    // every used block is accounted for
+    uint64 usedBlocks = report.journalBlocks + report.mapBlocks + report.refsTableBlocks +
+                        report.dirIndexBlocks;
+    for (const VfsFileUsage& usage : report.inodes)
+        usedBlocks += usage.blocks;
+    VFS_ASSERT(usedBlocks - report.sharedBlocks == report.totalBlocks - report.freeBlocks);
+    VFS_ASSERT(initialFree - report.freeBlocks > 2 * fileBlocks);
+
+    // the free runs add up to the free blocks
+    uint64 freeRunsBlocks = 0;
+    for (uint32 i = 0; i < VFS_FREE_RUN_BUCKETS; ++i)
+    {
+        VFS_ASSERT(report.freeRuns[i] == 0 || report.largestFreeRun >= (1u << i));
+        freeRunsBlocks += report.freeRuns[i] * (1ull << i);
+    }
+    VFS_ASSERT(freeRunsBlocks <= report.freeBlocks && report.largestFreeRun <= report.freeBlocks);
+
+    for (const VfsFileUsage& usage : report.inodes)
+    {
+        VFS_ASSERT(usage.fragments <= usage.blocks);
+        if (!usage.directory && usage.size == data.size())
+            VFS_ASSERT(usage.blocks == fileBlocks && usage.fragments > 1);
+    }
+    vfs.Release();
+
+    // block pointers trees
+    MakeLegacyImage(vfs, fsSize);
+    VFS_ASSERT(vfs.Open("test.bin"));
+    WriteFile(vfs, "file", data);
+    VFS_ASSERT(vfs.GetUsageReport(report));
+    VFS_ASSERT(report.files == 1 && report.mapBlocks == 1);
+    VFS_ASSERT(report.inodes.back().blocks == fileBlocks);
+    VFS_ASSERT(report.inodes.back().mapBlocks == 1 && report.inodes.back().fragments >= 1);
+}
+
+void INodeBitmapTest()
+{
+    // legacy inodes are smaller, so the inode table holds more of them than the bitmap can track
+    const uint32 fsSize = 64 * 1024 * 1024;
+    Vfs vfs;
+    MakeLegacyImage(vfs, fsSize);
+
+    Superblock superblock;
+    std::vector<uint8> superblockData(sizeof(superblock));
+    VFS_ASSERT(AccessImage("test.bin", 0, superblockData, false));
+    memcpy(&superblock, superblockData.data(), sizeof(superblock));
+    const uint32 bitmapINodes = superblock.inodeBitmapBlocks * superblock.blockSize * 8;
+    VFS_ASSERT(superblock.inodeBlocks * (superblock.blockSize / INODE_LEGACY_SIZE) > bitmapINodes);
+
+    VFS_ASSERT(vfs.Open("test.bin"));
+    VfsUsageReport report;
+    VFS_ASSERT(vfs.GetUsageReport(report));
+    VFS_ASSERT(report.totalINodes == bitmapINodes);
+    const uint32 initialFree = report.freeBlocks;
+
+    // fill the inode bitmap (more files are requested than there are inodes)
+    const uint32 dirsNum = 32;
+    std::vector<std::string> dirs;
+    for (uint32 i = 0; i < dirsNum; ++i)
+        dirs.push_back("dir" + std::to_string(i));
+    VFS_ASSERT(vfs.CreateDirs(dirs) == dirsNum);
+    std::vector<std::string> paths;
+    for (uint32 i = 0; i < bitmapINodes; ++i)
+        paths.push_back(dirs[i % dirsNum] + "/" + std::to_string(i));
+    VFS_ASSERT(vfs.CreateFiles(paths) == report.freeINodes - dirsNum);
+    VFS_ASSERT(false == vfs.CreateDir("full"));
+
+    // only the directories took data blocks, every used block is accounted for
+    VFS_ASSERT(vfs.GetUsageReport(report));
+    VFS_ASSERT(report.freeINodes == 0 && report.files == bitmapINodes - dirsNum - 1);
+    uint64 usedBlocks = report.mapBlocks;
+    for (const VfsFileUsage& usage : report.inodes)
+        usedBlocks += usage.blocks;
+    VFS_ASSERT(usedBlocks == report.totalBlocks - report.freeBlocks);
+    VFS_ASSERT(initialFree - report.freeBlocks < report.totalBlocks / 4);
+
+    // data blocks are still allocated correctly, also after reopening the image
+    const std::vector<uint8> data = MakePattern(8 * 1024 * 1024);
+    VFS_ASSERT(vfs.RemoveMany({ paths.front() }) == 1);
+    WriteFile(vfs, paths.front(), data);
+    CheckFile(vfs, paths.front(), data);
+    vfs.Release();
+    VFS_ASSERT(vfs.Open("test.bin"));
+    CheckFile(vfs, paths.front(), data);
+    CheckFile(vfs, paths[1], {});
+    VFS_ASSERT(vfs.GetUsageReport(report));
+    VFS_ASSERT(report.freeINodes == 0);
+}
+
+// read a file in small chunks and compare it with the expected data
+static void ReadInChunks(Vfs& vfs, const std::string& path, const std::vector<uint8>& data,
+                         uint32 chunkSize)
+{
+    std::vector<uint8> readData(data.size());
+    VfsFile* file = vfs.OpenFile(path, false);
+    VFS_ASSERT(file != nullptr);
+    for (size_t i = 0; i < data.size(); i += chunkSize)
+    {
+        uint32 toRead = static_cast<uint32>(std::min<size_t>(chunkSize, data.size() - i));
+        VFS_ASSERT(file->Read(toRead, readData.data() + i) == toRead);
+    }
+    VFS_ASSERT(vfs.Close(file));
+    VFS_ASSERT(readData == data);
+}
+
+void SequentialAccessTest()
+{
+    const uint32 fsSize = 32 * 1024 * 1024;
+    const uint32 chunkSize = 100;
+    const std::vector<uint8> data = MakePattern(1024 * 1024);
+    const uint32 chunksNum = static_cast<uint32>(data.size() / chunkSize) + 1;
+
+    Vfs vfs;
+    VFS_ASSERT(vfs.Init("test.bin", fsSize));
+    vfs.SetStatsEnabled(true);
+
+    // small sequential writes are gathered and written as whole blocks (bypassing the cache
+    // and the journal)
+    VfsFile* file = vfs.OpenFile("file", true);
+    VFS_ASSERT(file != nullptr);
+    for (size_t i = 0; i < data.size(); i += chunkSize)
+    {
+        uint32 toWrite = static_cast<uint32>(std::min<size_t>(chunkSize, data.size() - i));
+        VFS_ASSERT(file->Write(toWrite, data.data() + i) == toWrite);
+    }
+
+    // the gathered data is visible before it's written
+    PathInfo info;
+    VFS_ASSERT(vfs.GetInfo("file", info) && info.size == data.size());
+    VFS_ASSERT(file->Seek(0, VfsSeekMode::End) == data.size());
+    CheckFile(vfs, "file", data);
+    VFS_ASSERT(vfs.Close(file));
+    VFS_ASSERT(vfs.Sync());
+    VfsStats stats = vfs.GetStats();
+    VFS_ASSERT(stats.image.writes < chunksNum / 100);
+    VFS_ASSERT(stats.image.bytesWritten < data.size() + data.size() / 2);
+    vfs.Release();
+
+    // small sequential reads are served from the prefetched blocks
+    VFS_ASSERT(vfs.Open("test.bin"));
+    vfs.SetStatsEnabled(true);
+    ReadInChunks(vfs, "file", data, chunkSize);
+    stats = vfs.GetStats();
+    VFS_ASSERT(stats.image.reads < chunksNum / 100);
+    VFS_ASSERT(stats.cache.hits > 0);
+
+    // random reads don't prefetch
+    file = vfs.OpenFile("file", false);
+    VFS_ASSERT(file != nullptr);
+    for (uint32 i = 0; i < 100; ++i)
+    {
+        uint64 offset = (i * 7919 * chunkSize) % (data.size() - chunkSize);
+        uint8 chunk[chunkSize];
+        VFS_ASSERT(file->Seek(offset, VfsSeekMode::Begin) == offset);
+        VFS_ASSERT(file->Read(chunkSize, chunk) == chunkSize);
+        VFS_ASSERT(memcmp(chunk, data.data() + offset, chunkSize) == 0);
+    }
+    VFS_ASSERT(vfs.Close(file));
+
+    // the gathered data is written before truncation
+    std::vector<uint8> expected(data.begin(), data.begin() + 5000);
+    file = vfs.OpenFile("small", true);
+    VFS_ASSERT(file != nullptr);
+    for (uint32 i = 0; i < 8000; i += chunkSize)
+        VFS_ASSERT(file->Write(chunkSize, data.data() + i) == chunkSize);
+    VFS_ASSERT(file->Truncate(expected.size()));
+    VFS_ASSERT(vfs.Close(file));
+    CheckFile(vfs, "small", expected);
+
+    // the size isn't taken from the flushed buffer after shrinking the file
+    expected.assign(data.begin(), data.begin() + 500);
+    file = vfs.OpenFile("shrunk", true);
+    VFS_ASSERT(file != nullptr);
+    VFS_ASSERT(file->Write(10000, data.data()) == 10000);
+    VFS_ASSERT(file->Write(chunkSize, data.data() + 10000) == chunkSize);
+    VFS_ASSERT(file->Truncate(expected.size()));
+    VFS_ASSERT(vfs.GetInfo("shrunk", info) && info.size == expected.size());
+    VFS_ASSERT(file->Seek(0, VfsSeekMode::End) == expected.size());
+    VFS_ASSERT(file->Write(1, data.data() + expected.size()) == 1);
+    VFS_ASSERT(vfs.Close(file));
+    expected.push_back(data[expected.size()]);
+    CheckFile(vfs, "shrunk", expected);
+    vfs.Release();
+
+    // blocks mapped by block pointers trees
+    MakeLegacyImage(vfs, fsSize);
+    VFS_ASSERT(vfs.Open("test.bin"));
+    WriteFile(vfs, "file", data);
+    ReadInChunks(vfs, "file", data, chunkSize);
+    vfs.Release();
+
+    VFS_ASSERT(vfs.Open("test.bin", VfsStorageMode::MemoryMapped));
+    ReadInChunks(vfs, "file", data, chunkSize);
+}
+
 int main(int argc, char** argv)
 {
     DirTest();
     FileTest();
     BigFileTest();
     FileStressTest();
+    CacheTest();
+    MemoryMappedTest();
+    FragmentedFilesTest();
+    PreallocateTest();
+    AsyncReadTest(VfsAsyncMode::Ring);
+    AsyncReadTest(VfsAsyncMode::ThreadPool);
+    LargeFileTest(argc > 1 && strcmp(argv[1], "--large") == 0);
+    BlockSizeTest();
+    InlineDataTest();
+    DirIndexTest();
+    CompactDirTest();
+    BatchTest();
+    JournalTest();
+    CloneTest();
+    StatsTest();
+    TruncateTest();
+    JournalLimitsTest();
+    DefragTest();
+    UsageTest();
+    INodeBitmapTest();
+    SequentialAccessTest();
+    DentryCacheTest();
+    ConcurrencyTest();
 
     std::cout << "DONE." << std::endl;
     getchar();
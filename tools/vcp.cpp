@@ -1,10 +1,21 @@
 /**
  * @author Michal Witanowski
- * @brief  VFS creation tool.
+ * @brief  VFS copy tool.
  */
 
 #include "../vfs.hpp"
 
+#include <errno.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#include <memory>
+#include <functional>
+#include <thread>
+#include <future>
+#include <atomic>
+#include <mutex>
+
 enum class Direction
 {
     Internal,
@@ -14,179 +25,433 @@ enum class Direction
 
 void PrintUsage()
 {
-    std::cout << "Usage: vcp [vfs image] dir [source]... [destination]..." << std::endl;
+    std::cout << "Usage: vcp [vfs image] dir [-r] [source]... [destination]..." << std::endl;
 }
 
-#define BUFFER_SIZE 64*1024
-static unsigned char buffer[BUFFER_SIZE];
+// chunk size of streamed files (two chunks are in flight - one is read while the other one is
+// written)
+#define BUFFER_SIZE (1024 * 1024)
+
+// files up to this size are copied at once by the worker threads
+#define SMALL_FILE_SIZE (256 * 1024)
+
+#define WORKER_THREADS 8
+
+static std::mutex gOutputLock;
+
+/**
+ * File to copy
+ */
+struct CopyTask
+{
+    std::string source;
+    std::string dest;
+    uint64 size;
+    bool ready; //< destination was prepared
+};
 
-int CopyDown(Vfs& vfs, int argc, char** argv)
+/**
+ * Directories to create and files to copy
+ */
+struct CopyPlan
+{
+    std::vector<std::string> dirs; //< destination directories (parents first)
+    std::vector<CopyTask> files;
+};
+
+/**
+ * Opened file on one side of the copy
+ */
+class Stream
+{
+public:
+    virtual ~Stream() {}
+
+    // returns number of bytes read (zero at the end of the file)
+    virtual size_t Read(uint8* data, size_t bytes) = 0;
+    virtual bool Write(const uint8* data, size_t bytes) = 0;
+};
+
+/**
+ * Source or destination file system
+ */
+class Storage
 {
-    for (int i = 3; i < argc - 1; ++i)
+public:
+    virtual ~Storage() {}
+
+    virtual bool GetInfo(const std::string& path, PathInfo& info) = 0;
+    virtual bool List(const std::string& path, std::vector<std::string>& names) = 0;
+
+    // create the destination directories
+    virtual void CreateDirs(const std::vector<std::string>& dirs) = 0;
+
+    // mark the files that can be written (creating them if needed)
+    virtual void CreateFiles(std::vector<CopyTask>& files) = 0;
+
+    // copy a file without copying its data (if the storage supports it)
+    virtual bool Clone(const std::string&, const std::string&)
     {
-        std::string source = argv[i];
-        std::string dest = argv[argc - 1];
-        dest += '/';
-        dest += source;
+        return false;
+    }
 
-        /// open source file
-        VfsFile* srcFile = vfs.OpenFile(source, false);
-        if (srcFile == 0)
-        {
-            std::cout << "Failed to open '" << source << "' file" << std::endl;
-            return 1;
-        }
+    /**
+     * Open a file.
+     * @param size Expected size of a written file
+     */
+    virtual std::unique_ptr<Stream> Open(const std::string& path, bool write, uint64 size) = 0;
+};
 
-        /// create destination file
-        FILE* destFile = fopen(dest.c_str(), "wb");
-        if (destFile == 0)
-        {
-            std::cout << "Failed to open '" << dest << "' file for writing" << std::endl;
-            vfs.Close(srcFile);
-            return 1;
-        }
+class HostStream final : public Stream
+{
+    FILE* mFile;
 
-        /// copy
-        size_t bytesRead;
-        while ((bytesRead = srcFile->Read(BUFFER_SIZE, buffer)) > 0)
-        {
-            if (fwrite(buffer, 1, bytesRead, destFile) < bytesRead)
-            {
-                std::cout << "Failed to write '" << dest << "'. Skipping." << std::endl;
-                break;
-            }
-        }
+public:
+    explicit HostStream(FILE* file) : mFile(file) {}
 
-        vfs.Close(srcFile);
-        fclose(destFile);
-        std::cout << "Copied '" << source << "' to '" << dest << "'" << std::endl;
+    ~HostStream()
+    {
+        fclose(mFile);
     }
 
-    return 0;
-}
+    size_t Read(uint8* data, size_t bytes) override
+    {
+        return fread(data, 1, bytes, mFile);
+    }
 
-int CopyUp(Vfs& vfs, int argc, char** argv)
+    bool Write(const uint8* data, size_t bytes) override
+    {
+        return fwrite(data, 1, bytes, mFile) == bytes;
+    }
+};
+
+class HostStorage final : public Storage
 {
-    bool singleCopy = true;
-    PathInfo info;
-    if (vfs.GetInfo(argv[argc - 1], info))
+public:
+    bool GetInfo(const std::string& path, PathInfo& info) override
     {
-        if (info.directory)
-        {
-            singleCopy = false;
-        }
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0)
+            return false;
+
+        info.directory = S_ISDIR(st.st_mode);
+        info.size = static_cast<uint64>(st.st_size);
+        return true;
     }
 
-    for (int i = 3; i < argc - 1; ++i)
+    bool List(const std::string& path, std::vector<std::string>& names) override
     {
-        std::string source = argv[i];
-        std::string dest = argv[argc - 1];
+        DIR* dir = opendir(path.c_str());
+        if (dir == nullptr)
+            return false;
 
-        if (!singleCopy)
+        names.clear();
+        while (dirent* entry = readdir(dir))
         {
-            dest += '/';
-            dest += source;
+            std::string name = entry->d_name;
+            if (name != "." && name != "..")
+                names.push_back(name);
         }
 
-        /// open source file
-        FILE* srcFile = fopen(source.c_str(), "rb");
-        if (srcFile == 0)
-        {
-            std::cout << "Failed to open '" << source << "' file" << std::endl;
-            return 1;
-        }
+        closedir(dir);
+        return true;
+    }
 
-        /// create destination file
-        VfsFile* destFile = vfs.OpenFile(dest, true);
-        if (destFile == 0)
-        {
-            std::cout << "Failed to open '" << dest << "' file for writing" << std::endl;
-            fclose(srcFile);
-            return 1;
-        }
+    void CreateDirs(const std::vector<std::string>& dirs) override
+    {
+        for (const auto& dir : dirs)
+            if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+                std::cout << "Failed to create '" << dir << "' directory" << std::endl;
+    }
 
-        /// copy
-        size_t bytesRead;
-        while ((bytesRead = fread(buffer, 1, BUFFER_SIZE, srcFile)) > 0)
-        {
-            if (destFile->Write(bytesRead, buffer) < bytesRead)
-            {
-                std::cout << "Failed to write '" << dest << "'. Skipping." << std::endl;
-                break;
-            }
-        }
+    void CreateFiles(std::vector<CopyTask>& files) override
+    {
+        for (auto& task : files)
+            task.ready = true;
+    }
 
-        vfs.Close(destFile);
-        fclose(srcFile);
-        std::cout << "Copied '" << source << "' to '" << dest << "'" << std::endl;
+    std::unique_ptr<Stream> Open(const std::string& path, bool write, uint64) override
+    {
+        FILE* file = fopen(path.c_str(), write ? "wb" : "rb");
+        if (file == nullptr)
+            return nullptr;
 
-        if (singleCopy)
-            break;
+        return std::unique_ptr<Stream>(new HostStream(file));
     }
+};
 
-    return 0;
-}
+class VfsStream final : public Stream
+{
+    Vfs& mVfs;
+    VfsFile* mFile;
+
+public:
+    VfsStream(Vfs& vfs, VfsFile* file) : mVfs(vfs), mFile(file) {}
+
+    ~VfsStream()
+    {
+        mVfs.Close(mFile);
+    }
+
+    size_t Read(uint8* data, size_t bytes) override
+    {
+        uint32 bytesRead = mFile->Read(static_cast<uint32>(bytes), data);
+        return bytesRead == INVALID_INDEX ? 0 : bytesRead;
+    }
+
+    bool Write(const uint8* data, size_t bytes) override
+    {
+        return mFile->Write(static_cast<uint32>(bytes), data) == bytes;
+    }
+};
 
-int CopyInternal(Vfs& vfs, int argc, char** argv)
+class VfsStorage final : public Storage
 {
-    bool singleCopy = true;
-    PathInfo info;
-    if (vfs.GetInfo(argv[argc - 1], info))
+    Vfs& mVfs;
+
+public:
+    explicit VfsStorage(Vfs& vfs) : mVfs(vfs) {}
+
+    bool GetInfo(const std::string& path, PathInfo& info) override
     {
-        if (info.directory)
-        {
-            singleCopy = false;
-        }
+        return mVfs.GetInfo(path, info);
     }
 
-    for (int i = 3; i < argc - 1; ++i)
+    bool List(const std::string& path, std::vector<std::string>& names) override
     {
-        std::string source = argv[i];
-        std::string dest = argv[argc - 1];
+        return mVfs.List(path, names);
+    }
 
-        if (!singleCopy)
-        {
-            dest += '/';
-            dest += source;
-        }
+    void CreateDirs(const std::vector<std::string>& dirs) override
+    {
+        // directories may exist already (their contents are merged then)
+        mVfs.CreateDirs(dirs);
+    }
 
-        /// open source file
-        VfsFile* srcFile = vfs.OpenFile(source, false);
-        if (srcFile == 0)
-        {
-            std::cout << "Failed to open '" << source << "' file" << std::endl;
-            return 1;
-        }
+    void CreateFiles(std::vector<CopyTask>& files) override
+    {
+        // all the destination files are created at once
+        std::vector<std::string> paths;
+        for (const auto& task : files)
+            paths.push_back(task.dest);
+
+        std::vector<bool> created;
+        mVfs.CreateFiles(paths, &created);
+        for (size_t i = 0; i < files.size(); ++i)
+            files[i].ready = created[i];
+    }
 
-        /// create destination file
-        VfsFile* destFile = vfs.OpenFile(dest, true);
-        if (destFile == 0)
+    bool Clone(const std::string& source, const std::string& dest) override
+    {
+        return mVfs.Clone(source, dest);
+    }
+
+    std::unique_ptr<Stream> Open(const std::string& path, bool write, uint64 size) override
+    {
+        VfsFile* file = mVfs.OpenFile(path, false);
+        if (file == nullptr)
+            return nullptr;
+
+        // reserve space for the whole file, so it's stored contiguously
+        if (write && size > 0 && !file->Preallocate(size))
         {
-            std::cout << "Failed to open '" << dest << "' file for writing" << std::endl;
-            vfs.Close(srcFile);
-            return 1;
+            std::lock_guard<std::mutex> lock(gOutputLock);
+            std::cout << "Failed to preallocate '" << path << "'" << std::endl;
         }
 
-        /// copy
+        return std::unique_ptr<Stream>(new VfsStream(mVfs, file));
+    }
+};
+
+// add a path to the copy plan (with the directory contents if the copy is recursive)
+bool AddToPlan(Storage& from, const std::string& source, const std::string& dest, bool recursive,
+               CopyPlan& plan)
+{
+    PathInfo info;
+    if (!from.GetInfo(source, info))
+    {
+        std::cout << "Failed to open '" << source << "' file" << std::endl;
+        return false;
+    }
+
+    if (!info.directory)
+    {
+        CopyTask task;
+        task.source = source;
+        task.dest = dest;
+        task.size = info.size;
+        task.ready = false;
+        plan.files.push_back(task);
+        return true;
+    }
+
+    if (!recursive)
+    {
+        std::cout << "'" << source << "' is a directory (use -r to copy it)" << std::endl;
+        return false;
+    }
+
+    std::vector<std::string> names;
+    if (!from.List(source, names))
+    {
+        std::cout << "Failed to list '" << source << "' directory" << std::endl;
+        return false;
+    }
+
+    plan.dirs.push_back(dest);
+    bool result = true;
+    for (const auto& name : names)
+        result &= AddToPlan(from, source + '/' + name, dest + '/' + name, recursive, plan);
+    return result;
+}
+
+/**
+ * Copy a single file.
+ * @param buffer Buffer for files copied at once or nullptr if the file is streamed in chunks
+ */
+bool CopyFile(Storage& from, Storage& to, const CopyTask& task, std::vector<uint8>* buffer)
+{
+    std::unique_ptr<Stream> src = from.Open(task.source, false, 0);
+    if (!src)
+    {
+        std::lock_guard<std::mutex> lock(gOutputLock);
+        std::cout << "Failed to open '" << task.source << "' file" << std::endl;
+        return false;
+    }
+
+    std::unique_ptr<Stream> dest = task.ready ? to.Open(task.dest, true, task.size) : nullptr;
+    if (!dest)
+    {
+        std::lock_guard<std::mutex> lock(gOutputLock);
+        std::cout << "Failed to open '" << task.dest << "' file for writing" << std::endl;
+        return false;
+    }
+
+    bool written = true;
+    if (buffer)
+    {
         size_t bytesRead;
-        while ((bytesRead = srcFile->Read(BUFFER_SIZE, buffer)) > 0)
+        while (written && (bytesRead = src->Read(buffer->data(), buffer->size())) > 0)
+            written = dest->Write(buffer->data(), bytesRead);
+    }
+    else
+    {
+        // the next chunk is read while the current one is written
+        std::vector<uint8> chunks[2] = { std::vector<uint8>(BUFFER_SIZE),
+                                         std::vector<uint8>(BUFFER_SIZE) };
+        size_t bytesRead = src->Read(chunks[0].data(), BUFFER_SIZE);
+        for (int current = 0; written && bytesRead > 0; current ^= 1)
         {
-            if (destFile->Write(bytesRead, buffer) < bytesRead)
+            uint8* next = chunks[current ^ 1].data();
+            std::future<size_t> nextRead = std::async(std::launch::async, [&src, next]
             {
-                std::cout << "Failed to write '" << dest << "'. Skipping." << std::endl;
-                break;
-            }
+                return src->Read(next, BUFFER_SIZE);
+            });
+
+            written = dest->Write(chunks[current].data(), bytesRead);
+            bytesRead = nextRead.get();
         }
+    }
+
+    std::lock_guard<std::mutex> lock(gOutputLock);
+    if (!written)
+    {
+        std::cout << "Failed to write '" << task.dest << "'. Skipping." << std::endl;
+        return false;
+    }
+
+    std::cout << "Copied '" << task.source << "' to '" << task.dest << "'" << std::endl;
+    return true;
+}
+
+/**
+ * Get path of a source copied into a directory (named after the last component of the source,
+ * like "cp -r" does). The contents of "." and ".." are copied directly into the directory.
+ */
+std::string GetPathInDir(std::string dir, const std::string& source)
+{
+    while (dir.size() > 1 && dir.back() == '/')
+        dir.pop_back();
+
+    size_t end = source.find_last_not_of('/');
+    if (end == std::string::npos)
+        return dir;
+
+    size_t start = source.find_last_of('/', end);
+    start = (start == std::string::npos) ? 0 : start + 1;
+    const std::string name = source.substr(start, end + 1 - start);
+    if (name == "." || name == "..")
+        return dir;
+
+    return dir + '/' + name;
+}
+
+int Copy(Storage& from, Storage& to, const std::vector<std::string>& sources,
+         const std::string& dest, bool recursive)
+{
+    // sources are copied into the destination directory, otherwise only the first one is copied
+    PathInfo info;
+    bool intoDir = to.GetInfo(dest, info) && info.directory;
+
+    CopyPlan plan;
+    for (std::string source : sources)
+    {
+        // trailing slashes would double the separators of the nested paths
+        while (source.size() > 1 && source.back() == '/')
+            source.pop_back();
 
-        vfs.Close(destFile);
-        vfs.Close(srcFile);
-        std::cout << "Copied '" << source << "' to '" << dest << "'" << std::endl;
+        if (!AddToPlan(from, source, intoDir ? GetPathInDir(dest, source) : dest, recursive,
+                       plan))
+            return 1;
 
-        if (singleCopy)
+        if (!intoDir)
             break;
     }
 
-    return 0;
+    to.CreateDirs(plan.dirs);
+
+    // files copied within the image share their data blocks (if the image supports it)
+    std::vector<CopyTask> tasks;
+    bool clone = &from == &to;
+    for (const auto& task : plan.files)
+    {
+        clone = clone && from.Clone(task.source, task.dest);
+        if (clone)
+            std::cout << "Cloned '" << task.source << "' to '" << task.dest << "'" << std::endl;
+        else
+            tasks.push_back(task);
+    }
+
+    to.CreateFiles(tasks);
+
+    std::vector<const CopyTask*> smallFiles, largeFiles;
+    for (const auto& task : tasks)
+        (task.size <= SMALL_FILE_SIZE ? smallFiles : largeFiles).push_back(&task);
+
+    // small files are copied by the workers, large ones are streamed by this thread meanwhile
+    std::atomic<size_t> nextFile(0);
+    std::atomic<bool> failed(false);
+    std::vector<std::thread> workers;
+    size_t workersNum = std::min<size_t>(WORKER_THREADS, smallFiles.size());
+    for (size_t i = 0; i < workersNum; ++i)
+    {
+        workers.emplace_back([&]
+        {
+            std::vector<uint8> buffer(SMALL_FILE_SIZE);
+            for (size_t j = nextFile++; j < smallFiles.size(); j = nextFile++)
+                if (!CopyFile(from, to, *smallFiles[j], &buffer))
+                    failed = true;
+        });
+    }
+
+    for (const CopyTask* task : largeFiles)
+        if (!CopyFile(from, to, *task, nullptr))
+            failed = true;
+
+    for (auto& worker : workers)
+        worker.join();
+
+    return failed ? 1 : 0;
 }
 
 int main(int argc, char** argv)
@@ -214,20 +479,37 @@ int main(int argc, char** argv)
         return 1;
     }
 
+    int firstSource = 3;
+    std::string recursiveStr = argv[3];
+    bool recursive = recursiveStr == "-r" || recursiveStr == "--recursive";
+    if (recursive)
+        firstSource++;
+
+    if (argc - firstSource < 2)
+    {
+        PrintUsage();
+        return 1;
+    }
+
     Vfs vfs;
     if (!vfs.Open(argv[1]))
     {
         return 1;
     }
 
+    std::vector<std::string> sources(argv + firstSource, argv + argc - 1);
+    std::string dest = argv[argc - 1];
+
+    HostStorage host;
+    VfsStorage image(vfs);
     switch (dir)
     {
     case Direction::Up:
-        return CopyUp(vfs, argc, argv);
+        return Copy(host, image, sources, dest, recursive);
     case Direction::Down:
-        return CopyDown(vfs, argc, argv);
+        return Copy(image, host, sources, dest, recursive);
     case Direction::Internal:
-        return CopyInternal(vfs, argc, argv);
+        return Copy(image, image, sources, dest, recursive);
     }
 
     return 0;
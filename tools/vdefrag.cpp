@@ -0,0 +1,59 @@
+/**
+ * @author Michal Witanowski
+ * @brief  VFS defragmentation tool. Moves fragmented files into contiguous runs of blocks and
+ *         compacts directories, step by step.
+ */
+
+#include "../vfs.hpp"
+
+void PrintUsage()
+{
+    std::cout << "Usage: vdefrag [vfs image] [budget in MiB per step (optional)]" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2 || argc > 3)
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    uint64 budget = ~0ULL;
+    if (argc == 3)
+    {
+        int megabytes = atoi(argv[2]);
+        if (megabytes <= 0)
+        {
+            PrintUsage();
+            return 1;
+        }
+        budget = static_cast<uint64>(megabytes) * 1024 * 1024;
+    }
+
+    Vfs vfs;
+    if (!vfs.Open(argv[1]))
+    {
+        return 1;
+    }
+
+    VfsDefragStats total;
+    VfsDefragStats stats;
+    uint32 step = 0;
+    do
+    {
+        stats = vfs.Defragment(budget);
+        step++;
+        total.filesMoved += stats.filesMoved;
+        total.dirsCompacted += stats.dirsCompacted;
+        total.bytesMoved += stats.bytesMoved;
+
+        std::cout << "Step " << step << ": " << stats.filesMoved << " files moved (" <<
+                     stats.bytesMoved << " bytes), " << stats.dirsCompacted <<
+                     " directories compacted" << std::endl;
+    } while (!stats.finished);
+
+    std::cout << "Total: " << total.filesMoved << " files moved (" << total.bytesMoved <<
+                 " bytes), " << total.dirsCompacted << " directories compacted" << std::endl;
+    return 0;
+}
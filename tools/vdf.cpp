@@ -0,0 +1,101 @@
+/**
+ * @author Michal Witanowski
+ * @brief  VFS space usage tool. Prints used and free space, metadata overhead, free space
+ *         fragmentation and the most fragmented files.
+ */
+
+#include "../vfs.hpp"
+
+#include <algorithm>
+
+void PrintUsage()
+{
+    std::cout << "Usage: vdf [vfs image] [number of listed files (optional)]" << std::endl;
+}
+
+void PrintBlocks(const char* name, uint64 blocks, const VfsUsageReport& report)
+{
+    printf("%-18s %10llu blocks %12llu KiB %6.1f%%\n", name,
+           static_cast<unsigned long long>(blocks),
+           static_cast<unsigned long long>(blocks * report.blockSize / 1024),
+           report.totalBlocks ? 100.0 * blocks / report.totalBlocks : 0.0);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2 || argc > 3)
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    size_t filesListed = 10;
+    if (argc == 3)
+        filesListed = static_cast<size_t>(atoi(argv[2]));
+
+    Vfs vfs;
+    if (!vfs.Open(argv[1]))
+    {
+        return 1;
+    }
+
+    VfsUsageReport report;
+    if (!vfs.GetUsageReport(report))
+    {
+        return 1;
+    }
+
+    uint64 dataBlocks = 0;
+    for (const VfsFileUsage& usage : report.inodes)
+        dataBlocks += usage.blocks;
+
+    std::cout << "block size: " << report.blockSize << " bytes" << std::endl;
+    PrintBlocks("total", report.totalBlocks, report);
+    PrintBlocks("used", report.totalBlocks - report.freeBlocks, report);
+    PrintBlocks("free", report.freeBlocks, report);
+    PrintBlocks("  file data", dataBlocks, report);
+    PrintBlocks("  shared", report.sharedBlocks, report);
+    PrintBlocks("  block maps", report.mapBlocks, report);
+    PrintBlocks("  shared table", report.refsTableBlocks, report);
+    PrintBlocks("  dir indexes", report.dirIndexBlocks, report);
+    PrintBlocks("  journal", report.journalBlocks, report);
+    std::cout << "metadata area:     " << report.metadataBlocks << " blocks" << std::endl;
+
+    std::cout << std::endl << "inodes: " << report.totalINodes - report.freeINodes << " used, " <<
+                 report.freeINodes << " free (" << report.files << " files, " <<
+                 report.directories << " directories, " << report.inlineFiles << " inline)" <<
+                 std::endl;
+
+    std::cout << std::endl << "free runs (largest " << report.largestFreeRun << " blocks):" <<
+                 std::endl;
+    for (uint32 i = 0; i < VFS_FREE_RUN_BUCKETS; ++i)
+    {
+        if (report.freeRuns[i] > 0)
+            printf("  %10u - %-10u %10u\n", 1u << i, (2u << i) - 1, report.freeRuns[i]);
+    }
+
+    std::cout << std::endl << "fragmented: " << report.fragmentedFiles << " of " <<
+                 report.inodes.size() << " inodes" << std::endl;
+
+    std::vector<VfsFileUsage> fragmented;
+    for (const VfsFileUsage& usage : report.inodes)
+        if (usage.fragments > 1)
+            fragmented.push_back(usage);
+
+    std::sort(fragmented.begin(), fragmented.end(),
+              [](const VfsFileUsage& a, const VfsFileUsage& b)
+              {
+                  return a.fragments > b.fragments;
+              });
+
+    if (fragmented.size() > filesListed)
+        fragmented.resize(filesListed);
+
+    for (const VfsFileUsage& usage : fragmented)
+    {
+        std::cout << "  inode " << usage.inodeID << (usage.directory ? " [DIR]" : "") << ": " <<
+                     usage.fragments << " fragments, " << usage.blocks << " blocks" << std::endl;
+    }
+
+    return 0;
+}
@@ -24,9 +24,14 @@ int main(int argc, char** argv)
         return 1;
     }
 
+    // all the directories are created at once (parents may be listed before their children)
+    std::vector<std::string> paths(argv + 2, argv + argc);
+    std::vector<bool> results;
+    vfs.CreateDirs(paths, &results);
+
     for (int i = 2; i < argc; ++i)
     {
-        if (vfs.CreateDir(argv[i]))
+        if (results[i - 2])
             std::cout << "Directory '" << argv[i] << "' created" << std::endl;
         else
             std::cout << "Failed to create '" << argv[i] << "' directory" << std::endl;
@@ -7,7 +7,8 @@
 
 void PrintUsage()
 {
-    std::cout << "Usage: vmkfs [size] [path]" << std::endl;
+    std::cout << "Usage: vmkfs [size] [path] [block size (optional)] [journal size (optional)]"
+              << std::endl;
 }
 
 int main(int argc, char** argv)
@@ -18,7 +19,7 @@ int main(int argc, char** argv)
         return 1;
     }
 
-    uint32 size = atoi(argv[1]);
+    uint64 size = strtoull(argv[1], nullptr, 10);
     std::string path = argv[2];
 
     if (size == 0)
@@ -28,6 +29,15 @@ int main(int argc, char** argv)
     }
 
     Vfs vfs;
+    if (argc > 3 && !vfs.SetBlockSize(atoi(argv[3])))
+    {
+        return 1;
+    }
+
+    // zero creates an image without a journal
+    if (argc > 4)
+        vfs.SetJournalSize(strtoull(argv[4], nullptr, 10));
+
     if (!vfs.Init(path, size))
     {
         return 1;
@@ -24,9 +24,14 @@ int main(int argc, char** argv)
         return 1;
     }
 
+    // all the paths are removed at once (directories may be listed with their contents)
+    std::vector<std::string> paths(argv + 2, argv + argc);
+    std::vector<bool> results;
+    vfs.RemoveMany(paths, &results);
+
     for (int i = 2; i < argc; ++i)
     {
-        if (vfs.Remove(argv[i]))
+        if (results[i - 2])
             std::cout << "Path '" << argv[i] << "' removed" << std::endl;
         else
             std::cout << "Failed to remove '" << argv[i] << "' path" << std::endl;
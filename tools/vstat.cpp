@@ -0,0 +1,134 @@
+/**
+ * @author Michal Witanowski
+ * @brief  VFS statistics tool. Opens an image, reads the whole directory tree and prints the
+ *         gathered latencies and I/O counters.
+ */
+
+#include "../vfs.hpp"
+
+void PrintUsage()
+{
+    std::cout << "Usage: vstat [vfs image] [path (optional)]..." << std::endl;
+}
+
+// list directories recursively and read all the files
+void Walk(Vfs& vfs, const std::string& path, std::vector<uint8>& buffer)
+{
+    PathInfo info;
+    if (!vfs.GetInfo(path, info))
+    {
+        std::cout << "Failed to open '" << path << "'" << std::endl;
+        return;
+    }
+
+    if (info.directory)
+    {
+        std::vector<std::string> names;
+        if (!vfs.List(path, names))
+        {
+            std::cout << "Failed to list '" << path << "' directory" << std::endl;
+            return;
+        }
+
+        for (const auto& name : names)
+            Walk(vfs, path.empty() ? name : path + '/' + name, buffer);
+        return;
+    }
+
+    VfsFile* file = vfs.OpenFile(path, false);
+    if (file == nullptr)
+    {
+        std::cout << "Failed to open '" << path << "' file" << std::endl;
+        return;
+    }
+
+    uint32 bytesRead;
+    do
+    {
+        bytesRead = file->Read(static_cast<uint32>(buffer.size()), buffer.data());
+    } while (bytesRead != INVALID_INDEX && bytesRead > 0);
+
+    vfs.Close(file);
+}
+
+// get upper bound (in microseconds) of the histogram bucket containing the given percentile
+uint64 GetPercentile(const VfsOperationStats& operation, double percentile)
+{
+    uint64 count = 0;
+    for (uint32 i = 0; i < VFS_LATENCY_BUCKETS; ++i)
+    {
+        count += operation.histogram[i];
+        if (count >= percentile * operation.count)
+            return 1ull << i;
+    }
+    return 1ull << (VFS_LATENCY_BUCKETS - 1);
+}
+
+void PrintStats(const VfsStats& stats)
+{
+    std::cout << "operation      count     avg [us]   max [us]   p50 [us]   p99 [us]" <<
+                 std::endl;
+    for (size_t i = 0; i < static_cast<size_t>(VfsOperation::Count); ++i)
+    {
+        const VfsOperationStats& operation = stats.operations[i];
+        if (operation.count == 0)
+            continue;
+
+        printf("%-10s %10llu %12.2f %10.2f %10s %10s\n",
+               VfsStats::GetOperationName(static_cast<VfsOperation>(i)),
+               static_cast<unsigned long long>(operation.count),
+               operation.totalTime / 1000.0 / operation.count, operation.maxTime / 1000.0,
+               ("<" + std::to_string(GetPercentile(operation, 0.5))).c_str(),
+               ("<" + std::to_string(GetPercentile(operation, 0.99))).c_str());
+    }
+
+    std::cout << std::endl << "image:" << std::endl <<
+                 "  reads:         " << stats.image.reads << " (" << stats.image.bytesRead <<
+                 " bytes)" << std::endl <<
+                 "  writes:        " << stats.image.writes << " (" <<
+                 stats.image.bytesWritten << " bytes)" << std::endl <<
+                 "  seeks:         " << stats.image.seeks << std::endl <<
+                 "  syncs:         " << stats.image.syncs << std::endl;
+
+    std::cout << "cache:" << std::endl <<
+                 "  hits:          " << stats.cache.hits << std::endl <<
+                 "  misses:        " << stats.cache.misses << std::endl <<
+                 "  evictions:     " << stats.cache.evictions << std::endl <<
+                 "  write-backs:   " << stats.cache.writeBacks << std::endl <<
+                 "  direct blocks: " << stats.cache.direct << std::endl;
+
+    std::cout << "bitmap scans:    " << stats.bitmapScans << " (" << stats.bitmapScanWords <<
+                 " words, the longest " << stats.bitmapMaxScan << ")" << std::endl;
+
+    std::cout << "block lookups:   " << stats.blockLookups[0] << " direct, " <<
+                 stats.blockLookups[1] << " indirect, " << stats.blockLookups[2] <<
+                 " double-indirect, " << stats.blockLookups[VFS_LOOKUP_DEPTHS - 1] <<
+                 " extents" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    // the image loading is a part of the session too
+    Vfs vfs;
+    vfs.SetStatsEnabled(true);
+    if (!vfs.Open(argv[1]))
+    {
+        return 1;
+    }
+
+    std::vector<uint8> buffer(1024 * 1024);
+    if (argc == 2)
+        Walk(vfs, "", buffer);
+
+    for (int i = 2; i < argc; ++i)
+        Walk(vfs, argv[i], buffer);
+
+    PrintStats(vfs.GetStats());
+    return 0;
+}
@@ -7,92 +7,404 @@
 #include <assert.h>
 #include <string.h>
 #include <iostream>
-#include <sstream>
 #include <stack>
 #include <iomanip>
+#include <algorithm>
+#include <map>
+#include <unordered_set>
 
 #define ROOT_INODE_INDEX 0
 
-// NOTE: this is slow - O(n) worst case time complexity
-uint32 Vfs::ReserveBitmap(uint32 firstBitmapBlock, uint32 bitmapSize)
+static_assert(sizeof(INode) == VFS_INODE_SIZE, "Invalid INode structure size");
+
+// call a function for each run of consecutive IDs in a sorted list
+template<typename Func>
+static void ForEachRun(const std::vector<uint32>& ids, Func func)
+{
+    for (size_t i = 0; i < ids.size(); )
+    {
+        size_t length = 1;
+        while (i + length < ids.size() && ids[i + length] == ids[i] + length)
+            length++;
+
+        func(ids[i], static_cast<uint32>(length));
+        i += length;
+    }
+}
+
+uint32 Vfs::ReserveBlock(uint32 hint)
+{
+    std::lock_guard<std::mutex> lock(mBlocksLock);
+    uint32 id;
+    if (hint != INVALID_INDEX && hint < mSuperblock.dataBlocks)
+        id = mBlockBitmap.ReserveNear(hint);
+    else
+        id = mBlockBitmap.Reserve();
+
+    if (id != INVALID_INDEX)
+        mFreeSpace.Reserve(id, 1);
+    return id;
+}
+
+void Vfs::ReleaseBlock(uint32 id)
 {
-    fseek(mImage, VFS_BLOCK_SIZE * firstBitmapBlock, SEEK_SET);
+    std::lock_guard<std::mutex> lock(mBlocksLock);
+    if (mSharedBlocksNum > 0)
+    {
+        auto it = mBlockRefs.find(id);
+        if (it != mBlockRefs.end())
+        {
+            // the block is still used by other files
+            if (--it->second == 1)
+                mBlockRefs.erase(it);
+            mSharedBlocksNum = mBlockRefs.size();
+            mBlockRefsDirty = true;
+            return;
+        }
+    }
 
-    // iterate bitmap bytes
-    for (uint32 i = 0; i < bitmapSize / 8; ++i) 
+    // the committed metadata may still use the block
+    if (mJournal.IsEnabled())
     {
-        uint8 byte = 0;
-        VFS_ASSERT(1 == fread(&byte, 1, 1, mImage));
+        mFreedBlocks.push_back(id);
+        return;
+    }
 
-        if (byte == 0xFF)
-            continue;
+    mBlockBitmap.Release(id);
+    mFreeSpace.Release(id, 1);
+}
 
-        uint8 mask = 0x1;
-        // iterate bitmap's byte bits
-        for (uint32 j = 0; j < 8; ++j)
+void Vfs::ReleaseRunLocked(uint32 firstBlockID, uint32 count)
+{
+    const uint32 end = firstBlockID + count;
+    for (uint32 runStart = firstBlockID; runStart < end; )
+    {
+        // the blocks still used by other files split the run
+        uint32 runEnd = runStart;
+        auto it = mBlockRefs.end();
+        while (runEnd < end &&
+               (mSharedBlocksNum == 0 || (it = mBlockRefs.find(runEnd)) == mBlockRefs.end()))
+            runEnd++;
+
+        if (runEnd > runStart)
         {
-            if ((byte & mask) == 0)
+            // the committed metadata may still use the blocks
+            if (mJournal.IsEnabled())
+            {
+                for (uint32 id = runStart; id < runEnd; ++id)
+                    mFreedBlocks.push_back(id);
+            }
+            else
             {
-                byte |= mask;
-                fseek(mImage, -1, SEEK_CUR);
-                VFS_ASSERT(1 == fwrite(&byte, 1, 1, mImage));
-                return 8 * i + j;
+                mBlockBitmap.ReleaseRange(runStart, runEnd - runStart);
+                mFreeSpace.Release(runStart, runEnd - runStart);
             }
-            mask <<= 1;
+        }
+
+        if (runEnd < end)
+        {
+            if (--it->second == 1)
+                mBlockRefs.erase(it);
+            mSharedBlocksNum = mBlockRefs.size();
+            mBlockRefsDirty = true;
+        }
+
+        runStart = runEnd + 1;
+    }
+}
+
+void Vfs::ReleaseBlockRun(uint32 firstBlockID, uint32 count)
+{
+    std::lock_guard<std::mutex> lock(mBlocksLock);
+    ReleaseRunLocked(firstBlockID, count);
+}
+
+void Vfs::ReleaseBlocks(std::vector<uint32>& blocks)
+{
+    std::sort(blocks.begin(), blocks.end());
+
+    std::lock_guard<std::mutex> lock(mBlocksLock);
+    ForEachRun(blocks, [this](uint32 start, uint32 length)
+    {
+        ReleaseRunLocked(start, length);
+    });
+}
+
+void Vfs::ShareBlocks(const std::vector<Extent>& extents)
+{
+    std::lock_guard<std::mutex> lock(mBlocksLock);
+    for (const Extent& extent : extents)
+    {
+        for (uint32 i = 0; i < extent.length; ++i)
+        {
+            // unshared blocks have no entry
+            auto result = mBlockRefs.insert(std::make_pair(extent.start + i, 2u));
+            if (!result.second)
+                result.first->second++;
         }
     }
 
-    return INVALID_INDEX;
+    mSharedBlocksNum = mBlockRefs.size();
+    mBlockRefsDirty = true;
 }
 
-// NOTE: this is slow - O(n) worst case time complexity
-void Vfs::ReleaseBitmap(uint32 firstBitmapBlock, uint32 bitmapSize, uint32 id)
+uint32 Vfs::GetSharedRun(uint32 firstBlockID, uint32 count, bool& shared)
 {
-    VFS_ASSERT(id < bitmapSize);
-    uint32 byteOffset = VFS_BLOCK_SIZE * firstBitmapBlock + id / 8;
-    uint8 mask = 1 << (id % 8);
+    shared = false;
+    if (mSharedBlocksNum == 0)
+        return count;
+
+    std::lock_guard<std::mutex> lock(mBlocksLock);
+    shared = mBlockRefs.count(firstBlockID) > 0;
+    uint32 length = 1;
+    while (length < count && (mBlockRefs.count(firstBlockID + length) > 0) == shared)
+        length++;
+    return length;
+}
 
-    uint8 byte;
-    fseek(mImage, byteOffset, SEEK_SET);
-    VFS_ASSERT(1 == fread(&byte, 1, 1, mImage));
-    VFS_ASSERT((byte & mask) == mask);
+bool Vfs::LoadBlockRefs()
+{
+    mBlockRefs.clear();
+    mSharedBlocksNum = 0;
+    mBlockRefsDirty = false;
+    if (mSuperblock.version < VFS_VERSION_SHARED_BLOCKS)
+        return true;
+
+    VfsFile file(this, mSuperblock.blockRefsINode, true);
+    uint32 recordsNum = 0;
+    if (file.mINode.GetSize() == 0)
+        return true;
+
+    if (file.ReadOffset(sizeof(recordsNum), 0, &recordsNum) != sizeof(recordsNum))
+        return false;
 
-    byte &= ~mask;
+    std::vector<BlockRefs> records(recordsNum);
+    uint32 bytes = recordsNum * static_cast<uint32>(sizeof(BlockRefs));
+    if (file.ReadOffset(bytes, sizeof(recordsNum), records.data()) != bytes)
+        return false;
 
-    fseek(mImage, byteOffset, SEEK_SET);
-    VFS_ASSERT(1 == fwrite(&byte, 1, 1, mImage));
+    for (const BlockRefs& record : records)
+        mBlockRefs[record.block] = record.refs;
+    mSharedBlocksNum = mBlockRefs.size();
+    return true;
 }
 
-uint32 Vfs::ReserveBlock()
+bool Vfs::SaveBlockRefs()
 {
-    return ReserveBitmap(mSuperblock.inodeBitmapBlocks + 1, mSuperblock.dataBlocks);
+    std::vector<BlockRefs> records;
+    {
+        std::lock_guard<std::mutex> lock(mBlocksLock);
+        if (!mBlockRefsDirty)
+            return true;
+
+        for (const auto& it : mBlockRefs)
+        {
+            BlockRefs record;
+            record.block = it.first;
+            record.refs = it.second;
+            records.push_back(record);
+        }
+        mBlockRefsDirty = false;
+    }
+
+    std::sort(records.begin(), records.end(), [](const BlockRefs& a, const BlockRefs& b)
+    {
+        return a.block < b.block;
+    });
+
+    // the records count is stored first (the file is never truncated)
+    std::vector<uint8> data(sizeof(uint32) + records.size() * sizeof(BlockRefs));
+    uint32 recordsNum = static_cast<uint32>(records.size());
+    memcpy(data.data(), &recordsNum, sizeof(recordsNum));
+    if (!records.empty())
+        memcpy(data.data() + sizeof(recordsNum), records.data(), records.size() * sizeof(BlockRefs));
+
+    VfsFile file(this, mSuperblock.blockRefsINode);
+    file.mMetadata = true;
+    VfsFile::ExclusiveLock lock(file.mNode->lock);
+    uint32 bytes = static_cast<uint32>(data.size());
+    if (file.WriteOffset(bytes, 0, data.data()) != bytes)
+    {
+        LOG_ERROR("Failed to write the shared blocks table");
+        return false;
+    }
+
+    return true;
 }
 
-void Vfs::ReleaseBlock(uint32 id)
+uint32 Vfs::ReserveBlockRun(uint32 count, uint32& reserved)
+{
+    std::lock_guard<std::mutex> lock(mBlocksLock);
+    uint32 runLength;
+    uint32 start = mFreeSpace.FindBestFit(count, runLength);
+    if (start == INVALID_INDEX)
+        start = mFreeSpace.FindLongest(runLength);
+
+    reserved = std::min(count, runLength);
+    if (start == INVALID_INDEX || reserved == 0)
+        return INVALID_INDEX;
+
+    mBlockBitmap.ReserveRange(start, reserved);
+    mFreeSpace.Reserve(start, reserved);
+    return start;
+}
+
+uint32 Vfs::GetFreeBlocksNum()
 {
-    ReleaseBitmap(mSuperblock.inodeBitmapBlocks + 1, mSuperblock.dataBlocks, id);
+    std::lock_guard<std::mutex> lock(mBlocksLock);
+    return mFreeSpace.GetFreeBlocksNum();
 }
 
 uint32 Vfs::ReserveINode()
 {
-    return ReserveBitmap(1, VFS_BLOCK_SIZE * mSuperblock.inodeBlocks / sizeof(INode));
+    std::lock_guard<std::mutex> lock(mINodeBitmapLock);
+    return mINodeBitmap.Reserve();
 }
 
 void Vfs::ReleaseINode(uint32 id)
 {
-    ReleaseBitmap(1, VFS_BLOCK_SIZE * mSuperblock.inodeBlocks / sizeof(INode), id);
+    std::lock_guard<std::mutex> lock(mINodeBitmapLock);
+    mINodeBitmap.Release(id);
 }
 
-std::string Vfs::NameFromPath(const std::string& path)
+void Vfs::ReserveINodes(uint32 count, std::vector<uint32>& ids)
 {
-    std::vector<std::string> dirs;
-    std::string dir;
-    std::istringstream pathStream(path);
-    while (std::getline(pathStream, dir, '/'))
+    std::lock_guard<std::mutex> lock(mINodeBitmapLock);
+    ids.clear();
+    for (uint32 i = 0; i < count; ++i)
+    {
+        uint32 id = mINodeBitmap.Reserve();
+        if (id == INVALID_INDEX)
+            break;
+        ids.push_back(id);
+    }
+}
+
+void Vfs::ReleaseINodes(const std::vector<uint32>& ids)
+{
+    std::lock_guard<std::mutex> lock(mINodeBitmapLock);
+    for (uint32 id : ids)
+        mINodeBitmap.Release(id);
+}
+
+VfsINode* Vfs::OpenINode(uint32 id)
+{
+    std::lock_guard<std::mutex> lock(mINodesLock);
+    std::unique_ptr<VfsINode>& node = mINodes[id];
+    if (!node)
+        node.reset(new VfsINode);
+
+    node->refs++;
+    return node.get();
+}
+
+void Vfs::CloseINode(uint32 id)
+{
+    std::lock_guard<std::mutex> lock(mINodesLock);
+    auto it = mINodes.find(id);
+    VFS_ASSERT(it != mINodes.end());
+    if (--it->second->refs == 0)
+        mINodes.erase(it);
+}
+
+bool Vfs::LoadBitmaps()
+{
+    // inodes bitmap can't exceed its blocks, otherwise it would overlap with data blocks bitmap
+    uint64 inodes = std::min<uint64>(static_cast<uint64>(mBlockSize) *
+                                     mSuperblock.inodeBlocks / GetINodeSize(),
+                                     static_cast<uint64>(mBlockSize) * 8 *
+                                     mSuperblock.inodeBitmapBlocks);
+    inodes = std::min<uint64>(inodes, INVALID_INDEX);
+
+    if (!mINodeBitmap.Load(mCache, 1, static_cast<uint32>(inodes)))
+    {
+        LOG_ERROR("Failed to read inodes bitmap");
+        return false;
+    }
+
+    if (!mBlockBitmap.Load(mCache, mSuperblock.inodeBitmapBlocks + 1, mSuperblock.dataBlocks))
+    {
+        LOG_ERROR("Failed to read data blocks bitmap");
+        return false;
+    }
+
+    mFreeSpace.Build(mBlockBitmap);
+    return true;
+}
+
+void Vfs::InitCache(uint32 blockSize)
+{
+    mBlockSize = blockSize;
+    mBlockShift = CountTrailingZeros(blockSize);
+    mBlockMask = blockSize - 1;
+
+    // memory mapped image does not need caching (unless the metadata is journaled)
+    size_t budget = mImage.GetMapping() ? 0 : mCacheSize;
+    if (mJournal.IsEnabled())
+    {
+        // modified metadata blocks stay in the cache until they are committed
+        budget = std::max<size_t>(mCacheSize,
+                                  static_cast<size_t>(VFS_JOURNAL_MIN_CACHE_BLOCKS) << mBlockShift);
+        uint32 cacheBlocks = static_cast<uint32>(std::min<size_t>(budget >> mBlockShift,
+                                                                  INVALID_INDEX));
+        mCommitThreshold = std::min(mJournal.GetCapacity(), cacheBlocks) / 2;
+    }
+
+    mCache.Init(&mImage, budget, blockSize);
+    mCache.SetPinDirty(mJournal.IsEnabled());
+}
+
+void Vfs::InitINode(INode& inode, INodeType type) const
+{
+    inode = INode();
+    inode.type = type;
+
+    if (mSuperblock.version >= VFS_VERSION_EXTENTS)
+        inode.ptrDepth = INODE_EXTENT_MAP;
+
+    // small files start inside the inode (they get data blocks when they grow)
+    if (type == INodeType::File && mSuperblock.version >= VFS_VERSION_INLINE_DATA)
+        inode.ptrDepth = INODE_INLINE_DATA;
+}
+
+uint32 Vfs::GetINodeSize() const
+{
+    if (mSuperblock.version >= VFS_VERSION_INLINE_DATA)
+        return VFS_INODE_SIZE;
+
+    return mSuperblock.version >= VFS_VERSION_DIR_INDEX ? INODE_NO_INLINE_SIZE : INODE_LEGACY_SIZE;
+}
+
+uint64 Vfs::GetMaxFileSize() const
+{
+    // older images don't store the upper half of the file size
+    if (mSuperblock.version < VFS_VERSION_LARGE_FILES)
+        return INVALID_INDEX;
+
+    // file blocks are addressed with 32-bit indices
+    return static_cast<uint64>(INVALID_INDEX) << mBlockShift;
+}
+
+void Vfs::SplitPath(const std::string& path, std::vector<std::string>& dirs)
+{
+    dirs.clear();
+    size_t begin = 0;
+    while (begin < path.length())
     {
-        if (dir.length() > 0)
-            dirs.push_back(dir);
+        size_t end = path.find('/', begin);
+        if (end == std::string::npos)
+            end = path.length();
+
+        if (end > begin)
+            dirs.push_back(path.substr(begin, end - begin));
+        begin = end + 1;
     }
+}
+
+std::string Vfs::NameFromPath(const std::string& path)
+{
+    std::vector<std::string> dirs;
+    SplitPath(path, dirs);
 
     if (dirs.size() == 0)
         return std::string();
@@ -102,15 +414,8 @@ std::string Vfs::NameFromPath(const std::string& path)
 
 void Vfs::GetINodeByPath(const std::string& path, uint32& inodeID, uint32& parentINodeID)
 {
-    /// split path
     std::vector<std::string> dirs;
-    std::string dir;
-    std::istringstream pathStream(path);
-    while (std::getline(pathStream, dir, '/'))
-    {
-        if (dir.length() > 0)
-            dirs.push_back(dir);
-    }
+    SplitPath(path, dirs);
 
     inodeID = INVALID_INDEX;
     parentINodeID = INVALID_INDEX;
@@ -120,277 +425,1208 @@ void Vfs::GetINodeByPath(const std::string& path, uint32& inodeID, uint32& paren
     if (dirs.size() == 0)
         inodeID = ROOT_INODE_INDEX;
 
-    uint32 currINodeID = 0;
-    for (size_t j = 0; j < dirs.size(); ++j)
-    {
-        const auto& dir = dirs[j];
-        bool found = false;
+    uint32 currINodeID = 0;
+    for (size_t j = 0; j < dirs.size(); ++j)
+    {
+        uint32 childINodeID;
+        if (!mDentries.Lookup(currINodeID, dirs[j], childINodeID))
+        {
+            // not cached - search the directory (and remember the result, even if not found)
+            Directory dirEntry;
+            VfsFile dirFile(this, currINodeID, true);
+            childINodeID = INVALID_INDEX;
+            if (dirFile.FindDirectoryEntry(dirs[j].c_str(), dirEntry) != INVALID_INDEX)
+                childINodeID = dirEntry.inodeID;
+
+            mDentries.Insert(currINodeID, dirs[j], childINodeID);
+        }
+
+        if (childINodeID == INVALID_INDEX)
+            return;
+
+        currINodeID = childINodeID;
+
+        if (j == dirs.size() - 1) // target path found
+            inodeID = currINodeID;
+        else if (j == dirs.size() - 2) // parent directory found
+            parentINodeID = currINodeID;
+    }
+}
+
+void Vfs::WriteINode(uint32 id, const INode& inode)
+{
+    // legacy inodes are a prefix of the INode structure
+    uint32 inodeSize = GetINodeSize();
+    uint32 block = 1 + mSuperblock.dataBitmapBlocks + mSuperblock.inodeBitmapBlocks;
+    block += id / (mBlockSize / inodeSize);
+    uint32 offset = (id % (mBlockSize / inodeSize)) * inodeSize;
+    VFS_ASSERT(mCache.Write(block, offset, inodeSize, &inode));
+}
+
+void Vfs::ReadINode(uint32 id, INode& inode)
+{
+    uint32 inodeSize = GetINodeSize();
+    uint32 block = 1 + mSuperblock.dataBitmapBlocks + mSuperblock.inodeBitmapBlocks;
+    block += id / (mBlockSize / inodeSize);
+    uint32 offset = (id % (mBlockSize / inodeSize)) * inodeSize;
+
+    inode = INode();
+    VFS_ASSERT(mCache.Read(block, offset, inodeSize, &inode));
+}
+
+bool Vfs::ReadDataBlock(uint32 blockID, uint32 offset, uint32 bytes, void* data)
+{
+    VFS_ASSERT(blockID < mSuperblock.dataBlocks);
+    return mCache.Read(mSuperblock.firstDataBlock + blockID, offset, bytes, data);
+}
+
+bool Vfs::WriteDataBlock(uint32 blockID, uint32 offset, uint32 bytes, const void* data)
+{
+    VFS_ASSERT(blockID < mSuperblock.dataBlocks);
+    return mCache.Write(mSuperblock.firstDataBlock + blockID, offset, bytes, data);
+}
+
+bool Vfs::ReadDataBlocks(uint32 firstBlockID, uint32 count, void* data)
+{
+    VFS_ASSERT(firstBlockID + count <= mSuperblock.dataBlocks);
+    return mCache.ReadBlocks(mSuperblock.firstDataBlock + firstBlockID, count, data);
+}
+
+bool Vfs::WriteDataBlocks(uint32 firstBlockID, uint32 count, const void* data)
+{
+    VFS_ASSERT(firstBlockID + count <= mSuperblock.dataBlocks);
+
+    // the blocks released since the last commit are not reused before it, so the data can be
+    // written in place
+    return mCache.WriteBlocks(mSuperblock.firstDataBlock + firstBlockID, count, data);
+}
+
+//=================================================================================================
+
+Vfs::Vfs()
+{
+    mCacheSize = VFS_DEFAULT_CACHE_SIZE;
+    mInitBlockSize = VFS_DEFAULT_BLOCK_SIZE;
+    mInitJournalSize = VFS_DEFAULT_JOURNAL_SIZE;
+    mCommitThreshold = 0;
+    mSharedBlocksNum = 0;
+    mBlockRefsDirty = false;
+    mBlockSize = VFS_DEFAULT_BLOCK_SIZE;
+    mBlockShift = CountTrailingZeros(VFS_DEFAULT_BLOCK_SIZE);
+    mBlockMask = VFS_DEFAULT_BLOCK_SIZE - 1;
+    mAsyncMode = VfsAsyncMode::Ring;
+    mIoThreads = VFS_DEFAULT_IO_THREADS;
+    mDefragCursor = 0;
+
+    mImage.SetStats(&mStats);
+    mINodeBitmap.SetStats(&mStats);
+    mBlockBitmap.SetStats(&mStats);
+}
+
+Vfs::~Vfs()
+{
+    Release();
+}
+
+void Vfs::Release()
+{
+    mDentries.Clear();
+
+    if (!mOpenedFiles.empty())
+    {
+        LOG_DEBUG(mOpenedFiles.size() << " files were not closed");
+        for (auto& ptr : mOpenedFiles)
+            delete ptr;
+        mOpenedFiles.clear();
+    }
+    VFS_ASSERT(mINodes.empty());
+
+    // the files wait for their asynchronous reads when closed, so the engine is idle now
+    mIoEngine.Stop();
+
+    if (mImage.IsOpened())
+    {
+        // the blocks of a failed commit were not logged, so they are never written in place
+        if (Flush() || !mJournal.IsEnabled())
+            mCache.Release();
+        else
+        {
+            LOG_ERROR("Failed to commit, the changes since the last commit are lost");
+            mCache.Discard();
+        }
+        mJournal.Release();
+        mImage.Close();
+    }
+    mFreedBlocks.clear();
+    mBlockRefs.clear();
+    mSharedBlocksNum = 0;
+    mBlockRefsDirty = false;
+    mDefragCursor = 0;
+}
+
+bool Vfs::Flush()
+{
+    if (mJournal.IsEnabled())
+        return Commit();
+
+    bool result = SaveBlockRefs();
+    result &= FlushBitmaps();
+    result &= mCache.Flush();
+    return result;
+}
+
+bool Vfs::FlushBitmaps()
+{
+    bool result;
+    {
+        std::lock_guard<std::mutex> lock(mINodeBitmapLock);
+        result = mINodeBitmap.Flush(mCache);
+    }
+    {
+        std::lock_guard<std::mutex> lock(mBlocksLock);
+        result &= mBlockBitmap.Flush(mCache);
+    }
+    return result;
+}
+
+void Vfs::BeginOperation(uint64 bytes)
+{
+    if (!mJournal.IsEnabled())
+        return;
+
+    // the blocks released since the last commit are reusable after the next one, so it's made
+    // first if the operation may need them (the blocks mapping the data are counted too)
+    uint64 blocks = CeilDivide<uint64>(bytes, mBlockSize);
+    blocks += blocks / (mBlockSize / sizeof(uint32)) + 1;
+    bool reclaim;
+    {
+        std::lock_guard<std::mutex> lock(mBlocksLock);
+        reclaim = !mFreedBlocks.empty() && mFreeSpace.GetFreeBlocksNum() < blocks;
+    }
+    if (reclaim)
+        VFS_ASSERT(Commit());
+
+    mJournal.BeginOperation();
+}
+
+void Vfs::EndOperation()
+{
+    if (!mJournal.IsEnabled())
+        return;
+
+    mJournal.EndOperation();
+
+    // commit before the modified blocks outgrow the cache or the journal
+    if (mCache.GetDirtyBlocksNum() >= mCommitThreshold)
+        VFS_ASSERT(Commit());
+}
+
+void Vfs::SplitOperation()
+{
+    if (!mJournal.IsEnabled() || mCache.GetDirtyBlocksNum() < mCommitThreshold)
+        return;
+
+    EndOperation();
+    BeginOperation(0);
+}
+
+size_t Vfs::GetSplitEntries() const
+{
+    if (!mJournal.IsEnabled())
+        return SIZE_MAX;
+
+    // every entry modifies a part of an inode block and of a directory block
+    return static_cast<size_t>(std::max<uint32>(mCommitThreshold / 4, 1)) *
+           (mBlockSize / GetINodeSize());
+}
+
+uint64 Vfs::GetSplitBytes() const
+{
+    if (!mJournal.IsEnabled())
+        return ~0ULL;
+
+    // every data block adds at most an extent (or a block pointer) to the file's map blocks
+    return (static_cast<uint64>(std::max<uint32>(mCommitThreshold / 4, 1)) *
+            (mBlockSize / sizeof(Extent))) << mBlockShift;
+}
+
+bool Vfs::Commit()
+{
+    if (!mJournal.BeginCommit())
+        return mJournal.GetCommitResult();
+
+    bool result = WriteTransaction();
+    mJournal.EndCommit(result);
+    return result;
+}
+
+bool Vfs::WriteTransaction()
+{
+    // in-core inodes are written back when their last user is destroyed - only the opened
+    // files outlive the operations
+    std::vector<uint32> openedINodes;
+    {
+        std::lock_guard<std::mutex> lock(mFilesLock);
+        for (VfsFile* file : mOpenedFiles)
+            openedINodes.push_back(file->mINodeID);
+    }
+
+    for (uint32 inodeID : openedINodes)
+    {
+        // the inode is written back when the temporary file is destroyed
+        VfsFile file(this, inodeID);
+    }
+
+    bool result = SaveBlockRefs();
+
+    // the released blocks are free in the logged bitmap, but they are given out only once the
+    // record is durable (nothing allocates blocks until the commit ends)
+    std::vector<uint32> freedBlocks;
+    {
+        std::lock_guard<std::mutex> lock(mBlocksLock);
+        freedBlocks.swap(mFreedBlocks);
+        std::sort(freedBlocks.begin(), freedBlocks.end());
+        ForEachRun(freedBlocks, [this](uint32 start, uint32 length)
+        {
+            mBlockBitmap.ReleaseRange(start, length);
+        });
+    }
+
+    result &= FlushBitmaps();
+    std::vector<uint32> blocks;
+    std::vector<uint8> data;
+    mCache.GetDirtyBlocks(blocks, data);
+
+    // the blocks are never written in place before they are logged - the operations are split
+    // long before this happens (see SplitOperation)
+    bool logged;
+    if (blocks.size() > mJournal.GetCapacity())
+    {
+        LOG_ERROR("Transaction of " << blocks.size() << " blocks does not fit in the journal");
+        logged = false;
+    }
+    else if (blocks.empty())
+        logged = mImage.Sync(); // the data written in place so far is durable
+    else
+        logged = mJournal.Write(blocks, data);
+
+    // checkpoint - the record is overwritten by the next commit only after this is durable
+    if (logged && mCache.GetDirtyBlocksNum() > 0)
+    {
+        result &= mCache.Flush();
+        result &= mImage.Sync();
+    }
+
+    // the released blocks wait for the next commit if this one failed
+    std::lock_guard<std::mutex> lock(mBlocksLock);
+    ForEachRun(freedBlocks, [this, logged](uint32 start, uint32 length)
+    {
+        if (logged)
+            mFreeSpace.Release(start, length);
+        else
+            mBlockBitmap.ReserveRange(start, length);
+    });
+    if (!logged)
+        mFreedBlocks.insert(mFreedBlocks.end(), freedBlocks.begin(), freedBlocks.end());
+
+    return result && logged;
+}
+
+bool Vfs::Sync()
+{
+    if (!mImage.IsOpened())
+        return false;
+
+    // journal commits are durable already (the opened files write their buffered data when
+    // their inodes are written back by the commit)
+    if (mJournal.IsEnabled())
+        return Commit();
+
+    bool result = true;
+    {
+        std::lock_guard<std::mutex> lock(mFilesLock);
+        for (VfsFile* file : mOpenedFiles)
+            result &= file->FlushWrites();
+    }
+
+    return result && Flush() && mImage.Sync();
+}
+
+VfsStorageMode Vfs::GetStorageMode() const
+{
+    return mImage.GetMode();
+}
+
+void Vfs::SetCacheSize(size_t bytes)
+{
+    mCacheSize = bytes;
+}
+
+bool Vfs::SetBlockSize(uint32 bytes)
+{
+    if (bytes < VFS_MIN_BLOCK_SIZE || bytes > VFS_MAX_BLOCK_SIZE || (bytes & (bytes - 1)) != 0)
+    {
+        LOG_ERROR("Invalid block size: " << bytes);
+        return false;
+    }
+
+    mInitBlockSize = bytes;
+    return true;
+}
+
+void Vfs::SetJournalSize(uint64 bytes)
+{
+    mInitJournalSize = bytes;
+}
+
+uint32 Vfs::GetBlockSize() const
+{
+    return mBlockSize;
+}
+
+void Vfs::SetAsyncMode(VfsAsyncMode mode, uint32 threadsNum)
+{
+    mAsyncMode = mode;
+    mIoThreads = threadsNum;
+}
+
+VfsIoEngine* Vfs::GetIoEngine()
+{
+    std::lock_guard<std::mutex> lock(mIoEngineLock);
+    if (!mIoEngine.IsStarted() && !mIoEngine.Start(&mImage, mAsyncMode, mIoThreads))
+        return nullptr;
+
+    return &mIoEngine;
+}
+
+void Vfs::SetDentryCacheSize(size_t entries)
+{
+    mDentries.SetCapacity(entries);
+}
+
+VfsCacheStats Vfs::GetCacheStats() const
+{
+    return mCache.GetStats();
+}
+
+void Vfs::SetStatsEnabled(bool enabled)
+{
+    mStats.SetEnabled(enabled);
+}
+
+void Vfs::ResetStats()
+{
+    mStats.Reset();
+}
+
+VfsStats Vfs::GetStats() const
+{
+    VfsStats stats;
+    mStats.Get(stats);
+    stats.cache = mCache.GetStats();
+    return stats;
+}
+
+bool Vfs::Open(const std::string& imagePath, VfsStorageMode mode)
+{
+    Release();
+
+    if (!mImage.Open(imagePath, mode))
+    {
+        LOG_ERROR("Failed to open VFS");
+        return false;
+    }
+
+    // the block size is not known yet, so the superblock is read directly
+    if (!mImage.Read(0, sizeof(Superblock), &mSuperblock))
+    {
+        LOG_ERROR("Failed to read superblock");
+        Release();
+        return false;
+    }
+
+    if (mSuperblock.magic != VFS_MAGIC)
+    {
+        LOG_ERROR("Invalid superblock signature");
+        Release();
+        return false;
+    }
+
+    if (mSuperblock.version > VFS_VERSION_CURRENT)
+    {
+        LOG_ERROR("Unsupported VFS version: " << mSuperblock.version);
+        Release();
+        return false;
+    }
+
+    if (mSuperblock.version < VFS_VERSION_JOURNAL)
+    {
+        mSuperblock.journalStart = 0;
+        mSuperblock.journalBlocks = 0;
+    }
+
+    uint32 blockSize = VFS_DEFAULT_BLOCK_SIZE;
+    if (mSuperblock.version >= VFS_VERSION_BLOCK_SIZE)
+    {
+        blockSize = mSuperblock.blockSize;
+        if (blockSize < VFS_MIN_BLOCK_SIZE || blockSize > VFS_MAX_BLOCK_SIZE ||
+            (blockSize & (blockSize - 1)) != 0)
+        {
+            LOG_ERROR("Invalid block size: " << blockSize);
+            Release();
+            return false;
+        }
+    }
+
+    if (mSuperblock.journalBlocks > 0)
+    {
+        if (static_cast<uint64>(mSuperblock.journalStart) + mSuperblock.journalBlocks >
+            mSuperblock.dataBlocks)
+        {
+            LOG_ERROR("Invalid journal location");
+            Release();
+            return false;
+        }
+
+        // the last transaction may not be fully written in place (the superblock may be updated)
+        mJournal.Init(&mImage, blockSize, mSuperblock.firstDataBlock + mSuperblock.journalStart,
+                      mSuperblock.journalBlocks);
+        if (!mJournal.Replay() || !mImage.Read(0, sizeof(Superblock), &mSuperblock))
+        {
+            LOG_ERROR("Failed to replay the journal");
+            mJournal.Release();
+            Release();
+            return false;
+        }
+    }
+
+    if (mSuperblock.version < VFS_VERSION_SHARED_BLOCKS)
+        mSuperblock.blockRefsINode = INVALID_INDEX;
+
+    InitCache(blockSize);
+
+    if (!LoadBitmaps())
+    {
+        Release();
+        return false;
+    }
+
+    if (!LoadBlockRefs())
+    {
+        LOG_ERROR("Failed to read the shared blocks table");
+        Release();
+        return false;
+    }
+
+    return true;
+}
+
+bool Vfs::Init(const std::string& imagePath, uint64 size, VfsStorageMode mode)
+{
+    Release();
+
+    // blocks are addressed with 32-bit indices
+    const uint32 blockSize = mInitBlockSize;
+    uint64 blocks = CeilDivide<uint64>(size, blockSize);
+    if (blocks >= INVALID_INDEX)
+    {
+        LOG_ERROR("VFS size is too big: " << size);
+        return false;
+    }
+
+    // init superblock
+    mSuperblock.magic = VFS_MAGIC;
+    mSuperblock.blocks = static_cast<uint32>(blocks);
+    mSuperblock.SetVfsSize(blocks * blockSize);
+    mSuperblock.inodeBlocks = CeilDivide<uint32>(mSuperblock.blocks,
+                                                 blockSize / VFS_INODE_SIZE);
+    mSuperblock.dataBitmapBlocks = CeilDivide<uint32>(mSuperblock.blocks, blockSize * 8);
+    mSuperblock.inodeBitmapBlocks = mSuperblock.dataBitmapBlocks;
+    mSuperblock.firstDataBlock = 1 +
+                                 mSuperblock.dataBitmapBlocks +
+                                 mSuperblock.inodeBitmapBlocks +
+                                 mSuperblock.inodeBlocks;
+    if (mSuperblock.firstDataBlock >= mSuperblock.blocks)
+    {
+        LOG_ERROR("VFS size is too small: " << size);
+        return false;
+    }
+
+    mSuperblock.dataBlocks = mSuperblock.blocks - mSuperblock.firstDataBlock;
+    mSuperblock.version = VFS_VERSION_CURRENT;
+    mSuperblock.blockSize = blockSize;
+
+    // the journal takes the first data blocks (small images don't get one)
+    uint64 journalBlocks = std::min<uint64>(mInitJournalSize, VFS_MAX_JOURNAL_SIZE) / blockSize;
+    journalBlocks = std::min<uint64>(journalBlocks, mSuperblock.dataBlocks / 8);
+    mSuperblock.journalStart = 0;
+    mSuperblock.journalBlocks = 0;
+    if (journalBlocks >= VFS_JOURNAL_MIN_BLOCKS)
+        mSuperblock.journalBlocks = static_cast<uint32>(journalBlocks);
+
+    // the shared blocks table is stored in the inode following the root directory
+    mSuperblock.blockRefsINode = ROOT_INODE_INDEX + 1;
+
+    if (!mImage.Create(imagePath, mSuperblock.GetVfsSize(), mode))
+    {
+        LOG_ERROR("Failed to create VFS");
+        return false;
+    }
+
+    // write superblock
+    mJournal.Init(&mImage, blockSize, mSuperblock.firstDataBlock, mSuperblock.journalBlocks);
+    InitCache(blockSize);
+    VFS_ASSERT(mCache.Write(0, 0, sizeof(Superblock), &mSuperblock));
+
+    if (!LoadBitmaps())
+    {
+        Release();
+        return false;
+    }
+
+    if (mSuperblock.journalBlocks > 0)
+    {
+        uint32 reserved;
+        VFS_ASSERT(ReserveBlockRun(mSuperblock.journalBlocks, reserved) == 0);
+        VFS_ASSERT(reserved == mSuperblock.journalBlocks);
+    }
+
+    VFS_ASSERT(ReserveINode() == 0);
+    INode rootInode;
+    InitINode(rootInode, INodeType::Directory);
+    WriteINode(ROOT_INODE_INDEX, rootInode);
+
+    VFS_ASSERT(ReserveINode() == mSuperblock.blockRefsINode);
+    INode blockRefsInode;
+    InitINode(blockRefsInode, INodeType::File);
+    WriteINode(mSuperblock.blockRefsINode, blockRefsInode);
+
+    return true;
+}
+
+VfsFile* Vfs::OpenFile(const std::string& path, bool create)
+{
+    VfsStatsCollector::Timer timer(mStats, VfsOperation::OpenFile);
+    Operation operation(this);
+
+    // only creating a file modifies the directory tree
+    std::unique_lock<std::shared_timed_mutex> exclusiveLock(mNamespaceLock, std::defer_lock);
+    std::shared_lock<std::shared_timed_mutex> sharedLock(mNamespaceLock, std::defer_lock);
+    if (create)
+        exclusiveLock.lock();
+    else
+        sharedLock.lock();
+
+    uint32 inodeID, parentInodeID;
+    GetINodeByPath(path, inodeID, parentInodeID);
+
+    if (create)
+    {
+        if (inodeID != INVALID_INDEX)
+        {
+            LOG_ERROR("Path '" << path << "' already exists");
+            return nullptr;
+        }
+
+        // NOTE: name was extracted in GetINodeByPath()
+        std::string fileName = NameFromPath(path);
+        if (fileName.length() > VFS_MAX_NAME_LENGTH)
+        {
+            LOG_ERROR("File name '" << fileName << "' is too long");
+            return nullptr;
+        }
+
+        // create an inode for the new file
+        inodeID = ReserveINode();
+        if (inodeID == INVALID_INDEX)
+        {
+            LOG_ERROR("Failed to reserve inode for a file");
+            return nullptr;
+        }
+
+        INode inode;
+        InitINode(inode, INodeType::File);
+        WriteINode(inodeID, inode);
+
+        Directory dirEntry;
+        dirEntry.inodeID = inodeID;
+        strcpy(dirEntry.name, fileName.c_str());
+
+        // update parent directory table
+        VfsFile parentDirFile(this, parentInodeID);
+        if (!parentDirFile.AddDirectoryEntry(dirEntry, INodeType::File))
+        {
+            LOG_ERROR("Failed create file");
+            ReleaseINode(inodeID);
+            return nullptr;
+        }
+
+        mDentries.Insert(parentInodeID, fileName, inodeID);
+    }
+    else
+    {
+        if (inodeID == INVALID_INDEX)
+        {
+            LOG_ERROR("Invalid path: " << path);
+            return nullptr;
+        }
+    }
+    
+    VfsFile* fileHandle = new VfsFile(this, inodeID, false);
+    if (fileHandle->mINode.type != INodeType::File)
+    {
+        delete fileHandle;
+        LOG_ERROR("Path '" << path << "' is not a file");
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(mFilesLock);
+    mOpenedFiles.insert(fileHandle);
+    return fileHandle;
+}
+
+bool Vfs::Close(VfsFile* file)
+{
+    {
+        std::lock_guard<std::mutex> lock(mFilesLock);
+        auto it = mOpenedFiles.find(file);
+        if (it == mOpenedFiles.end())
+        {
+            LOG_ERROR("This file is not opended");
+            return false;
+        }
+
+        mOpenedFiles.erase(it);
+    }
+
+    {
+        Operation operation(this);
+        delete file;
+    }
+
+    // journaled changes are written in place by commits
+    if (mJournal.IsEnabled())
+        return true;
+
+    return mCache.Flush();
+}
+
+bool Vfs::CreateDir(const std::string& path)
+{
+    Operation operation(this);
+    std::lock_guard<std::shared_timed_mutex> lock(mNamespaceLock);
+    uint32 inodeID, parentInodeID;
+    GetINodeByPath(path, inodeID, parentInodeID);
+
+    if (parentInodeID == INVALID_INDEX)
+    {
+        LOG_ERROR("Invalid path: " << path);
+        return false;
+    }
+
+    if (inodeID != INVALID_INDEX)
+    {
+        LOG_ERROR("Directory '" << path << "' already exists");
+        return false;
+    }
+
+    // NOTE: name was extracted in GetINodeByPath()
+    std::string dirName = NameFromPath(path);
+    if (dirName.length() > VFS_MAX_NAME_LENGTH)
+    {
+        LOG_ERROR("Directory name '" << dirName << "' is too long");
+        return false;
+    }
+
+    inodeID = ReserveINode();
+    if (inodeID == INVALID_INDEX)
+    {
+        LOG_ERROR("Failed to reserve inode for directory");
+        return false;
+    }
+
+    Directory dirEntry;
+    dirEntry.inodeID = inodeID;
+    strcpy(dirEntry.name, dirName.c_str());
+
+    INode inode;
+    InitINode(inode, INodeType::Directory);
+    WriteINode(inodeID, inode);
+
+    // update parent directory table
+    VfsFile parentDirFile(this, parentInodeID);
+    if (!parentDirFile.AddDirectoryEntry(dirEntry, INodeType::Directory))
+    {
+        LOG_ERROR("Failed create directory");
+        ReleaseINode(inodeID);
+        return false;
+    }
+
+    mDentries.Insert(parentInodeID, dirName, inodeID);
+    return true;
+}
+
+uint32 Vfs::CreateFiles(const std::vector<std::string>& paths, std::vector<bool>* results)
+{
+    return CreateMany(paths, INodeType::File, results);
+}
+
+uint32 Vfs::CreateDirs(const std::vector<std::string>& paths, std::vector<bool>* results)
+{
+    return CreateMany(paths, INodeType::Directory, results);
+}
+
+uint32 Vfs::CreateMany(const std::vector<std::string>& paths, INodeType type,
+                       std::vector<bool>* results)
+{
+    Operation operation(this);
+    std::unique_lock<std::shared_timed_mutex> lock(mNamespaceLock);
+    if (results)
+        results->assign(paths.size(), false);
+
+    // parents must be created before their children, so the paths are processed by depth
+    std::vector<std::vector<std::string>> components(paths.size());
+    std::vector<size_t> order(paths.size());
+    for (size_t i = 0; i < paths.size(); ++i)
+    {
+        SplitPath(paths[i], components[i]);
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&components](size_t a, size_t b)
+    {
+        return components[a].size() < components[b].size();
+    });
+
+    // large batches are committed in parts (the parents are resolved again after each one)
+    const size_t splitEntries = GetSplitEntries();
+    uint32 created = 0;
+    for (size_t first = 0, last; first < order.size(); first = last)
+    {
+        if (first > 0)
+        {
+            lock.unlock();
+            operation.Split();
+            lock.lock();
+        }
+
+        const size_t depth = components[order[first]].size();
+        for (last = first; last < order.size() && last - first < splitEntries &&
+                           components[order[last]].size() == depth; )
+            ++last;
+
+        // group the new entries by parent directory (each parent path is resolved once)
+        std::map<uint32, std::vector<size_t>> groups;
+        std::unordered_map<std::string, uint32> parents;
+        for (size_t i = first; i < last; ++i)
+        {
+            const size_t index = order[i];
+            const std::vector<std::string>& dirs = components[index];
+            if (dirs.empty())
+            {
+                LOG_ERROR("Invalid path: " << paths[index]);
+                continue;
+            }
+
+            if (dirs.back().length() > VFS_MAX_NAME_LENGTH)
+            {
+                LOG_ERROR("Name '" << dirs.back() << "' is too long");
+                continue;
+            }
+
+            std::string parentPath;
+            for (size_t j = 0; j + 1 < dirs.size(); ++j)
+                parentPath += dirs[j] + '/';
+
+            auto it = parents.find(parentPath);
+            if (it == parents.end())
+            {
+                uint32 inodeID, parentInodeID;
+                GetINodeByPath(parentPath, inodeID, parentInodeID);
+                it = parents.insert(std::make_pair(parentPath, inodeID)).first;
+            }
+
+            if (it->second == INVALID_INDEX)
+            {
+                LOG_ERROR("Invalid path: " << paths[index]);
+                continue;
+            }
+
+            groups[it->second].push_back(index);
+        }
+
+        for (const auto& group : groups)
+        {
+            const uint32 parentInodeID = group.first;
+            const std::vector<size_t>& indices = group.second;
+
+            VfsFile parentDirFile(this, parentInodeID);
+            if (parentDirFile.mINode.type != INodeType::Directory)
+            {
+                LOG_ERROR("Path '" << paths[indices.front()] << "' is not inside a directory");
+                continue;
+            }
+
+            std::vector<uint32> ids;
+            ReserveINodes(static_cast<uint32>(indices.size()), ids);
+            if (ids.size() < indices.size())
+                LOG_ERROR("Failed to reserve " << indices.size() - ids.size() << " inodes");
+
+            INode inode;
+            InitINode(inode, type);
+            std::vector<Directory> entries(ids.size());
+            for (size_t j = 0; j < ids.size(); ++j)
+            {
+                entries[j].inodeID = ids[j];
+                strcpy(entries[j].name, components[indices[j]].back().c_str());
+                WriteINode(ids[j], inode);
+            }
+
+            // update parent directory table
+            std::vector<bool> added;
+            parentDirFile.AddDirectoryEntries(entries, type, added);
+
+            std::vector<uint32> unused;
+            for (size_t j = 0; j < ids.size(); ++j)
+            {
+                if (!added[j])
+                {
+                    LOG_ERROR("Failed to create '" << paths[indices[j]] << "'");
+                    unused.push_back(ids[j]);
+                    continue;
+                }
+
+                mDentries.Insert(parentInodeID, entries[j].name, ids[j]);
+                if (results)
+                    (*results)[indices[j]] = true;
+                created++;
+            }
+            ReleaseINodes(unused);
+        }
+    }
+
+    return created;
+}
+
+uint32 Vfs::RemoveMany(const std::vector<std::string>& paths, std::vector<bool>* results)
+{
+    Operation operation(this);
+    std::unique_lock<std::shared_timed_mutex> lock(mNamespaceLock);
+    if (results)
+        results->assign(paths.size(), false);
+
+    // children must be removed before their parents, so the deepest paths go first
+    std::vector<std::vector<std::string>> components(paths.size());
+    std::vector<size_t> order(paths.size());
+    for (size_t i = 0; i < paths.size(); ++i)
+    {
+        SplitPath(paths[i], components[i]);
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&components](size_t a, size_t b)
+    {
+        return components[a].size() > components[b].size();
+    });
+
+    // large batches are committed in parts
+    const size_t splitEntries = GetSplitEntries();
+    uint32 removed = 0;
+    std::vector<uint32> inodes(paths.size(), INVALID_INDEX);
+    std::unordered_set<uint32> listed;
+    for (size_t first = 0, last; first < order.size(); first = last)
+    {
+        if (first > 0)
+        {
+            lock.unlock();
+            operation.Split();
+            lock.lock();
+
+            // the removed inodes may be reused by other operations meanwhile
+            listed.clear();
+        }
+
+        const size_t depth = components[order[first]].size();
+        for (last = first; last < order.size() && last - first < splitEntries &&
+                           components[order[last]].size() == depth; )
+            ++last;
+
+        // release the contents first and group the entries by parent directory
+        std::map<uint32, std::vector<size_t>> groups;
+        for (size_t i = first; i < last; ++i)
+        {
+            const size_t index = order[i];
+            uint32 inodeID, parentInodeID;
+            GetINodeByPath(paths[index], inodeID, parentInodeID);
+            if (inodeID == INVALID_INDEX || parentInodeID == INVALID_INDEX)
+            {
+                LOG_ERROR("Invalid path: " << paths[index]);
+                continue;
+            }
+
+            if (!listed.insert(inodeID).second)
+            {
+                LOG_ERROR("Path '" << paths[index] << "' is listed more than once");
+                continue;
+            }
+
+            {
+                std::lock_guard<std::mutex> inodesLock(mINodesLock);
+                if (mINodes.count(inodeID) > 0)
+                {
+                    LOG_ERROR("Path '" << paths[index] << "' is opened");
+                    continue;
+                }
+            }
 
-        Directory dirEntry;
-        VfsFile dirFile(this, currINodeID, true);
-        // NOTE: this is slow - O(n) worst case time complexity
-        for (uint32 i = 0; i < dirFile.mINode.usage; ++i)
-        {
-            dirFile.Read(sizeof(Directory), &dirEntry);
-            if (dir == dirEntry.name)
             {
-                currINodeID = dirEntry.inodeID;
-                found = true;
-                break;
+                VfsFile file(this, inodeID);
+                if (!file.Remove())
+                    continue;
             }
+
+            inodes[index] = inodeID;
+            groups[parentInodeID].push_back(index);
         }
 
-        if (!found)
-            return;
+        for (const auto& group : groups)
+        {
+            const uint32 parentInodeID = group.first;
+            const std::vector<size_t>& indices = group.second;
 
-        if (j == dirs.size() - 1) // target path found
-            inodeID = currINodeID;
-        else if (j == dirs.size() - 2) // parent directory found
-            parentINodeID = currINodeID;
-    }
-}
+            std::vector<const char*> names;
+            for (size_t index : indices)
+                names.push_back(components[index].back().c_str());
 
-void Vfs::WriteINode(uint32 id, const INode& inode)
-{
-    uint32 offset = 1 + mSuperblock.dataBitmapBlocks + mSuperblock.inodeBitmapBlocks;
-    VFS_ASSERT(fseek(mImage, VFS_BLOCK_SIZE * offset + id * sizeof(INode), SEEK_SET) == 0);
-    VFS_ASSERT(fwrite(&inode, sizeof(INode), 1, mImage) == 1);
-}
+            std::vector<bool> entriesRemoved;
+            {
+                VfsFile parentDirFile(this, parentInodeID);
+                parentDirFile.RemoveDirectoryEntries(names, entriesRemoved);
+            }
 
-void Vfs::ReadINode(uint32 id, INode& inode)
-{
-    uint32 offset = 1 + mSuperblock.dataBitmapBlocks + mSuperblock.inodeBitmapBlocks;
-    VFS_ASSERT(fseek(mImage, VFS_BLOCK_SIZE * offset + id * sizeof(INode), SEEK_SET) == 0);
-    VFS_ASSERT(fread(&inode, sizeof(INode), 1, mImage) == 1);
-}
+            std::vector<uint32> released;
+            for (size_t j = 0; j < indices.size(); ++j)
+            {
+                VFS_ASSERT(entriesRemoved[j]);
+                const uint32 inodeID = inodes[indices[j]];
 
-//=================================================================================================
+                // the inode may be reused, so drop (negative) entries of the removed directory
+                mDentries.Insert(parentInodeID, names[j], INVALID_INDEX);
+                mDentries.InvalidateDirectory(inodeID);
+                released.push_back(inodeID);
 
-Vfs::Vfs()
-{
-    mImage = nullptr;
-}
+                if (results)
+                    (*results)[indices[j]] = true;
+                removed++;
+            }
+            ReleaseINodes(released);
+        }
+    }
 
-Vfs::~Vfs()
-{
-    Release();
+    return removed;
 }
 
-void Vfs::Release()
+bool Vfs::Clone(const std::string& src, const std::string& dest)
 {
-    if (!mOpenedFiles.empty())
+    Operation operation(this);
+    std::lock_guard<std::shared_timed_mutex> lock(mNamespaceLock);
+
+    if (mSuperblock.version < VFS_VERSION_SHARED_BLOCKS)
     {
-        LOG_DEBUG(mOpenedFiles.size() << " files were not closed");
-        for (auto& ptr : mOpenedFiles)
-            delete ptr;
-        mOpenedFiles.clear();
+        LOG_ERROR("Cloning files is not supported by the image version " << mSuperblock.version);
+        return false;
     }
 
-    if (mImage)
+    uint32 srcINodeID, srcParentINodeID;
+    GetINodeByPath(src, srcINodeID, srcParentINodeID);
+    if (srcINodeID == INVALID_INDEX)
     {
-        fclose(mImage);
-        mImage = nullptr;
+        LOG_ERROR("Invalid path: " << src);
+        return false;
     }
-}
-
 
-bool Vfs::Open(const std::string& imagePath)
-{
-    Release();
-
-    mImage = fopen(imagePath.c_str(), "r+b");
-    if (mImage == 0)
+    uint32 inodeID, parentInodeID;
+    GetINodeByPath(dest, inodeID, parentInodeID);
+    if (parentInodeID == INVALID_INDEX)
     {
-        LOG_ERROR("Failed to open VFS");
+        LOG_ERROR("Invalid path: " << dest);
         return false;
     }
 
-    fseek(mImage, 0, SEEK_SET);
-    if (fread(&mSuperblock, sizeof(Superblock), 1, mImage) != 1)
+    if (inodeID != INVALID_INDEX)
     {
-        LOG_ERROR("Failed to read superblock");
-        Release();
+        LOG_ERROR("Path '" << dest << "' already exists");
         return false;
     }
 
-    if (mSuperblock.magic != VFS_MAGIC)
+    // NOTE: name was extracted in GetINodeByPath()
+    std::string fileName = NameFromPath(dest);
+    if (fileName.length() > VFS_MAX_NAME_LENGTH)
     {
-        LOG_ERROR("Invalid superblock signature");
-        Release();
+        LOG_ERROR("File name '" << fileName << "' is too long");
         return false;
     }
 
-    return true;
-}
-
-bool Vfs::Init(const std::string& imagePath, uint32 size)
-{
-    Release();
-
-    mImage = fopen(imagePath.c_str(), "w+b");
-    if (mImage == 0)
+    VfsFile srcFile(this, srcINodeID, true);
+    if (srcFile.mINode.type != INodeType::File)
     {
-        LOG_ERROR("Failed to open VFS");
+        LOG_ERROR("Path '" << src << "' is not a file");
         return false;
     }
 
-    // init superblock
-    mSuperblock.magic = VFS_MAGIC;
-    mSuperblock.blocks = CeilDivide<uint32>(size, VFS_BLOCK_SIZE);
-    mSuperblock.vfsSize = mSuperblock.blocks * VFS_BLOCK_SIZE;
-    mSuperblock.inodeBlocks = CeilDivide<uint32>(mSuperblock.blocks,
-                                                 VFS_BLOCK_SIZE / VFS_INODE_SIZE);
-    mSuperblock.dataBitmapBlocks = CeilDivide<uint32>(mSuperblock.blocks, VFS_BLOCK_SIZE * 8);
-    mSuperblock.inodeBitmapBlocks = mSuperblock.dataBitmapBlocks;
-    mSuperblock.firstDataBlock = 1 +
-                                 mSuperblock.dataBitmapBlocks +
-                                 mSuperblock.inodeBitmapBlocks +
-                                 mSuperblock.inodeBlocks;
-    mSuperblock.dataBlocks = mSuperblock.blocks - mSuperblock.firstDataBlock;
-
-    // clear VFS file
-    static uint8 clearBlock[VFS_BLOCK_SIZE] = { 0x0 };
-    fseek(mImage, 0, SEEK_SET);
-    for (uint32 i = 0; i < mSuperblock.blocks; ++i)
+    // the clone gets also the data gathered by the writers of the source file
     {
-        VFS_ASSERT(1 == fwrite(clearBlock, VFS_BLOCK_SIZE, 1, mImage));
+        VfsFile::ExclusiveLock lock(srcFile.mNode->lock);
+        srcFile.WaitForAsyncReads();
+        if (!srcFile.FlushWriteBuffer())
+            return false;
     }
 
-    // write superblock
-    fseek(mImage, 0, SEEK_SET);
-    fwrite(&mSuperblock, sizeof(Superblock), 1, mImage);
-
-    VFS_ASSERT(ReserveINode() == 0);
-    INode rootInode;
-    rootInode.type = INodeType::Directory;
-    WriteINode(ROOT_INODE_INDEX, rootInode);
+    inodeID = ReserveINode();
+    if (inodeID == INVALID_INDEX)
+    {
+        LOG_ERROR("Failed to reserve inode for a file");
+        return false;
+    }
 
-    return true;
-}
+    INode inode;
+    InitINode(inode, INodeType::File);
+    WriteINode(inodeID, inode);
 
-VfsFile* Vfs::OpenFile(const std::string& path, bool create)
-{
-    uint32 inodeID, parentInodeID;
-    GetINodeByPath(path, inodeID, parentInodeID);
+    Directory dirEntry;
+    dirEntry.inodeID = inodeID;
+    strcpy(dirEntry.name, fileName.c_str());
 
-    if (create)
     {
-        if (inodeID != INVALID_INDEX)
-        {
-            LOG_ERROR("Path '" << path << "' already exists");
-            return nullptr;
-        }
+        VfsFile file(this, inodeID);
+        bool cloned = file.CloneFrom(srcFile);
 
-        // create an inode for the new file
-        inodeID = ReserveINode();
-        if (inodeID == INVALID_INDEX)
+        // update parent directory table
+        if (cloned)
         {
-            LOG_ERROR("Failed to reserve inode for a file");
-            return nullptr;
+            VfsFile parentDirFile(this, parentInodeID);
+            cloned = parentDirFile.AddDirectoryEntry(dirEntry, INodeType::File);
         }
 
-        INode inode;
-        inode.type = INodeType::File;
-        WriteINode(inodeID, inode);
-
-        // NOTE: name was extracted in GetINodeByPath()
-        std::string fileName = NameFromPath(path);
-        Directory dirEntry;
-        dirEntry.inodeID = inodeID;
-        strcpy(dirEntry.name, fileName.c_str());
-
-        // update parent directory table
-        VfsFile parentDirFile(this, parentInodeID);
-        if (!parentDirFile.AddDirectoryEntry(dirEntry))
+        if (!cloned)
         {
-            LOG_ERROR("Failed create file");
+            LOG_ERROR("Failed to clone file");
+            VFS_ASSERT(file.Remove());
             ReleaseINode(inodeID);
-            return nullptr;
-        }
-    }
-    else
-    {
-        if (inodeID == INVALID_INDEX)
-        {
-            LOG_ERROR("Invalid path: " << path);
-            return nullptr;
+            return false;
         }
     }
-    
-    VfsFile* fileHandle = new VfsFile(this, inodeID, false);
-    if (fileHandle->mINode.type != INodeType::File)
-    {
-        delete fileHandle;
-        LOG_ERROR("Path '" << path << "' is not a file");
-        return nullptr;
-    }
 
-    mOpenedFiles.insert(fileHandle);
-    return fileHandle;
+    mDentries.Insert(parentInodeID, fileName, inodeID);
+    return true;
 }
 
-bool Vfs::Close(VfsFile* file)
+VfsDefragStats::VfsDefragStats()
 {
-    auto it = mOpenedFiles.find(file);
-    if (it == mOpenedFiles.end())
-    {
-        LOG_ERROR("This file is not opended");
-        return false;
-    }
+    filesMoved = 0;
+    dirsCompacted = 0;
+    bytesMoved = 0;
+    finished = false;
+}
 
-    mOpenedFiles.erase(it);
-    delete file;
-    return true;
+bool Vfs::IsINodeReserved(uint32 inodeID)
+{
+    std::lock_guard<std::mutex> lock(mINodeBitmapLock);
+    return mINodeBitmap.IsSet(inodeID);
 }
 
-bool Vfs::CreateDir(const std::string& path)
+VfsDefragStats Vfs::Defragment(uint64 budget)
 {
-    uint32 inodeID, parentInodeID;
-    GetINodeByPath(path, inodeID, parentInodeID);
+    std::lock_guard<std::mutex> lock(mDefragLock);
+    VfsDefragStats stats;
 
-    if (parentInodeID == INVALID_INDEX)
+    const uint32 inodesNum = mINodeBitmap.GetSize();
+    while (mDefragCursor < inodesNum)
     {
-        LOG_ERROR("Invalid path: " << path);
-        return false;
-    }
+        uint32 inodeID;
+        {
+            std::lock_guard<std::mutex> bitmapLock(mINodeBitmapLock);
+            inodeID = mINodeBitmap.FindNext(mDefragCursor, true);
+        }
+        if (inodeID >= inodesNum)
+            break;
 
-    if (inodeID != INVALID_INDEX)
-    {
-        LOG_ERROR("Directory '" << path << "' already exists");
-        return false;
+        // the first inode is processed even if it exceeds the budget, so every call progresses
+        uint64 left = budget > stats.bytesMoved ? budget - stats.bytesMoved : 0;
+        if (!DefragmentINode(inodeID, stats.bytesMoved == 0 ? ~0ULL : left, stats))
+            return stats;
+
+        mDefragCursor = inodeID + 1;
     }
 
-    inodeID = ReserveINode();
-    if (inodeID == INVALID_INDEX)
+    mDefragCursor = 0;
+    stats.finished = true;
+    return stats;
+}
+
+bool Vfs::DefragmentINode(uint32 inodeID, uint64 budget, VfsDefragStats& stats)
+{
+    // the table is rewritten as a whole when it changes
+    if (inodeID == mSuperblock.blockRefsINode)
+        return true;
+
+    Operation operation(this);
+
+    // removing an inode requires the exclusive namespace lock, moving directory entries too
+    bool directory;
     {
-        LOG_ERROR("Failed to reserve inode for directory");
-        return false;
+        std::shared_lock<std::shared_timed_mutex> lock(mNamespaceLock);
+        if (!IsINodeReserved(inodeID))
+            return true;
+
+        VfsFile file(this, inodeID, true);
+        directory = file.mINode.type == INodeType::Directory;
     }
 
-    // NOTE: name was extracted in GetINodeByPath()
-    std::string dirName = NameFromPath(path);
-    Directory dirEntry;
-    dirEntry.inodeID = inodeID;
-    strcpy(dirEntry.name, dirName.c_str());
+    std::unique_lock<std::shared_timed_mutex> exclusiveLock(mNamespaceLock, std::defer_lock);
+    std::shared_lock<std::shared_timed_mutex> sharedLock(mNamespaceLock, std::defer_lock);
+    if (directory)
+        exclusiveLock.lock();
+    else
+        sharedLock.lock();
 
-    INode inode;
-    inode.type = INodeType::Directory;
-    WriteINode(inodeID, inode);
+    if (!IsINodeReserved(inodeID))
+        return true;
 
-    // update parent directory table
-    VfsFile parentDirFile(this, parentInodeID);
-    if (!parentDirFile.AddDirectoryEntry(dirEntry))
+    VfsFile file(this, inodeID);
+    VfsFile::ExclusiveLock lock(file.mNode->lock);
+    file.WaitForAsyncReads();
+
+    if (directory && file.UsesCompactEntries() && file.mINode.dirFreeBytes > 0)
     {
-        LOG_ERROR("Failed create directory");
-        ReleaseINode(inodeID);
-        return false;
+        if (!file.CompactEntries())
+        {
+            LOG_ERROR("Failed to compact directory " << inodeID);
+            return true;
+        }
+
+        // the blocks past the end of the packed entries are not needed anymore
+        uint32 keepBlocks = CeilDivide<uint32>(file.mINode.size, mBlockSize);
+        VFS_ASSERT(file.UsesExtents() ? file.TruncateExtents(keepBlocks) :
+                                        file.TruncatePointers(keepBlocks));
+        stats.dirsCompacted++;
     }
 
+    uint64 moved;
+    if (!file.Relocate(budget, moved))
+        return false;
+
+    if (moved > 0)
+    {
+        stats.filesMoved++;
+        stats.bytesMoved += moved;
+    }
     return true;
 }
 
 bool Vfs::Rename(const std::string& src, const std::string& dest)
 {
+    VfsStatsCollector::Timer timer(mStats, VfsOperation::Rename);
+    Operation operation(this);
+    std::lock_guard<std::shared_timed_mutex> lock(mNamespaceLock);
     /// get old path info
     uint32 oldParentInodeID, oldInodeID;
     GetINodeByPath(src, oldInodeID, oldParentInodeID);
@@ -418,14 +1654,23 @@ bool Vfs::Rename(const std::string& src, const std::string& dest)
     // create new directory table entry
     // NOTE: name was extracted in GetINodeByPath()
     std::string dirName = NameFromPath(dest);
+    if (dirName.length() > VFS_MAX_NAME_LENGTH)
+    {
+        LOG_ERROR("Name '" << dirName << "' is too long");
+        return false;
+    }
+
     Directory dirEntry;
     dirEntry.inodeID = oldInodeID;
     strcpy(dirEntry.name, dirName.c_str());
 
+    INode inode;
+    ReadINode(oldInodeID, inode);
+
     // update new parent directory table
     {
         VfsFile newParentDirFile(this, newParentInodeID);
-        if (!newParentDirFile.AddDirectoryEntry(dirEntry))
+        if (!newParentDirFile.AddDirectoryEntry(dirEntry, inode.type))
         {
             LOG_ERROR("Failed move object");
             return false;
@@ -435,14 +1680,20 @@ bool Vfs::Rename(const std::string& src, const std::string& dest)
     // update old parent directory table
     {
         VfsFile oldParentDirFile(this, oldParentInodeID);
-        VFS_ASSERT(oldParentDirFile.RemoveDirectoryEntry(oldInodeID));
+        VFS_ASSERT(oldParentDirFile.RemoveDirectoryEntry(NameFromPath(src).c_str()));
     }
 
+    // children entries are keyed by the inode, so they remain valid
+    mDentries.Insert(oldParentInodeID, NameFromPath(src), INVALID_INDEX);
+    mDentries.Insert(newParentInodeID, dirName, oldInodeID);
     return true;
 }
 
 bool Vfs::Remove(const std::string& path)
 {
+    VfsStatsCollector::Timer timer(mStats, VfsOperation::Remove);
+    Operation operation(this);
+    std::lock_guard<std::shared_timed_mutex> lock(mNamespaceLock);
     uint32 inodeID, parentInodeID;
     GetINodeByPath(path, inodeID, parentInodeID);
     if (inodeID == INVALID_INDEX)
@@ -451,12 +1702,25 @@ bool Vfs::Remove(const std::string& path)
         return false;
     }
 
+    {
+        std::lock_guard<std::mutex> inodesLock(mINodesLock);
+        if (mINodes.count(inodeID) > 0)
+        {
+            LOG_ERROR("Path '" << path << "' is opened");
+            return false;
+        }
+    }
+
     VfsFile dirFile(this, inodeID);
     if (!dirFile.Remove())
         return false;
 
     VfsFile parentDirFile(this, parentInodeID);
-    VFS_ASSERT(parentDirFile.RemoveDirectoryEntry(inodeID));
+    VFS_ASSERT(parentDirFile.RemoveDirectoryEntry(NameFromPath(path).c_str()));
+
+    // the inode may be reused, so drop (negative) entries of the removed directory
+    mDentries.Insert(parentInodeID, NameFromPath(path), INVALID_INDEX);
+    mDentries.InvalidateDirectory(inodeID);
 
     ReleaseINode(inodeID);
     return true;
@@ -464,6 +1728,8 @@ bool Vfs::Remove(const std::string& path)
 
 bool Vfs::List(const std::string& path, std::vector<std::string>& nodes)
 {
+    VfsStatsCollector::Timer timer(mStats, VfsOperation::List);
+    std::shared_lock<std::shared_timed_mutex> lock(mNamespaceLock);
     uint32 inodeID, parentInodeID;
     GetINodeByPath(path, inodeID, parentInodeID);
     if (inodeID == INVALID_INDEX)
@@ -480,18 +1746,16 @@ bool Vfs::List(const std::string& path, std::vector<std::string>& nodes)
     }
 
     nodes.clear();
-    for (uint32 i = 0; i < dirFile.mINode.usage; ++i)
+    return dirFile.ForEachDirectoryEntry([&nodes](uint32, const Directory& dirEntry, uint32)
     {
-        Directory dirEntry;
-        dirFile.Read(sizeof(Directory), &dirEntry);
         nodes.push_back(dirEntry.name);
-    }
-
-    return true;
+        return true;
+    });
 }
 
 bool Vfs::GetInfo(const std::string& path, PathInfo& info)
 {
+    std::shared_lock<std::shared_timed_mutex> lock(mNamespaceLock);
     uint32 inodeID, parentInodeID;
     GetINodeByPath(path, inodeID, parentInodeID);
 
@@ -501,14 +1765,130 @@ bool Vfs::GetInfo(const std::string& path, PathInfo& info)
         return false;
     }
 
-    VfsFile file (this, inodeID, false);
+    VfsFile file(this, inodeID, true);
+    VfsFile::SharedLock fileLock(file.mNode->lock);
     info.directory = file.mINode.type == INodeType::Directory;
-    info.size = info.directory ? file.mINode.usage : file.mINode.size;
+    info.size = info.directory ? file.mINode.usage : file.GetBufferedSize();
+    return true;
+}
+
+VfsUsageReport::VfsUsageReport()
+{
+    blockSize = 0;
+    totalBlocks = 0;
+    freeBlocks = 0;
+    journalBlocks = 0;
+    sharedBlocks = 0;
+    metadataBlocks = 0;
+    mapBlocks = 0;
+    refsTableBlocks = 0;
+    dirIndexBlocks = 0;
+    totalINodes = 0;
+    freeINodes = 0;
+    files = 0;
+    directories = 0;
+    inlineFiles = 0;
+    fragmentedFiles = 0;
+    memset(freeRuns, 0, sizeof(freeRuns));
+    largestFreeRun = 0;
+}
+
+bool Vfs::GetUsageReport(VfsUsageReport& report)
+{
+    report = VfsUsageReport();
+    report.blockSize = mBlockSize;
+    report.totalBlocks = mSuperblock.dataBlocks;
+    report.journalBlocks = mSuperblock.journalBlocks;
+    report.metadataBlocks = mSuperblock.firstDataBlock;
+
+    // free runs of the data blocks bitmap
+    {
+        std::lock_guard<std::mutex> lock(mBlocksLock);
+        report.sharedBlocks = static_cast<uint32>(mBlockRefs.size());
+
+        const uint32 blocksNum = mBlockBitmap.GetSize();
+        for (uint32 start = mBlockBitmap.FindNext(0, false); start < blocksNum; )
+        {
+            uint32 end = mBlockBitmap.FindNext(start, true);
+            uint32 length = end - start;
+            report.freeBlocks += length;
+            report.largestFreeRun = std::max(report.largestFreeRun, length);
+
+            uint32 bucket = 0;
+            while (bucket < VFS_FREE_RUN_BUCKETS - 1 && (length >> (bucket + 1)) > 0)
+                bucket++;
+            report.freeRuns[bucket]++;
+
+            start = end < blocksNum ? mBlockBitmap.FindNext(end, false) : blocksNum;
+        }
+    }
+
+    // inodes are visited in the table order, not by the directory tree
+    std::shared_lock<std::shared_timed_mutex> lock(mNamespaceLock);
+    report.totalINodes = mINodeBitmap.GetSize();
+    report.freeINodes = report.totalINodes;
+
+    // directory indexes are told apart once all the directories are visited (an index inode
+    // may precede its directory in the table)
+    std::vector<bool> indexINodes(report.totalINodes, false);
+    std::vector<bool> inlineINodes(report.totalINodes, false);
+    std::vector<VfsFileUsage> usages;
+    for (uint32 inodeID = 0; ; ++inodeID)
+    {
+        {
+            std::lock_guard<std::mutex> bitmapLock(mINodeBitmapLock);
+            inodeID = mINodeBitmap.FindNext(inodeID, true);
+        }
+        if (inodeID >= report.totalINodes)
+            break;
+
+        report.freeINodes--;
+        VfsFile file(this, inodeID, true);
+        VfsFileUsage usage;
+        if (!file.GetUsage(usage))
+        {
+            LOG_ERROR("Failed to read block map of inode " << inodeID);
+            return false;
+        }
+
+        if (inodeID == mSuperblock.blockRefsINode)
+        {
+            report.refsTableBlocks = usage.blocks + usage.mapBlocks;
+            continue;
+        }
+
+        if (usage.directory && file.mINode.dirIndex < report.totalINodes)
+            indexINodes[file.mINode.dirIndex] = true;
+        inlineINodes[inodeID] = file.UsesInlineData();
+        usages.push_back(usage);
+    }
+
+    for (const VfsFileUsage& usage : usages)
+    {
+        if (indexINodes[usage.inodeID])
+        {
+            report.dirIndexBlocks += usage.blocks + usage.mapBlocks;
+            continue;
+        }
+
+        report.mapBlocks += usage.mapBlocks;
+        if (usage.directory)
+            report.directories++;
+        else
+            report.files++;
+        if (inlineINodes[usage.inodeID])
+            report.inlineFiles++;
+        if (usage.fragments > 1)
+            report.fragmentedFiles++;
+        report.inodes.push_back(usage);
+    }
+
     return true;
 }
 
 void Vfs::DebugPrint()
 {
+    std::shared_lock<std::shared_timed_mutex> lock(mNamespaceLock);
     struct Node
     {
         int depth;
@@ -537,18 +1917,16 @@ void Vfs::DebugPrint()
         dirStack.pop();
 
         VfsFile file(this, dir.inodeID, true);
-        for (uint32 i = 0; i < file.mINode.usage; ++i)
+        file.ForEachDirectoryEntry([&](uint32, const Directory& dirEntry, uint32)
         {
-            Directory dirEntry;
-            file.Read(sizeof(Directory), &dirEntry);
-            
             Node child;
             child.depth = dir.depth + 1;
             child.fullPath = dir.fullPath + '/' + dirEntry.name;
             child.inodeID = dirEntry.inodeID;
             child.name = dirEntry.name;
             dirStack.push(child);
-        }
+            return true;
+        });
 
         for (int i = 0; i < dir.depth; ++i)
             std::cout << INDENT;
@@ -557,7 +1935,7 @@ void Vfs::DebugPrint()
             type = " [DIR] ";
 
         std::cout << "* " << std::setw(4) << std::setfill(' ') << dir.inodeID;
-        std::cout << type << dir.name << " (" << file.mINode.size << " bytes)  { ";
+        std::cout << type << dir.name << " (" << file.mINode.GetSize() << " bytes)  { ";
 
         std::vector<uint32> blocks = file.GetBlocksMap();
         for (uint32 b : blocks)
@@ -6,79 +6,417 @@
 
 #include "vfsstructures.hpp"
 #include "vfsfile.hpp"
+#include "vfsbitmap.hpp"
+#include "vfsblockcache.hpp"
+#include "vfsimage.hpp"
+#include "vfsfreespace.hpp"
+#include "vfsdentrycache.hpp"
+#include "vfsioengine.hpp"
+#include "vfsjournal.hpp"
+#include "vfsstats.hpp"
 
 #include <vector>
 #include <string>
 #include <set>
 #include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <atomic>
 
-// block size in bytes
-#define VFS_BLOCK_SIZE 4096
+// block size in bytes (a power of two chosen when an image is initialized)
+#define VFS_DEFAULT_BLOCK_SIZE 4096
+#define VFS_MIN_BLOCK_SIZE     1024
+#define VFS_MAX_BLOCK_SIZE     (1024 * 1024)
 
-// inode size in bytes
-#define VFS_INODE_SIZE (4*16)
+// inode size in bytes (smaller in older images, see INODE_NO_INLINE_SIZE and INODE_LEGACY_SIZE)
+#define VFS_INODE_SIZE (4*32)
+
+// size of directory entries (in bytes) above which a directory gets a hash index
+#define VFS_DIR_INDEX_THRESHOLD 4096
 
 #define VFS_MAGIC 0x76667321
 
+// on-disk format versions
+#define VFS_VERSION_LEGACY       0 //< files are mapped with block pointers trees
+#define VFS_VERSION_EXTENTS      1 //< new files are mapped with extents
+#define VFS_VERSION_DIR_INDEX    2 //< 64-byte inodes, large directories are hash indexed
+#define VFS_VERSION_COMPACT_DIRS 3 //< variable length directory entries
+#define VFS_VERSION_LARGE_FILES  4 //< 64-bit image and file sizes
+#define VFS_VERSION_BLOCK_SIZE   5 //< block size stored in the superblock (4096 before)
+#define VFS_VERSION_INLINE_DATA  6 //< 128-byte inodes, small files are stored inside inodes
+#define VFS_VERSION_JOURNAL      7 //< metadata updates are logged in a write-ahead journal
+#define VFS_VERSION_SHARED_BLOCKS 8 //< data blocks can be shared by cloned files
+#define VFS_VERSION_CURRENT      VFS_VERSION_SHARED_BLOCKS
+
+// default block cache size in bytes
+#define VFS_DEFAULT_CACHE_SIZE (4 * 1024 * 1024)
+
+// default journal size in bytes (limited to 1/8 of the image)
+#define VFS_DEFAULT_JOURNAL_SIZE (8 * 1024 * 1024)
+#define VFS_MAX_JOURNAL_SIZE     (1024 * 1024 * 1024)
+
+// minimum block cache size of journaled images (in blocks, metadata is kept until a commit)
+#define VFS_JOURNAL_MIN_CACHE_BLOCKS 64
+
 struct PathInfo
 {
-    uint32 size;
+    uint64 size;
     bool directory;
 };
 
+/**
+ * Result of a Vfs::Defragment call
+ */
+struct VfsDefragStats
+{
+    uint32 filesMoved;    //< files (and directories) relocated into a single run
+    uint32 dirsCompacted; //< directories with removed entries that were packed
+    uint64 bytesMoved;
+    bool finished;        //< all the inodes were visited (the next call starts over)
+
+    VfsDefragStats();
+};
+
+// free runs histogram bucket "i" counts runs of 2^i to 2^(i+1)-1 blocks
+#define VFS_FREE_RUN_BUCKETS 32
+
+/**
+ * Space usage and fragmentation of the image (see Vfs::GetUsageReport)
+ */
+struct VfsUsageReport
+{
+    uint32 blockSize;
+    uint32 totalBlocks;     //< data blocks (including the journal)
+    uint32 freeBlocks;
+    uint32 journalBlocks;
+    uint32 sharedBlocks;    //< data blocks referenced by more than one file
+    uint32 metadataBlocks;  //< superblock, bitmaps and inodes (outside of the data blocks)
+    uint32 mapBlocks;       //< block pointers and extent maps of all the files
+    uint32 refsTableBlocks; //< shared blocks table
+    uint32 dirIndexBlocks;  //< hash indexes of large directories (with their block maps)
+
+    uint32 totalINodes;
+    uint32 freeINodes;
+    uint32 files;
+    uint32 directories;
+    uint32 inlineFiles;     //< files stored inside their inodes
+    uint32 fragmentedFiles; //< files and directories with more than one fragment
+
+    uint32 freeRuns[VFS_FREE_RUN_BUCKETS];
+    uint32 largestFreeRun;
+
+    // ordered by inode ID (the shared blocks table and the directory indexes excluded)
+    std::vector<VfsFileUsage> inodes;
+
+    VfsUsageReport();
+};
+
 /**
  * @brief Class representing VFS
+ *
+ * Once an image is opened, all the methods (except Open, Init and Release) can be called
+ * concurrently. Operations modifying the directory tree are serialized, file data accesses
+ * are synchronized per inode.
  */
 class Vfs final
 {
     friend class VfsFile;
 
-    FILE* mImage;
+    // scope of an operation modifying the image (journal commits are made between operations)
+    class Operation final
+    {
+        Vfs* mVfs;
+
+    public:
+        /**
+         * @param bytes Amount of data the operation may allocate blocks for (the blocks released
+         *              since the last commit are reclaimed first if the free ones are not enough)
+         */
+        explicit Operation(Vfs* vfs, uint64 bytes = 0) : mVfs(vfs)
+        {
+            mVfs->BeginOperation(bytes);
+        }
+
+        ~Operation()
+        {
+            mVfs->EndOperation();
+        }
+
+        // commit the changes made so far if the modified blocks reached the commit threshold and
+        // continue in a new transaction (the caller must not hold any locks or files then)
+        void Split()
+        {
+            mVfs->SplitOperation();
+        }
+    };
+
+    VfsStatsCollector mStats;
+    VfsImage mImage;
     Superblock mSuperblock;
+    VfsBlockCache mCache;
+    size_t mCacheSize;
+    uint32 mInitBlockSize; //< block size of images created with Init()
+    uint64 mInitJournalSize; //< journal size of images created with Init()
+
+    // block size of the opened image (hot paths use the shift and the mask instead of division)
+    uint32 mBlockSize;
+    uint32 mBlockShift;
+    uint32 mBlockMask;
+
+    // taken exclusively by operations modifying directories, shared by path lookups
+    std::shared_timed_mutex mNamespaceLock;
+    VfsDentryCache mDentries;
+
+    std::mutex mFilesLock;
     std::set<VfsFile*> mOpenedFiles;
 
+    std::mutex mINodesLock;
+    std::unordered_map<uint32, std::unique_ptr<VfsINode>> mINodes; //< in-core inodes
+
+    std::mutex mINodeBitmapLock;
+    VfsBitmap mINodeBitmap;
+
+    std::mutex mBlocksLock; //< guards both the data blocks bitmap and the free space index
+    VfsBitmap mBlockBitmap;
+    VfsFreeSpaceIndex mFreeSpace;
+
+    // data blocks released since the last commit - the committed metadata may still use them,
+    // so they are returned to the bitmap and the free space index by the next commit
+    // (guarded by mBlocksLock)
+    std::vector<uint32> mFreedBlocks;
+
+    // reference counts of data blocks shared by cloned files (guarded by mBlocksLock)
+    std::unordered_map<uint32, uint32> mBlockRefs;
+    std::atomic<size_t> mSharedBlocksNum; //< size of mBlockRefs (read without the lock)
+    bool mBlockRefsDirty;
+
+    VfsJournal mJournal;
+    uint32 mCommitThreshold; //< number of dirty cached blocks triggering a commit
+
+    std::mutex mDefragLock;
+    uint32 mDefragCursor; //< next inode visited by Defragment() (guarded by mDefragLock)
+
+    // asynchronous reads engine (started by the first asynchronous read)
+    std::mutex mIoEngineLock;
+    VfsIoEngine mIoEngine;
+    VfsAsyncMode mAsyncMode;
+    uint32 mIoThreads;
+
+    // load inodes and data blocks bitmaps into memory
+    bool LoadBitmaps();
+
+    // set up the block cache for the block size of the image
+    void InitCache(uint32 blockSize);
+
+    // write all in-memory metadata and cached blocks to the image
+    bool Flush();
+
+    // write in-memory bitmaps to the block cache
+    bool FlushBitmaps();
+
+    // operations modifying the image are committed atomically when the image is journaled
+    void BeginOperation(uint64 bytes);
+    void EndOperation();
+    void SplitOperation();
+
+    // number of entries (or bytes of file data) processed by a split operation between commits,
+    // so its modified blocks don't outgrow the journal (unlimited if there is no journal)
+    size_t GetSplitEntries() const;
+    uint64 GetSplitBytes() const;
+
     /**
-     * Reserve a single item in a bitmap (write bit "1" in an empty field).
-     * @param firstBitmapBlock Index of the first bitmap block
-     * @param bitmapSize       Bitmap size (in bits)
-     * @return Reserved bit index or (-1) if bitmap is full.
+     * Commit the finished operations to the journal and write them in place. Concurrent calls
+     * are merged into a single commit.
      */
-    uint32 ReserveBitmap(uint32 firstBitmapBlock, uint32 bitmapSize);
+    bool Commit();
+    bool WriteTransaction();
 
     /**
-     * Release a single item in a bitmap (write bit "0" in the field).
-     * @param firstBitmapBlock Index of the first bitmap block
-     * @param bitmapSize       Bitmap size (in bits)
-     * @param id               Field ID
+     * Reserve a data block.
+     * @param hint Preferred block ID. If it's not free, the first free block after it is taken.
      */
-    void ReleaseBitmap(uint32 firstBitmapBlock, uint32 bitmapSize, uint32 id);
+    uint32 ReserveBlock(uint32 hint = INVALID_INDEX);
 
-    uint32 ReserveBlock();
+    // release a data block (or drop a reference to a shared one)
     void ReleaseBlock(uint32 id);
+
+    // release a run of data blocks (shared blocks only lose a reference)
+    void ReleaseBlockRun(uint32 firstBlockID, uint32 count);
+
+    // release data blocks in bulk - the list is sorted and released as runs
+    void ReleaseBlocks(std::vector<uint32>& blocks);
+
+    // release a run of data blocks with mBlocksLock held
+    void ReleaseRunLocked(uint32 firstBlockID, uint32 count);
+
+    // add a reference to all the blocks of the extents
+    void ShareBlocks(const std::vector<Extent>& extents);
+
+    /**
+     * Check if blocks are shared by multiple files.
+     * @param[out] shared Sharing state of the first block
+     * @return Number of the following blocks (up to "count") with the same sharing state
+     */
+    uint32 GetSharedRun(uint32 firstBlockID, uint32 count, bool& shared);
+
+    // check if an inode is in use
+    bool IsINodeReserved(uint32 inodeID);
+
+    /**
+     * Defragment a single inode (see Defragment).
+     * @return False if moving the inode's blocks would exceed the budget
+     */
+    bool DefragmentINode(uint32 inodeID, uint64 budget, VfsDefragStats& stats);
+
+    // load or store the shared blocks table
+    bool LoadBlockRefs();
+    bool SaveBlockRefs();
+
+    /**
+     * Reserve a contiguous run of data blocks, choosing the shortest free run that fits.
+     * @param count          Requested number of blocks
+     * @param[out] reserved  Number of reserved blocks. Less than "count" if there is no free run
+     *                       long enough - the longest one is reserved then.
+     * @return First block of the run or (-1) if there are no free blocks.
+     */
+    uint32 ReserveBlockRun(uint32 count, uint32& reserved);
+
+    uint32 GetFreeBlocksNum();
+
     uint32 ReserveINode();
     void ReleaseINode(uint32 id);
 
+    // reserve up to "count" inodes at once (fewer if there are no more free inodes)
+    void ReserveINodes(uint32 count, std::vector<uint32>& ids);
+    void ReleaseINodes(const std::vector<uint32>& ids);
+
+    // get in-core inode (creating it if the inode is not used yet)
+    VfsINode* OpenINode(uint32 id);
+
+    // drop in-core inode reference (the inode must be already written back)
+    void CloseINode(uint32 id);
+
+    // prepare a new inode according to the image format version
+    void InitINode(INode& inode, INodeType type) const;
+
+    // size of an on-disk inode
+    uint32 GetINodeSize() const;
+
+    // maximum file size supported by the image format
+    uint64 GetMaxFileSize() const;
+
+    // create files or directories, adding entries to each parent directory at once
+    uint32 CreateMany(const std::vector<std::string>& paths, INodeType type,
+                      std::vector<bool>* results);
+
+    static void SplitPath(const std::string& path, std::vector<std::string>& dirs);
     static std::string NameFromPath(const std::string& path);
     void GetINodeByPath(const std::string& path, uint32& inodeID, uint32& parentINodeID);
     void WriteINode(uint32 id, const INode& inode);
     void ReadINode(uint32 id, INode& inode);
 
+    // access data block contents through the block cache
+    bool ReadDataBlock(uint32 blockID, uint32 offset, uint32 bytes, void* data);
+    bool WriteDataBlock(uint32 blockID, uint32 offset, uint32 bytes, const void* data);
+
+    // get the asynchronous reads engine (starting it if needed)
+    VfsIoEngine* GetIoEngine();
+
+    // transfer consecutive whole data blocks at once, bypassing the block cache
+    bool ReadDataBlocks(uint32 firstBlockID, uint32 count, void* data);
+    bool WriteDataBlocks(uint32 firstBlockID, uint32 count, const void* data);
+
 public:
     ~Vfs();
     Vfs();
 
     void Release();
 
+    /**
+     * @brief Set block cache size. Takes effect when an image is opened or initialized.
+     * @param bytes Cache size in bytes (zero disables caching)
+     */
+    void SetCacheSize(size_t bytes);
+
+    /**
+     * @brief Set block size of images created with Init()
+     * @param bytes Block size in bytes, a power of two between VFS_MIN_BLOCK_SIZE and
+     *              VFS_MAX_BLOCK_SIZE
+     */
+    bool SetBlockSize(uint32 bytes);
+
+    /**
+     * @brief Set journal size of images created with Init()
+     * @param bytes Journal size in bytes (zero creates images without a journal)
+     */
+    void SetJournalSize(uint64 bytes);
+
+    /**
+     * @brief Get block size of the opened image
+     */
+    uint32 GetBlockSize() const;
+
+    /**
+     * @brief Choose how asynchronous file reads are executed. Takes effect when an image is
+     *        opened or initialized.
+     * @param mode       Preferred backend
+     * @param threadsNum Number of threads reading the image (used by the thread pool backend)
+     */
+    void SetAsyncMode(VfsAsyncMode mode, uint32 threadsNum = VFS_DEFAULT_IO_THREADS);
+
+    /**
+     * @brief Set maximum number of cached path components (zero disables caching)
+     */
+    void SetDentryCacheSize(size_t entries);
+
+    /**
+     * @brief Get block cache hit/miss counters
+     */
+    VfsCacheStats GetCacheStats() const;
+
+    /**
+     * @brief Enable or disable gathering of the operation latencies and the I/O counters
+     *        (disabled by default, the probes cost almost nothing then)
+     */
+    void SetStatsEnabled(bool enabled);
+
+    /**
+     * @brief Clear the statistics gathered so far
+     */
+    void ResetStats();
+
+    /**
+     * @brief Get the gathered statistics (and the block cache counters)
+     */
+    VfsStats GetStats() const;
+
     /**
      * @brief Open existing filesystem image
+     * @param mode Image storage mode
      */
-    bool Open(const std::string& imagePath);
+    bool Open(const std::string& imagePath, VfsStorageMode mode = VfsStorageMode::Stdio);
 
     /**
      * @brief Initialize filesystem. This will remove all data
      * @param size Virtual File System size in bytes
+     * @param mode Image storage mode
      */
-    bool Init(const std::string& imagePath, uint32 size);
+    bool Init(const std::string& imagePath, uint64 size,
+              VfsStorageMode mode = VfsStorageMode::Stdio);
+
+    /**
+     * @brief Write all pending changes to the image and wait until they are durable
+     *        (a msync checkpoint for memory mapped images). Changes of journaled images are
+     *        committed atomically, concurrent calls share a single commit.
+     */
+    bool Sync();
+
+    /**
+     * @brief Get storage mode of the opened image
+     */
+    VfsStorageMode GetStorageMode() const;
 
     /**
      * @brief Open a file in the VFS
@@ -99,6 +437,53 @@ public:
      */
     bool CreateDir(const std::string& path);
 
+    /**
+     * @brief Create multiple empty files. Entries of each parent directory are added at once,
+     *        so this is much faster than creating the files one by one.
+     * @param paths   File paths. Parents must exist or be created earlier in the same batch.
+     * @param results Optional per path success flags
+     * @return Number of created files
+     */
+    uint32 CreateFiles(const std::vector<std::string>& paths,
+                       std::vector<bool>* results = nullptr);
+
+    /**
+     * @brief Create multiple directories (see CreateFiles)
+     * @param paths   Directory paths. Parents must exist or be listed in the same batch.
+     * @param results Optional per path success flags
+     * @return Number of created directories
+     */
+    uint32 CreateDirs(const std::vector<std::string>& paths,
+                      std::vector<bool>* results = nullptr);
+
+    /**
+     * @brief Remove multiple files or directories, updating each parent directory once.
+     *        Directories must be empty or have all their contents listed in the same batch.
+     * @param results Optional per path success flags
+     * @return Number of removed paths
+     */
+    uint32 RemoveMany(const std::vector<std::string>& paths,
+                      std::vector<bool>* results = nullptr);
+
+    /**
+     * @brief Create a copy of a file without copying its data - the files share their data
+     *        blocks until either of them is modified (the modified blocks are copied then).
+     *        Requires VFS_VERSION_SHARED_BLOCKS or newer image.
+     * @param src  Source file path
+     * @param dest New file path
+     */
+    bool Clone(const std::string& src, const std::string& dest);
+
+    /**
+     * @brief Relocate fragmented files and directories into contiguous runs of blocks and pack
+     *        directories with removed entries. The image can be used meanwhile - the work is
+     *        done in steps, each call continues where the previous one stopped.
+     *        Shared (cloned) blocks and the journal are never moved.
+     * @param budget Maximum number of bytes moved by the call (a file larger than the budget
+     *               is moved if it's the first one visited by the call)
+     */
+    VfsDefragStats Defragment(uint64 budget);
+
     /**
      * @brief Rename a file or a directory
      * @param src Old path
@@ -107,7 +492,7 @@ public:
     bool Rename(const std::string& src, const std::string& dest);
 
     /**
-     * @brief Remove a file or an empty directory
+     * @brief Remove a file or an empty directory. Opened files can't be removed.
      * @param path File or directory path
      */
     bool Remove(const std::string& path);
@@ -122,8 +507,11 @@ public:
      */
     bool GetInfo(const std::string& path, PathInfo& info);
 
-    // TODO:
-    // * file system map (used/unused block, fragmentation, etc.)
+    /**
+     * @brief Gather the space usage and the fragmentation statistics. Takes a single pass over
+     *        the bitmaps and the inodes.
+     */
+    bool GetUsageReport(VfsUsageReport& report);
 
     void DebugPrint();
 };
@@ -0,0 +1,225 @@
+/**
+ * @author Michal Witanowski
+ */
+
+#include "vfsbitmap.hpp"
+#include "vfs.hpp"
+#include "vfsstats.hpp"
+
+#include <algorithm>
+
+#define BITS_PER_WORD 64u
+
+VfsBitmap::VfsBitmap()
+{
+    mWords = nullptr;
+    mWordsNum = 0;
+    mFirstBlock = 0;
+    mBlockSize = VFS_DEFAULT_BLOCK_SIZE;
+    mSize = 0;
+    mHint = 0;
+    mStats = nullptr;
+}
+
+void VfsBitmap::SetStats(VfsStatsCollector* stats)
+{
+    mStats = stats;
+}
+
+bool VfsBitmap::Load(VfsBlockCache& cache, uint32 firstBlock, uint32 size)
+{
+    mFirstBlock = firstBlock;
+    mBlockSize = cache.GetBlockSize();
+    mSize = size;
+    mHint = 0;
+
+    uint32 bytes = CeilDivide<uint32>(size, 8);
+    mWordsNum = CeilDivide<uint32>(size, BITS_PER_WORD);
+    mDirtyBlocks.assign(CeilDivide<uint32>(bytes, mBlockSize), false);
+
+    // bitmap blocks are aligned to the block size, so the words can be accessed directly
+    uint8* mapped = cache.GetMappedBlock(firstBlock);
+    if (mapped)
+    {
+        mStorage.clear();
+        mWords = reinterpret_cast<uint64*>(mapped);
+        return true;
+    }
+
+    mStorage.assign(mWordsNum, 0);
+    mWords = mStorage.data();
+
+    uint8* bytesPtr = reinterpret_cast<uint8*>(mWords);
+    for (uint32 i = 0; i < mDirtyBlocks.size(); ++i)
+    {
+        uint32 offset = mBlockSize * i;
+        uint32 toRead = std::min<uint32>(mBlockSize, bytes - offset);
+        if (!cache.Read(mFirstBlock + i, 0, toRead, bytesPtr + offset))
+            return false;
+    }
+
+    return true;
+}
+
+bool VfsBitmap::Flush(VfsBlockCache& cache)
+{
+    if (mStorage.empty())
+        return true;
+
+    const uint8* bytesPtr = reinterpret_cast<const uint8*>(mWords);
+    uint32 bytes = CeilDivide<uint32>(mSize, 8);
+
+    for (uint32 i = 0; i < mDirtyBlocks.size(); ++i)
+    {
+        if (!mDirtyBlocks[i])
+            continue;
+
+        uint32 offset = mBlockSize * i;
+        uint32 toWrite = std::min<uint32>(mBlockSize, bytes - offset);
+        if (!cache.Write(mFirstBlock + i, 0, toWrite, bytesPtr + offset))
+            return false;
+
+        mDirtyBlocks[i] = false;
+    }
+
+    return true;
+}
+
+uint32 VfsBitmap::Reserve()
+{
+    const uint32 words = mWordsNum;
+
+    for (uint32 i = mHint; i < words; ++i)
+    {
+        uint64 freeBits = ~mWords[i];
+
+        // mask out the bits past the bitmap end
+        if (i == words - 1 && (mSize % BITS_PER_WORD) != 0)
+            freeBits &= (1ULL << (mSize % BITS_PER_WORD)) - 1;
+
+        if (freeBits == 0)
+            continue;
+
+        if (mStats)
+            mStats->RecordBitmapScan(i - mHint + 1);
+
+        uint32 bit = CountTrailingZeros(freeBits);
+        mWords[i] |= 1ULL << bit;
+        mDirtyBlocks[(i * sizeof(uint64)) / mBlockSize] = true;
+        mHint = i;
+        return BITS_PER_WORD * i + bit;
+    }
+
+    if (mStats)
+        mStats->RecordBitmapScan(words - mHint);
+    mHint = words;
+    return INVALID_INDEX;
+}
+
+uint32 VfsBitmap::ReserveNear(uint32 hint)
+{
+    VFS_ASSERT(hint < mSize);
+    const uint32 words = mWordsNum;
+
+    // ignore the bits below the hint in the first word
+    uint64 mask = ~((1ULL << (hint % BITS_PER_WORD)) - 1);
+    for (uint32 i = hint / BITS_PER_WORD; i < words; ++i)
+    {
+        uint64 freeBits = ~mWords[i] & mask;
+        mask = ~0ULL;
+
+        if (i == words - 1 && (mSize % BITS_PER_WORD) != 0)
+            freeBits &= (1ULL << (mSize % BITS_PER_WORD)) - 1;
+
+        if (freeBits == 0)
+            continue;
+
+        if (mStats)
+            mStats->RecordBitmapScan(i - hint / BITS_PER_WORD + 1);
+
+        uint32 bit = CountTrailingZeros(freeBits);
+        mWords[i] |= 1ULL << bit;
+        mDirtyBlocks[(i * sizeof(uint64)) / mBlockSize] = true;
+        return BITS_PER_WORD * i + bit;
+    }
+
+    if (mStats)
+        mStats->RecordBitmapScan(words - hint / BITS_PER_WORD);
+    return Reserve();
+}
+
+void VfsBitmap::ReserveRange(uint32 first, uint32 count)
+{
+    VFS_ASSERT(first + count <= mSize);
+
+    for (uint32 id = first; id < first + count; )
+    {
+        uint32 word = id / BITS_PER_WORD;
+        uint32 bit = id % BITS_PER_WORD;
+        uint32 bits = std::min(BITS_PER_WORD - bit, first + count - id);
+        uint64 mask = (bits == BITS_PER_WORD) ? ~0ULL : (((1ULL << bits) - 1) << bit);
+
+        VFS_ASSERT((mWords[word] & mask) == 0);
+        mWords[word] |= mask;
+        mDirtyBlocks[(word * sizeof(uint64)) / mBlockSize] = true;
+        id += bits;
+    }
+}
+
+void VfsBitmap::Release(uint32 id)
+{
+    VFS_ASSERT(id < mSize);
+    uint32 word = id / BITS_PER_WORD;
+    uint64 mask = 1ULL << (id % BITS_PER_WORD);
+    VFS_ASSERT((mWords[word] & mask) == mask);
+
+    mWords[word] &= ~mask;
+    mDirtyBlocks[(word * sizeof(uint64)) / mBlockSize] = true;
+    mHint = std::min(mHint, word);
+}
+
+void VfsBitmap::ReleaseRange(uint32 first, uint32 count)
+{
+    VFS_ASSERT(first + count <= mSize);
+    if (count == 0)
+        return;
+
+    for (uint32 id = first; id < first + count; )
+    {
+        uint32 word = id / BITS_PER_WORD;
+        uint32 bit = id % BITS_PER_WORD;
+        uint32 bits = std::min(BITS_PER_WORD - bit, first + count - id);
+        uint64 mask = (bits == BITS_PER_WORD) ? ~0ULL : (((1ULL << bits) - 1) << bit);
+
+        VFS_ASSERT((mWords[word] & mask) == mask);
+        mWords[word] &= ~mask;
+        mDirtyBlocks[(word * sizeof(uint64)) / mBlockSize] = true;
+        id += bits;
+    }
+
+    mHint = std::min(mHint, first / BITS_PER_WORD);
+}
+
+uint32 VfsBitmap::FindNext(uint32 from, bool set) const
+{
+    if (from >= mSize)
+        return mSize;
+
+    uint64 mask = ~((1ULL << (from % BITS_PER_WORD)) - 1);
+    for (uint32 i = from / BITS_PER_WORD; i < mWordsNum; ++i)
+    {
+        uint64 bits = (set ? mWords[i] : ~mWords[i]) & mask;
+        mask = ~0ULL;
+
+        if (bits != 0)
+            return std::min(mSize, BITS_PER_WORD * i + CountTrailingZeros(bits));
+    }
+
+    return mSize;
+}
+
+bool VfsBitmap::IsSet(uint32 id) const
+{
+    VFS_ASSERT(id < mSize);
+    return (mWords[id / BITS_PER_WORD] & (1ULL << (id % BITS_PER_WORD))) != 0;
+}
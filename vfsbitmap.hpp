@@ -0,0 +1,91 @@
+/**
+ * @author Michal Witanowski
+ */
+
+#pragma once
+
+#include "vfscommon.hpp"
+#include "vfsblockcache.hpp"
+
+#include <vector>
+
+class VfsStatsCollector;
+
+/**
+ * @brief In-memory copy of an on-disk allocation bitmap.
+ *
+ * The bitmap is loaded once and scanned a 64-bit word at a time. Modified bitmap blocks
+ * are only marked as dirty and written back to the block cache in Flush().
+ * If the image is memory mapped, the bitmap is accessed in place instead.
+ */
+class VfsBitmap final
+{
+    std::vector<uint64> mStorage;
+    std::vector<bool> mDirtyBlocks;
+    uint64* mWords;
+    uint32 mWordsNum;
+    uint32 mFirstBlock; //< index of the first bitmap block in the image
+    uint32 mBlockSize;  //< image block size (in bytes)
+    uint32 mSize;       //< bitmap size (in bits)
+    uint32 mHint;       //< all the words below this index are known to be full
+    VfsStatsCollector* mStats;
+
+public:
+    VfsBitmap();
+
+    // set statistics receiving the scan lengths (can be nullptr)
+    void SetStats(VfsStatsCollector* stats);
+
+    /**
+     * Read the bitmap from the image.
+     * @param cache      Image block cache
+     * @param firstBlock Index of the first bitmap block
+     * @param size       Bitmap size (in bits)
+     */
+    bool Load(VfsBlockCache& cache, uint32 firstBlock, uint32 size);
+
+    /**
+     * Write all the modified bitmap blocks back to the image.
+     */
+    bool Flush(VfsBlockCache& cache);
+
+    /**
+     * Reserve the lowest free item (write bit "1" in an empty field).
+     * @return Reserved bit index or (-1) if bitmap is full.
+     */
+    uint32 Reserve();
+
+    /**
+     * Reserve the first free item starting from the given one.
+     * Falls back to Reserve() if there are no free items past the hint.
+     */
+    uint32 ReserveNear(uint32 hint);
+
+    /**
+     * Reserve a range of items. All of them must be free.
+     */
+    void ReserveRange(uint32 first, uint32 count);
+
+    /**
+     * Release a single item (write bit "0" in the field).
+     */
+    void Release(uint32 id);
+
+    /**
+     * Release a range of items. All of them must be reserved.
+     */
+    void ReleaseRange(uint32 first, uint32 count);
+
+    bool IsSet(uint32 id) const;
+
+    /**
+     * Find the first item with the given state, starting from "from".
+     * @return Item index or the bitmap size if there is no such item
+     */
+    uint32 FindNext(uint32 from, bool set) const;
+
+    uint32 GetSize() const
+    {
+        return mSize;
+    }
+};
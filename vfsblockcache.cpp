@@ -0,0 +1,477 @@
+/**
+ * @author Michal Witanowski
+ */
+
+#include "vfsblockcache.hpp"
+#include "vfs.hpp"
+
+#include <string.h>
+#include <algorithm>
+
+VfsCacheStats::VfsCacheStats()
+{
+    hits = 0;
+    misses = 0;
+    evictions = 0;
+    writeBacks = 0;
+    direct = 0;
+}
+
+VfsBlockCache::Shard::Shard()
+    : clockHand(0), budget(0), generation(0), hits(0), misses(0), evictions(0), writeBacks(0),
+      direct(0)
+{
+}
+
+VfsBlockCache::VfsBlockCache()
+{
+    mImage = nullptr;
+    mPassThrough = true;
+    mPinDirty = false;
+    mDirtyBlocks = 0;
+    Init(nullptr, 0, VFS_DEFAULT_BLOCK_SIZE);
+}
+
+void VfsBlockCache::Init(VfsImage* image, size_t budget, uint32 blockSize)
+{
+    VFS_ASSERT((blockSize & (blockSize - 1)) == 0);
+    mImage = image;
+    mBlockSize = blockSize;
+    mBlockShift = CountTrailingZeros(blockSize);
+
+    size_t slots = budget >> mBlockShift;
+    mPassThrough = (slots == 0);
+    mPinDirty = false;
+    mDirtyBlocks = 0;
+
+    // each shard needs at least one slot
+    size_t shardsNum = std::max<size_t>(1, std::min<size_t>(VFS_CACHE_SHARDS, slots));
+    mShards.clear();
+    for (size_t i = 0; i < shardsNum; ++i)
+    {
+        std::unique_ptr<Shard> shard(new Shard);
+        size_t shardSlots = slots / shardsNum + (i < slots % shardsNum ? 1 : 0);
+        shard->slots.resize(shardSlots);
+        shard->budget = static_cast<uint32>(shardSlots);
+        for (auto& slot : shard->slots)
+        {
+            slot.block = INVALID_INDEX;
+            slot.valid = false;
+            slot.dirty = false;
+            slot.referenced = false;
+        }
+
+        shard->data.resize(shardSlots << mBlockShift);
+        mShards.push_back(std::move(shard));
+    }
+}
+
+void VfsBlockCache::SetPinDirty(bool pin)
+{
+    VFS_ASSERT(!pin || !mPassThrough);
+    mPinDirty = pin;
+}
+
+bool VfsBlockCache::WriteBack(Shard& shard, uint32 slot)
+{
+    Slot& s = shard.slots[slot];
+    if (!s.dirty)
+        return true;
+
+    if (!mImage->Write(BlockOffset(s.block), mBlockSize, SlotData(shard, slot)))
+        return false;
+
+    s.dirty = false;
+    mDirtyBlocks--;
+    shard.writeBacks++;
+    shard.generation++;
+    return true;
+}
+
+uint32 VfsBlockCache::Grow(Shard& shard)
+{
+    Slot slot;
+    slot.block = INVALID_INDEX;
+    slot.valid = false;
+    slot.dirty = false;
+    slot.referenced = false;
+    shard.slots.push_back(slot);
+    shard.data.resize(shard.slots.size() << mBlockShift);
+    return static_cast<uint32>(shard.slots.size() - 1);
+}
+
+void VfsBlockCache::Trim(Shard& shard)
+{
+    if (shard.slots.size() <= shard.budget)
+        return;
+
+    for (uint32 i = shard.budget; i < shard.slots.size(); ++i)
+    {
+        VFS_ASSERT(!shard.slots[i].dirty);
+        if (shard.slots[i].valid)
+            shard.lookup.erase(shard.slots[i].block);
+    }
+
+    shard.slots.resize(shard.budget);
+    shard.data.resize(static_cast<size_t>(shard.budget) << mBlockShift);
+    shard.data.shrink_to_fit();
+    shard.clockHand %= shard.budget;
+}
+
+uint32 VfsBlockCache::Evict(Shard& shard)
+{
+    const uint32 slots = static_cast<uint32>(shard.slots.size());
+
+    // CLOCK algorithm - give referenced blocks a second chance
+    for (uint32 visited = 0; ; ++visited)
+    {
+        // all the blocks are pinned (two rounds clear all the reference bits)
+        if (mPinDirty && visited == 2 * slots)
+            return Grow(shard);
+
+        uint32 slot = shard.clockHand;
+        shard.clockHand = (shard.clockHand + 1) % slots;
+
+        Slot& s = shard.slots[slot];
+        if (!s.valid)
+            return slot;
+
+        if (s.referenced)
+        {
+            s.referenced = false;
+            continue;
+        }
+
+        if (mPinDirty && s.dirty)
+            continue;
+
+        if (!WriteBack(shard, slot))
+        {
+            LOG_ERROR("Failed to write back block " << s.block);
+            return INVALID_INDEX;
+        }
+
+        shard.lookup.erase(s.block);
+        s.valid = false;
+        shard.evictions++;
+        return slot;
+    }
+}
+
+uint32 VfsBlockCache::GetSlot(Shard& shard, uint32 block, bool load)
+{
+    auto it = shard.lookup.find(block);
+    if (it != shard.lookup.end())
+    {
+        shard.hits++;
+        shard.slots[it->second].referenced = true;
+        return it->second;
+    }
+
+    shard.misses++;
+    uint32 slot = Evict(shard);
+    if (slot == INVALID_INDEX)
+        return INVALID_INDEX;
+
+    if (load)
+    {
+        if (!mImage->Read(BlockOffset(block), mBlockSize, SlotData(shard, slot)))
+        {
+            LOG_ERROR("Failed to read block " << block);
+            return INVALID_INDEX;
+        }
+    }
+
+    Slot& s = shard.slots[slot];
+    s.block = block;
+    s.valid = true;
+    s.dirty = false;
+    s.referenced = true;
+    shard.lookup[block] = slot;
+    return slot;
+}
+
+bool VfsBlockCache::Read(uint32 block, uint32 offset, uint32 bytes, void* data)
+{
+    VFS_ASSERT(offset + bytes <= mBlockSize);
+    Shard& shard = GetShard(block);
+
+    if (mPassThrough)
+    {
+        shard.misses++;
+        return mImage->Read(BlockOffset(block) + offset, bytes, data);
+    }
+
+    std::lock_guard<std::mutex> lock(shard.lock);
+    uint32 slot = GetSlot(shard, block, true);
+    if (slot == INVALID_INDEX)
+        return false;
+
+    memcpy(data, SlotData(shard, slot) + offset, bytes);
+    return true;
+}
+
+bool VfsBlockCache::ReadCached(uint32 block, uint32 offset, uint32 bytes, void* data)
+{
+    VFS_ASSERT(offset + bytes <= mBlockSize);
+    if (mPassThrough)
+        return false;
+
+    Shard& shard = GetShard(block);
+    std::lock_guard<std::mutex> lock(shard.lock);
+    auto it = shard.lookup.find(block);
+    if (it == shard.lookup.end())
+        return false;
+
+    shard.hits++;
+    shard.slots[it->second].referenced = true;
+    memcpy(data, SlotData(shard, it->second) + offset, bytes);
+    return true;
+}
+
+bool VfsBlockCache::Write(uint32 block, uint32 offset, uint32 bytes, const void* data)
+{
+    VFS_ASSERT(offset + bytes <= mBlockSize);
+    Shard& shard = GetShard(block);
+
+    if (mPassThrough)
+    {
+        shard.misses++;
+        return mImage->Write(BlockOffset(block) + offset, bytes, data);
+    }
+
+    // there is no need to read the block if it's going to be overwritten entirely
+    std::lock_guard<std::mutex> lock(shard.lock);
+    uint32 slot = GetSlot(shard, block, bytes < mBlockSize);
+    if (slot == INVALID_INDEX)
+        return false;
+
+    memcpy(SlotData(shard, slot) + offset, data, bytes);
+    if (!shard.slots[slot].dirty)
+    {
+        shard.slots[slot].dirty = true;
+        mDirtyBlocks++;
+    }
+    return true;
+}
+
+bool VfsBlockCache::IsCached(uint32 block) const
+{
+    Shard& shard = GetShard(block);
+    std::lock_guard<std::mutex> lock(shard.lock);
+    return shard.lookup.count(block) > 0;
+}
+
+bool VfsBlockCache::Prefetch(uint32 firstBlock, uint32 count)
+{
+    if (mPassThrough)
+        return true;
+
+    // only the uncached part of the range is read
+    uint32 first = firstBlock;
+    uint32 end = firstBlock + count;
+    while (first < end && IsCached(first))
+        first++;
+    while (end > first && IsCached(end - 1))
+        end--;
+
+    if (first == end)
+        return true;
+
+    // a dirty block may be written back and evicted while the image is read
+    std::vector<uint64> generations(mShards.size());
+    for (uint32 i = 0; i < std::min<size_t>(end - first, mShards.size()); ++i)
+        generations[(first + i) % mShards.size()] = GetShard(first + i).generation;
+
+    std::vector<uint8> data(static_cast<size_t>(end - first) << mBlockShift);
+    if (!mImage->Read(BlockOffset(first), (end - first) << mBlockShift, data.data()))
+        return false;
+
+    for (uint32 block = first; block < end; ++block)
+    {
+        Shard& shard = GetShard(block);
+        std::lock_guard<std::mutex> lock(shard.lock);
+
+        // the cached copy may be newer than the image (the read one may be outdated already)
+        if (shard.lookup.count(block) > 0 ||
+            shard.generation != generations[block % mShards.size()])
+            continue;
+
+        uint32 slot = GetSlot(shard, block, false);
+        if (slot == INVALID_INDEX)
+            return false;
+
+        size_t offset = static_cast<size_t>(block - first) << mBlockShift;
+        memcpy(SlotData(shard, slot), data.data() + offset, mBlockSize);
+
+        // blocks that are never read are evicted first
+        shard.slots[slot].referenced = false;
+    }
+
+    return true;
+}
+
+bool VfsBlockCache::ReadBlocks(uint32 firstBlock, uint32 count, void* data)
+{
+    // a dirty block may be written back and evicted while the image is read
+    std::vector<uint64> generations(mPassThrough ? 0 : mShards.size());
+    for (uint32 i = 0; i < std::min<size_t>(count, generations.size()); ++i)
+        generations[(firstBlock + i) % mShards.size()] = GetShard(firstBlock + i).generation;
+
+    uint8* dataPtr = static_cast<uint8*>(data);
+    if (!mImage->Read(BlockOffset(firstBlock), count << mBlockShift, dataPtr))
+        return false;
+
+    GetShard(firstBlock).direct += count;
+    if (mPassThrough)
+        return true;
+
+    // the image may be outdated
+    for (uint32 i = 0; i < count; ++i)
+    {
+        const uint32 block = firstBlock + i;
+        uint8* blockData = dataPtr + (static_cast<size_t>(i) << mBlockShift);
+        Shard& shard = GetShard(block);
+        std::lock_guard<std::mutex> lock(shard.lock);
+        auto it = shard.lookup.find(block);
+        if (it != shard.lookup.end())
+            memcpy(blockData, SlotData(shard, it->second), mBlockSize);
+        else if (shard.generation != generations[block % mShards.size()] &&
+                 !mImage->Read(BlockOffset(block), mBlockSize, blockData))
+            return false;
+    }
+
+    return true;
+}
+
+bool VfsBlockCache::WriteBlocks(uint32 firstBlock, uint32 count, const void* data)
+{
+    if (!mImage->Write(BlockOffset(firstBlock), count << mBlockShift, data))
+        return false;
+
+    GetShard(firstBlock).direct += count;
+    if (mPassThrough)
+        return true;
+
+    for (uint32 i = 0; i < count; ++i)
+    {
+        Shard& shard = GetShard(firstBlock + i);
+        std::lock_guard<std::mutex> lock(shard.lock);
+        auto it = shard.lookup.find(firstBlock + i);
+        if (it != shard.lookup.end())
+        {
+            Slot& s = shard.slots[it->second];
+            if (s.dirty)
+                mDirtyBlocks--;
+            s.valid = false;
+            s.dirty = false;
+            shard.lookup.erase(it);
+        }
+    }
+
+    return true;
+}
+
+bool VfsBlockCache::Flush()
+{
+    // lock all the shards (always in the same order) to write the blocks in the image order
+    std::vector<std::unique_lock<std::mutex>> locks;
+    std::vector<std::pair<uint32, uint32>> dirtySlots; // (shard, slot)
+    for (uint32 i = 0; i < mShards.size(); ++i)
+    {
+        Shard& shard = *mShards[i];
+        locks.emplace_back(shard.lock);
+        for (uint32 j = 0; j < shard.slots.size(); ++j)
+            if (shard.slots[j].valid && shard.slots[j].dirty)
+                dirtySlots.push_back(std::make_pair(i, j));
+    }
+
+    std::sort(dirtySlots.begin(), dirtySlots.end(),
+              [this](const std::pair<uint32, uint32>& a, const std::pair<uint32, uint32>& b)
+    {
+        return mShards[a.first]->slots[a.second].block < mShards[b.first]->slots[b.second].block;
+    });
+
+    bool result = true;
+    for (const auto& dirtySlot : dirtySlots)
+    {
+        Shard& shard = *mShards[dirtySlot.first];
+        if (!WriteBack(shard, dirtySlot.second))
+        {
+            LOG_ERROR("Failed to write back block " << shard.slots[dirtySlot.second].block);
+            result = false;
+        }
+    }
+
+    // pinned blocks are clean now, so the shards can shrink back to their budgets
+    if (result)
+        for (const auto& shard : mShards)
+            Trim(*shard);
+
+    return result;
+}
+
+void VfsBlockCache::GetDirtyBlocks(std::vector<uint32>& blocks, std::vector<uint8>& data)
+{
+    typedef std::pair<uint32, const uint8*> DirtyBlock; // (block, slot data)
+
+    std::vector<std::unique_lock<std::mutex>> locks;
+    std::vector<DirtyBlock> dirtyBlocks;
+    for (const auto& shard : mShards)
+    {
+        locks.emplace_back(shard->lock);
+        for (uint32 j = 0; j < shard->slots.size(); ++j)
+            if (shard->slots[j].valid && shard->slots[j].dirty)
+                dirtyBlocks.push_back(std::make_pair(shard->slots[j].block, SlotData(*shard, j)));
+    }
+
+    std::sort(dirtyBlocks.begin(), dirtyBlocks.end(),
+              [](const DirtyBlock& a, const DirtyBlock& b)
+    {
+        return a.first < b.first;
+    });
+
+    blocks.clear();
+    data.resize(dirtyBlocks.size() << mBlockShift);
+    for (size_t i = 0; i < dirtyBlocks.size(); ++i)
+    {
+        blocks.push_back(dirtyBlocks[i].first);
+        memcpy(data.data() + (i << mBlockShift), dirtyBlocks[i].second, mBlockSize);
+    }
+}
+
+VfsCacheStats VfsBlockCache::GetStats() const
+{
+    VfsCacheStats stats;
+    for (const auto& shard : mShards)
+    {
+        stats.hits += shard->hits;
+        stats.misses += shard->misses;
+        stats.evictions += shard->evictions;
+        stats.writeBacks += shard->writeBacks;
+        stats.direct += shard->direct;
+    }
+    return stats;
+}
+
+uint8* VfsBlockCache::GetMappedBlock(uint32 block) const
+{
+    // pinned blocks must not be modified in place before they are logged
+    uint8* mapping = (mImage && !mPinDirty) ? mImage->GetMapping() : nullptr;
+    if (mapping == nullptr)
+        return nullptr;
+
+    return mapping + BlockOffset(block);
+}
+
+bool VfsBlockCache::Release()
+{
+    bool result = Flush();
+    Init(nullptr, 0, VFS_DEFAULT_BLOCK_SIZE);
+    return result;
+}
+
+void VfsBlockCache::Discard()
+{
+    Init(nullptr, 0, VFS_DEFAULT_BLOCK_SIZE);
+}
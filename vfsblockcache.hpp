@@ -0,0 +1,206 @@
+/**
+ * @author Michal Witanowski
+ */
+
+#pragma once
+
+#include "vfscommon.hpp"
+#include "vfsimage.hpp"
+
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+
+// maximum number of independently locked cache partitions
+#define VFS_CACHE_SHARDS 16
+
+/**
+ * Block cache statistics
+ */
+struct VfsCacheStats
+{
+    uint64 hits;       //< block accesses served from the cache
+    uint64 misses;     //< block accesses that required reading the image
+    uint64 evictions;  //< blocks dropped to make space for other blocks
+    uint64 writeBacks; //< dirty blocks written to the image
+    uint64 direct;     //< whole blocks transferred directly, bypassing the cache
+
+    VfsCacheStats();
+};
+
+/**
+ * @brief Write-back cache of the image blocks with CLOCK eviction.
+ *
+ * Blocks are distributed between shards (by block index), each one with its own lock, slots
+ * and clock hand, so accesses to different blocks don't contend. All the methods are thread-safe.
+ */
+class VfsBlockCache final
+{
+    struct Slot
+    {
+        uint32 block;
+        bool valid;
+        bool dirty;
+        bool referenced;
+    };
+
+    struct Shard
+    {
+        std::mutex lock;
+        std::vector<uint8> data;
+        std::vector<Slot> slots;
+        std::unordered_map<uint32, uint32> lookup; //< block index -> slot index
+        uint32 clockHand;
+        uint32 budget; //< number of slots (exceeded only by pinned dirty blocks)
+
+        // incremented (with the lock held) after a block is written back, so the image contents
+        // read without the lock can be validated before they are used
+        std::atomic<uint64> generation;
+
+        // statistics (updated without holding the lock in the pass-through mode)
+        std::atomic<uint64> hits;
+        std::atomic<uint64> misses;
+        std::atomic<uint64> evictions;
+        std::atomic<uint64> writeBacks;
+        std::atomic<uint64> direct;
+
+        Shard();
+    };
+
+    VfsImage* mImage;
+    std::vector<std::unique_ptr<Shard>> mShards;
+    bool mPassThrough;
+    bool mPinDirty; //< dirty blocks are written only by Flush (never evicted)
+    std::atomic<uint32> mDirtyBlocks;
+    uint32 mBlockSize;
+    uint32 mBlockShift; //< log2 of the block size
+
+    uint8* SlotData(Shard& shard, uint32 slot) const
+    {
+        return shard.data.data() + (static_cast<size_t>(slot) << mBlockShift);
+    }
+
+    uint64 BlockOffset(uint32 block) const
+    {
+        return static_cast<uint64>(block) << mBlockShift;
+    }
+
+    Shard& GetShard(uint32 block) const
+    {
+        return *mShards[block % mShards.size()];
+    }
+
+    // find a slot for a block, evicting other block if needed (the shard must be locked)
+    uint32 GetSlot(Shard& shard, uint32 block, bool load);
+    uint32 Evict(Shard& shard);
+    bool WriteBack(Shard& shard, uint32 slot);
+
+    // add a slot to a shard whose slots are all pinned
+    uint32 Grow(Shard& shard);
+
+    // drop the slots above the shard budget (they must be clean)
+    void Trim(Shard& shard);
+
+    bool IsCached(uint32 block) const;
+
+public:
+    VfsBlockCache();
+
+    /**
+     * Attach the cache to an image.
+     * @param image     Image storage
+     * @param budget    Maximum cache size in bytes (zero disables caching)
+     * @param blockSize Image block size in bytes (power of two)
+     */
+    void Init(VfsImage* image, size_t budget, uint32 blockSize);
+
+    /**
+     * Keep dirty blocks in the cache until Flush is called, even if the cache grows above its
+     * budget (so a journal can log them before they are written in place). Requires a non-zero
+     * cache budget, also the image mapping is not exposed then (see GetMappedBlock).
+     */
+    void SetPinDirty(bool pin);
+
+    /**
+     * Read data from a block (or its part).
+     * @param block  Image block index
+     * @param offset Offset inside the block
+     */
+    bool Read(uint32 block, uint32 offset, uint32 bytes, void* data);
+
+    /**
+     * Read data from a block (or its part) only if the block is cached.
+     * @return False if the block is not in the cache (nothing is read then)
+     */
+    bool ReadCached(uint32 block, uint32 offset, uint32 bytes, void* data);
+
+    /**
+     * Write data to a block (or its part).
+     * @param block  Image block index
+     * @param offset Offset inside the block
+     */
+    bool Write(uint32 block, uint32 offset, uint32 bytes, const void* data);
+
+    /**
+     * Load consecutive blocks into the cache with a single image access (the blocks cached
+     * already are kept). Does nothing if the cache is disabled.
+     */
+    bool Prefetch(uint32 firstBlock, uint32 count);
+
+    /**
+     * Read consecutive whole blocks with a single image access, bypassing the cache.
+     * Cached copies of the blocks take precedence over the image contents.
+     */
+    bool ReadBlocks(uint32 firstBlock, uint32 count, void* data);
+
+    /**
+     * Write consecutive whole blocks with a single image access, bypassing the cache.
+     * Cached copies of the blocks are dropped.
+     */
+    bool WriteBlocks(uint32 firstBlock, uint32 count, const void* data);
+
+    /**
+     * Write all the dirty blocks to the image.
+     */
+    bool Flush();
+
+    /**
+     * Get copies of all the dirty blocks.
+     * @param[out] blocks Block indices (sorted)
+     * @param[out] data   Blocks contents
+     */
+    void GetDirtyBlocks(std::vector<uint32>& blocks, std::vector<uint8>& data);
+
+    uint32 GetDirtyBlocksNum() const
+    {
+        return mDirtyBlocks;
+    }
+
+    /**
+     * Write all the dirty blocks and detach from the image.
+     */
+    bool Release();
+
+    /**
+     * Drop all the blocks (also the dirty ones) and detach from the image.
+     */
+    void Discard();
+
+    /**
+     * Get pointer to a block inside the image mapping.
+     * @return nullptr if the image is not memory mapped (or dirty blocks are pinned)
+     */
+    uint8* GetMappedBlock(uint32 block) const;
+
+    /**
+     * Get statistics summed over all the shards.
+     */
+    VfsCacheStats GetStats() const;
+
+    uint32 GetBlockSize() const
+    {
+        return mBlockSize;
+    }
+};
@@ -6,6 +6,12 @@
 
 #include <iostream>
 
+#ifdef _MSC_VER
+    #include <intrin.h>
+#endif
+
+typedef long long int64;
+typedef unsigned long long uint64;
 typedef int int32;
 typedef unsigned int uint32;
 typedef short int16;
@@ -29,3 +35,17 @@ inline T CeilDivide(T a, T b)
 {
     return (a / b) + ((a % b > 0) ? 1 : 0);
 }
+
+// count trailing zero bits (x must be non-zero)
+inline uint32 CountTrailingZeros(uint64 x)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    if (_BitScanForward(&index, static_cast<unsigned long>(x)))
+        return index;
+    _BitScanForward(&index, static_cast<unsigned long>(x >> 32));
+    return index + 32;
+#else
+    return static_cast<uint32>(__builtin_ctzll(x));
+#endif
+}
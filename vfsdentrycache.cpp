@@ -0,0 +1,81 @@
+/**
+ * @author Michal Witanowski
+ */
+
+#include "vfsdentrycache.hpp"
+
+VfsDentryCache::VfsDentryCache()
+{
+    mCapacity = VFS_DEFAULT_DENTRY_CACHE_SIZE;
+}
+
+void VfsDentryCache::SetCapacity(size_t capacity)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    mCapacity = capacity;
+
+    while (mEntries.size() > mCapacity)
+    {
+        mEntries.erase(mLRU.back());
+        mLRU.pop_back();
+    }
+}
+
+bool VfsDentryCache::Lookup(uint32 parentID, const std::string& name, uint32& inodeID)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    auto it = mEntries.find(Key(parentID, name));
+    if (it == mEntries.end())
+        return false;
+
+    mLRU.splice(mLRU.begin(), mLRU, it->second.lruPos);
+    inodeID = it->second.inodeID;
+    return true;
+}
+
+void VfsDentryCache::Insert(uint32 parentID, const std::string& name, uint32 inodeID)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    if (mCapacity == 0)
+        return;
+
+    Key key(parentID, name);
+    auto it = mEntries.find(key);
+    if (it != mEntries.end())
+    {
+        mLRU.splice(mLRU.begin(), mLRU, it->second.lruPos);
+        it->second.inodeID = inodeID;
+        return;
+    }
+
+    if (mEntries.size() >= mCapacity)
+    {
+        mEntries.erase(mLRU.back());
+        mLRU.pop_back();
+    }
+
+    mLRU.push_front(key);
+    Entry& entry = mEntries[key];
+    entry.inodeID = inodeID;
+    entry.lruPos = mLRU.begin();
+}
+
+void VfsDentryCache::InvalidateDirectory(uint32 parentID)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    // entries are ordered by the parent inode first
+    auto it = mEntries.lower_bound(Key(parentID, std::string()));
+    while (it != mEntries.end() && it->first.first == parentID)
+    {
+        mLRU.erase(it->second.lruPos);
+        it = mEntries.erase(it);
+    }
+}
+
+void VfsDentryCache::Clear()
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    mEntries.clear();
+    mLRU.clear();
+}
@@ -0,0 +1,66 @@
+/**
+ * @author Michal Witanowski
+ */
+
+#pragma once
+
+#include "vfscommon.hpp"
+
+#include <string>
+#include <map>
+#include <list>
+#include <mutex>
+
+// default maximum number of cached directory entries
+#define VFS_DEFAULT_DENTRY_CACHE_SIZE 16384
+
+/**
+ * @brief Cache of resolved directory entries: (parent inode, name) -> child inode.
+ *
+ * Names known not to exist are cached as negative entries (with INVALID_INDEX inode).
+ * The least recently used entries are dropped when the cache is full. All the methods
+ * are thread-safe.
+ */
+class VfsDentryCache final
+{
+    typedef std::pair<uint32, std::string> Key;
+
+    struct Entry
+    {
+        uint32 inodeID;
+        std::list<Key>::iterator lruPos;
+    };
+
+    std::mutex mLock;
+    std::map<Key, Entry> mEntries;
+    std::list<Key> mLRU; //< most recently used entries first
+    size_t mCapacity;
+
+public:
+    VfsDentryCache();
+
+    /**
+     * Set maximum number of cached entries (zero disables caching).
+     */
+    void SetCapacity(size_t capacity);
+
+    /**
+     * Look up an entry.
+     * @param[out] inodeID Child inode or INVALID_INDEX if the name is known not to exist
+     * @return True if the entry was found in the cache
+     */
+    bool Lookup(uint32 parentID, const std::string& name, uint32& inodeID);
+
+    /**
+     * Add or update an entry.
+     * @param inodeID Child inode or INVALID_INDEX for a negative entry
+     */
+    void Insert(uint32 parentID, const std::string& name, uint32 inodeID);
+
+    /**
+     * Drop all the entries of a directory.
+     */
+    void InvalidateDirectory(uint32 parentID);
+
+    void Clear();
+};
@@ -7,23 +7,493 @@
 #include "vfscommon.hpp"
 
 #include <assert.h>
+#include <string.h>
 #include <algorithm>
+#include <unordered_set>
 
-#define VFS_PTRS_PER_BLOCK (VFS_BLOCK_SIZE / sizeof(uint32))
+#define VFS_PTRS_PER_BLOCK(blockSize) ((blockSize) / static_cast<uint32>(sizeof(uint32)))
+#define VFS_EXTENTS_PER_BLOCK(blockSize) \
+    (((blockSize) - static_cast<uint32>(sizeof(ExtentBlockHeader))) / static_cast<uint32>(sizeof(Extent)))
+
+VfsINode::VfsINode()
+{
+    refs = 0;
+    mappedBlocks = 0;
+    extentsDirty = false;
+    writeBufferOffset = 0;
+    asyncReads = 0;
+}
 
 VfsFile::VfsFile(Vfs* vfs, uint32 inodeID, bool readOnly)
+    : mNode(vfs->OpenINode(inodeID))
+    , mINode(mNode->inode)
 {
     mVFS = vfs;
     mCursor = 0;
     mINodeID = inodeID;
     mReadOnly = readOnly;
-    mVFS->ReadINode(mINodeID, mINode);
+    mMetadata = false;
+    mAsyncReads = 0;
+    mReadEnd = ~0ULL;
+    mWriteEnd = ~0ULL;
+    mReadAheadBlocks = 0;
+    mReadAheadEnd = 0;
+
+    // the inode is loaded only once, other users wait until it's done
+    std::call_once(mNode->loaded, [this]
+    {
+        mVFS->ReadINode(mINodeID, mINode);
+        if (UsesExtents())
+            VFS_ASSERT(LoadExtents());
+    });
 }
 
 VfsFile::~VfsFile()
 {
+    {
+        std::unique_lock<std::mutex> lock(mNode->asyncLock);
+        mNode->asyncDone.wait(lock, [this] { return mAsyncReads == 0; });
+    }
+
     if (!mReadOnly)
+    {
+        ExclusiveLock lock(mNode->lock);
+        if (!FlushWriteBuffer())
+            LOG_ERROR("Failed to write buffered data of inode " << mINodeID);
+        if (mNode->extentsDirty)
+            VFS_ASSERT(SaveExtents());
+
         mVFS->WriteINode(mINodeID, mINode);
+    }
+
+    mVFS->CloseINode(mINodeID);
+}
+
+void VfsFile::WaitForAsyncReads()
+{
+    std::unique_lock<std::mutex> lock(mNode->asyncLock);
+    mNode->asyncDone.wait(lock, [this] { return mNode->asyncReads == 0; });
+}
+
+bool VfsFile::LoadExtents()
+{
+    mNode->extents.clear();
+    mNode->extentOffsets.clear();
+    mNode->extentBlocks.clear();
+    mNode->mappedBlocks = 0;
+
+    for (uint32 i = 0; i < INODE_EXTENTS; ++i)
+    {
+        Extent extent;
+        extent.start = mINode.blockPtr[2 * i];
+        extent.length = mINode.blockPtr[2 * i + 1];
+        if (extent.start == INVALID_INDEX || extent.length == 0)
+            break;
+
+        mNode->extents.push_back(extent);
+    }
+
+    const uint32 blockSize = mVFS->mBlockSize;
+    std::vector<uint8> block(blockSize);
+    uint32 extentBlockId = mINode.blockPtr[INODE_PTRS - 1];
+    while (extentBlockId != INVALID_INDEX)
+    {
+        if (!mVFS->ReadDataBlock(extentBlockId, 0, blockSize, block.data()))
+            return false;
+
+        ExtentBlockHeader header;
+        memcpy(&header, block.data(), sizeof(header));
+        VFS_ASSERT(header.count <= VFS_EXTENTS_PER_BLOCK(blockSize));
+
+        const Extent* extents = reinterpret_cast<const Extent*>(block.data() + sizeof(header));
+        mNode->extents.insert(mNode->extents.end(), extents, extents + header.count);
+        mNode->extentBlocks.push_back(extentBlockId);
+        extentBlockId = header.next;
+    }
+
+    for (const Extent& extent : mNode->extents)
+    {
+        mNode->extentOffsets.push_back(mNode->mappedBlocks);
+        mNode->mappedBlocks += extent.length;
+    }
+
+    return true;
+}
+
+bool VfsFile::SaveExtents()
+{
+    for (uint32 i = 0; i < INODE_EXTENTS; ++i)
+    {
+        mINode.blockPtr[2 * i] = i < mNode->extents.size() ? mNode->extents[i].start : INVALID_INDEX;
+        mINode.blockPtr[2 * i + 1] = i < mNode->extents.size() ? mNode->extents[i].length : 0;
+    }
+
+    // adjust number of extent blocks
+    const uint32 blockSize = mVFS->mBlockSize;
+    const uint32 extentsPerBlock = VFS_EXTENTS_PER_BLOCK(blockSize);
+    uint32 overflow = 0;
+    if (mNode->extents.size() > INODE_EXTENTS)
+        overflow = static_cast<uint32>(mNode->extents.size()) - INODE_EXTENTS;
+    size_t blocksNeeded = CeilDivide<uint32>(overflow, extentsPerBlock);
+
+    while (mNode->extentBlocks.size() > blocksNeeded)
+    {
+        mVFS->ReleaseBlock(mNode->extentBlocks.back());
+        mNode->extentBlocks.pop_back();
+    }
+
+    while (mNode->extentBlocks.size() < blocksNeeded)
+    {
+        uint32 blockId = mVFS->ReserveBlock();
+        if (blockId == INVALID_INDEX)
+        {
+            LOG_ERROR("No blocks left for the extent map");
+            return false;
+        }
+        mNode->extentBlocks.push_back(blockId);
+    }
+
+    // write extent blocks
+    std::vector<uint8> block(blockSize);
+    for (size_t i = 0; i < mNode->extentBlocks.size(); ++i)
+    {
+        std::fill(block.begin(), block.end(), static_cast<uint8>(0));
+
+        size_t first = INODE_EXTENTS + i * extentsPerBlock;
+        ExtentBlockHeader header;
+        header.next = (i + 1 < mNode->extentBlocks.size()) ? mNode->extentBlocks[i + 1] : INVALID_INDEX;
+        header.count = static_cast<uint32>(std::min<size_t>(extentsPerBlock,
+                                                            mNode->extents.size() - first));
+        memcpy(block.data(), &header, sizeof(header));
+        memcpy(block.data() + sizeof(header), &mNode->extents[first],
+               header.count * sizeof(Extent));
+
+        if (!mVFS->WriteDataBlock(mNode->extentBlocks[i], 0, blockSize, block.data()))
+            return false;
+    }
+
+    mINode.blockPtr[INODE_PTRS - 1] = mNode->extentBlocks.empty() ? INVALID_INDEX : mNode->extentBlocks[0];
+    mNode->extentsDirty = false;
+    return true;
+}
+
+bool VfsFile::ReleaseExtents()
+{
+    return TruncateExtents(0);
+}
+
+bool VfsFile::TruncateExtents(uint32 keepBlocks)
+{
+    while (mNode->mappedBlocks > keepBlocks)
+    {
+        Extent& extent = mNode->extents.back();
+        uint32 excess = std::min(extent.length, mNode->mappedBlocks - keepBlocks);
+        mVFS->ReleaseBlockRun(extent.start + extent.length - excess, excess);
+
+        extent.length -= excess;
+        mNode->mappedBlocks -= excess;
+        if (extent.length == 0)
+        {
+            mNode->extents.pop_back();
+            mNode->extentOffsets.pop_back();
+        }
+    }
+
+    return SaveExtents();
+}
+
+bool VfsFile::CollectPointerTree(uint32 blockID, uint32 depth, uint64 treeStart,
+                                 uint64 keepBlocks, std::vector<uint32>& freed, bool& whole)
+{
+    whole = treeStart >= keepBlocks;
+    if (depth == 0)
+    {
+        if (whole)
+            freed.push_back(blockID);
+        return true;
+    }
+
+    const uint32 ptrsPerBlock = VFS_PTRS_PER_BLOCK(mVFS->mBlockSize);
+    uint64 childSpan = 1;
+    for (uint32 i = 1; i < depth; ++i)
+        childSpan *= ptrsPerBlock;
+
+    // the subtree is visited once - its pointers block is read with a single access
+    std::vector<uint32> ptrs(ptrsPerBlock);
+    if (!mVFS->ReadDataBlock(blockID, 0, mVFS->mBlockSize, ptrs.data()))
+        return false;
+
+    bool modified = false;
+    for (uint32 i = 0; i < ptrsPerBlock; ++i)
+    {
+        uint64 childStart = treeStart + i * childSpan;
+        if (ptrs[i] == INVALID_INDEX || childStart + childSpan <= keepBlocks)
+            continue;
+
+        bool childWhole;
+        if (!CollectPointerTree(ptrs[i], depth - 1, childStart, keepBlocks, freed, childWhole))
+            return false;
+
+        if (childWhole && !whole)
+        {
+            ptrs[i] = INVALID_INDEX;
+            modified = true;
+        }
+    }
+
+    if (whole)
+        freed.push_back(blockID);
+    else if (modified)
+        return mVFS->WriteDataBlock(blockID, 0, mVFS->mBlockSize, ptrs.data());
+
+    return true;
+}
+
+bool VfsFile::TruncatePointers(uint32 keepBlocks)
+{
+    const uint32 ptrsPerBlock = VFS_PTRS_PER_BLOCK(mVFS->mBlockSize);
+    uint64 span = 1;
+    for (uint32 i = 0; i < mINode.ptrDepth; ++i)
+        span *= ptrsPerBlock;
+
+    std::vector<uint32> freed;
+    bool result = true;
+    for (uint32 i = 0; i < INODE_PTRS && result; ++i)
+    {
+        if (mINode.blockPtr[i] == INVALID_INDEX || (i + 1) * span <= keepBlocks)
+            continue;
+
+        bool whole;
+        result = CollectPointerTree(mINode.blockPtr[i], mINode.ptrDepth, i * span, keepBlocks,
+                                    freed, whole);
+        if (result && whole)
+            mINode.blockPtr[i] = INVALID_INDEX;
+    }
+
+    // the freed blocks are released at once, as runs
+    mVFS->ReleaseBlocks(freed);
+    return result;
+}
+
+bool VfsFile::PromoteInlineData()
+{
+    uint8 data[INODE_INLINE_SIZE];
+    const uint32 size = mINode.size;
+    memcpy(data, mINode.inlineData, size);
+
+    memset(mINode.inlineData, 0, sizeof(mINode.inlineData));
+    mINode.ptrDepth = INODE_EXTENT_MAP;
+    mINode.SetSize(0);
+    if (WriteOffset(size, 0, data) == size)
+        return true;
+
+    // out of space - keep the data inline
+    VFS_ASSERT(ReleaseExtents());
+    mINode.ptrDepth = INODE_INLINE_DATA;
+    mINode.SetSize(size);
+    memcpy(mINode.inlineData, data, size);
+    return false;
+}
+
+bool VfsFile::AppendBlock()
+{
+    // try to grow the last extent
+    uint32 hint = INVALID_INDEX;
+    if (!mNode->extents.empty())
+        hint = mNode->extents.back().start + mNode->extents.back().length;
+
+    uint32 blockId = mVFS->ReserveBlock(hint);
+    if (blockId == INVALID_INDEX)
+    {
+        LOG_DEBUG("No blocks left");
+        return false;
+    }
+
+    return AppendRun(blockId, 1);
+}
+
+bool VfsFile::AppendRun(uint32 start, uint32 length)
+{
+    if (!mNode->extents.empty() && mNode->extents.back().start + mNode->extents.back().length == start)
+    {
+        mNode->extents.back().length += length;
+    }
+    else
+    {
+        // reserve space for the new extent up front, so the map can be always saved
+        if (!ReserveExtentSlots(1))
+        {
+            for (uint32 i = 0; i < length; ++i)
+                mVFS->ReleaseBlock(start + i);
+            return false;
+        }
+
+        Extent extent;
+        extent.start = start;
+        extent.length = length;
+        mNode->extents.push_back(extent);
+        mNode->extentOffsets.push_back(mNode->mappedBlocks);
+    }
+
+    mNode->mappedBlocks += length;
+    mNode->extentsDirty = true;
+    return true;
+}
+
+bool VfsFile::ReserveExtentSlots(size_t count)
+{
+    const size_t extentsPerBlock = VFS_EXTENTS_PER_BLOCK(mVFS->mBlockSize);
+    while (mNode->extents.size() + count >
+           INODE_EXTENTS + mNode->extentBlocks.size() * extentsPerBlock)
+    {
+        uint32 extentBlockId = mVFS->ReserveBlock();
+        if (extentBlockId == INVALID_INDEX)
+        {
+            LOG_DEBUG("No blocks left for the extent map");
+            return false;
+        }
+        mNode->extentBlocks.push_back(extentBlockId);
+    }
+
+    return true;
+}
+
+bool VfsFile::RemapRun(uint32 fileBlock, uint32 count, uint32 newStart)
+{
+    // the extent may be split into three
+    if (!ReserveExtentSlots(2))
+        return false;
+
+    std::vector<Extent>& extents = mNode->extents;
+    size_t extentId = std::upper_bound(mNode->extentOffsets.begin(), mNode->extentOffsets.end(),
+                                       fileBlock) - mNode->extentOffsets.begin() - 1;
+    const Extent extent = extents[extentId];
+    const uint32 head = fileBlock - mNode->extentOffsets[extentId];
+    VFS_ASSERT(head + count <= extent.length);
+
+    Extent pieces[3];
+    size_t piecesNum = 0;
+    if (head > 0)
+        pieces[piecesNum++] = { extent.start, head };
+    pieces[piecesNum++] = { newStart, count };
+    if (head + count < extent.length)
+        pieces[piecesNum++] = { extent.start + head + count, extent.length - head - count };
+
+    extents.erase(extents.begin() + extentId);
+    extents.insert(extents.begin() + extentId, pieces, pieces + piecesNum);
+
+    // merge the new run with its neighbours if they happen to be contiguous
+    size_t last = 0;
+    for (size_t i = 1; i < extents.size(); ++i)
+    {
+        if (extents[last].start + extents[last].length == extents[i].start)
+            extents[last].length += extents[i].length;
+        else
+            extents[++last] = extents[i];
+    }
+    extents.resize(last + 1);
+
+    mNode->extentOffsets.clear();
+    uint32 offset = 0;
+    for (const Extent& e : extents)
+    {
+        mNode->extentOffsets.push_back(offset);
+        offset += e.length;
+    }
+
+    mNode->extentsDirty = true;
+    return true;
+}
+
+uint32 VfsFile::UnshareRun(uint32 fileBlock, uint32 oldStart, uint32& count, bool copy)
+{
+    uint32 reserved;
+    uint32 newStart = mVFS->ReserveBlockRun(count, reserved);
+    if (newStart == INVALID_INDEX)
+    {
+        LOG_DEBUG("No blocks left");
+        return INVALID_INDEX;
+    }
+
+    count = reserved;
+    if (copy)
+    {
+        std::vector<uint8> block(mVFS->mBlockSize);
+        for (uint32 i = 0; i < count; ++i)
+        {
+            if (!mVFS->ReadDataBlock(oldStart + i, 0, mVFS->mBlockSize, block.data()) ||
+                !mVFS->WriteDataBlock(newStart + i, 0, mVFS->mBlockSize, block.data()))
+            {
+                count = 0;
+            }
+        }
+    }
+
+    if (count == 0 || !RemapRun(fileBlock, reserved, newStart))
+    {
+        for (uint32 i = 0; i < reserved; ++i)
+            mVFS->ReleaseBlock(newStart + i);
+        return INVALID_INDEX;
+    }
+
+    // drop this file's references
+    for (uint32 i = 0; i < count; ++i)
+        mVFS->ReleaseBlock(oldStart + i);
+
+    return newStart;
+}
+
+uint32 VfsFile::GetRealBlockRun(uint32 id, uint32 maxRun, bool allocate, uint32& runLength)
+{
+    runLength = 1;
+
+    if (!UsesExtents())
+    {
+        uint32 realBlockId = GetRealBlockID(id, allocate);
+        if (realBlockId == INVALID_INDEX)
+            return INVALID_INDEX;
+
+        // check if the following blocks happen to be contiguous
+        while (runLength < maxRun &&
+               GetRealBlockID(id + runLength, allocate) == realBlockId + runLength)
+            runLength++;
+
+        return realBlockId;
+    }
+
+    if (id >= mNode->mappedBlocks)
+    {
+        if (!allocate)
+            return INVALID_INDEX;
+
+        // extents can't have holes (skipped blocks are cleared in WriteOffset)
+        while (mNode->mappedBlocks <= id)
+        {
+            if (!AppendBlock())
+                return INVALID_INDEX;
+        }
+
+        // allocate the rest of the requested blocks, so they can be transferred at once
+        while (mNode->mappedBlocks < id + maxRun && AppendBlock())
+        {
+        }
+    }
+
+    // find the extent containing the block
+    mVFS->mStats.RecordBlockLookup(VFS_LOOKUP_DEPTHS - 1);
+    size_t extentId = std::upper_bound(mNode->extentOffsets.begin(), mNode->extentOffsets.end(), id) -
+                      mNode->extentOffsets.begin() - 1;
+    const Extent& extent = mNode->extents[extentId];
+    uint32 blockInExtent = id - mNode->extentOffsets[extentId];
+
+    runLength = std::min(maxRun, extent.length - blockInExtent);
+    return extent.start + blockInExtent;
+}
+
+bool VfsFile::InitPointersBlock(uint32 blockID)
+{
+    std::vector<uint32> pointers(VFS_PTRS_PER_BLOCK(mVFS->mBlockSize), INVALID_INDEX);
+    return mVFS->WriteDataBlock(blockID, 0, mVFS->mBlockSize, pointers.data());
 }
 
 bool VfsFile::ExtendPointers()
@@ -37,14 +507,13 @@ bool VfsFile::ExtendPointers()
         return false;
     }
 
-    uint32 offset = VFS_BLOCK_SIZE * (mVFS->mSuperblock.firstDataBlock + pointersBlockId);
-    VFS_ASSERT(fseek(mVFS->mImage, offset, SEEK_SET) == 0);
-
     // copy old indode's pointers to the new pointers block
-    VFS_ASSERT(fwrite(mINode.blockPtr, sizeof(uint32), INODE_PTRS, mVFS->mImage) == INODE_PTRS);
-    // initialize the rest of the pointers with invalid indicies
-    for (uint32 i = INODE_PTRS; i < VFS_PTRS_PER_BLOCK; ++i)
-        VFS_ASSERT(fwrite(&INVALID_INDEX, sizeof(uint32), 1, mVFS->mImage) == 1);
+    // (the rest of the pointers are initialized with invalid indicies)
+    std::vector<uint32> pointers(VFS_PTRS_PER_BLOCK(mVFS->mBlockSize), INVALID_INDEX);
+    for (uint32 i = 0; i < INODE_PTRS; ++i)
+        pointers[i] = mINode.blockPtr[i];
+
+    VFS_ASSERT(mVFS->WriteDataBlock(pointersBlockId, 0, mVFS->mBlockSize, pointers.data()));
 
     // update inode's pointers
     mINode.blockPtr[0] = pointersBlockId;
@@ -58,6 +527,8 @@ bool VfsFile::ExtendPointers()
 uint32 VfsFile::GetRealBlockID(uint32 id, bool allocate)
 {
     VFS_ASSERT(mINode.ptrDepth < 3);
+    mVFS->mStats.RecordBlockLookup(mINode.ptrDepth);
+    const uint32 ptrsPerBlock = VFS_PTRS_PER_BLOCK(mVFS->mBlockSize);
 
     uint32 realBlockId = INVALID_INDEX;
     uint32 offset;
@@ -89,7 +560,7 @@ uint32 VfsFile::GetRealBlockID(uint32 id, bool allocate)
 
     if (mINode.ptrDepth == 1) // we have indirect block pointers
     {
-        if (id >= INODE_PTRS * VFS_PTRS_PER_BLOCK)
+        if (id >= INODE_PTRS * ptrsPerBlock)
         {
             if (!allocate)
                 return INVALID_INDEX;
@@ -99,8 +570,8 @@ uint32 VfsFile::GetRealBlockID(uint32 id, bool allocate)
         }
         else
         {
-            uint32 inodePtrId = id / VFS_PTRS_PER_BLOCK;
-            uint32 blockPtrId = id % VFS_PTRS_PER_BLOCK;
+            uint32 inodePtrId = id / ptrsPerBlock;
+            uint32 blockPtrId = id % ptrsPerBlock;
 
             // reserve block for indirect pointers
             if (mINode.blockPtr[inodePtrId] == INVALID_INDEX && allocate)
@@ -112,24 +583,16 @@ uint32 VfsFile::GetRealBlockID(uint32 id, bool allocate)
                 }
 
                 // initialize allocated pointers block (write invalid indicies)
-                offset = VFS_BLOCK_SIZE * (mVFS->mSuperblock.firstDataBlock +
-                                           mINode.blockPtr[inodePtrId]);
-                VFS_ASSERT(offset < mVFS->mSuperblock.vfsSize);
-                VFS_ASSERT(fseek(mVFS->mImage, offset, SEEK_SET) == 0);
-                for (uint32 i = 0; i < VFS_PTRS_PER_BLOCK; ++i)
-                    VFS_ASSERT(fwrite(&INVALID_INDEX, sizeof(uint32), 1, mVFS->mImage) == 1);
+                VFS_ASSERT(InitPointersBlock(mINode.blockPtr[inodePtrId]));
             }
 
             if (mINode.blockPtr[inodePtrId] == INVALID_INDEX)
                 return INVALID_INDEX;
 
             // read direct pointer from pointers block
-            offset = VFS_BLOCK_SIZE * (mVFS->mSuperblock.firstDataBlock +
-                                       mINode.blockPtr[inodePtrId]);
-            offset += sizeof(uint32) * blockPtrId;
-            VFS_ASSERT(offset < mVFS->mSuperblock.vfsSize);
-            VFS_ASSERT(fseek(mVFS->mImage, offset, SEEK_SET) == 0);
-            VFS_ASSERT(fread(&realBlockId, sizeof(uint32), 1, mVFS->mImage) == 1);
+            offset = sizeof(uint32) * blockPtrId;
+            VFS_ASSERT(mVFS->ReadDataBlock(mINode.blockPtr[inodePtrId], offset,
+                                           sizeof(uint32), &realBlockId));
 
             // reserve data block if not reserved yet
             if (realBlockId == INVALID_INDEX && allocate)
@@ -141,23 +604,24 @@ uint32 VfsFile::GetRealBlockID(uint32 id, bool allocate)
                 }
 
                 // write direct pointer to pointers block
-                VFS_ASSERT(fseek(mVFS->mImage, offset, SEEK_SET) == 0);
-                VFS_ASSERT(fwrite(&realBlockId, sizeof(uint32), 1, mVFS->mImage) == 1);
+                VFS_ASSERT(mVFS->WriteDataBlock(mINode.blockPtr[inodePtrId], offset,
+                                                sizeof(uint32), &realBlockId));
             }
         }
     }
 
     if (mINode.ptrDepth == 2) // we have double-indirect block pointers
     {
-        if (id >= INODE_PTRS * VFS_PTRS_PER_BLOCK * VFS_PTRS_PER_BLOCK)
+        const uint64 ptrsPerPtrBlock = static_cast<uint64>(ptrsPerBlock) * ptrsPerBlock;
+        if (id >= INODE_PTRS * ptrsPerPtrBlock)
             return INVALID_INDEX; // we can't extend pointers further
 
-        uint32 inodePtrId = id / (VFS_PTRS_PER_BLOCK * VFS_PTRS_PER_BLOCK);
-        id -= inodePtrId * (VFS_PTRS_PER_BLOCK * VFS_PTRS_PER_BLOCK);
-        uint32 blockPtrId = id / VFS_PTRS_PER_BLOCK;
-        uint32 secondBlockPtrId = id % VFS_PTRS_PER_BLOCK;
+        uint32 inodePtrId = static_cast<uint32>(id / ptrsPerPtrBlock);
+        id -= static_cast<uint32>(inodePtrId * ptrsPerPtrBlock);
+        uint32 blockPtrId = id / ptrsPerBlock;
+        uint32 secondBlockPtrId = id % ptrsPerBlock;
 
-        VFS_ASSERT(blockPtrId < VFS_PTRS_PER_BLOCK);
+        VFS_ASSERT(blockPtrId < ptrsPerBlock);
         VFS_ASSERT(inodePtrId < INODE_PTRS);
 
         // reserve block for double-indirect pointers
@@ -170,11 +634,7 @@ uint32 VfsFile::GetRealBlockID(uint32 id, bool allocate)
             }
 
             // initialize allocated pointers block (write invalid indicies)
-            offset = VFS_BLOCK_SIZE * (mVFS->mSuperblock.firstDataBlock +
-                                       mINode.blockPtr[inodePtrId]);
-            VFS_ASSERT(fseek(mVFS->mImage, offset, SEEK_SET) == 0);
-            for (uint32 i = 0; i < VFS_PTRS_PER_BLOCK; ++i)
-                VFS_ASSERT(fwrite(&INVALID_INDEX, sizeof(uint32), 1, mVFS->mImage) == 1);
+            VFS_ASSERT(InitPointersBlock(mINode.blockPtr[inodePtrId]));
         }
 
         if (mINode.blockPtr[inodePtrId] == INVALID_INDEX)
@@ -182,11 +642,9 @@ uint32 VfsFile::GetRealBlockID(uint32 id, bool allocate)
 
         // read indirect pointer from pointers block
         uint32 ptrBlockId = INVALID_INDEX;
-        offset = VFS_BLOCK_SIZE * (mVFS->mSuperblock.firstDataBlock + mINode.blockPtr[inodePtrId]);
-        offset += sizeof(uint32) * blockPtrId;
-        VFS_ASSERT(offset < mVFS->mSuperblock.vfsSize);
-        VFS_ASSERT(fseek(mVFS->mImage, offset, SEEK_SET) == 0);
-        VFS_ASSERT(fread(&ptrBlockId, sizeof(uint32), 1, mVFS->mImage) == 1);
+        offset = sizeof(uint32) * blockPtrId;
+        VFS_ASSERT(mVFS->ReadDataBlock(mINode.blockPtr[inodePtrId], offset,
+                                       sizeof(uint32), &ptrBlockId));
 
         // reserve pointers block if not reserved yet
         if (ptrBlockId == INVALID_INDEX && allocate)
@@ -198,25 +656,19 @@ uint32 VfsFile::GetRealBlockID(uint32 id, bool allocate)
             }
 
             // initialize allocated pointers block (write invalid indicies)
-            uint32 offset2 = VFS_BLOCK_SIZE * (mVFS->mSuperblock.firstDataBlock + ptrBlockId);
-            VFS_ASSERT(fseek(mVFS->mImage, offset2, SEEK_SET) == 0);
-            for (uint32 i = 0; i < VFS_PTRS_PER_BLOCK; ++i)
-                VFS_ASSERT(fwrite(&INVALID_INDEX, sizeof(uint32), 1, mVFS->mImage) == 1);
+            VFS_ASSERT(InitPointersBlock(ptrBlockId));
 
             // write indirect pointer to pointers block
-            VFS_ASSERT(fseek(mVFS->mImage, offset, SEEK_SET) == 0);
-            VFS_ASSERT(fwrite(&ptrBlockId, sizeof(uint32), 1, mVFS->mImage) == 1);
+            VFS_ASSERT(mVFS->WriteDataBlock(mINode.blockPtr[inodePtrId], offset,
+                                            sizeof(uint32), &ptrBlockId));
         }
 
         if (ptrBlockId == INVALID_INDEX)
             return INVALID_INDEX;
 
         // read indirect pointer from pointers block
-        offset = VFS_BLOCK_SIZE * (mVFS->mSuperblock.firstDataBlock + ptrBlockId);
-        offset += sizeof(uint32) * secondBlockPtrId;
-        VFS_ASSERT(offset < mVFS->mSuperblock.vfsSize);
-        VFS_ASSERT(fseek(mVFS->mImage, offset, SEEK_SET) == 0);
-        VFS_ASSERT(fread(&realBlockId, sizeof(uint32), 1, mVFS->mImage) == 1);
+        offset = sizeof(uint32) * secondBlockPtrId;
+        VFS_ASSERT(mVFS->ReadDataBlock(ptrBlockId, offset, sizeof(uint32), &realBlockId));
 
         // reserve pointers block if not reserved yet
         if (realBlockId == INVALID_INDEX && allocate)
@@ -228,52 +680,65 @@ uint32 VfsFile::GetRealBlockID(uint32 id, bool allocate)
             }
 
             // write indirect pointer to pointers block
-            VFS_ASSERT(fseek(mVFS->mImage, offset, SEEK_SET) == 0);
-            VFS_ASSERT(fwrite(&realBlockId, sizeof(uint32), 1, mVFS->mImage) == 1);
+            VFS_ASSERT(mVFS->WriteDataBlock(ptrBlockId, offset, sizeof(uint32), &realBlockId));
         }
     }
 
     return realBlockId;
 }
 
-uint32 VfsFile::ReadOffset(uint32 bytes, uint32 offset, void* data)
+uint32 VfsFile::ReadOffset(uint32 bytes, uint64 offset, void* data)
 {
-    if (offset >= mINode.size)
+    const uint64 size = mINode.GetSize();
+    if (offset >= size)
         return 0;
 
-    if (offset + bytes > mINode.size)
-        bytes = mINode.size - offset;
+    if (offset + bytes > size)
+        bytes = static_cast<uint32>(size - offset);
 
     if (bytes == 0)
         return 0;
 
+    if (UsesInlineData())
+    {
+        memcpy(data, mINode.inlineData + offset, bytes);
+        return bytes;
+    }
+
+    const uint32 blockSize = mVFS->mBlockSize;
+    const uint32 blockShift = mVFS->mBlockShift;
+    const uint32 blockMask = mVFS->mBlockMask;
+
     uint32 read = 0;
-    uint32 firstBlockId = offset / VFS_BLOCK_SIZE;
-    uint32 lastBlockId = (offset + bytes - 1) / VFS_BLOCK_SIZE;
+    uint32 lastBlockId = static_cast<uint32>((offset + bytes - 1) >> blockShift);
     char* dataPtr = (char*)data;
 
-    for (uint32 i = firstBlockId; i <= lastBlockId; ++i)
+    while (read < bytes)
     {
-        uint32 blockID = GetRealBlockID(i, false);
+        uint32 blockIndex = static_cast<uint32>((offset + read) >> blockShift);
+        uint32 runLength;
+        uint32 blockID = GetRealBlockRun(blockIndex, lastBlockId - blockIndex + 1, false,
+                                         runLength);
         if (blockID == INVALID_INDEX)
             break;
 
-        // calculate VFS read offset (in bytes)
-        uint32 vfsOffset = VFS_BLOCK_SIZE * (mVFS->mSuperblock.firstDataBlock + blockID);
+        // calculate offset inside the block (in bytes)
+        uint32 interBlockOffset = static_cast<uint32>(offset + read) & blockMask;
+        uint32 toRead;
 
-        // calculate number of bytes to read
-        uint32 toRead = VFS_BLOCK_SIZE;
-        if (i == firstBlockId)
+        if (interBlockOffset == 0 && bytes - read >= blockSize)
         {
-            uint32 interBlockOffset = offset - VFS_BLOCK_SIZE * (offset / VFS_BLOCK_SIZE);
-            vfsOffset += interBlockOffset;
-            toRead = VFS_BLOCK_SIZE - interBlockOffset;
+            // whole blocks - read the entire contiguous run directly into the target buffer
+            uint32 blocks = std::min(runLength, (bytes - read) >> blockShift);
+            toRead = blocks << blockShift;
+            VFS_ASSERT(mVFS->ReadDataBlocks(blockID, blocks, dataPtr));
+        }
+        else
+        {
+            toRead = std::min(blockSize - interBlockOffset, bytes - read);
+            VFS_ASSERT(mVFS->ReadDataBlock(blockID, interBlockOffset, toRead, dataPtr));
         }
 
-        toRead = std::min(toRead, bytes - read);
-
-        VFS_ASSERT(fseek(mVFS->mImage, vfsOffset, SEEK_SET) == 0);
-        VFS_ASSERT(fread(dataPtr, toRead, 1, mVFS->mImage) == 1);
         dataPtr += toRead;
         read += toRead;
     }
@@ -281,133 +746,1396 @@ uint32 VfsFile::ReadOffset(uint32 bytes, uint32 offset, void* data)
     return read;
 }
 
-uint32 VfsFile::WriteOffset(uint32 bytes, uint32 offset, const void* data)
+uint32 VfsFile::WriteOffset(uint32 bytes, uint64 offset, const void* data, bool accepted)
 {
     if (bytes == 0)
         return 0;
 
-    if (mReadOnly)
+    if (mReadOnly && !accepted)
     {
         LOG_DEBUG("Trying to write read-only file");
         return 0;
     }
 
+    const uint64 maxSize = mVFS->GetMaxFileSize();
+    if (offset >= maxSize)
+    {
+        LOG_DEBUG("File size limit reached");
+        return 0;
+    }
+
+    if (offset + bytes > maxSize)
+        bytes = static_cast<uint32>(maxSize - offset);
+
+    if (UsesInlineData())
+    {
+        if (offset + bytes <= INODE_INLINE_SIZE)
+        {
+            // the bytes past the file end are always zeroed
+            memcpy(mINode.inlineData + offset, data, bytes);
+            mINode.SetSize(std::max<uint64>(mINode.size, offset + bytes));
+            return bytes;
+        }
+
+        if (!PromoteInlineData())
+        {
+            LOG_DEBUG("No blocks left");
+            return 0;
+        }
+    }
+
+    const uint32 blockSize = mVFS->mBlockSize;
+    const uint32 blockShift = mVFS->mBlockShift;
+    const uint32 blockMask = mVFS->mBlockMask;
+
+    // writing past the file end - clear the gap, it may contain stale data of preallocated blocks
+    // (up to the block boundary first, so the rest is written as whole blocks, bypassing the cache
+    // and the journal)
+    if (mINode.GetSize() < offset)
+    {
+        const std::vector<uint8> zeros(blockSize, 0);
+        while (mINode.GetSize() < offset)
+        {
+            uint64 size = mINode.GetSize();
+            uint32 toBoundary = blockSize - (static_cast<uint32>(size) & blockMask);
+            uint32 gap = static_cast<uint32>(std::min<uint64>(offset - size, toBoundary));
+            if (WriteOffset(gap, size, zeros.data(), accepted) != gap)
+                return 0;
+        }
+    }
+
+    // journaled metadata must not bypass the cache
+    const bool direct = !mVFS->mJournal.IsEnabled() ||
+                        (mINode.type == INodeType::File && !mMetadata);
+
     uint32 written = 0;
-    uint32 firstBlockId = offset / VFS_BLOCK_SIZE;
-    uint32 lastBlockId = (offset + bytes - 1) / VFS_BLOCK_SIZE;
+    uint32 lastBlockId = static_cast<uint32>((offset + bytes - 1) >> blockShift);
     const char* dataPtr = (const char*)data;
 
-    for (uint32 i = firstBlockId; i <= lastBlockId; ++i)
+    while (written < bytes)
     {
-        uint32 blockID = GetRealBlockID(i, true);
+        uint32 blockIndex = static_cast<uint32>((offset + written) >> blockShift);
+        uint32 runLength;
+        uint32 blockID = GetRealBlockRun(blockIndex, lastBlockId - blockIndex + 1, true,
+                                         runLength);
         if (blockID == INVALID_INDEX)
             break;
 
-        // calculate VFS write offset (in bytes)
-        uint32 vfsOffset = VFS_BLOCK_SIZE * (mVFS->mSuperblock.firstDataBlock + blockID);
+        // calculate offset inside the block (in bytes)
+        uint32 interBlockOffset = static_cast<uint32>(offset + written) & blockMask;
+        const bool whole = direct && interBlockOffset == 0 && bytes - written >= blockSize;
+        uint32 blocks = whole ? std::min(runLength, (bytes - written) >> blockShift) : 1;
+        uint32 toWrite = std::min(blockSize - interBlockOffset, bytes - written);
 
-        // calculate number of bytes to write
-        uint32 toWrite = VFS_BLOCK_SIZE;
-        if (i == firstBlockId)
+        // blocks shared with cloned files are moved before they are modified
+        if (UsesExtents())
         {
-            uint32 interBlockOffset = offset - VFS_BLOCK_SIZE * (offset / VFS_BLOCK_SIZE);
-            vfsOffset += interBlockOffset;
-            toWrite = VFS_BLOCK_SIZE - interBlockOffset;
+            bool shared;
+            blocks = mVFS->GetSharedRun(blockID, blocks, shared);
+            if (shared)
+            {
+                blockID = UnshareRun(blockIndex, blockID, blocks, !whole && toWrite < blockSize);
+                if (blockID == INVALID_INDEX)
+                    break;
+            }
         }
 
-        toWrite = std::min(toWrite, bytes - written);
+        if (whole)
+        {
+            // whole blocks - write the entire contiguous run directly from the source buffer
+            toWrite = blocks << blockShift;
+            VFS_ASSERT(mVFS->WriteDataBlocks(blockID, blocks, dataPtr));
+        }
+        else
+        {
+            VFS_ASSERT(mVFS->WriteDataBlock(blockID, interBlockOffset, toWrite, dataPtr));
+        }
 
-        VFS_ASSERT(fseek(mVFS->mImage, vfsOffset, SEEK_SET) == 0);
-        VFS_ASSERT(fwrite(dataPtr, toWrite, 1, mVFS->mImage) == 1);
         dataPtr += toWrite;
         written += toWrite;
 
         // update file size
-        mINode.size = std::max(mINode.size, offset + written);
+        mINode.SetSize(std::max(mINode.GetSize(), offset + written));
     }
 
     return written;
 }
 
-bool VfsFile::Remove()
+bool VfsFile::RemapPointerTree(uint32 blockID, uint32 depth, uint64 treeStart, uint32 newStart)
 {
-    if (mINode.type == INodeType::Directory && mINode.usage != 0)
-    {
-        LOG_DEBUG("Directory is not empty");
+    const uint32 ptrsPerBlock = VFS_PTRS_PER_BLOCK(mVFS->mBlockSize);
+    uint64 childSpan = 1;
+    for (uint32 i = 1; i < depth; ++i)
+        childSpan *= ptrsPerBlock;
+
+    std::vector<uint32> ptrs(ptrsPerBlock);
+    if (!mVFS->ReadDataBlock(blockID, 0, mVFS->mBlockSize, ptrs.data()))
         return false;
-    }
 
-    // TODO: support for pointers depth > 0
-    for (uint32 i = 0; i < INODE_PTRS; ++i)
+    for (uint32 i = 0; i < ptrsPerBlock; ++i)
     {
-        if (mINode.blockPtr[i] != INVALID_INDEX)
-        {
-            mVFS->ReleaseBlock(mINode.blockPtr[i]);
-            mINode.blockPtr[i] = INVALID_INDEX;
-        }
+        if (ptrs[i] == INVALID_INDEX)
+            continue;
+
+        uint64 childStart = treeStart + i * childSpan;
+        if (depth == 1)
+            ptrs[i] = newStart + static_cast<uint32>(childStart);
+        else if (!RemapPointerTree(ptrs[i], depth - 1, childStart, newStart))
+            return false;
     }
 
-    return true;
+    if (depth > 1)
+        return true;
+
+    return mVFS->WriteDataBlock(blockID, 0, mVFS->mBlockSize, ptrs.data());
 }
 
-bool VfsFile::RemoveDirectoryEntry(uint32 inodeID)
+bool VfsFile::Relocate(uint64 budget, uint64& moved)
 {
-    VFS_ASSERT(mINode.type == INodeType::Directory);
+    moved = 0;
+    if (UsesInlineData())
+        return true;
 
-    bool found = false;
-    for (uint32 i = 0; i < mINode.usage; ++i)
+    // data blocks in the file order
+    std::vector<uint32> blocks;
+    if (UsesExtents())
     {
-        Directory dirEntry;
-        Read(sizeof(Directory), &dirEntry);
+        if (mNode->extents.size() <= 1)
+            return true;
 
-        // swap with last element - fast O(1) removal
-        if (dirEntry.inodeID == inodeID)
+        for (const Extent& extent : mNode->extents)
         {
-            if ((mINode.usage > 1) && (i < mINode.usage - 1))
-            {
-                ReadOffset(sizeof(Directory), (mINode.usage - 1) * sizeof(Directory), &dirEntry);
-                WriteOffset(sizeof(Directory), i * sizeof(Directory), &dirEntry);
-            }
-            found = true;
-            break;
+            // moving shared blocks would make copies of them
+            bool shared;
+            if (mVFS->GetSharedRun(extent.start, extent.length, shared) < extent.length ||
+                shared)
+                return true;
+
+            for (uint32 i = 0; i < extent.length; ++i)
+                blocks.push_back(extent.start + i);
         }
     }
+    else
+    {
+        VfsFileUsage usage;
+        uint32 lastBlock = INVALID_INDEX;
+        for (uint32 i = 0; i < INODE_PTRS; ++i)
+        {
+            if (mINode.blockPtr[i] != INVALID_INDEX &&
+                !CountPointerTree(mINode.blockPtr[i], mINode.ptrDepth, lastBlock, usage))
+                return true;
+        }
 
-    if (found)
-        mINode.usage--;
+        if (usage.fragments <= 1)
+            return true;
 
-    return found;
-}
+        // the tree is remapped to consecutive blocks, so files with holes (written by older
+        // versions past the file end) are left as they are
+        for (uint32 i = 0; i < usage.blocks; ++i)
+        {
+            uint32 blockID = GetRealBlockID(i, false);
+            if (blockID == INVALID_INDEX)
+                return true;
+            blocks.push_back(blockID);
+        }
+    }
 
-bool VfsFile::AddDirectoryEntry(const Directory& dir)
-{
-    VFS_ASSERT(mINode.type == INodeType::Directory);
+    const uint32 count = static_cast<uint32>(blocks.size());
+    const uint64 bytes = static_cast<uint64>(count) << mVFS->mBlockShift;
+    if (bytes > budget)
+        return false;
 
-    if (WriteOffset(sizeof(Directory), mINode.usage * sizeof(Directory), &dir)
-        != sizeof(Directory))
+    // there is no point in moving the file if it doesn't fit in a single free run
+    uint32 reserved;
+    uint32 newStart = mVFS->ReserveBlockRun(count, reserved);
+    if (newStart == INVALID_INDEX)
+        return true;
+
+    if (reserved < count)
     {
-        return false;
+        mVFS->ReleaseBlockRun(newStart, reserved);
+        return true;
     }
 
-    mINode.usage++;
-    return true;
-}
+    // copy contiguous runs of the old blocks in chunks
+    const uint32 chunkBlocks = 256;
+    std::vector<uint8> buffer(static_cast<size_t>(chunkBlocks) << mVFS->mBlockShift);
+    for (uint32 i = 0; i < count; )
+    {
+        uint32 length = 1;
+        while (length < chunkBlocks && i + length < count && blocks[i + length] == blocks[i] + length)
+            length++;
 
-uint32 VfsFile::Read(uint32 bytes, void* data)
-{
-    uint32 bytesRead = ReadOffset(bytes, mCursor, data);
-    mCursor += bytesRead;
-    return bytesRead;
+        VFS_ASSERT(mVFS->ReadDataBlocks(blocks[i], length, buffer.data()));
+        VFS_ASSERT(mVFS->WriteDataBlocks(newStart + i, length, buffer.data()));
+        i += length;
+    }
+
+    if (UsesExtents())
+    {
+        Extent extent;
+        extent.start = newStart;
+        extent.length = count;
+        mNode->extents.assign(1, extent);
+        mNode->extentOffsets.assign(1, 0);
+        VFS_ASSERT(SaveExtents());
+    }
+    else
+    {
+        const uint32 ptrsPerBlock = VFS_PTRS_PER_BLOCK(mVFS->mBlockSize);
+        uint64 span = 1;
+        for (uint32 i = 0; i < mINode.ptrDepth; ++i)
+            span *= ptrsPerBlock;
+
+        for (uint32 i = 0; i < INODE_PTRS; ++i)
+        {
+            if (mINode.blockPtr[i] == INVALID_INDEX)
+                continue;
+
+            if (mINode.ptrDepth == 0)
+                mINode.blockPtr[i] = newStart + i;
+            else
+                VFS_ASSERT(RemapPointerTree(mINode.blockPtr[i], mINode.ptrDepth, i * span,
+                                            newStart));
+        }
+    }
+
+    mVFS->ReleaseBlocks(blocks);
+    moved = bytes;
+    return true;
+}
+
+bool VfsFile::CloneFrom(VfsFile& source)
+{
+    ExclusiveLock lock(mNode->lock);
+    SharedLock sourceLock(source.mNode->lock);
+
+    if (source.UsesInlineData())
+    {
+        memcpy(mINode.inlineData, source.mINode.inlineData, sizeof(mINode.inlineData));
+        mINode.ptrDepth = INODE_INLINE_DATA;
+        mINode.SetSize(source.mINode.GetSize());
+        return true;
+    }
+
+    if (!source.UsesExtents())
+    {
+        // empty files of old images have no blocks to share
+        if (source.mINode.GetSize() == 0)
+            return true;
+
+        LOG_ERROR("Files using block pointers can't be cloned");
+        return false;
+    }
+
+    mINode.ptrDepth = INODE_EXTENT_MAP;
+    mNode->extents = source.mNode->extents;
+    mNode->extentOffsets = source.mNode->extentOffsets;
+    mNode->mappedBlocks = source.mNode->mappedBlocks;
+    mNode->extentBlocks.clear();
+    if (!SaveExtents())
+    {
+        mNode->extents.clear();
+        mNode->extentOffsets.clear();
+        mNode->mappedBlocks = 0;
+        return false;
+    }
+
+    mVFS->ShareBlocks(mNode->extents);
+    mINode.SetSize(source.mINode.GetSize());
+    return true;
+}
+
+bool VfsFile::Remove()
+{
+    ExclusiveLock lock(mNode->lock);
+    WaitForAsyncReads();
+
+    if (mINode.type == INodeType::Directory && mINode.usage != 0)
+    {
+        LOG_DEBUG("Directory is not empty");
+        return false;
+    }
+
+    DropIndex();
+    mNode->writeBuffer.clear();
+
+    if (UsesInlineData())
+    {
+        memset(mINode.inlineData, 0, sizeof(mINode.inlineData));
+        return true;
+    }
+
+    if (UsesExtents())
+        return ReleaseExtents();
+
+    return TruncatePointers(0);
+}
+
+uint32 VfsFile::HashName(const char* name)
+{
+    // 32-bit FNV-1a
+    uint32 hash = 2166136261u;
+    for (; *name != '\0'; ++name)
+    {
+        hash ^= static_cast<uint8>(*name);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// size of a compact directory entry with the given name
+static uint32 CompactEntryLength(uint32 nameLength)
+{
+    uint32 length = static_cast<uint32>(sizeof(DirEntryHeader)) + nameLength;
+    return CeilDivide<uint32>(length, DIR_ENTRY_ALIGNMENT) * DIR_ENTRY_ALIGNMENT;
+}
+
+// get offset at which a compact entry can be appended (entries don't cross chunk boundaries)
+static uint32 PlaceCompactEntry(uint32 size, uint32 entryLength)
+{
+    uint32 left = DIR_ENTRY_CHUNK - size % DIR_ENTRY_CHUNK;
+    return entryLength <= left ? size : size + left;
+}
+
+/**
+ * Walk compact entries stored in a directory chunk.
+ * @param func Called for each entry (including removed ones) with the entry offset inside the
+ *             chunk, its header and name. Returns false to stop.
+ * @return False if the chunk is corrupted
+ */
+template<typename Func>
+static bool ParseCompactEntries(const uint8* block, uint32 bytes, Func func)
+{
+    for (uint32 offset = 0; offset + sizeof(DirEntryHeader) <= bytes; )
+    {
+        DirEntryHeader header;
+        memcpy(&header, block + offset, sizeof(header));
+        if (header.entryLength < sizeof(header) || offset + header.entryLength > bytes ||
+            sizeof(header) + header.nameLength > header.entryLength)
+        {
+            LOG_ERROR("Corrupted directory entry");
+            return false;
+        }
+
+        if (!func(offset, header, reinterpret_cast<const char*>(block + offset + sizeof(header))))
+            return true;
+
+        offset += header.entryLength;
+    }
+
+    return true;
+}
+
+bool VfsFile::UsesCompactEntries() const
+{
+    return mVFS->mSuperblock.version >= VFS_VERSION_COMPACT_DIRS;
+}
+
+bool VfsFile::ForEachEntry(const EntryCallback& callback)
+{
+    // the entries are read in batches growing up to the read-ahead limit, so long scans take
+    // few image accesses and the short ones (stopped early) don't read the whole directory
+    const uint32 maxBatch = std::max<uint32>(VFS_READ_AHEAD_MAX, DIR_ENTRY_CHUNK);
+    if (UsesCompactEntries())
+    {
+        std::vector<uint8> batch(std::min<uint32>(maxBatch, mINode.size));
+        uint32 batchSize = DIR_ENTRY_CHUNK;
+        bool stop = false;
+        for (uint32 batchStart = 0; batchStart < mINode.size && !stop;
+             batchStart += batchSize, batchSize = std::min(2 * batchSize, maxBatch))
+        {
+            uint32 batchBytes = std::min(batchSize, mINode.size - batchStart);
+            if (ReadOffset(batchBytes, batchStart, batch.data()) != batchBytes)
+                return false;
+
+            for (uint32 chunkStart = 0; chunkStart < batchBytes && !stop;
+                 chunkStart += DIR_ENTRY_CHUNK)
+            {
+                uint32 blockStart = batchStart + chunkStart;
+                uint32 bytes = std::min<uint32>(DIR_ENTRY_CHUNK, batchBytes - chunkStart);
+
+                auto func = [&](uint32 offset, const DirEntryHeader& header, const char* name)
+                {
+                    if (header.inodeID == INVALID_INDEX)
+                        return true;
+
+                    Directory entry;
+                    entry.inodeID = header.inodeID;
+                    memcpy(entry.name, name, header.nameLength);
+                    stop = !callback(blockStart + offset, entry, header.hash);
+                    return !stop;
+                };
+
+                if (!ParseCompactEntries(&batch[chunkStart], bytes, func))
+                    return false;
+            }
+        }
+
+        return true;
+    }
+
+    const uint32 perBlock = mVFS->mBlockSize / sizeof(Directory);
+    const uint32 maxEntries = std::max<uint32>(maxBatch / sizeof(Directory), perBlock);
+    std::vector<Directory> entries(std::min(maxEntries, mINode.usage));
+    uint32 batchEntries = perBlock;
+    for (uint32 i = 0; i < mINode.usage;
+         i += batchEntries, batchEntries = std::min(2 * batchEntries, maxEntries))
+    {
+        uint32 count = std::min(batchEntries, mINode.usage - i);
+        uint32 bytes = count * sizeof(Directory);
+        if (ReadOffset(bytes, i * sizeof(Directory), entries.data()) != bytes)
+            return false;
+
+        for (uint32 j = 0; j < count; ++j)
+            if (!callback(i + j, entries[j], HashName(entries[j].name)))
+                return true;
+    }
+
+    return true;
+}
+
+bool VfsFile::ReadEntry(uint32 position, Directory& entry)
+{
+    if (!UsesCompactEntries())
+    {
+        return ReadOffset(sizeof(Directory), position * sizeof(Directory), &entry) ==
+               sizeof(Directory);
+    }
+
+    uint8 data[sizeof(DirEntryHeader) + VFS_MAX_NAME_LENGTH];
+    uint32 bytes = ReadOffset(sizeof(data), position, data);
+    if (bytes < sizeof(DirEntryHeader))
+        return false;
+
+    DirEntryHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (header.inodeID == INVALID_INDEX || sizeof(header) + header.nameLength > bytes)
+        return false;
+
+    entry = Directory();
+    entry.inodeID = header.inodeID;
+    memcpy(entry.name, data + sizeof(header), header.nameLength);
+    return true;
+}
+
+uint32 VfsFile::FindEntry(const char* name, Directory& entry)
+{
+    if (mINode.type != INodeType::Directory)
+        return INVALID_INDEX;
+
+    uint32 hash = HashName(name);
+    if (mINode.dirIndex != INVALID_INDEX)
+    {
+        VfsFile index(mVFS, mINode.dirIndex, true);
+        uint32 mask = index.mINode.size / sizeof(DirIndexSlot) - 1;
+
+        // the index is never full, so there is always an empty slot terminating the search
+        for (uint32 pos = hash & mask; ; pos = (pos + 1) & mask)
+        {
+            DirIndexSlot slot;
+            if (index.ReadOffset(sizeof(slot), pos * sizeof(slot), &slot) != sizeof(slot))
+                return INVALID_INDEX;
+            if (slot.entry == INVALID_INDEX)
+                return INVALID_INDEX;
+
+            if (slot.hash == hash && ReadEntry(slot.entry, entry) &&
+                strcmp(entry.name, name) == 0)
+                return slot.entry;
+        }
+    }
+
+    // no index - scan all the entries
+    uint32 found = INVALID_INDEX;
+    ForEachEntry([&](uint32 position, const Directory& dirEntry, uint32 entryHash)
+    {
+        if (entryHash != hash || strcmp(dirEntry.name, name) != 0)
+            return true;
+
+        entry = dirEntry;
+        found = position;
+        return false;
+    });
+
+    return found;
+}
+
+bool VfsFile::BuildIndex(uint32 slotsNum)
+{
+    if (mINode.dirIndex == INVALID_INDEX)
+    {
+        uint32 indexID = mVFS->ReserveINode();
+        if (indexID == INVALID_INDEX)
+        {
+            LOG_DEBUG("Failed to reserve inode for directory index");
+            return false;
+        }
+
+        INode inode;
+        mVFS->InitINode(inode, INodeType::File);
+        mVFS->WriteINode(indexID, inode);
+        mINode.dirIndex = indexID;
+    }
+
+    DirIndexSlot emptySlot;
+    emptySlot.hash = 0;
+    emptySlot.entry = INVALID_INDEX;
+    std::vector<DirIndexSlot> slots(slotsNum, emptySlot);
+    const uint32 mask = slotsNum - 1;
+
+    bool result = ForEachEntry([&](uint32 position, const Directory&, uint32 hash)
+    {
+        uint32 pos = hash & mask;
+        while (slots[pos].entry != INVALID_INDEX)
+            pos = (pos + 1) & mask;
+
+        slots[pos].hash = hash;
+        slots[pos].entry = position;
+        return true;
+    });
+
+    if (!result)
+        return false;
+
+    VfsFile index(mVFS, mINode.dirIndex);
+    index.mMetadata = true;
+    uint32 bytes = slotsNum * sizeof(DirIndexSlot);
+    return index.WriteOffset(bytes, 0, slots.data()) == bytes;
+}
+
+void VfsFile::DropIndex()
+{
+    if (mINode.dirIndex == INVALID_INDEX)
+        return;
+
+    {
+        VfsFile index(mVFS, mINode.dirIndex);
+        VFS_ASSERT(index.Remove());
+    }
+
+    mVFS->ReleaseINode(mINode.dirIndex);
+    mINode.dirIndex = INVALID_INDEX;
+}
+
+uint32 VfsFile::FindIndexSlot(VfsFile& index, uint32 hash, uint32 entry)
+{
+    uint32 mask = index.mINode.size / sizeof(DirIndexSlot) - 1;
+    for (uint32 pos = hash & mask; ; pos = (pos + 1) & mask)
+    {
+        DirIndexSlot slot;
+        if (index.ReadOffset(sizeof(slot), pos * sizeof(slot), &slot) != sizeof(slot))
+            return INVALID_INDEX;
+        if (slot.entry == INVALID_INDEX)
+            return INVALID_INDEX;
+        if (slot.hash == hash && slot.entry == entry)
+            return pos;
+    }
+}
+
+bool VfsFile::IndexInsert(VfsFile& index, uint32 hash, uint32 entry)
+{
+    uint32 mask = index.mINode.size / sizeof(DirIndexSlot) - 1;
+    for (uint32 pos = hash & mask; ; pos = (pos + 1) & mask)
+    {
+        DirIndexSlot slot;
+        if (index.ReadOffset(sizeof(slot), pos * sizeof(slot), &slot) != sizeof(slot))
+            return false;
+
+        if (slot.entry == INVALID_INDEX)
+        {
+            slot.hash = hash;
+            slot.entry = entry;
+            return index.WriteOffset(sizeof(slot), pos * sizeof(slot), &slot) == sizeof(slot);
+        }
+    }
+}
+
+bool VfsFile::IndexRemove(VfsFile& index, uint32 hash, uint32 entry)
+{
+    uint32 pos = FindIndexSlot(index, hash, entry);
+    if (pos == INVALID_INDEX)
+        return false;
+
+    // move the following slots of the probe sequence back, so no tombstones are needed
+    uint32 mask = index.mINode.size / sizeof(DirIndexSlot) - 1;
+    DirIndexSlot slot;
+    for (uint32 next = (pos + 1) & mask; ; next = (next + 1) & mask)
+    {
+        if (index.ReadOffset(sizeof(slot), next * sizeof(slot), &slot) != sizeof(slot))
+            return false;
+        if (slot.entry == INVALID_INDEX)
+            break;
+
+        // the slot must stay if its home position lies cyclically in (pos, next]
+        uint32 home = slot.hash & mask;
+        bool stays = (pos < next) ? (home > pos && home <= next) : (home > pos || home <= next);
+        if (!stays)
+        {
+            if (index.WriteOffset(sizeof(slot), pos * sizeof(slot), &slot) != sizeof(slot))
+                return false;
+            pos = next;
+        }
+    }
+
+    slot.hash = 0;
+    slot.entry = INVALID_INDEX;
+    return index.WriteOffset(sizeof(slot), pos * sizeof(slot), &slot) == sizeof(slot);
+}
+
+bool VfsFile::IndexUpdate(VfsFile& index, uint32 hash, uint32 entry, uint32 newEntry)
+{
+    uint32 pos = FindIndexSlot(index, hash, entry);
+    if (pos == INVALID_INDEX)
+        return false;
+
+    DirIndexSlot slot;
+    slot.hash = hash;
+    slot.entry = newEntry;
+    return index.WriteOffset(sizeof(slot), pos * sizeof(slot), &slot) == sizeof(slot);
+}
+
+bool VfsFile::CompactEntries()
+{
+    std::vector<uint8> oldData(mINode.size);
+    if (ReadOffset(mINode.size, 0, oldData.data()) != mINode.size)
+        return false;
+
+    // pack the remaining entries, keeping them inside chunk boundaries
+    std::vector<uint8> newData;
+    for (uint32 blockStart = 0; blockStart < mINode.size; blockStart += DIR_ENTRY_CHUNK)
+    {
+        uint32 bytes = std::min<uint32>(DIR_ENTRY_CHUNK, mINode.size - blockStart);
+        auto func = [&](uint32 offset, const DirEntryHeader& header, const char*)
+        {
+            if (header.inodeID == INVALID_INDEX)
+                return true;
+
+            uint32 entryLength = header.entryLength;
+            uint32 position = PlaceCompactEntry(static_cast<uint32>(newData.size()),
+                                                entryLength);
+            if (position - newData.size() >= sizeof(DirEntryHeader))
+            {
+                DirEntryHeader padding;
+                memset(&padding, 0, sizeof(padding));
+                padding.inodeID = INVALID_INDEX;
+                padding.entryLength = static_cast<uint16>(position - newData.size());
+                newData.insert(newData.end(), reinterpret_cast<const uint8*>(&padding),
+                               reinterpret_cast<const uint8*>(&padding + 1));
+            }
+
+            newData.resize(position);
+            const uint8* entry = &oldData[blockStart + offset];
+            newData.insert(newData.end(), entry, entry + entryLength);
+            return true;
+        };
+
+        if (!ParseCompactEntries(&oldData[blockStart], bytes, func))
+            return false;
+    }
+
+    uint32 newSize = static_cast<uint32>(newData.size());
+    if (WriteOffset(newSize, 0, newData.data()) != newSize)
+        return false;
+
+    // the blocks past the end are kept and reused by the following entries
+    mINode.size = newSize;
+    mINode.dirFreeBytes = 0;
+
+    // entries were moved
+    if (mINode.dirIndex != INVALID_INDEX)
+    {
+        uint32 slotsNum;
+        {
+            VfsFile index(mVFS, mINode.dirIndex, true);
+            slotsNum = index.mINode.size / sizeof(DirIndexSlot);
+        }
+
+        if (!BuildIndex(slotsNum))
+        {
+            LOG_DEBUG("Failed to rebuild directory index");
+            DropIndex();
+        }
+    }
+
+    return true;
+}
+
+uint32 VfsFile::FindDirectoryEntry(const char* name, Directory& entry)
+{
+    SharedLock lock(mNode->lock);
+    return FindEntry(name, entry);
+}
+
+bool VfsFile::ForEachDirectoryEntry(const EntryCallback& callback)
+{
+    SharedLock lock(mNode->lock);
+    if (mINode.type != INodeType::Directory)
+        return false;
+
+    return ForEachEntry(callback);
+}
+
+bool VfsFile::RemoveEntry(const char* name, VfsFile* index)
+{
+    Directory dirEntry;
+    uint32 id = FindEntry(name, dirEntry);
+    if (id == INVALID_INDEX)
+        return false;
+
+    if (UsesCompactEntries())
+    {
+        // mark the entry as removed, the space is reclaimed when the directory is compacted
+        uint32 removed = INVALID_INDEX;
+        if (WriteOffset(sizeof(removed), id, &removed) != sizeof(removed))
+            return false;
+
+        if (index)
+            VFS_ASSERT(IndexRemove(*index, HashName(name), id));
+
+        mINode.usage--;
+        mINode.dirFreeBytes += CompactEntryLength(static_cast<uint32>(strlen(name)));
+        return true;
+    }
+
+    // swap with last element - fast O(1) removal
+    uint32 lastId = mINode.usage - 1;
+    Directory lastEntry;
+    if (id < lastId)
+        ReadOffset(sizeof(Directory), lastId * sizeof(Directory), &lastEntry);
+
+    if (index)
+    {
+        VFS_ASSERT(IndexRemove(*index, HashName(name), id));
+        if (id < lastId)
+            VFS_ASSERT(IndexUpdate(*index, HashName(lastEntry.name), lastId, id));
+    }
+
+    if (id < lastId)
+        WriteOffset(sizeof(Directory), id * sizeof(Directory), &lastEntry);
+
+    mINode.usage--;
+    return true;
+}
+
+bool VfsFile::RemoveDirectoryEntry(const char* name)
+{
+    std::vector<const char*> names(1, name);
+    std::vector<bool> removed;
+    return RemoveDirectoryEntries(names, removed) == 1;
+}
+
+uint32 VfsFile::RemoveDirectoryEntries(const std::vector<const char*>& names,
+                                       std::vector<bool>& removed)
+{
+    ExclusiveLock lock(mNode->lock);
+    WaitForAsyncReads();
+    VFS_ASSERT(mINode.type == INodeType::Directory);
+
+    std::unique_ptr<VfsFile> index;
+    if (mINode.dirIndex != INVALID_INDEX)
+        index.reset(new VfsFile(mVFS, mINode.dirIndex));
+
+    uint32 removedNum = 0;
+    removed.assign(names.size(), false);
+    for (size_t i = 0; i < names.size(); ++i)
+    {
+        removed[i] = RemoveEntry(names[i], index.get());
+        if (removed[i])
+            removedNum++;
+    }
+
+    index.reset();
+    if (UsesCompactEntries() && 2 * mINode.dirFreeBytes > mINode.size)
+        VFS_ASSERT(CompactEntries());
+
+    return removedNum;
+}
+
+bool VfsFile::AddDirectoryEntry(const Directory& dir, INodeType type)
+{
+    std::vector<Directory> entries(1, dir);
+    std::vector<bool> added;
+    return AddDirectoryEntries(entries, type, added) == 1;
+}
+
+uint32 VfsFile::AddDirectoryEntries(const std::vector<Directory>& entries, INodeType type,
+                                    std::vector<bool>& added)
+{
+    ExclusiveLock lock(mNode->lock);
+    WaitForAsyncReads();
+    VFS_ASSERT(mINode.type == INodeType::Directory);
+
+    // skip names that already exist (a single scan is enough if there is no index)
+    std::unordered_set<std::string> names;
+    const bool scanned = (mINode.dirIndex == INVALID_INDEX && entries.size() > 1);
+    if (scanned)
+    {
+        ForEachEntry([&names](uint32, const Directory& entry, uint32)
+        {
+            names.insert(entry.name);
+            return true;
+        });
+    }
+
+    added.assign(entries.size(), false);
+    std::vector<uint32> positions;
+    std::vector<uint32> hashes;
+    std::vector<uint8> data;
+    const bool compact = UsesCompactEntries();
+    const uint32 firstPosition = compact ? mINode.size : mINode.usage * sizeof(Directory);
+
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        const Directory& dir = entries[i];
+        Directory existing;
+        if (!scanned && FindEntry(dir.name, existing) != INVALID_INDEX)
+        {
+            LOG_DEBUG("Directory entry '" << dir.name << "' already exists");
+            continue;
+        }
+
+        // the names added in this batch are remembered as well
+        if (!names.insert(dir.name).second)
+        {
+            LOG_DEBUG("Directory entry '" << dir.name << "' already exists");
+            continue;
+        }
+
+        uint32 hash = HashName(dir.name);
+        if (compact)
+        {
+            uint32 nameLength = static_cast<uint32>(strlen(dir.name));
+            VFS_ASSERT(nameLength <= VFS_MAX_NAME_LENGTH);
+
+            DirEntryHeader header;
+            header.inodeID = dir.inodeID;
+            header.hash = hash;
+            header.entryLength = static_cast<uint16>(CompactEntryLength(nameLength));
+            header.type = type;
+            header.nameLength = static_cast<uint8>(nameLength);
+
+            // cover the unused end of a chunk with a removed entry
+            uint32 end = firstPosition + static_cast<uint32>(data.size());
+            uint32 position = PlaceCompactEntry(end, header.entryLength);
+            if (position - end >= sizeof(DirEntryHeader))
+            {
+                DirEntryHeader padding;
+                memset(&padding, 0, sizeof(padding));
+                padding.inodeID = INVALID_INDEX;
+                padding.entryLength = static_cast<uint16>(position - end);
+                data.insert(data.end(), reinterpret_cast<const uint8*>(&padding),
+                            reinterpret_cast<const uint8*>(&padding + 1));
+            }
+            data.resize(position - firstPosition + header.entryLength, 0);
+            memcpy(data.data() + position - firstPosition, &header, sizeof(header));
+            memcpy(data.data() + position - firstPosition + sizeof(header), dir.name, nameLength);
+            positions.push_back(position);
+        }
+        else
+        {
+            data.insert(data.end(), reinterpret_cast<const uint8*>(&dir),
+                        reinterpret_cast<const uint8*>(&dir + 1));
+            positions.push_back(mINode.usage + static_cast<uint32>(positions.size()));
+        }
+
+        hashes.push_back(hash);
+        added[i] = true;
+    }
+
+    if (positions.empty())
+        return 0;
+
+    // all the entries are written at once
+    uint32 bytes = static_cast<uint32>(data.size());
+    if (WriteOffset(bytes, firstPosition, data.data()) != bytes)
+    {
+        added.assign(entries.size(), false);
+        return 0;
+    }
+
+    const uint32 addedNum = static_cast<uint32>(positions.size());
+    mINode.usage += addedNum;
+
+    // keep the index load factor below 3/4
+    uint32 slotsNum = mVFS->mBlockSize / sizeof(DirIndexSlot);
+    if (mINode.dirIndex != INVALID_INDEX)
+    {
+        VfsFile index(mVFS, mINode.dirIndex);
+        uint32 indexSlots = index.mINode.size / sizeof(DirIndexSlot);
+        if (4 * mINode.usage <= 3 * indexSlots)
+        {
+            for (uint32 i = 0; i < addedNum; ++i)
+                VFS_ASSERT(IndexInsert(index, hashes[i], positions[i]));
+            return addedNum;
+        }
+        slotsNum = std::max(slotsNum, indexSlots);
+    }
+    else if (mVFS->mSuperblock.version < VFS_VERSION_DIR_INDEX ||
+             mINode.size <= VFS_DIR_INDEX_THRESHOLD)
+    {
+        return addedNum;
+    }
+
+    while (4 * mINode.usage > 3 * slotsNum)
+        slotsNum *= 2;
+
+    // lookups still work without the index, so running out of space is not an error
+    if (!BuildIndex(slotsNum))
+    {
+        LOG_DEBUG("Failed to build directory index");
+        DropIndex();
+    }
+
+    return addedNum;
+}
+
+void VfsFile::PrefetchOffset(uint32 bytes, uint64 offset, bool cache)
+{
+    const uint64 size = mINode.GetSize();
+    if (offset >= size || UsesInlineData())
+        return;
+
+    bytes = static_cast<uint32>(std::min<uint64>(bytes, size - offset));
+    const uint32 blockShift = mVFS->mBlockShift;
+    uint32 firstBlockId = static_cast<uint32>(offset >> blockShift);
+    uint32 lastBlockId = static_cast<uint32>((offset + bytes - 1) >> blockShift);
+
+    // hint physically contiguous runs of blocks
+    for (uint32 i = firstBlockId; i <= lastBlockId; )
+    {
+        uint32 runLength;
+        uint32 blockID = GetRealBlockRun(i, lastBlockId - i + 1, false, runLength);
+        if (blockID == INVALID_INDEX)
+            break;
+
+        // merge with the following runs if they are adjacent
+        while (i + runLength <= lastBlockId)
+        {
+            uint32 nextRunLength;
+            uint32 nextBlockID = GetRealBlockRun(i + runLength, lastBlockId - i - runLength + 1,
+                                                 false, nextRunLength);
+            if (nextBlockID != blockID + runLength)
+                break;
+            runLength += nextRunLength;
+        }
+
+        // read-ahead is only an optimization - failures are reported by the reads themselves
+        uint32 imageBlock = mVFS->mSuperblock.firstDataBlock + blockID;
+        if (!cache)
+            mVFS->mImage.WillNeed(static_cast<uint64>(imageBlock) << blockShift,
+                                  static_cast<uint64>(runLength) << blockShift);
+        else if (!mVFS->mCache.Prefetch(imageBlock, runLength))
+            break;
+        i += runLength;
+    }
+}
+
+void VfsFile::ReadAhead(bool cache)
+{
+    const uint32 blockShift = mVFS->mBlockShift;
+    uint32 block = static_cast<uint32>(mCursor >> blockShift);
+    if (mReadAheadBlocks > 0 && block < mReadAheadEnd)
+        return;
+
+    const uint32 minBlocks = std::max<uint32>(VFS_READ_AHEAD_MIN >> blockShift, 1);
+    const uint32 maxBlocks = std::max<uint32>(VFS_READ_AHEAD_MAX >> blockShift, 1);
+    mReadAheadBlocks = mReadAheadBlocks > 0 ? std::min(2 * mReadAheadBlocks, maxBlocks) :
+                                              minBlocks;
+    mReadAheadEnd = block + mReadAheadBlocks;
+    PrefetchOffset(mReadAheadBlocks << blockShift, static_cast<uint64>(block) << blockShift,
+                   cache);
+}
+
+uint32 VfsFile::Read(uint32 bytes, void* data)
+{
+    VfsStatsCollector::Timer timer(mVFS->mStats, VfsOperation::Read);
+    if (!FlushWrites())
+        return INVALID_INDEX;
+
+    SharedLock lock(mNode->lock);
+    const bool sequential = mCursor == mReadEnd;
+    uint32 bytesRead = ReadOffset(bytes, mCursor, data);
+    mCursor += bytesRead;
+    mReadEnd = mCursor;
+
+    // small reads are served from the cache (the following blocks are loaded with a single
+    // image access), the large ones only hint the image
+    if (sequential && bytesRead > 0)
+        ReadAhead(bytesRead < mVFS->mBlockSize && !mVFS->mImage.GetMapping());
+    else
+        mReadAheadBlocks = 0;
+
+    return bytesRead;
+}
+
+bool VfsFile::ReadAsync(uint64 offset, uint32 bytes, void* data, ReadCallback callback)
+{
+    VfsIoEngine* engine = mVFS->GetIoEngine();
+    if (engine == nullptr || !FlushWrites())
+        return false;
+
+    // map the whole range at once - cached blocks are copied right away, the rest of the
+    // blocks is read from the image in a single batch
+    std::vector<VfsIoRequest> requests;
+    {
+        SharedLock lock(mNode->lock);
+        const uint64 size = mINode.GetSize();
+        bytes = offset < size ? static_cast<uint32>(std::min<uint64>(bytes, size - offset)) : 0;
+
+        uint8* dataPtr = static_cast<uint8*>(data);
+        if (bytes > 0 && UsesInlineData())
+            memcpy(dataPtr, mINode.inlineData + offset, bytes);
+        else if (bytes > 0)
+        {
+            const uint32 blockSize = mVFS->mBlockSize;
+            const uint32 blockShift = mVFS->mBlockShift;
+            const uint32 blockMask = mVFS->mBlockMask;
+            const uint32 firstDataBlock = mVFS->mSuperblock.firstDataBlock;
+            uint32 lastBlockId = static_cast<uint32>((offset + bytes - 1) >> blockShift);
+            uint32 read = 0;
+
+            while (read < bytes)
+            {
+                uint32 blockIndex = static_cast<uint32>((offset + read) >> blockShift);
+                uint32 runLength;
+                uint32 blockID = GetRealBlockRun(blockIndex, lastBlockId - blockIndex + 1, false,
+                                                 runLength);
+                if (blockID == INVALID_INDEX)
+                    break;
+
+                for (uint32 i = 0; i < runLength && read < bytes; ++i)
+                {
+                    uint32 interBlockOffset = static_cast<uint32>(offset + read) & blockMask;
+                    uint32 toRead = std::min(blockSize - interBlockOffset, bytes - read);
+                    uint32 block = firstDataBlock + blockID + i;
+
+                    // cached copy of a block may be newer than the image
+                    if (!mVFS->mCache.ReadCached(block, interBlockOffset, toRead, dataPtr + read))
+                    {
+                        uint64 imageOffset = (static_cast<uint64>(block) << blockShift) +
+                                             interBlockOffset;
+                        VfsIoRequest* last = requests.empty() ? nullptr : &requests.back();
+                        if (last && last->offset + last->bytes == imageOffset &&
+                            last->data + last->bytes == dataPtr + read)
+                            last->bytes += toRead;
+                        else
+                            requests.push_back(VfsIoRequest{ imageOffset, toRead, dataPtr + read });
+                    }
+
+                    read += toRead;
+                }
+            }
+
+            bytes = read;
+        }
+
+        if (!requests.empty())
+        {
+            std::lock_guard<std::mutex> asyncLock(mNode->asyncLock);
+            mNode->asyncReads++;
+            mAsyncReads++;
+        }
+    }
+
+    if (requests.empty())
+    {
+        callback(bytes);
+        return true;
+    }
+
+    auto completion = [this, bytes, callback](bool success)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mNode->asyncLock);
+            mNode->asyncReads--;
+        }
+        mNode->asyncDone.notify_all();
+
+        callback(success ? bytes : INVALID_INDEX);
+
+        // the file can be closed from now on
+        std::lock_guard<std::mutex> lock(mNode->asyncLock);
+        mAsyncReads--;
+        mNode->asyncDone.notify_all();
+    };
+
+    if (!engine->Submit(requests, completion))
+    {
+        LOG_ERROR("Failed to submit asynchronous read");
+
+        // the completion is never called then
+        {
+            std::lock_guard<std::mutex> lock(mNode->asyncLock);
+            mNode->asyncReads--;
+            mAsyncReads--;
+        }
+        mNode->asyncDone.notify_all();
+        return false;
+    }
+
+    return true;
+}
+
+std::future<uint32> VfsFile::ReadAsync(uint64 offset, uint32 bytes, void* data)
+{
+    auto promise = std::make_shared<std::promise<uint32>>();
+    std::future<uint32> future = promise->get_future();
+
+    auto callback = [promise](uint32 bytesRead)
+    {
+        promise->set_value(bytesRead);
+    };
+
+    if (!ReadAsync(offset, bytes, data, callback))
+        promise->set_value(INVALID_INDEX);
+
+    return future;
 }
 
 uint32 VfsFile::Write(uint32 bytes, const void* data)
 {
-    uint32 bytesWritten = WriteOffset(bytes, mCursor, data);
-    mCursor += bytesWritten;
+    VfsStatsCollector::Timer timer(mVFS->mStats, VfsOperation::Write);
+    Vfs::Operation operation(mVFS, bytes);
+    ExclusiveLock lock(mNode->lock);
+    WaitForAsyncReads();
+
+    const bool sequential = mCursor == mWriteEnd;
+    if (sequential && BufferWrite(bytes, data))
+    {
+        mCursor += bytes;
+        mWriteEnd = mCursor;
+        return bytes;
+    }
+
+    if (!FlushWriteBuffer())
+        return 0;
+
+    // large writes are committed in parts, so the modified map blocks don't outgrow the journal
+    // (the file is opened, so its inode is written back by the commit)
+    const uint64 splitBytes = mVFS->GetSplitBytes();
+    const uint8* dataPtr = static_cast<const uint8*>(data);
+    uint32 bytesWritten = 0;
+    while (bytesWritten < bytes)
+    {
+        if (bytesWritten > 0)
+        {
+            lock.unlock();
+            operation.Split();
+            lock.lock();
+            WaitForAsyncReads();
+        }
+
+        uint32 chunk = static_cast<uint32>(std::min<uint64>(bytes - bytesWritten, splitBytes));
+        uint32 written = WriteOffset(chunk, mCursor, dataPtr + bytesWritten);
+        mCursor += written;
+        bytesWritten += written;
+        if (written != chunk)
+            break;
+    }
+
+    mWriteEnd = mCursor;
     return bytesWritten;
 }
 
-uint32 VfsFile::Seek(int32 offset, VfsSeekMode mode)
+bool VfsFile::BufferWrite(uint32 bytes, const void* data)
+{
+    // only small writes of regular files are gathered (the large ones are written directly)
+    const uint32 blockSize = mVFS->mBlockSize;
+    if (mReadOnly || bytes >= blockSize || mINode.type != INodeType::File || mMetadata)
+        return false;
+
+    std::vector<uint8>& buffer = mNode->writeBuffer;
+    if (buffer.empty())
+    {
+        // writes past the file end need the gap cleared, small files are kept in the inode
+        if (mCursor > mINode.GetSize() || mCursor + bytes > mVFS->GetMaxFileSize() ||
+            (UsesInlineData() && mCursor + bytes <= INODE_INLINE_SIZE))
+            return false;
+
+        mNode->writeBufferOffset = mCursor;
+    }
+    else if (mCursor != mNode->writeBufferOffset + buffer.size() ||
+             mCursor + bytes > mVFS->GetMaxFileSize())
+        return false;
+
+    // the whole blocks are written once the buffer is full, the last partial one stays
+    const uint64 blocksEnd = (mNode->writeBufferOffset + buffer.size()) &
+                             ~static_cast<uint64>(mVFS->mBlockMask);
+    if (buffer.size() + bytes > std::max<uint32>(VFS_WRITE_BEHIND_SIZE, blockSize) &&
+        blocksEnd > mNode->writeBufferOffset)
+    {
+        const uint32 toWrite = static_cast<uint32>(blocksEnd - mNode->writeBufferOffset);
+        uint32 written = WriteOffset(toWrite, mNode->writeBufferOffset, buffer.data());
+        buffer.erase(buffer.begin(), buffer.begin() + written);
+        mNode->writeBufferOffset += written;
+        if (written != toWrite)
+            return false;
+    }
+
+    const uint8* dataPtr = static_cast<const uint8*>(data);
+    buffer.insert(buffer.end(), dataPtr, dataPtr + bytes);
+    return true;
+}
+
+bool VfsFile::FlushWriteBuffer()
+{
+    std::vector<uint8>& buffer = mNode->writeBuffer;
+    if (buffer.empty())
+        return true;
+
+    // the buffer may be flushed by any object of the inode (also a read-only one)
+    const uint32 bytes = static_cast<uint32>(buffer.size());
+    uint32 written = WriteOffset(bytes, mNode->writeBufferOffset, buffer.data(), true);
+
+    buffer.clear();
+    if (written != bytes)
+    {
+        LOG_ERROR("Failed to write buffered data (" << bytes - written << " bytes lost)");
+        return false;
+    }
+    return true;
+}
+
+bool VfsFile::FlushWrites()
+{
+    uint64 buffered;
+    {
+        SharedLock lock(mNode->lock);
+        buffered = mNode->writeBuffer.size();
+        if (buffered == 0)
+            return true;
+    }
+
+    Vfs::Operation operation(mVFS, buffered);
+    ExclusiveLock lock(mNode->lock);
+    WaitForAsyncReads();
+    return FlushWriteBuffer();
+}
+
+uint64 VfsFile::GetBufferedSize() const
+{
+    // the offset is stale once the buffer is flushed (the file could be truncated since then)
+    if (mNode->writeBuffer.empty())
+        return mINode.GetSize();
+
+    return std::max<uint64>(mINode.GetSize(),
+                            mNode->writeBufferOffset + mNode->writeBuffer.size());
+}
+
+bool VfsFile::Preallocate(uint64 bytes)
+{
+    if (mReadOnly)
+    {
+        LOG_DEBUG("Trying to preallocate read-only file");
+        return false;
+    }
+
+    if (bytes > mVFS->GetMaxFileSize())
+    {
+        LOG_DEBUG("File size limit exceeded");
+        return false;
+    }
+
+    uint32 blocks = static_cast<uint32>(CeilDivide<uint64>(bytes, mVFS->mBlockSize));
+    Vfs::Operation operation(mVFS, bytes);
+    ExclusiveLock lock(mNode->lock);
+    WaitForAsyncReads();
+    if (!FlushWriteBuffer())
+        return false;
+
+    if (UsesInlineData())
+    {
+        if (bytes <= INODE_INLINE_SIZE)
+            return true;
+
+        if (!PromoteInlineData())
+        {
+            LOG_DEBUG("No blocks left");
+            return false;
+        }
+    }
+
+    if (!UsesExtents())
+    {
+        for (uint32 i = 0; i < blocks; ++i)
+            if (GetRealBlockID(i, true) == INVALID_INDEX)
+                return false;
+        return true;
+    }
+
+    if (blocks > mNode->mappedBlocks && blocks - mNode->mappedBlocks > mVFS->GetFreeBlocksNum())
+    {
+        LOG_DEBUG("Not enough free blocks");
+        return false;
+    }
+
+    // allocate missing blocks in as few runs as possible
+    while (mNode->mappedBlocks < blocks)
+    {
+        uint32 reserved;
+        uint32 start = mVFS->ReserveBlockRun(blocks - mNode->mappedBlocks, reserved);
+        if (start == INVALID_INDEX)
+        {
+            LOG_DEBUG("No blocks left");
+            return false;
+        }
+
+        if (!AppendRun(start, reserved))
+            return false;
+    }
+
+    return true;
+}
+
+bool VfsFile::Truncate(uint64 size)
+{
+    if (mReadOnly)
+    {
+        LOG_DEBUG("Trying to truncate read-only file");
+        return false;
+    }
+
+    if (size > mVFS->GetMaxFileSize())
+    {
+        LOG_DEBUG("File size limit exceeded");
+        return false;
+    }
+
+    Vfs::Operation operation(mVFS, size);
+    ExclusiveLock lock(mNode->lock);
+    WaitForAsyncReads();
+
+    if (mINode.type != INodeType::File)
+    {
+        LOG_ERROR("Only files can be truncated");
+        return false;
+    }
+
+    if (!FlushWriteBuffer())
+        return false;
+
+    // growing - the gap is cleared by writing past the file end
+    if (size > mINode.GetSize())
+    {
+        const uint8 zero = 0;
+        return WriteOffset(1, size - 1, &zero) == 1;
+    }
+
+    if (UsesInlineData())
+    {
+        memset(mINode.inlineData + size, 0, INODE_INLINE_SIZE - static_cast<size_t>(size));
+        mINode.SetSize(size);
+        return true;
+    }
+
+    // the blocks past the end (also the preallocated ones) are released
+    uint32 keepBlocks = static_cast<uint32>(CeilDivide<uint64>(size, mVFS->mBlockSize));
+    bool result = UsesExtents() ? TruncateExtents(keepBlocks) : TruncatePointers(keepBlocks);
+    mINode.SetSize(size);
+    return result;
+}
+
+uint64 VfsFile::Seek(int64 offset, VfsSeekMode mode)
 {
     switch (mode)
     {
@@ -415,8 +2143,11 @@ uint32 VfsFile::Seek(int32 offset, VfsSeekMode mode)
         mCursor = offset;
         break;
     case VfsSeekMode::End:
-        mCursor = mINode.size + offset;
+    {
+        SharedLock lock(mNode->lock);
+        mCursor = GetBufferedSize() + offset;
         break;
+    }
     case VfsSeekMode::Curr:
         mCursor += offset;
         break;
@@ -425,17 +2156,97 @@ uint32 VfsFile::Seek(int32 offset, VfsSeekMode mode)
     return mCursor;
 }
 
+VfsFileUsage::VfsFileUsage()
+{
+    inodeID = INVALID_INDEX;
+    directory = false;
+    size = 0;
+    blocks = 0;
+    fragments = 0;
+    mapBlocks = 0;
+}
+
 std::vector<uint32> VfsFile::GetBlocksMap()
 {
+    SharedLock lock(mNode->lock);
     std::vector<uint32> result;
-    uint32 blocks = CeilDivide<uint32>(mINode.size, VFS_BLOCK_SIZE);
+    if (UsesInlineData())
+        return result;
 
-    for (uint32 i = 0; i < blocks; ++i)
+    uint32 blocks = static_cast<uint32>(CeilDivide<uint64>(mINode.GetSize(), mVFS->mBlockSize));
+
+    for (uint32 i = 0; i < blocks; )
     {
-        uint32 realBlockId = GetRealBlockID(i, false);
-        if (realBlockId != INVALID_INDEX)
-            result.push_back(realBlockId);
+        uint32 runLength;
+        uint32 realBlockId = GetRealBlockRun(i, blocks - i, false, runLength);
+        for (uint32 j = 0; j < runLength; ++j)
+            if (realBlockId != INVALID_INDEX)
+                result.push_back(realBlockId + j);
+        i += runLength;
     }
 
     return result;
 }
+
+bool VfsFile::GetUsage(VfsFileUsage& usage)
+{
+    SharedLock lock(mNode->lock);
+    usage.inodeID = mINodeID;
+    usage.directory = mINode.type == INodeType::Directory;
+    usage.size = usage.directory ? mINode.usage : mINode.GetSize();
+    if (UsesInlineData())
+        return true;
+
+    if (UsesExtents())
+    {
+        usage.blocks = mNode->mappedBlocks;
+        usage.mapBlocks = static_cast<uint32>(mNode->extentBlocks.size());
+        for (size_t i = 0; i < mNode->extents.size(); ++i)
+        {
+            const Extent& extent = mNode->extents[i];
+            if (i == 0 || mNode->extents[i - 1].start + mNode->extents[i - 1].length != extent.start)
+                usage.fragments++;
+        }
+        return true;
+    }
+
+    uint32 lastBlock = INVALID_INDEX;
+    for (uint32 i = 0; i < INODE_PTRS; ++i)
+    {
+        if (mINode.blockPtr[i] == INVALID_INDEX)
+            continue;
+
+        if (!CountPointerTree(mINode.blockPtr[i], mINode.ptrDepth, lastBlock, usage))
+            return false;
+    }
+    return true;
+}
+
+bool VfsFile::CountPointerTree(uint32 blockID, uint32 depth, uint32& lastBlock,
+                               VfsFileUsage& usage)
+{
+    if (depth == 0)
+    {
+        if (usage.blocks == 0 || blockID != lastBlock + 1)
+            usage.fragments++;
+        usage.blocks++;
+        lastBlock = blockID;
+        return true;
+    }
+
+    const uint32 ptrsPerBlock = VFS_PTRS_PER_BLOCK(mVFS->mBlockSize);
+    std::vector<uint32> ptrs(ptrsPerBlock);
+    if (!mVFS->ReadDataBlock(blockID, 0, mVFS->mBlockSize, ptrs.data()))
+        return false;
+
+    usage.mapBlocks++;
+    for (uint32 i = 0; i < ptrsPerBlock; ++i)
+    {
+        if (ptrs[i] == INVALID_INDEX)
+            continue;
+
+        if (!CountPointerTree(ptrs[i], depth - 1, lastBlock, usage))
+            return false;
+    }
+    return true;
+}
@@ -3,19 +3,101 @@
 #include "vfsstructures.hpp"
 
 #include <vector>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+
+// window of the blocks prefetched after sequential reads (in bytes) - it starts at the minimum
+// and it's doubled by every prefetch of the same stream
+#define VFS_READ_AHEAD_MIN (16 * 1024)
+#define VFS_READ_AHEAD_MAX (256 * 1024)
+
+// sequential writes smaller than a block are gathered in a buffer of this size (in bytes)
+#define VFS_WRITE_BEHIND_SIZE (64 * 1024)
+
+/**
+ * @brief In-core inode, shared by all the VfsFile objects referring to the same inode
+ */
+struct VfsINode
+{
+    uint32 refs;                  //< number of VfsFile objects (guarded by Vfs::mINodesLock)
+    std::once_flag loaded;        //< the first VfsFile object loads the inode from the image
+    std::shared_timed_mutex lock; //< taken exclusively when the file is modified
+
+    INode inode;
+
+    // extent map (for INODE_EXTENT_MAP inodes)
+    std::vector<Extent> extents;
+    std::vector<uint32> extentOffsets; //< file block index of each extent's first block
+    std::vector<uint32> extentBlocks;  //< blocks holding extents that don't fit in the inode
+    uint32 mappedBlocks;               //< total number of blocks in the extents
+    bool extentsDirty;
+
+    // small sequential writes not written to the blocks yet (guarded by "lock")
+    std::vector<uint8> writeBuffer;
+    uint64 writeBufferOffset; //< file offset of the first buffered byte
+
+    // asynchronous reads in flight (the inode is modified only when there are none)
+    std::mutex asyncLock;
+    std::condition_variable asyncDone;
+    uint32 asyncReads;
+
+    VfsINode();
+};
+
+/**
+ * @brief Space used by a single inode (see Vfs::GetUsageReport)
+ */
+struct VfsFileUsage
+{
+    uint32 inodeID;
+    bool directory;
+    uint64 size;
+    uint32 blocks;    //< data blocks (zero for files stored inside the inode)
+    uint32 fragments; //< runs of consecutive data blocks
+    uint32 mapBlocks; //< block pointers or extent map blocks
+
+    VfsFileUsage();
+};
 
 /**
  * @brief Class representing an open file in the VFS
+ *
+ * Different VfsFile objects can be used concurrently, also when they refer to the same file
+ * (reads are performed in parallel, writes are exclusive). A single VfsFile object must not be
+ * used by multiple threads at once.
  */
 class VfsFile final
 {
     friend class Vfs;
 
+    typedef std::shared_lock<std::shared_timed_mutex> SharedLock;
+    typedef std::unique_lock<std::shared_timed_mutex> ExclusiveLock;
+
+    /**
+     * Directory entry visitor. Returns false to stop iterating.
+     * @param position Entry index (or byte offset of a compact entry) in the directory
+     * @param hash     Name hash
+     */
+    typedef std::function<bool(uint32 position, const Directory& entry, uint32 hash)>
+        EntryCallback;
+
     Vfs* mVFS;
-    uint32 mCursor;
+    uint64 mCursor;
     uint32 mINodeID;
-    INode mINode;
+    VfsINode* mNode;
+    INode& mINode; //< shortcut to mNode->inode
     bool mReadOnly;
+    bool mMetadata; //< directory hash index (written through the cache, like directories)
+    uint32 mAsyncReads; //< asynchronous reads started by this object (guarded by asyncLock)
+
+    // sequential access detection
+    uint64 mReadEnd;         //< end of the previous read
+    uint64 mWriteEnd;        //< end of the previous write
+    uint32 mReadAheadBlocks; //< current read-ahead window (zero if the reads are not sequential)
+    uint32 mReadAheadEnd;    //< first file block past the prefetched window
 
     VfsFile(const VfsFile& file) = delete;
     VfsFile(Vfs* vfs, uint32 inodeID, bool readOnly = false);
@@ -23,31 +105,214 @@ class VfsFile final
     // translate block index into real index in the VFS
     uint32 GetRealBlockID(uint32 id, bool allocate);
 
+    /**
+     * Translate block index into real index in the VFS.
+     * @param maxRun    Maximum number of blocks to look up
+     * @param runLength Number of the following file blocks (up to "maxRun") that are stored
+     *                  contiguously starting at the returned block
+     */
+    uint32 GetRealBlockRun(uint32 id, uint32 maxRun, bool allocate, uint32& runLength);
+
+    bool UsesExtents() const
+    {
+        return mINode.ptrDepth == INODE_EXTENT_MAP;
+    }
+
+    bool UsesInlineData() const
+    {
+        return mINode.ptrDepth == INODE_INLINE_DATA;
+    }
+
+    // the following methods expect the inode to be locked by the caller
+
+    // wait until asynchronous reads of the inode are finished (called with the exclusive lock)
+    void WaitForAsyncReads();
+
+    bool LoadExtents();
+    bool SaveExtents();
+
+    // release all the blocks mapped by the extents
+    bool ReleaseExtents();
+
+    // release the blocks mapped by the extents past the given number of file blocks
+    bool TruncateExtents(uint32 keepBlocks);
+
+    /**
+     * Collect blocks of a pointer (sub)tree mapping file blocks past "keepBlocks".
+     * @param blockID    Root of the subtree (a data block if "depth" is zero)
+     * @param treeStart  Index of the first file block mapped by the subtree
+     * @param freed      Collected blocks (released later in bulk)
+     * @param[out] whole The whole subtree was collected, so the pointer to it must be cleared
+     */
+    bool CollectPointerTree(uint32 blockID, uint32 depth, uint64 treeStart, uint64 keepBlocks,
+                            std::vector<uint32>& freed, bool& whole);
+
+    // release the blocks mapped by the block pointers past the given number of file blocks
+    bool TruncatePointers(uint32 keepBlocks);
+
+    // point the data block pointers of a subtree to consecutive blocks starting at "newStart"
+    bool RemapPointerTree(uint32 blockID, uint32 depth, uint64 treeStart, uint32 newStart);
+
+    /**
+     * Move all the data blocks of a fragmented file into a single run.
+     * @param budget     Maximum number of bytes to move
+     * @param[out] moved Number of bytes moved (zero if the file is skipped)
+     * @return False if the file would exceed the budget (nothing is moved then)
+     */
+    bool Relocate(uint64 budget, uint64& moved);
+
+    // move data stored in the inode to a data block, switching the file to extents
+    bool PromoteInlineData();
+
+    // allocate a new block at the end of the extent map
+    bool AppendBlock();
+
+    // append already reserved blocks to the extent map
+    bool AppendRun(uint32 start, uint32 length);
+
+    // reserve extent blocks, so the given number of extents can be added to the map
+    bool ReserveExtentSlots(size_t count);
+
+    // map a run of file blocks (lying within a single extent) to other data blocks
+    bool RemapRun(uint32 fileBlock, uint32 count, uint32 newStart);
+
+    /**
+     * Move a run of shared blocks to newly reserved blocks, so they can be modified.
+     * @param count[in,out] Number of blocks to move (may be reduced if there is no free run
+     *                      long enough)
+     * @param copy          Copy the blocks contents (the blocks are not overwritten entirely)
+     * @return New data block ID of the first block or INVALID_INDEX on failure
+     */
+    uint32 UnshareRun(uint32 fileBlock, uint32 oldStart, uint32& count, bool copy);
+
+    // make this (empty) file share the data of another one
+    bool CloneFrom(VfsFile& source);
+
+    // fill a newly allocated pointers block with invalid indicies
+    bool InitPointersBlock(uint32 blockID);
+
     // reorganize block pointers if there is no left space
     bool ExtendPointers();
 
     // read data without affecting cursor
-    uint32 ReadOffset(uint32 bytes, uint32 offset, void* data);
+    uint32 ReadOffset(uint32 bytes, uint64 offset, void* data);
 
-    // write data without affecting cursor
-    uint32 WriteOffset(uint32 bytes, uint32 offset, const void* data);
+    /**
+     * Write data without affecting cursor.
+     * @param accepted The data was accepted by a writable object of the inode already (buffered
+     *                 writes are written also when the buffer is flushed by a read-only object)
+     */
+    uint32 WriteOffset(uint32 bytes, uint64 offset, const void* data, bool accepted = false);
+
+    /**
+     * Prefetch the given range of the file (and the pointer blocks mapping it).
+     * @param cache Load the blocks into the block cache, otherwise only hint the image
+     */
+    void PrefetchOffset(uint32 bytes, uint64 offset, bool cache);
+
+    // prefetch the blocks following the cursor if it reached the end of the read-ahead window
+    void ReadAhead(bool cache);
+
+    // gather a small sequential write (returns false if the write must be done directly)
+    bool BufferWrite(uint32 bytes, const void* data);
+
+    // write the gathered data to the blocks (requires the exclusive lock)
+    bool FlushWriteBuffer();
+
+    // flush the gathered data before the file is accessed in another way
+    bool FlushWrites();
+
+    // file size including the gathered writes
+    uint64 GetBufferedSize() const;
+
+    // check if the directory stores compact (variable length) entries
+    bool UsesCompactEntries() const;
+
+    bool ForEachEntry(const EntryCallback& callback);
+    bool ReadEntry(uint32 position, Directory& entry);
+
+    // find a directory entry (using the hash index if the directory has one)
+    uint32 FindEntry(const char* name, Directory& entry);
+
+    // pack compact entries, dropping the removed ones
+    bool CompactEntries();
+
+    static uint32 HashName(const char* name);
+
+    // (re)build the directory hash index with the given number of slots (power of two)
+    bool BuildIndex(uint32 slotsNum);
+
+    // remove the directory hash index (lookups fall back to scanning the entries)
+    void DropIndex();
+
+    // find position of an index slot pointing to the given entry
+    uint32 FindIndexSlot(VfsFile& index, uint32 hash, uint32 entry);
+
+    bool IndexInsert(VfsFile& index, uint32 hash, uint32 entry);
+    bool IndexRemove(VfsFile& index, uint32 hash, uint32 entry);
+    bool IndexUpdate(VfsFile& index, uint32 hash, uint32 entry, uint32 newEntry);
+
+    // remove a directory entry (the compaction is left to the caller)
+    bool RemoveEntry(const char* name, VfsFile* index);
+
+    // the following methods lock the inode by themselves
 
     // remove all file blocks (or directory table if empty)
     bool Remove();
 
-    bool RemoveDirectoryEntry(uint32 inodeID);
-    bool AddDirectoryEntry(const Directory& dir);
+    bool RemoveDirectoryEntry(const char* name);
+    bool AddDirectoryEntry(const Directory& dir, INodeType type);
+
+    /**
+     * Remove multiple directory entries, locking the directory and updating the index once.
+     * @param[out] removed Flags of the entries that were found and removed
+     * @return Number of removed entries
+     */
+    uint32 RemoveDirectoryEntries(const std::vector<const char*>& names,
+                                  std::vector<bool>& removed);
+
+    /**
+     * Add multiple directory entries with a single write.
+     * @param[out] added Flags of the entries that were added (existing names are skipped)
+     * @return Number of added entries
+     */
+    uint32 AddDirectoryEntries(const std::vector<Directory>& entries, INodeType type,
+                               std::vector<bool>& added);
+
+    /**
+     * Call a function for each entry of the directory.
+     */
+    bool ForEachDirectoryEntry(const EntryCallback& callback);
+
+    /**
+     * Find a directory entry by name.
+     * @param[out] entry Found entry
+     * @return Entry index or (-1) if there is no such entry
+     */
+    uint32 FindDirectoryEntry(const char* name, Directory& entry);
 
     /**
      * Query list of all blocks used by this file.
      */
     std::vector<uint32> GetBlocksMap();
 
+    // count data blocks, their runs and the mapping blocks of the file
+    bool GetUsage(VfsFileUsage& usage);
+
+    // count blocks of a pointer (sub)tree ("lastBlock" is the previous data block of the file)
+    bool CountPointerTree(uint32 blockID, uint32 depth, uint32& lastBlock, VfsFileUsage& usage);
+
 public:
+    /**
+     * Asynchronous read completion callback.
+     * @param bytesRead Number of bytes read or -1 on error
+     */
+    typedef std::function<void(uint32 bytesRead)> ReadCallback;
+
     ~VfsFile();
 
     /**
-     * @brief Read data from the file
+     * @brief Read data from the file. Sequential reads prefetch the following blocks.
      * @param bytes Number of bytes to read
      * @param data  Target buffer pointer
      * @return      Number of bytes read or -1 on error
@@ -55,18 +320,54 @@ public:
     uint32 Read(uint32 bytes, void* data);
 
     /**
-     * @brief Write data to the file
+     * @brief Start reading data from the file without waiting for it. The file cursor is not
+     *        affected. Modifications of the file wait until the read is finished.
+     * @param offset   Offset in the file
+     * @param bytes    Number of bytes to read
+     * @param data     Target buffer pointer (must be valid until the callback is called)
+     * @param callback Called from an I/O thread (or from the calling thread if no image access
+     *                 is needed) when the data is read. The file must not be closed in it.
+     * @return         False if the read could not be started
+     */
+    bool ReadAsync(uint64 offset, uint32 bytes, void* data, ReadCallback callback);
+
+    /**
+     * @brief Start reading data from the file without waiting for it.
+     * @return Future number of bytes read or -1 on error
+     */
+    std::future<uint32> ReadAsync(uint64 offset, uint32 bytes, void* data);
+
+    /**
+     * @brief Write data to the file. Small sequential writes are gathered and written as whole
+     *        blocks when the buffer fills up, the file is read, truncated or closed, or the VFS
+     *        is synced.
      * @param bytes Number of bytes to write
      * @param data  Source buffer pointer
      * @return      Number of bytes written or -1 on error
      */
     uint32 Write(uint32 bytes, const void* data);
 
+    /**
+     * @brief Reserve space for the file, so the following writes don't need to allocate blocks.
+     *        The file size is not changed.
+     * @param bytes Total number of bytes the file is expected to have
+     * @return      True on success or false if there is not enough space
+     */
+    bool Preallocate(uint64 bytes);
+
+    /**
+     * @brief Change the file size. The blocks past the new end are released, a grown file is
+     *        filled with zeros.
+     * @param size New file size in bytes
+     * @return     True on success
+     */
+    bool Truncate(uint64 size);
+
     /**
      * @brief Change file cursor
      * @param offset Offset in bytes
      * @param mode Seeking mode
      * @return File currsor after seeking
      */
-    uint32 Seek(int32 offset, VfsSeekMode mode);
+    uint64 Seek(int64 offset, VfsSeekMode mode);
 };
@@ -0,0 +1,120 @@
+/**
+ * @author Michal Witanowski
+ */
+
+#include "vfsfreespace.hpp"
+#include "vfsstructures.hpp"
+
+#include <iterator>
+
+VfsFreeSpaceIndex::VfsFreeSpaceIndex()
+{
+    mFreeBlocks = 0;
+}
+
+void VfsFreeSpaceIndex::AddRun(uint32 start, uint32 length)
+{
+    mByStart[start] = length;
+    mByLength.insert(std::make_pair(length, start));
+}
+
+void VfsFreeSpaceIndex::RemoveRun(std::map<uint32, uint32>::iterator it)
+{
+    mByLength.erase(std::make_pair(it->second, it->first));
+    mByStart.erase(it);
+}
+
+void VfsFreeSpaceIndex::Build(const VfsBitmap& bitmap)
+{
+    mByStart.clear();
+    mByLength.clear();
+    mFreeBlocks = 0;
+
+    uint32 size = bitmap.GetSize();
+    uint32 start = bitmap.FindNext(0, false);
+    while (start < size)
+    {
+        uint32 end = bitmap.FindNext(start, true);
+        AddRun(start, end - start);
+        mFreeBlocks += end - start;
+        start = bitmap.FindNext(end, false);
+    }
+}
+
+void VfsFreeSpaceIndex::Reserve(uint32 start, uint32 length)
+{
+    // find the run containing the range
+    auto it = mByStart.upper_bound(start);
+    VFS_ASSERT(it != mByStart.begin());
+    --it;
+
+    uint32 runStart = it->first;
+    uint32 runLength = it->second;
+    VFS_ASSERT(start + length <= runStart + runLength);
+    RemoveRun(it);
+    mFreeBlocks -= length;
+
+    // put back what is left on both sides of the range
+    if (start > runStart)
+        AddRun(runStart, start - runStart);
+    if (start + length < runStart + runLength)
+        AddRun(start + length, runStart + runLength - start - length);
+}
+
+void VfsFreeSpaceIndex::Release(uint32 start, uint32 length)
+{
+    auto next = mByStart.lower_bound(start);
+    mFreeBlocks += length;
+
+    // merge with the preceding run
+    if (next != mByStart.begin())
+    {
+        auto prev = std::prev(next);
+        VFS_ASSERT(prev->first + prev->second <= start);
+        if (prev->first + prev->second == start)
+        {
+            start = prev->first;
+            length += prev->second;
+            RemoveRun(prev);
+        }
+    }
+
+    // merge with the following run
+    if (next != mByStart.end())
+    {
+        VFS_ASSERT(start + length <= next->first);
+        if (start + length == next->first)
+        {
+            length += next->second;
+            RemoveRun(next);
+        }
+    }
+
+    AddRun(start, length);
+}
+
+uint32 VfsFreeSpaceIndex::FindBestFit(uint32 length, uint32& runLength) const
+{
+    auto it = mByLength.lower_bound(std::make_pair(length, 0u));
+    if (it == mByLength.end())
+    {
+        runLength = 0;
+        return INVALID_INDEX;
+    }
+
+    runLength = it->first;
+    return it->second;
+}
+
+uint32 VfsFreeSpaceIndex::FindLongest(uint32& runLength) const
+{
+    if (mByLength.empty())
+    {
+        runLength = 0;
+        return INVALID_INDEX;
+    }
+
+    auto it = mByLength.rbegin();
+    runLength = it->first;
+    return it->second;
+}
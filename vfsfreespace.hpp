@@ -0,0 +1,66 @@
+/**
+ * @author Michal Witanowski
+ */
+
+#pragma once
+
+#include "vfscommon.hpp"
+#include "vfsbitmap.hpp"
+
+#include <map>
+#include <set>
+#include <utility>
+
+/**
+ * @brief Index of free data block runs, ordered both by position and by length.
+ */
+class VfsFreeSpaceIndex final
+{
+    std::map<uint32, uint32> mByStart;              //< run start -> run length
+    std::set<std::pair<uint32, uint32>> mByLength; //< (run length, run start)
+    uint32 mFreeBlocks;
+
+    void AddRun(uint32 start, uint32 length);
+    void RemoveRun(std::map<uint32, uint32>::iterator it);
+
+public:
+    VfsFreeSpaceIndex();
+
+    /**
+     * Rebuild the index from a bitmap.
+     */
+    void Build(const VfsBitmap& bitmap);
+
+    /**
+     * Mark a range as used. The range must be free.
+     */
+    void Reserve(uint32 start, uint32 length);
+
+    /**
+     * Mark a range as free (merging it with the neighbouring runs).
+     */
+    void Release(uint32 start, uint32 length);
+
+    /**
+     * Find the shortest free run that is at least "length" blocks long.
+     * @param[out] runLength Length of the found run
+     * @return Start of the run or (-1) if there is no such run
+     */
+    uint32 FindBestFit(uint32 length, uint32& runLength) const;
+
+    /**
+     * Find the longest free run.
+     * @param[out] runLength Length of the found run (zero if there is no free space)
+     */
+    uint32 FindLongest(uint32& runLength) const;
+
+    size_t GetRunsNum() const
+    {
+        return mByStart.size();
+    }
+
+    uint32 GetFreeBlocksNum() const
+    {
+        return mFreeBlocks;
+    }
+};
@@ -0,0 +1,244 @@
+/**
+ * @author Michal Witanowski
+ */
+
+#include "vfsimage.hpp"
+#include "vfs.hpp"
+#include "vfsstats.hpp"
+
+#include <string.h>
+#include <algorithm>
+
+#ifndef _WIN32
+    #define VFS_MMAP_SUPPORTED
+    #define VFS_PREAD_SUPPORTED
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#else
+    #include <io.h>
+#endif
+
+VfsImage::VfsImage()
+{
+    mFile = nullptr;
+    mMapping = nullptr;
+    mSize = 0;
+    mStats = nullptr;
+}
+
+VfsImage::~VfsImage()
+{
+    Close();
+}
+
+void VfsImage::SetStats(VfsStatsCollector* stats)
+{
+    mStats = stats;
+}
+
+bool VfsImage::Map()
+{
+#ifdef VFS_MMAP_SUPPORTED
+    struct stat fileStat;
+    if (fflush(mFile) != 0 || fstat(fileno(mFile), &fileStat) != 0)
+        return false;
+
+    mSize = static_cast<uint64>(fileStat.st_size);
+    if (mSize == 0)
+        return false;
+
+    void* ptr = mmap(nullptr, static_cast<size_t>(mSize), PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fileno(mFile), 0);
+    if (ptr == MAP_FAILED)
+        return false;
+
+    mMapping = static_cast<uint8*>(ptr);
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool VfsImage::Open(const std::string& path, VfsStorageMode mode)
+{
+    Close();
+
+    mFile = fopen(path.c_str(), "r+b");
+    if (mFile == nullptr)
+        return false;
+
+    if (mode == VfsStorageMode::MemoryMapped && !Map())
+        LOG_ERROR("Failed to map the image, falling back to stdio");
+
+    return true;
+}
+
+bool VfsImage::Create(const std::string& path, uint64 size, VfsStorageMode mode)
+{
+    Close();
+
+    mFile = fopen(path.c_str(), "w+b");
+    if (mFile == nullptr)
+        return false;
+
+    // extend the (empty) file without writing it - the contents read as zeros and the disk
+    // space is allocated only when the blocks are written (if the file system supports it)
+#ifdef _WIN32
+    bool resized = _chsize_s(_fileno(mFile), static_cast<int64>(size)) == 0;
+#else
+    bool resized = ftruncate(fileno(mFile), static_cast<off_t>(size)) == 0;
+#endif
+    if (!resized)
+    {
+        Close();
+        return false;
+    }
+    mSize = size;
+
+    if (mode == VfsStorageMode::MemoryMapped && !Map())
+        LOG_ERROR("Failed to map the image, falling back to stdio");
+
+    return true;
+}
+
+void VfsImage::Close()
+{
+#ifdef VFS_MMAP_SUPPORTED
+    if (mMapping)
+    {
+        munmap(mMapping, static_cast<size_t>(mSize));
+        mMapping = nullptr;
+    }
+#endif
+
+    if (mFile)
+    {
+        fclose(mFile);
+        mFile = nullptr;
+    }
+
+    mSize = 0;
+}
+
+bool VfsImage::Read(uint64 offset, uint32 bytes, void* data)
+{
+    if (mStats)
+        mStats->RecordRead(offset, bytes);
+
+    if (mMapping)
+    {
+        if (offset + bytes > mSize)
+            return false;
+
+        memcpy(data, mMapping + offset, bytes);
+        return true;
+    }
+
+#ifdef VFS_PREAD_SUPPORTED
+    // positional read doesn't depend on the file cursor (may return less than requested)
+    uint8* dataPtr = static_cast<uint8*>(data);
+    while (bytes > 0)
+    {
+        ssize_t ret = pread(fileno(mFile), dataPtr, bytes, static_cast<off_t>(offset));
+        if (ret <= 0)
+            return false;
+
+        dataPtr += ret;
+        offset += ret;
+        bytes -= static_cast<uint32>(ret);
+    }
+    return true;
+#else
+    std::lock_guard<std::mutex> lock(mCursorLock);
+    return _fseeki64(mFile, static_cast<int64>(offset), SEEK_SET) == 0 &&
+           fread(data, bytes, 1, mFile) == 1;
+#endif
+}
+
+bool VfsImage::Write(uint64 offset, uint32 bytes, const void* data)
+{
+    if (mStats)
+        mStats->RecordWrite(offset, bytes);
+
+    if (mMapping)
+    {
+        if (offset + bytes > mSize)
+            return false;
+
+        memcpy(mMapping + offset, data, bytes);
+        return true;
+    }
+
+#ifdef VFS_PREAD_SUPPORTED
+    const uint8* dataPtr = static_cast<const uint8*>(data);
+    while (bytes > 0)
+    {
+        ssize_t ret = pwrite(fileno(mFile), dataPtr, bytes, static_cast<off_t>(offset));
+        if (ret <= 0)
+            return false;
+
+        dataPtr += ret;
+        offset += ret;
+        bytes -= static_cast<uint32>(ret);
+    }
+    return true;
+#else
+    std::lock_guard<std::mutex> lock(mCursorLock);
+    return _fseeki64(mFile, static_cast<int64>(offset), SEEK_SET) == 0 &&
+           fwrite(data, bytes, 1, mFile) == 1;
+#endif
+}
+
+bool VfsImage::Sync()
+{
+    if (mStats)
+        mStats->RecordSync();
+
+#ifdef VFS_MMAP_SUPPORTED
+    if (mMapping)
+        return msync(mMapping, static_cast<size_t>(mSize), MS_SYNC) == 0;
+#endif
+
+#ifdef VFS_PREAD_SUPPORTED
+    return fsync(fileno(mFile)) == 0;
+#else
+    return fflush(mFile) == 0;
+#endif
+}
+
+int VfsImage::GetDescriptor() const
+{
+#ifdef _WIN32
+    return _fileno(mFile);
+#else
+    return fileno(mFile);
+#endif
+}
+
+void VfsImage::WillNeed(uint64 offset, uint64 bytes)
+{
+#ifdef VFS_MMAP_SUPPORTED
+    if (!mMapping)
+    {
+        // the kernel reads the range into the page cache in the background
+        if (mFile)
+            posix_fadvise(fileno(mFile), static_cast<off_t>(offset), static_cast<off_t>(bytes),
+                          POSIX_FADV_WILLNEED);
+        return;
+    }
+
+    if (offset >= mSize)
+        return;
+
+    // madvise requires page aligned address
+    uint64 pageMask = static_cast<uint64>(sysconf(_SC_PAGESIZE)) - 1;
+    uint64 begin = offset & ~pageMask;
+    uint64 end = std::min(offset + bytes, mSize);
+    madvise(mMapping + begin, static_cast<size_t>(end - begin), MADV_WILLNEED);
+#else
+    (void)offset;
+    (void)bytes;
+#endif
+}
@@ -0,0 +1,102 @@
+/**
+ * @author Michal Witanowski
+ */
+
+#pragma once
+
+#include "vfscommon.hpp"
+
+#include <stdio.h>
+#include <string>
+#include <mutex>
+
+class VfsStatsCollector;
+
+/**
+ * VFS image storage mode
+ */
+enum class VfsStorageMode
+{
+    Stdio,       //< access the image through stdio calls
+    MemoryMapped //< map the whole image into memory (falls back to Stdio if unavailable)
+};
+
+/**
+ * @brief Backing storage of a VFS image.
+ *
+ * Read() and Write() can be called concurrently - they use positional I/O (or the mapping)
+ * and don't depend on the file cursor.
+ */
+class VfsImage final
+{
+    FILE* mFile;
+    uint8* mMapping;
+    uint64 mSize;
+    std::mutex mCursorLock; //< guards the file cursor when positional I/O is not available
+    VfsStatsCollector* mStats;
+
+    bool Map();
+
+public:
+    VfsImage();
+    ~VfsImage();
+
+    // set statistics receiving the image accesses (can be nullptr)
+    void SetStats(VfsStatsCollector* stats);
+
+    VfsStatsCollector* GetStats() const
+    {
+        return mStats;
+    }
+
+    /**
+     * Open an existing image file.
+     */
+    bool Open(const std::string& path, VfsStorageMode mode);
+
+    /**
+     * Create a new, zero-filled image file. The contents are not written, so the file is sparse
+     * where supported.
+     * @param size Image size in bytes
+     */
+    bool Create(const std::string& path, uint64 size, VfsStorageMode mode);
+
+    void Close();
+
+    bool Read(uint64 offset, uint32 bytes, void* data);
+    bool Write(uint64 offset, uint32 bytes, const void* data);
+
+    /**
+     * Make all the writes durable (msync for memory mapped images).
+     */
+    bool Sync();
+
+    /**
+     * Hint that a range of the image is going to be read soon (the system may start reading
+     * it in the background).
+     */
+    void WillNeed(uint64 offset, uint64 bytes);
+
+    /**
+     * Get descriptor of the image file (for I/O performed outside of this class).
+     */
+    int GetDescriptor() const;
+
+    bool IsOpened() const
+    {
+        return mFile != nullptr;
+    }
+
+    /**
+     * Get pointer to the image mapping or nullptr if the image is not memory mapped.
+     */
+    uint8* GetMapping() const
+    {
+        return mMapping;
+    }
+
+    VfsStorageMode GetMode() const
+    {
+        return mMapping ? VfsStorageMode::MemoryMapped : VfsStorageMode::Stdio;
+    }
+};
@@ -0,0 +1,504 @@
+/**
+ * @author Michal Witanowski
+ */
+
+#include "vfsioengine.hpp"
+#include "vfsstats.hpp"
+
+#include <string.h>
+#include <algorithm>
+
+#if defined(__linux__) && defined(__has_include)
+    #if __has_include(<linux/io_uring.h>)
+        #define VFS_IO_URING_SUPPORTED
+        #include <linux/io_uring.h>
+        #include <sys/syscall.h>
+        #include <sys/mman.h>
+        #include <unistd.h>
+        #include <errno.h>
+    #endif
+#endif
+
+#ifdef VFS_IO_URING_SUPPORTED
+
+// user data of the operation stopping the completion thread
+#define VFS_RING_STOP 0
+
+namespace {
+
+int IoUringSetup(uint32 entries, io_uring_params* params)
+{
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int IoUringEnter(int fd, uint32 toSubmit, uint32 minComplete, uint32 flags)
+{
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags,
+                                    nullptr, 0));
+}
+
+} // namespace
+
+/**
+ * Submission and completion queues shared with the kernel
+ */
+struct VfsIoEngine::Ring
+{
+    int fd;
+    int imageFd;
+    void* sqRing;
+    size_t sqRingSize;
+    void* cqRing;
+    size_t cqRingSize;
+    io_uring_sqe* sqes;
+    size_t sqesSize;
+
+    uint32* sqHead;
+    uint32* sqTail;
+    uint32 sqMask;
+    uint32* sqArray;
+    uint32 sqEntries;
+    uint32 toSubmit; //< entries queued since the last io_uring_enter call
+
+    uint32* cqHead;
+    uint32* cqTail;
+    uint32 cqMask;
+    io_uring_cqe* cqes;
+
+    Ring()
+    {
+        fd = -1;
+        sqRing = cqRing = MAP_FAILED;
+        sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+        sqRingSize = cqRingSize = sqesSize = 0;
+        toSubmit = 0;
+    }
+
+    ~Ring()
+    {
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqesSize);
+        if (cqRing != MAP_FAILED && cqRing != sqRing)
+            munmap(cqRing, cqRingSize);
+        if (sqRing != MAP_FAILED)
+            munmap(sqRing, sqRingSize);
+        if (fd >= 0)
+            close(fd);
+    }
+
+    bool Init(int imageDescriptor, uint32 entries)
+    {
+        imageFd = imageDescriptor;
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        fd = IoUringSetup(entries, &params);
+        if (fd < 0)
+            return false;
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                      IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED)
+            return false;
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            cqRing = sqRing;
+        else
+        {
+            cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          fd, IORING_OFF_CQ_RING);
+            if (cqRing == MAP_FAILED)
+                return false;
+        }
+
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        void* ptr = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                         IORING_OFF_SQES);
+        if (ptr == MAP_FAILED)
+            return false;
+        sqes = static_cast<io_uring_sqe*>(ptr);
+
+        uint8* sq = static_cast<uint8*>(sqRing);
+        sqHead = reinterpret_cast<uint32*>(sq + params.sq_off.head);
+        sqTail = reinterpret_cast<uint32*>(sq + params.sq_off.tail);
+        sqMask = *reinterpret_cast<uint32*>(sq + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<uint32*>(sq + params.sq_off.array);
+        sqEntries = params.sq_entries;
+
+        uint8* cq = static_cast<uint8*>(cqRing);
+        cqHead = reinterpret_cast<uint32*>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<uint32*>(cq + params.cq_off.tail);
+        cqMask = *reinterpret_cast<uint32*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    // queue an operation (the caller guarantees there is a free entry)
+    void Push(uint8 opcode, const VfsIoRequest& request, uint64 userData)
+    {
+        uint32 tail = *sqTail;
+        uint32 index = tail & sqMask;
+        io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(io_uring_sqe));
+        sqe->opcode = opcode;
+        sqe->fd = imageFd;
+        sqe->off = request.offset;
+        sqe->addr = reinterpret_cast<uint64>(request.data);
+        sqe->len = request.bytes;
+        sqe->user_data = userData;
+        sqArray[index] = index;
+
+        // the entry must be visible to the kernel before the tail is moved
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        toSubmit++;
+    }
+
+    // take back the entries the kernel didn't consume (after a failed Submit)
+    void Withdraw(std::vector<uint64>& userData)
+    {
+        uint32 head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        uint32 tail = *sqTail;
+        for (uint32 i = head; i != tail; ++i)
+            userData.push_back(sqes[i & sqMask].user_data);
+
+        __atomic_store_n(sqTail, head, __ATOMIC_RELEASE);
+        toSubmit = 0;
+    }
+
+    bool Submit()
+    {
+        while (toSubmit > 0)
+        {
+            int ret = IoUringEnter(fd, toSubmit, 0, 0);
+            if (ret < 0)
+            {
+                if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                    continue;
+                return false;
+            }
+            toSubmit -= static_cast<uint32>(ret);
+        }
+        return true;
+    }
+};
+
+#else // VFS_IO_URING_SUPPORTED
+
+struct VfsIoEngine::Ring
+{
+};
+
+#endif // VFS_IO_URING_SUPPORTED
+
+VfsIoEngine::VfsIoEngine()
+{
+    mImage = nullptr;
+    mMode = VfsAsyncMode::ThreadPool;
+    mStopping = false;
+    mInFlight = 0;
+}
+
+VfsIoEngine::~VfsIoEngine()
+{
+    Stop();
+}
+
+bool VfsIoEngine::Start(VfsImage* image, VfsAsyncMode mode, uint32 threadsNum)
+{
+    Stop();
+    mImage = image;
+    mStopping = false;
+
+    if (mode == VfsAsyncMode::Ring)
+    {
+        if (StartRing())
+        {
+            mMode = VfsAsyncMode::Ring;
+            return true;
+        }
+
+        LOG_ERROR("io_uring is not available, falling back to the thread pool");
+    }
+
+    mMode = VfsAsyncMode::ThreadPool;
+    for (uint32 i = 0; i < std::max(1u, threadsNum); ++i)
+        mThreads.emplace_back(&VfsIoEngine::PoolThread, this);
+    return true;
+}
+
+void VfsIoEngine::Stop()
+{
+    if (mImage == nullptr)
+        return;
+
+    if (mRing)
+        StopRing();
+    else
+    {
+        {
+            std::lock_guard<std::mutex> lock(mQueueLock);
+            mStopping = true;
+        }
+        mQueueCV.notify_all();
+    }
+
+    for (auto& thread : mThreads)
+        thread.join();
+    mThreads.clear();
+    mRing.reset();
+    mImage = nullptr;
+}
+
+void VfsIoEngine::Complete(Batch* batch, bool success)
+{
+    if (!success)
+        batch->failed = true;
+
+    if (--batch->pending == 0)
+    {
+        batch->completion(!batch->failed);
+        delete batch;
+    }
+}
+
+bool VfsIoEngine::Submit(const std::vector<VfsIoRequest>& requests, Completion completion)
+{
+    if (mImage == nullptr)
+        return false;
+
+    if (requests.empty())
+    {
+        completion(true);
+        return true;
+    }
+
+    Batch* batch = new Batch;
+    batch->pending = static_cast<uint32>(requests.size());
+    batch->failed = false;
+    batch->completion = std::move(completion);
+
+    if (mRing)
+        return SubmitToRing(batch, requests);
+
+    {
+        std::lock_guard<std::mutex> lock(mQueueLock);
+        for (const auto& request : requests)
+        {
+            Operation op;
+            op.batch = batch;
+            op.request = request;
+            mQueue.push_back(op);
+        }
+    }
+    mQueueCV.notify_all();
+    return true;
+}
+
+void VfsIoEngine::PoolThread()
+{
+    for (;;)
+    {
+        Operation op;
+        {
+            std::unique_lock<std::mutex> lock(mQueueLock);
+            mQueueCV.wait(lock, [this] { return mStopping || !mQueue.empty(); });
+
+            // the queued reads are finished before stopping
+            if (mQueue.empty())
+                return;
+
+            op = mQueue.front();
+            mQueue.pop_front();
+        }
+
+        Complete(op.batch, mImage->Read(op.request.offset, op.request.bytes, op.request.data));
+    }
+}
+
+#ifdef VFS_IO_URING_SUPPORTED
+
+bool VfsIoEngine::StartRing()
+{
+    mRing.reset(new Ring);
+    if (!mRing->Init(mImage->GetDescriptor(), VFS_IO_RING_ENTRIES))
+    {
+        mRing.reset();
+        return false;
+    }
+
+    mInFlight = 0;
+    mThreads.emplace_back(&VfsIoEngine::RingThread, this);
+    return true;
+}
+
+void VfsIoEngine::StopRing()
+{
+    std::unique_lock<std::mutex> lock(mSubmitLock);
+    mSlotFreed.wait(lock, [this] { return mInFlight == 0; });
+
+    // wake up the completion thread
+    VfsIoRequest request;
+    memset(&request, 0, sizeof(request));
+    mRing->Push(IORING_OP_NOP, request, VFS_RING_STOP);
+    mInFlight++;
+    VFS_ASSERT(mRing->Submit());
+}
+
+bool VfsIoEngine::SubmitToRing(Batch* batch, const std::vector<VfsIoRequest>& requests)
+{
+    // completion callbacks may submit new reads - the completion thread can't wait for itself
+    const bool completionThread = (std::this_thread::get_id() == mThreads.front().get_id());
+
+    // reads done synchronously, so every batch is completed exactly once even if the ring fails
+    std::vector<Operation> overflow;
+    auto submit = [this, &overflow]
+    {
+        if (mRing->Submit())
+            return true;
+
+        LOG_ERROR("io_uring_enter failed (errno " << errno << ")");
+        std::vector<uint64> withdrawn;
+        mRing->Withdraw(withdrawn);
+        for (uint64 userData : withdrawn)
+        {
+            Operation* op = reinterpret_cast<Operation*>(userData);
+            overflow.push_back(*op);
+            delete op;
+        }
+        mInFlight -= static_cast<uint32>(withdrawn.size());
+        mSlotFreed.notify_all();
+        return false;
+    };
+
+    std::unique_lock<std::mutex> lock(mSubmitLock);
+    bool ringFailed = false;
+    for (const auto& request : requests)
+    {
+        Operation op;
+        op.batch = batch;
+        op.request = request;
+
+        if (!ringFailed && mInFlight == mRing->sqEntries)
+        {
+            if (completionThread)
+            {
+                overflow.push_back(op);
+                continue;
+            }
+
+            // the ring is full - let the kernel start the queued reads before waiting
+            ringFailed = !submit();
+            if (!ringFailed)
+                mSlotFreed.wait(lock, [this] { return mInFlight < mRing->sqEntries; });
+        }
+
+        if (ringFailed)
+        {
+            overflow.push_back(op);
+            continue;
+        }
+
+        mRing->Push(IORING_OP_READ, request, reinterpret_cast<uint64>(new Operation(op)));
+        mInFlight++;
+    }
+
+    if (!ringFailed)
+        submit();
+    lock.unlock();
+
+    for (const Operation& op : overflow)
+        Complete(op.batch, mImage->Read(op.request.offset, op.request.bytes, op.request.data));
+
+    return true;
+}
+
+void VfsIoEngine::RingThread()
+{
+    std::vector<std::pair<Operation*, int32>> completed;
+    bool stop = false;
+
+    while (!stop)
+    {
+        uint32 head = *mRing->cqHead;
+        uint32 tail = __atomic_load_n(mRing->cqTail, __ATOMIC_ACQUIRE);
+        if (head == tail)
+        {
+            if (IoUringEnter(mRing->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+            {
+                LOG_ERROR("io_uring_enter failed (errno " << errno << ")");
+                return;
+            }
+            continue;
+        }
+
+        completed.clear();
+        const uint32 reaped = tail - head;
+        for (; head != tail; ++head)
+        {
+            const io_uring_cqe& cqe = mRing->cqes[head & mRing->cqMask];
+            if (cqe.user_data == VFS_RING_STOP)
+                stop = true;
+            else
+                completed.push_back(std::make_pair(reinterpret_cast<Operation*>(cqe.user_data),
+                                                   cqe.res));
+        }
+        __atomic_store_n(mRing->cqHead, head, __ATOMIC_RELEASE);
+
+        {
+            std::lock_guard<std::mutex> lock(mSubmitLock);
+            mInFlight -= reaped;
+        }
+        mSlotFreed.notify_all();
+
+        for (const auto& entry : completed)
+        {
+            Operation* op = entry.first;
+            int32 result = entry.second;
+            bool success = (result == static_cast<int32>(op->request.bytes));
+
+            // the ring reads bypass VfsImage::Read
+            VfsStatsCollector* stats = mImage->GetStats();
+            if (success && stats)
+                stats->RecordRead(op->request.offset, op->request.bytes);
+
+            if (!success)
+            {
+                // short or failed read (e.g. the kernel doesn't support the opcode)
+                uint32 done = result > 0 ? static_cast<uint32>(result) : 0;
+                success = mImage->Read(op->request.offset + done, op->request.bytes - done,
+                                       op->request.data + done);
+            }
+
+            Complete(op->batch, success);
+            delete op;
+        }
+    }
+}
+
+#else // VFS_IO_URING_SUPPORTED
+
+bool VfsIoEngine::StartRing()
+{
+    return false;
+}
+
+void VfsIoEngine::StopRing()
+{
+}
+
+bool VfsIoEngine::SubmitToRing(Batch* batch, const std::vector<VfsIoRequest>& requests)
+{
+    (void)batch;
+    (void)requests;
+    return false;
+}
+
+void VfsIoEngine::RingThread()
+{
+}
+
+#endif // VFS_IO_URING_SUPPORTED
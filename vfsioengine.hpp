@@ -0,0 +1,136 @@
+/**
+ * @author Michal Witanowski
+ */
+
+#pragma once
+
+#include "vfscommon.hpp"
+#include "vfsimage.hpp"
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <functional>
+
+// number of threads reading the image when io_uring is not used
+#define VFS_DEFAULT_IO_THREADS 4
+
+// maximum number of reads submitted to io_uring at the same time
+#define VFS_IO_RING_ENTRIES 256
+
+/**
+ * Asynchronous I/O backend
+ */
+enum class VfsAsyncMode
+{
+    ThreadPool, //< reads are executed by a pool of threads
+    Ring        //< reads are submitted to io_uring (falls back to ThreadPool if unavailable)
+};
+
+/**
+ * Read of a contiguous range of the image
+ */
+struct VfsIoRequest
+{
+    uint64 offset; //< image offset in bytes
+    uint32 bytes;
+    uint8* data;
+};
+
+/**
+ * @brief Executes batches of image reads asynchronously.
+ *
+ * All the reads of a batch are queued at once (with a single io_uring_enter call if the ring is
+ * used) and the completion callback is called from an engine thread when the last one is done.
+ * All the methods except Start and Stop are thread-safe.
+ */
+class VfsIoEngine final
+{
+public:
+    typedef std::function<void(bool success)> Completion;
+
+private:
+    struct Batch
+    {
+        std::atomic<uint32> pending;
+        std::atomic<bool> failed;
+        Completion completion;
+    };
+
+    struct Operation
+    {
+        Batch* batch;
+        VfsIoRequest request;
+    };
+
+    struct Ring;
+
+    VfsImage* mImage;
+    VfsAsyncMode mMode;
+    std::vector<std::thread> mThreads;
+
+    // thread pool queue
+    std::mutex mQueueLock;
+    std::condition_variable mQueueCV;
+    std::deque<Operation> mQueue;
+    bool mStopping;
+
+    // io_uring state (operations in flight are limited by the submission queue size)
+    std::unique_ptr<Ring> mRing;
+    std::mutex mSubmitLock;
+    std::condition_variable mSlotFreed;
+    uint32 mInFlight;
+
+    bool StartRing();
+    void StopRing();
+    bool SubmitToRing(Batch* batch, const std::vector<VfsIoRequest>& requests);
+    void RingThread();
+    void PoolThread();
+
+    // finish a single read of a batch (the last one calls the completion callback)
+    void Complete(Batch* batch, bool success);
+
+    VfsIoEngine(const VfsIoEngine&) = delete;
+
+public:
+    VfsIoEngine();
+    ~VfsIoEngine();
+
+    /**
+     * Start the engine threads.
+     * @param image      Image storage
+     * @param mode       Preferred backend
+     * @param threadsNum Number of thread pool threads
+     */
+    bool Start(VfsImage* image, VfsAsyncMode mode, uint32 threadsNum);
+
+    /**
+     * Wait for the pending reads and stop the engine threads.
+     */
+    void Stop();
+
+    /**
+     * Queue a batch of reads.
+     * @param completion Called exactly once, when all the reads are done (also when the batch
+     *                   is empty). Reads the backend fails to queue are done synchronously.
+     * @return False if the engine is not started (the completion is not called then)
+     */
+    bool Submit(const std::vector<VfsIoRequest>& requests, Completion completion);
+
+    bool IsStarted() const
+    {
+        return mImage != nullptr;
+    }
+
+    /**
+     * Get the backend actually used by the engine.
+     */
+    VfsAsyncMode GetMode() const
+    {
+        return mMode;
+    }
+};
@@ -0,0 +1,205 @@
+/**
+ * @author Michal Witanowski
+ */
+
+#include "vfsjournal.hpp"
+#include "vfsstructures.hpp"
+
+#include <string.h>
+
+VfsJournal::VfsJournal()
+{
+    mOperations = 0;
+    mCommitting = false;
+    mCommits = 0;
+    mCommitResult = true;
+    Release();
+}
+
+void VfsJournal::Init(VfsImage* image, uint32 blockSize, uint32 firstBlock, uint32 blocks)
+{
+    mImage = image;
+    mBlockSize = blockSize;
+    mFirstBlock = firstBlock;
+    mBlocks = blocks;
+    mSequence = 0;
+}
+
+void VfsJournal::Release()
+{
+    Init(nullptr, 0, 0, 0);
+}
+
+uint32 VfsJournal::GetDescriptorBlocks(uint32 blocksNum) const
+{
+    return CeilDivide<uint32>(sizeof(JournalHeader) + blocksNum * sizeof(uint32), mBlockSize);
+}
+
+uint32 VfsJournal::GetCapacity() const
+{
+    if (mBlocks == 0)
+        return 0;
+
+    // the logged blocks and the descriptor (header and block indices) must fit in the journal
+    uint64 bytes = static_cast<uint64>(mBlocks) * mBlockSize - sizeof(JournalHeader);
+    return static_cast<uint32>(bytes / (mBlockSize + sizeof(uint32)));
+}
+
+uint64 VfsJournal::Hash(uint64 hash, const void* data, size_t bytes)
+{
+    // 64-bit FNV-1a
+    const uint8* ptr = static_cast<const uint8*>(data);
+    for (size_t i = 0; i < bytes; ++i)
+    {
+        hash ^= ptr[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+bool VfsJournal::Write(const std::vector<uint32>& blocks, const std::vector<uint8>& data)
+{
+    const uint32 blocksNum = static_cast<uint32>(blocks.size());
+    VFS_ASSERT(blocksNum <= GetCapacity());
+    VFS_ASSERT(data.size() == static_cast<size_t>(blocksNum) * mBlockSize);
+
+    const uint32 descriptorBlocks = GetDescriptorBlocks(blocksNum);
+    std::vector<uint8> descriptor(static_cast<size_t>(descriptorBlocks) * mBlockSize, 0);
+
+    JournalHeader header;
+    header.magic = VFS_JOURNAL_MAGIC;
+    header.blocksNum = blocksNum;
+    header.sequence = mSequence + 1;
+    header.checksum = 0;
+
+    uint64 hash = Hash(14695981039346656037ull, &header, sizeof(header));
+    hash = Hash(hash, blocks.data(), blocks.size() * sizeof(uint32));
+    header.checksum = Hash(hash, data.data(), data.size());
+
+    memcpy(descriptor.data(), &header, sizeof(header));
+    memcpy(descriptor.data() + sizeof(header), blocks.data(), blocks.size() * sizeof(uint32));
+
+    const uint64 offset = static_cast<uint64>(mFirstBlock) * mBlockSize;
+    if (!mImage->Write(offset, static_cast<uint32>(descriptor.size()), descriptor.data()) ||
+        !mImage->Write(offset + descriptor.size(), static_cast<uint32>(data.size()), data.data()))
+    {
+        LOG_ERROR("Failed to write journal record");
+        return false;
+    }
+
+    if (!mImage->Sync())
+    {
+        LOG_ERROR("Failed to sync journal record");
+        return false;
+    }
+
+    mSequence = header.sequence;
+    return true;
+}
+
+bool VfsJournal::Replay()
+{
+    const uint64 offset = static_cast<uint64>(mFirstBlock) * mBlockSize;
+    JournalHeader header;
+    if (!mImage->Read(offset, sizeof(header), &header))
+    {
+        LOG_ERROR("Failed to read journal header");
+        return false;
+    }
+
+    // nothing was committed yet
+    if (header.magic != VFS_JOURNAL_MAGIC)
+        return true;
+
+    if (header.blocksNum > GetCapacity())
+    {
+        LOG_ERROR("Invalid journal record size: " << header.blocksNum);
+        return false;
+    }
+
+    const uint32 descriptorBlocks = GetDescriptorBlocks(header.blocksNum);
+    std::vector<uint8> descriptor(static_cast<size_t>(descriptorBlocks) * mBlockSize);
+    std::vector<uint8> data(static_cast<size_t>(header.blocksNum) * mBlockSize);
+    if (!mImage->Read(offset, static_cast<uint32>(descriptor.size()), descriptor.data()) ||
+        !mImage->Read(offset + descriptor.size(), static_cast<uint32>(data.size()), data.data()))
+    {
+        LOG_ERROR("Failed to read journal record");
+        return false;
+    }
+
+    std::vector<uint32> blocks(header.blocksNum);
+    memcpy(blocks.data(), descriptor.data() + sizeof(header), blocks.size() * sizeof(uint32));
+
+    JournalHeader zeroed = header;
+    zeroed.checksum = 0;
+    uint64 hash = Hash(14695981039346656037ull, &zeroed, sizeof(zeroed));
+    hash = Hash(hash, blocks.data(), blocks.size() * sizeof(uint32));
+    hash = Hash(hash, data.data(), data.size());
+
+    // a torn record - the previous one was fully written in place before it was overwritten
+    mSequence = header.sequence;
+    if (hash != header.checksum)
+    {
+        LOG_DEBUG("Incomplete journal record " << header.sequence << " skipped");
+        return true;
+    }
+
+    for (uint32 i = 0; i < header.blocksNum; ++i)
+    {
+        if (!mImage->Write(static_cast<uint64>(blocks[i]) * mBlockSize, mBlockSize,
+                           data.data() + static_cast<size_t>(i) * mBlockSize))
+        {
+            LOG_ERROR("Failed to replay block " << blocks[i]);
+            return false;
+        }
+    }
+
+    return mImage->Sync();
+}
+
+void VfsJournal::BeginOperation()
+{
+    std::unique_lock<std::mutex> lock(mLock);
+    mStateChanged.wait(lock, [this] { return !mCommitting; });
+    mOperations++;
+}
+
+void VfsJournal::EndOperation()
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    VFS_ASSERT(mOperations > 0);
+    if (--mOperations == 0)
+        mStateChanged.notify_all();
+}
+
+bool VfsJournal::BeginCommit()
+{
+    std::unique_lock<std::mutex> lock(mLock);
+
+    // a commit started before the caller came has waited for all its operations
+    if (mCommitting)
+    {
+        const uint64 commits = mCommits;
+        mStateChanged.wait(lock, [this, commits] { return mCommits != commits; });
+        return false;
+    }
+
+    mCommitting = true;
+    mStateChanged.wait(lock, [this] { return mOperations == 0; });
+    return true;
+}
+
+void VfsJournal::EndCommit(bool result)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    mCommitting = false;
+    mCommitResult = result;
+    mCommits++;
+    mStateChanged.notify_all();
+}
+
+bool VfsJournal::GetCommitResult()
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    return mCommitResult;
+}
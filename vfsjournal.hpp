@@ -0,0 +1,106 @@
+/**
+ * @author Michal Witanowski
+ */
+
+#pragma once
+
+#include "vfscommon.hpp"
+#include "vfsimage.hpp"
+
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+#define VFS_JOURNAL_MAGIC 0x766A6E6C
+
+// images smaller than this (in blocks) are created without a journal
+#define VFS_JOURNAL_MIN_BLOCKS 16
+
+/**
+ * @brief Metadata write-ahead journal.
+ *
+ * Metadata blocks modified by operations are kept in the block cache until a commit logs all of
+ * them as a single transaction record at the beginning of the journal area. Once the record is
+ * durable, the blocks are written in place. The record is overwritten by the next commit only
+ * after the in-place writes are durable too, so replaying the last valid record when an image
+ * is opened is always safe.
+ *
+ * The journal also tracks the operations in progress - commits wait until there are none and
+ * the operations starting meanwhile wait for the commit. Commits requested while another one is
+ * running are satisfied by it (group commit), so concurrent operations share a single fsync.
+ */
+class VfsJournal final
+{
+    VfsImage* mImage;
+    uint32 mBlockSize;
+    uint32 mFirstBlock; //< image block index of the journal start
+    uint32 mBlocks;     //< journal size in blocks (zero if the journal is disabled)
+    uint64 mSequence;   //< number of the last written record
+
+    std::mutex mLock;
+    std::condition_variable mStateChanged;
+    uint32 mOperations;  //< operations in progress
+    bool mCommitting;
+    uint64 mCommits;     //< number of finished commits
+    bool mCommitResult;  //< result of the last finished commit
+
+    // number of blocks holding the header and indices of a record with the given size
+    uint32 GetDescriptorBlocks(uint32 blocksNum) const;
+
+    static uint64 Hash(uint64 hash, const void* data, size_t bytes);
+
+    VfsJournal(const VfsJournal&) = delete;
+
+public:
+    VfsJournal();
+
+    /**
+     * Attach the journal to an image.
+     * @param firstBlock Image block index of the journal area
+     * @param blocks     Journal size in blocks (zero disables journaling)
+     */
+    void Init(VfsImage* image, uint32 blockSize, uint32 firstBlock, uint32 blocks);
+
+    void Release();
+
+    bool IsEnabled() const
+    {
+        return mBlocks > 0;
+    }
+
+    /**
+     * Get maximum number of blocks logged by a single transaction.
+     */
+    uint32 GetCapacity() const;
+
+    /**
+     * Write the last valid transaction record in place (if there is one).
+     */
+    bool Replay();
+
+    /**
+     * Log a transaction and wait until it is durable.
+     * @param blocks Image indices of the modified blocks
+     * @param data   Blocks contents (in the same order)
+     */
+    bool Write(const std::vector<uint32>& blocks, const std::vector<uint8>& data);
+
+    /**
+     * Mark an operation start (waits if a commit is in progress).
+     */
+    void BeginOperation();
+    void EndOperation();
+
+    /**
+     * Start a commit, waiting until the operations in progress are finished.
+     * @return False if a commit that was already running covers the caller's operations -
+     *         the commit must not be performed then (see GetCommitResult).
+     */
+    bool BeginCommit();
+    void EndCommit(bool result);
+
+    /**
+     * Get result of the last finished commit.
+     */
+    bool GetCommitResult();
+};
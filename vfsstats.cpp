@@ -0,0 +1,159 @@
+/**
+ * @author Michal Witanowski
+ */
+
+#include "vfsstats.hpp"
+
+#include <string.h>
+
+VfsOperationStats::VfsOperationStats()
+{
+    count = 0;
+    totalTime = 0;
+    maxTime = 0;
+    memset(histogram, 0, sizeof(histogram));
+}
+
+VfsImageStats::VfsImageStats()
+{
+    reads = 0;
+    writes = 0;
+    seeks = 0;
+    syncs = 0;
+    bytesRead = 0;
+    bytesWritten = 0;
+}
+
+VfsStats::VfsStats()
+{
+    bitmapScans = 0;
+    bitmapScanWords = 0;
+    bitmapMaxScan = 0;
+    memset(blockLookups, 0, sizeof(blockLookups));
+}
+
+const char* VfsStats::GetOperationName(VfsOperation operation)
+{
+    switch (operation)
+    {
+    case VfsOperation::OpenFile:
+        return "OpenFile";
+    case VfsOperation::Read:
+        return "Read";
+    case VfsOperation::Write:
+        return "Write";
+    case VfsOperation::Rename:
+        return "Rename";
+    case VfsOperation::Remove:
+        return "Remove";
+    case VfsOperation::List:
+        return "List";
+    default:
+        return "Unknown";
+    }
+}
+
+// raise an atomic maximum
+static void UpdateMax(std::atomic<uint64>& max, uint64 value)
+{
+    uint64 current = max.load(std::memory_order_relaxed);
+    while (value > current &&
+           !max.compare_exchange_weak(current, value, std::memory_order_relaxed))
+    {
+    }
+}
+
+VfsStatsCollector::VfsStatsCollector()
+{
+    mEnabled = false;
+    Reset();
+}
+
+void VfsStatsCollector::SetEnabled(bool enabled)
+{
+    mEnabled = enabled;
+}
+
+void VfsStatsCollector::Reset()
+{
+    for (OperationCounters& counters : mOperations)
+    {
+        counters.count = 0;
+        counters.totalTime = 0;
+        counters.maxTime = 0;
+        for (auto& bucket : counters.histogram)
+            bucket = 0;
+    }
+
+    mReads = 0;
+    mWrites = 0;
+    mSeeks = 0;
+    mSyncs = 0;
+    mBytesRead = 0;
+    mBytesWritten = 0;
+    mLastOffset = 0;
+
+    mBitmapScans = 0;
+    mBitmapScanWords = 0;
+    mBitmapMaxScan = 0;
+
+    for (auto& lookups : mBlockLookups)
+        lookups = 0;
+}
+
+void VfsStatsCollector::Get(VfsStats& stats) const
+{
+    for (size_t i = 0; i < static_cast<size_t>(VfsOperation::Count); ++i)
+    {
+        const OperationCounters& counters = mOperations[i];
+        VfsOperationStats& operation = stats.operations[i];
+        operation.count = counters.count;
+        operation.totalTime = counters.totalTime;
+        operation.maxTime = counters.maxTime;
+        for (uint32 j = 0; j < VFS_LATENCY_BUCKETS; ++j)
+            operation.histogram[j] = counters.histogram[j];
+    }
+
+    stats.image.reads = mReads;
+    stats.image.writes = mWrites;
+    stats.image.seeks = mSeeks;
+    stats.image.syncs = mSyncs;
+    stats.image.bytesRead = mBytesRead;
+    stats.image.bytesWritten = mBytesWritten;
+
+    stats.bitmapScans = mBitmapScans;
+    stats.bitmapScanWords = mBitmapScanWords;
+    stats.bitmapMaxScan = mBitmapMaxScan;
+
+    for (uint32 i = 0; i < VFS_LOOKUP_DEPTHS; ++i)
+        stats.blockLookups[i] = mBlockLookups[i];
+}
+
+void VfsStatsCollector::AddOperation(VfsOperation operation, uint64 time)
+{
+    OperationCounters& counters = mOperations[static_cast<size_t>(operation)];
+    counters.count.fetch_add(1, std::memory_order_relaxed);
+    counters.totalTime.fetch_add(time, std::memory_order_relaxed);
+    UpdateMax(counters.maxTime, time);
+
+    uint32 bucket = 0;
+    for (uint64 micros = time / 1000; micros > 0 && bucket < VFS_LATENCY_BUCKETS - 1; micros >>= 1)
+        bucket++;
+    counters.histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+void VfsStatsCollector::AddAccess(uint64 offset, uint32 bytes, bool write)
+{
+    (write ? mWrites : mReads).fetch_add(1, std::memory_order_relaxed);
+    (write ? mBytesWritten : mBytesRead).fetch_add(bytes, std::memory_order_relaxed);
+
+    if (mLastOffset.exchange(offset + bytes, std::memory_order_relaxed) != offset)
+        mSeeks.fetch_add(1, std::memory_order_relaxed);
+}
+
+void VfsStatsCollector::AddBitmapScan(uint32 words)
+{
+    mBitmapScans.fetch_add(1, std::memory_order_relaxed);
+    mBitmapScanWords.fetch_add(words, std::memory_order_relaxed);
+    UpdateMax(mBitmapMaxScan, words);
+}
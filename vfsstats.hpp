@@ -0,0 +1,198 @@
+/**
+ * @author Michal Witanowski
+ */
+
+#pragma once
+
+#include "vfscommon.hpp"
+#include "vfsblockcache.hpp"
+
+#include <atomic>
+#include <chrono>
+
+/**
+ * Public operations with latency statistics
+ */
+enum class VfsOperation : uint8
+{
+    OpenFile,
+    Read,
+    Write,
+    Rename,
+    Remove,
+    List,
+
+    Count
+};
+
+// latency histogram bucket "i" counts operations shorter than 2^i microseconds (the last one
+// counts all the longer ones)
+#define VFS_LATENCY_BUCKETS 24
+
+// block lookups are counted by the pointer walk depth (0-2) and the last slot counts extent maps
+#define VFS_LOOKUP_DEPTHS 4
+
+/**
+ * Statistics of a single operation
+ */
+struct VfsOperationStats
+{
+    uint64 count;
+    uint64 totalTime; //< in nanoseconds
+    uint64 maxTime;   //< in nanoseconds
+    uint64 histogram[VFS_LATENCY_BUCKETS];
+
+    VfsOperationStats();
+};
+
+/**
+ * Image access statistics
+ */
+struct VfsImageStats
+{
+    uint64 reads;
+    uint64 writes;
+    uint64 seeks;        //< accesses not starting where the previous one ended
+    uint64 syncs;
+    uint64 bytesRead;
+    uint64 bytesWritten;
+
+    VfsImageStats();
+};
+
+/**
+ * Snapshot of the VFS statistics (see Vfs::GetStats)
+ */
+struct VfsStats
+{
+    VfsOperationStats operations[static_cast<size_t>(VfsOperation::Count)];
+    VfsImageStats image;
+    VfsCacheStats cache;
+
+    uint64 bitmapScans;       //< bitmap searches for a free item
+    uint64 bitmapScanWords;   //< total number of bitmap words visited by the searches
+    uint64 bitmapMaxScan;     //< the longest search (in words)
+
+    uint64 blockLookups[VFS_LOOKUP_DEPTHS]; //< file block translations by pointers depth
+
+    VfsStats();
+
+    static const char* GetOperationName(VfsOperation operation);
+};
+
+/**
+ * @brief Gathers the statistics from all the VFS components.
+ *
+ * The counters are updated only if the collection is enabled - otherwise every probe costs a
+ * single relaxed load. All the methods are thread-safe.
+ */
+class VfsStatsCollector final
+{
+    struct OperationCounters
+    {
+        std::atomic<uint64> count;
+        std::atomic<uint64> totalTime;
+        std::atomic<uint64> maxTime;
+        std::atomic<uint64> histogram[VFS_LATENCY_BUCKETS];
+    };
+
+    std::atomic<bool> mEnabled;
+
+    OperationCounters mOperations[static_cast<size_t>(VfsOperation::Count)];
+
+    std::atomic<uint64> mReads;
+    std::atomic<uint64> mWrites;
+    std::atomic<uint64> mSeeks;
+    std::atomic<uint64> mSyncs;
+    std::atomic<uint64> mBytesRead;
+    std::atomic<uint64> mBytesWritten;
+    std::atomic<uint64> mLastOffset; //< end of the last image access
+
+    std::atomic<uint64> mBitmapScans;
+    std::atomic<uint64> mBitmapScanWords;
+    std::atomic<uint64> mBitmapMaxScan;
+
+    std::atomic<uint64> mBlockLookups[VFS_LOOKUP_DEPTHS];
+
+    void AddOperation(VfsOperation operation, uint64 time);
+    void AddAccess(uint64 offset, uint32 bytes, bool write);
+    void AddBitmapScan(uint32 words);
+
+    VfsStatsCollector(const VfsStatsCollector&) = delete;
+
+public:
+    VfsStatsCollector();
+
+    void SetEnabled(bool enabled);
+
+    bool IsEnabled() const
+    {
+        return mEnabled.load(std::memory_order_relaxed);
+    }
+
+    // clear all the counters
+    void Reset();
+
+    void Get(VfsStats& stats) const;
+
+    void RecordRead(uint64 offset, uint32 bytes)
+    {
+        if (IsEnabled())
+            AddAccess(offset, bytes, false);
+    }
+
+    void RecordWrite(uint64 offset, uint32 bytes)
+    {
+        if (IsEnabled())
+            AddAccess(offset, bytes, true);
+    }
+
+    void RecordSync()
+    {
+        if (IsEnabled())
+            mSyncs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void RecordBitmapScan(uint32 words)
+    {
+        if (IsEnabled())
+            AddBitmapScan(words);
+    }
+
+    void RecordBlockLookup(uint32 depth)
+    {
+        if (IsEnabled())
+            mBlockLookups[depth].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * Measures an operation from the construction to the destruction.
+     */
+    class Timer final
+    {
+        VfsStatsCollector& mStats;
+        VfsOperation mOperation;
+        bool mActive;
+        std::chrono::steady_clock::time_point mStart;
+
+    public:
+        Timer(VfsStatsCollector& stats, VfsOperation operation)
+            : mStats(stats)
+            , mOperation(operation)
+            , mActive(stats.IsEnabled())
+        {
+            if (mActive)
+                mStart = std::chrono::steady_clock::now();
+        }
+
+        ~Timer()
+        {
+            if (mActive)
+            {
+                auto time = std::chrono::steady_clock::now() - mStart;
+                mStats.AddOperation(mOperation, static_cast<uint64>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(time).count()));
+            }
+        }
+    };
+};
@@ -8,6 +8,17 @@
 
 const uint32 INVALID_INDEX = static_cast<uint32>(-1);
 
+uint64 Superblock::GetVfsSize() const
+{
+    return (static_cast<uint64>(vfsSizeHigh) << 32) | vfsSize;
+}
+
+void Superblock::SetVfsSize(uint64 bytes)
+{
+    vfsSize = static_cast<uint32>(bytes);
+    vfsSizeHigh = static_cast<uint32>(bytes >> 32);
+}
+
 INode::INode()
 {
     type = INodeType::File;
@@ -17,6 +28,23 @@ INode::INode()
 
     for (int i = 0; i < INODE_PTRS; ++i)
         blockPtr[i] = INVALID_INDEX;
+
+    dirIndex = INVALID_INDEX;
+    dirFreeBytes = 0;
+    sizeHigh = 0;
+    memset(reserved, 0, sizeof(reserved));
+    memset(inlineData, 0, sizeof(inlineData));
+}
+
+uint64 INode::GetSize() const
+{
+    return (static_cast<uint64>(sizeHigh) << 32) | size;
+}
+
+void INode::SetSize(uint64 bytes)
+{
+    size = static_cast<uint32>(bytes);
+    sizeHigh = static_cast<uint32>(bytes >> 32);
 }
 
 Directory::Directory()
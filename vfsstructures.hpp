@@ -19,6 +19,15 @@ struct Superblock
     uint32 inodeBitmapBlocks; //< number of blocks containing inodes bitmap
     uint32 dataBitmapBlocks;  //< number of blocks containing data blocks bitmap
     uint32 firstDataBlock;    //< ID of the first block containing data
+    uint32 version;           //< on-disk format version (see VFS_VERSION_* values)
+    uint32 vfsSizeHigh;       //< upper 32 bits of "vfsSize" (VFS_VERSION_LARGE_FILES and newer)
+    uint32 blockSize;         //< block size in bytes (VFS_VERSION_BLOCK_SIZE and newer)
+    uint32 journalStart;      //< first data block of the journal (VFS_VERSION_JOURNAL and newer)
+    uint32 journalBlocks;     //< journal size in blocks, zero if the image has no journal
+    uint32 blockRefsINode;    //< inode of the shared blocks table (VFS_VERSION_SHARED_BLOCKS+)
+
+    uint64 GetVfsSize() const;
+    void SetVfsSize(uint64 bytes);
 
     // TODO: stats, etc.
 };
@@ -31,6 +40,24 @@ enum class INodeType : uint8
 
 #define INODE_PTRS 5
 
+// "ptrDepth" value of an inode which maps its data blocks with extents
+#define INODE_EXTENT_MAP 0xFF
+
+// "ptrDepth" value of a file inode which stores its data in "inlineData"
+#define INODE_INLINE_DATA 0xFE
+
+// maximum size of a file stored inside its inode
+#define INODE_INLINE_SIZE 64
+
+// number of extents stored directly in an inode (the last block pointer links extent blocks)
+#define INODE_EXTENTS ((INODE_PTRS - 1) / 2)
+
+// size of an on-disk inode in images older than VFS_VERSION_DIR_INDEX (fields up to "blockPtr")
+#define INODE_LEGACY_SIZE 32
+
+// size of an on-disk inode in images older than VFS_VERSION_INLINE_DATA (fields up to "reserved")
+#define INODE_NO_INLINE_SIZE 64
+
 /**
  * Index Node structure
  */
@@ -43,13 +70,70 @@ struct INode
      * 0 - "blockPtr" are direct pointers to data blocks
      * 1 - "blockPtr" are pointers to blocks containing pointers to data blocks
      * 2 - "blockPtr" are pointers to blocks containing pointers to blocks containing pointers to data blocks
+     * INODE_EXTENT_MAP - "blockPtr" contains INODE_EXTENTS (start, length) pairs followed by
+     *                    a pointer to the first extent block
+     * INODE_INLINE_DATA - the file has no data blocks, its contents are kept in "inlineData"
      */
     uint8 ptrDepth;
-    uint32 size; //< file size in bytes
+    uint32 size; //< file size in bytes (lower 32 bits, directories never exceed 4 GiB)
     uint32 usage; //< number of entries in the directory (only for dirs)
     uint32 blockPtr[INODE_PTRS];
 
+    // the following fields are stored only in VFS_VERSION_DIR_INDEX and newer images
+
+    uint32 dirIndex;     //< inode of the directory hash index or INVALID_INDEX (only for dirs)
+    uint32 dirFreeBytes; //< size of removed compact directory entries (only for dirs)
+    uint32 sizeHigh;     //< upper 32 bits of the file size (VFS_VERSION_LARGE_FILES and newer)
+    uint32 reserved[5];  //< unused, zeroed
+
+    // stored only in VFS_VERSION_INLINE_DATA and newer images
+
+    uint8 inlineData[INODE_INLINE_SIZE]; //< contents of INODE_INLINE_DATA files
+
     INode();
+
+    uint64 GetSize() const;
+    void SetSize(uint64 bytes);
+};
+
+/**
+ * Run of physically contiguous data blocks
+ */
+struct Extent
+{
+    uint32 start;  //< first data block ID
+    uint32 length; //< number of blocks
+};
+
+/**
+ * Header of a block holding extents that did not fit into an inode
+ */
+struct ExtentBlockHeader
+{
+    uint32 next;  //< next extent block ID
+    uint32 count; //< number of extents following the header
+};
+
+/**
+ * Reference count of a data block shared by multiple files. The table of these records (sorted by
+ * block and preceded by the number of records) is stored in a hidden file.
+ */
+struct BlockRefs
+{
+    uint32 block; //< data block ID
+    uint32 refs;  //< number of files using the block (at least two)
+};
+
+/**
+ * Header of the journal descriptor. It is followed by the image indices of the logged blocks
+ * (padded to whole blocks) and then by the blocks contents.
+ */
+struct JournalHeader
+{
+    uint32 magic;     //< VFS_JOURNAL_MAGIC
+    uint32 blocksNum; //< number of logged blocks
+    uint64 sequence;  //< transaction number
+    uint64 checksum;  //< hash of the header (with zero checksum), block indices and contents
 };
 
 /**
@@ -63,6 +147,39 @@ struct Directory
     Directory();
 };
 
+// maximum length of a file or directory name
+#define VFS_MAX_NAME_LENGTH (sizeof(Directory::name) - 1)
+
+/**
+ * Header of a compact directory entry (in VFS_VERSION_COMPACT_DIRS and newer images).
+ * It is followed by the name (not null-terminated) and padding up to DIR_ENTRY_ALIGNMENT.
+ * Entries don't cross DIR_ENTRY_CHUNK boundaries - the unused end of a chunk is skipped (it's
+ * covered by a removed entry if it's large enough to hold the header).
+ */
+struct DirEntryHeader
+{
+    uint32 inodeID;      //< INVALID_INDEX for removed entries
+    uint32 hash;         //< name hash
+    uint16 entryLength;  //< size of the whole entry in bytes
+    INodeType type;      //< type of the inode (so it doesn't need to be read)
+    uint8 nameLength;
+};
+
+#define DIR_ENTRY_ALIGNMENT 4
+
+// compact directory entries are parsed in chunks of this size (independently of the block size)
+#define DIR_ENTRY_CHUNK 4096
+
+/**
+ * Slot of a directory hash index (open addressing with linear probing)
+ */
+struct DirIndexSlot
+{
+    uint32 hash;  //< name hash
+    uint32 entry; //< entry index (or byte offset of a compact entry) in the directory,
+                  //< INVALID_INDEX if the slot is empty
+};
+
 /**
  * VFS file seeking mode
  */